@@ -52,7 +52,7 @@ make_gdtr_operand (uint16_t limit, void *base)
 void
 gdt_init(void)
 {
-    uint64_t gdtr_operand;
+    int i;
 
     /* null descriptor */
     gdt[SEL_NULL  / sizeof(*gdt)] = 0; /* 0x0 */
@@ -66,9 +66,22 @@ gdt_init(void)
     gdt[SEL_UDSEG / sizeof(*gdt)] = make_data_desc (3); /* 0x20  / 0x23*/
 
     /* TSS */
-    gdt[SEL_TSS / sizeof(*gdt)] = make_tss_desc(tss_get());
+    for (i = 0; i < MAX_CPUS; i ++)
+        gdt[SEL_TSS_CPU(i) / sizeof(*gdt)] = make_tss_desc(tss_get(i));
+
+    gdt_load(0);
+}
+
+/*
+ * gdt_load - load the GDT and the task register of CPU @cpu, which is
+ *            also how arch_cpu_id() tells the CPUs apart
+ */
+void
+gdt_load(int cpu)
+{
+    uint64_t gdtr_operand;
 
     gdtr_operand = make_gdtr_operand (sizeof(gdt) - 1, gdt);
     asm volatile ("lgdt %0" : : "m" (gdtr_operand));
-    asm volatile ("ltr %w0" : : "q" (SEL_TSS));
+    asm volatile ("ltr %w0" : : "q" ((uint16_t) SEL_TSS_CPU(cpu)));
 }
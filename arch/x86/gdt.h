@@ -2,15 +2,19 @@
 #define __LEVOS_X86_GDT_H
 
 #include <levos/types.h>
+#include <levos/smp.h>
 
 #define SEL_NULL        0x00    /* Null selector. */
 #define SEL_KCSEG       0x08    /* Kernel code selector. */
 #define SEL_KDSEG       0x10    /* Kernel data selector. */
 #define SEL_UCSEG       0x1B    /* User code selector. */
 #define SEL_UDSEG       0x23    /* User data selector. */
-#define SEL_TSS         0x28    /* Task-state segment. */
+#define SEL_TSS         0x28    /* Task-state segment of CPU 0. */
 
-#define SEL_CNT         6       /* Number of segments. */
+/* every CPU has its own TSS, the descriptors follow each other */
+#define SEL_TSS_CPU(n)  (SEL_TSS + (n) * 8)
+
+#define SEL_CNT         (5 + MAX_CPUS) /* Number of segments. */
 
 enum seg_class
 {
@@ -26,6 +30,8 @@ enum seg_granularity
 
 void
 gdt_init(void);
+void
+gdt_load(int);
 
 uint64_t make_seg_desc(uint32_t,
               uint32_t,
@@ -15,8 +15,6 @@ void *intr_data[256];
 
 static intr_handler_func *intr_handlers[INTR_CNT];
 
-struct task *current_task;
-
 void
 __dump_code_at(uint8_t *ptr)
 {
@@ -213,19 +211,27 @@ intr_register_user(uint8_t vec_no, intr_handler_func *handler)
 }
 
 
+/* idt_load - load the IDT on this CPU */
+void
+idt_load(void)
+{
+    uint64_t idtr_operand;
+
+    idtr_operand = make_idtr_operand(sizeof(idt) - 1, idt);
+    asm volatile ("lidt %0" : : "m" (idtr_operand));
+}
+
 int
 idt_init(void)
 {
     int i;
-    uint64_t idtr_operand;
 
     pic_init();
 
     for (i = 0; i < INTR_CNT; i++)
         idt[i] = make_intr_gate(intr_stubs[i], 0);
 
-    idtr_operand = make_idtr_operand(sizeof(idt) - 1, idt);
-    asm volatile ("lidt %0" : : "m" (idtr_operand));
+    idt_load();
 
     return 0;
 }
@@ -49,20 +49,118 @@ enable_sse(void)
     */
 }
 
-static uint8_t saves[512] __attribute__((aligned(16)));
+/*
+ * enable_pge - let global pages survive a CR3 reload, if the CPU can.
+ *              Turning it on flushes the whole TLB, so this also gets rid
+ *              of the boot time identity mappings.
+ */
+void
+enable_pge(void)
+{
+    size_t t;
+
+    if (!(arch_cpuid_edx() & X86_CPUID_EDX_PGE))
+        return;
+
+    asm volatile ("mov %%cr4, %0" : "=r"(t));
+    t |= X86_CR4_PGE;
+    asm volatile ("mov %0, %%cr4" :: "r"(t));
+}
+
+/*
+ * Lazy FPU switching. The FPU and SSE registers of a CPU hold the state
+ * of its cpu_fpu_owner, switching to any other task sets CR0.TS. The
+ * first FPU or SSE instruction that task executes traps with #NM, and
+ * only then is the owner's state saved and the task's own loaded. Tasks
+ * that never touch the FPU, like most kernel threads, never pay for it.
+ *
+ * task->sse_save is 16-byte aligned, so fxsave and fxrstor work on it
+ * directly.
+ */
+static inline void
+__fxsave(struct task *task)
+{
+    asm volatile ("fxsave (%0)" :: "r"(task->sse_save) : "memory");
+}
+
+static inline void
+__fxrstor(struct task *task)
+{
+    asm volatile ("fxrstor (%0)" :: "r"(task->sse_save) : "memory");
+}
+
+static inline void
+__stts(void)
+{
+    size_t t;
+
+    asm volatile ("mov %%cr0, %0" : "=r"(t));
+    if (!(t & X86_CR0_TS))
+        asm volatile ("mov %0, %%cr0" :: "r"(t | X86_CR0_TS));
+}
+
+/* arch_fpu_init - the FPU state a task starts out with in @area */
+void
+arch_fpu_init(char *area)
+{
+    memset(area, 0, 512);
+
+    /* all exceptions masked, like after fninit */
+    *(uint16_t *) (area + 0) = 0x037F;
+    *(uint32_t *) (area + 24) = 0x1F80;
+}
 
+/* arch_fpu_switch - @next is about to run on this CPU */
 void
-do_sse_save(struct task *task)
+arch_fpu_switch(struct task *next)
 {
-    asm volatile ("fxsave (%0)" :: "r"(saves));
-	memcpy(task->sse_save, &saves, 512);
+    if (this_cpu()->cpu_fpu_owner == next)
+        asm volatile ("clts");
+    else
+        __stts();
 }
 
+/* the #NM trap, current_task wants the FPU */
+static void
+fpu_trap(struct pt_regs *regs)
+{
+    struct cpu *cpu = this_cpu();
+    struct task *owner = cpu->cpu_fpu_owner;
+
+    asm volatile ("clts");
+
+    if (owner == current_task)
+        return;
+
+    if (owner)
+        __fxsave(owner);
+    __fxrstor(current_task);
+    cpu->cpu_fpu_owner = current_task;
+}
+
+/*
+ * arch_fpu_flush - bring @task->sse_save up to date, it might only be in
+ *                  the registers
+ */
+void
+arch_fpu_flush(struct task *task)
+{
+    uint32_t flags = arch_irq_save();
+
+    if (task == current_task && this_cpu()->cpu_fpu_owner == task)
+        __fxsave(task);
+
+    arch_irq_restore(flags);
+}
+
+/* arch_fpu_release - @task goes away, its state is no longer needed */
 void
-do_sse_restore(struct task *task)
+arch_fpu_release(struct task *task)
 {
-	memcpy(&saves, task->sse_save, 512);
-    asm volatile ("fxrstor (%0)" :: "r"(saves));
+    struct cpu *cpu = &cpus[task->cpu];
+
+    if (cpu->cpu_fpu_owner == task)
+        cpu->cpu_fpu_owner = NULL;
 }
 
 void
@@ -75,6 +173,7 @@ arch_early_init(uint32_t boot_sig, void *ptr)
     idt_init();
 
     enable_sse();
+    intr_register_hw(7, fpu_trap);
 
     *(uint16_t *)(0xC03FF000) = 0x1643;
 
@@ -130,7 +229,6 @@ __prepare_system_call(struct pt_regs *regs)
     asm volatile ("mov %%esp, %0":"=r"(stack));
     //printk("syscall: using stack 0x%x 0x%x\n", stack, regs->esp);
 
-    extern struct task *current_task;
     current_task->sys_regs = regs;
     current_task->regs = regs;
     regs->eax = syscall_hub(no, a, b, c, d);
@@ -2,6 +2,8 @@
 #include <levos/types.h>
 #include <levos/intr.h>
 #include <levos/task.h>
+#include <levos/time.h>
+#include <levos/timer.h>
 
 #include <levos/x86.h>
 
@@ -40,12 +42,16 @@ void
 pit_irq(struct pt_regs *r)
 {
     __pit_ticks ++;
+    time_tick();
+    timer_tick();
 }
 
 void
 pit_sched_irq(struct pt_regs *r)
 {
     __pit_ticks ++;
+    time_tick();
+    timer_tick();
     sched_tick(r);
 }
 
@@ -92,7 +98,7 @@ static void pit_start_counter(uint32_t freq, uint8_t counter, uint8_t mode) {
 void pit_init(void)
 {
     intr_register_hw(32, pit_irq);
-    pit_start_counter(200,PIT_OCW_COUNTER_0, PIT_OCW_MODE_SQUAREWAVEGEN);
+    pit_start_counter(HZ, PIT_OCW_COUNTER_0, PIT_OCW_MODE_SQUAREWAVEGEN);
     printk("x86: pit: clocksource registered\n");
 }
 
@@ -1,10 +1,11 @@
 #include <levos/kernel.h>
 #include <levos/x86.h>
 #include <levos/task.h>
+#include <levos/vsyscall.h>
 #include "gdt.h"
 
-/* Kernel TSS. */
-static struct tss tss __attribute__((aligned(4096)));
+/* Kernel TSS, one for every CPU. */
+static struct tss tss[MAX_CPUS] __attribute__((aligned(4096)));
 
 static char irq_stack[4096];
 
@@ -12,17 +13,21 @@ static char irq_stack[4096];
 void
 tss_init (void) 
 {
-    memset(&tss, 0, sizeof(struct tss));
-    tss.ss0 = 0x10;
-    tss.bitmap = 0xdfff;
+    int i;
+
+    memset(tss, 0, sizeof(tss));
+    for (i = 0; i < MAX_CPUS; i ++) {
+        tss[i].ss0 = 0x10;
+        tss[i].bitmap = 0xdfff;
+    }
     memset(irq_stack, 0, sizeof(irq_stack));
 }
 
-/* Returns the kernel TSS. */
+/* Returns the kernel TSS of CPU CPU. */
 struct tss *
-tss_get (void) 
+tss_get (int cpu) 
 {
-    return &tss;
+    return &tss[cpu];
 }
 
 /* Sets the ring 0 stack pointer in the TSS to point to the end
@@ -30,7 +35,11 @@ tss_get (void)
 void
 tss_update (struct task *task) 
 {
-    tss.esp0 = task->irq_stack_top;
+    tss[arch_cpu_id()].esp0 = task->irq_stack_top;
+
+    /* SYSENTER doesn't use the TSS, it has its own stack pointer */
+    if (x86_sysenter)
+        arch_wrmsr(X86_MSR_SYSENTER_ESP, (uint32_t) task->irq_stack_top);
 }
 
 uint64_t
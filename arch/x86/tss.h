@@ -29,7 +29,7 @@ struct tss
 
 struct task;
 
-struct tss *tss_get(void);
+struct tss *tss_get(int);
 uint64_t make_tss_desc (void *);
 void tss_update (struct task *task);
 void tss_init(void);
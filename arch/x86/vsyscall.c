@@ -0,0 +1,197 @@
+#include <levos/kernel.h>
+#include <levos/arch.h>
+#include <levos/errno.h>
+#include <levos/page.h>
+#include <levos/palloc.h>
+#include <levos/string.h>
+#include <levos/task.h>
+#include <levos/vma.h>
+#include <levos/vsyscall.h>
+
+#include "gdt.h"
+#include "tss.h"
+
+#define MODULE_NAME vsyscall
+
+/*
+ * Fast system calls. int $0x80 goes through the IDT and a gate, and
+ * iret has to check everything it pops. SYSENTER jumps straight to a
+ * kernel entry point that is set up in MSRs, SYSEXIT straight back to
+ * where %edx points. Userspace doesn't have to know which one the CPU
+ * has, it calls into the vsyscall page and the kernel put the right
+ * code there, see sysenter.S.
+ *
+ * SYSENTER doesn't touch the user stack nor save the return address, so
+ * the code in the vsyscall page leaves the stack pointer in %ebp, and
+ * the kernel always returns to the instruction after the SYSENTER.
+ *
+ * Behind the code are two read-only data pages. The first one is the
+ * clock that kernel/time.c keeps, it is the same frame in everyone. The
+ * second one is per process, it holds what the process could ask the
+ * kernel about itself, fork(2) gives the child its own.
+ */
+
+extern char vsyscall_page_start[], vsyscall_page_end[];
+extern char vsyscall_sysenter_start[], vsyscall_sysenter_return[];
+extern char vsyscall_sysenter_end[];
+
+void sysenter_entry(void);
+
+/* set when the CPUs have SYSENTER and the MSRs are programmed */
+int x86_sysenter;
+
+/* where sysenter_entry returns to in userspace */
+uint32_t vsyscall_sysenter_ret;
+
+/* the frame that every vsyscall page maps, it is never freed */
+static uintptr_t vsyscall_phys;
+
+static int
+__cpu_has_sysenter(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+    int family, model, stepping;
+
+    asm volatile("cpuid":"=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx):"a"(1));
+    if (!(edx & X86_CPUID_EDX_SEP))
+        return 0;
+
+    family = (eax >> 8) & 0xf;
+    model = (eax >> 4) & 0xf;
+    stepping = eax & 0xf;
+
+    /* the Pentium Pro claims to have it, but doesn't */
+    return !(family == 6 && model < 3 && stepping < 3);
+}
+
+/*
+ * vsyscall_cpu_init - point SYSENTER at the kernel on this CPU, the stack
+ *                     follows the running task, see tss_update()
+ */
+void
+vsyscall_cpu_init(void)
+{
+    if (!x86_sysenter)
+        return;
+
+    arch_wrmsr(X86_MSR_SYSENTER_CS, SEL_KCSEG);
+    arch_wrmsr(X86_MSR_SYSENTER_EIP, (uint32_t) sysenter_entry);
+}
+
+/* vsyscall_init - fill the vsyscall page, once at boot */
+void
+vsyscall_init(void)
+{
+    char *va;
+
+    vsyscall_phys = palloc_get_page();
+    if (!vsyscall_phys)
+        panic("vsyscall: no memory for the vsyscall page\n");
+
+    va = kmap_temp(vsyscall_phys);
+    memset(va, 0, 4096);
+    memcpy(va, vsyscall_page_start, vsyscall_page_end - vsyscall_page_start);
+
+    x86_sysenter = __cpu_has_sysenter();
+    if (x86_sysenter) {
+        memcpy(va, vsyscall_sysenter_start,
+                vsyscall_sysenter_end - vsyscall_sysenter_start);
+        vsyscall_sysenter_ret = VSYSCALL_BASE
+            + (vsyscall_sysenter_return - vsyscall_sysenter_start);
+    }
+
+    kunmap_temp(va);
+
+    vsyscall_cpu_init();
+    if (x86_sysenter)
+        tss_update(current_task);
+
+    mprintk("system calls through %s\n", x86_sysenter ? "SYSENTER" : "int $0x80");
+}
+
+static void
+__vsyscall_map_page(struct task *task, uintptr_t phys, uint32_t vaddr)
+{
+    page_t *pte;
+
+    map_page(task->mm, phys, vaddr, 1);
+
+    pte = get_page_from_pgd(task->mm, vaddr);
+    pte_mark_read_only(pte);
+    tlb_flush_page(task->mm, vaddr);
+}
+
+/* a new per process page for @task, the caller holds the reference */
+static uintptr_t
+__vsyscall_task_page(struct task *task)
+{
+    struct vsyscall_task *vt;
+    uintptr_t phys;
+
+    phys = palloc_get_zeroed_page();
+    if (!phys)
+        return 0;
+
+    vt = kmap_temp(phys);
+    vt->vt_pid = task->pid;
+    kunmap_temp(vt);
+
+    return phys;
+}
+
+/* vsyscall_map - map the vsyscall pages into @task, at exec time */
+int
+vsyscall_map(struct task *task)
+{
+    struct vm_area *vma;
+    uintptr_t task_phys;
+
+    task_phys = __vsyscall_task_page(task);
+    if (!task_phys)
+        return -ENOMEM;
+
+    /* faults in them are errors, and they can't be made writeable */
+    vma = vm_area_create_insert(VSYSCALL_BASE, 0,
+                                VSYSCALL_BASE + VSYSCALL_PAGES * 4096,
+                                task, VMA_RESERVED);
+    if (!vma) {
+        palloc_unref_page(task_phys);
+        return -ENOMEM;
+    }
+
+    palloc_ref_page(vsyscall_phys);
+    __vsyscall_map_page(task, vsyscall_phys, VSYSCALL_BASE);
+
+    /* part of the kernel image, references don't count for it */
+    __vsyscall_map_page(task, kv2p(vsyscall_data), VSYSCALL_DATA);
+
+    __vsyscall_map_page(task, task_phys, VSYSCALL_TASK);
+
+    return 0;
+}
+
+/*
+ * vsyscall_fork - give @child a per process page of its own, instead of
+ *                 the parent's that it got with the rest of the address
+ *                 space
+ */
+int
+vsyscall_fork(struct task *child)
+{
+    uintptr_t phys, old;
+    page_t *pte;
+
+    pte = get_page_from_pgd(child->mm, VSYSCALL_TASK);
+    if (!pte || !pte_present(*pte))
+        return 0;
+
+    phys = __vsyscall_task_page(child);
+    if (!phys)
+        return -ENOMEM;
+
+    old = PG_RND_DOWN(*pte);
+    replace_page(child->mm, VSYSCALL_TASK, create_pte(phys, 1, 0));
+    palloc_unref_page(old);
+
+    return 0;
+}
@@ -2,8 +2,12 @@
 #include <levos/ata.h>
 #include <levos/page.h>
 #include <levos/arch.h>
+#include <levos/bio.h>
 #include <levos/device.h>
 #include <levos/intr.h>
+#include <levos/list.h>
+#include <levos/spinlock.h>
+#include <levos/timer.h>
 
 #define ATA_PRIMARY_IRQ 14
 #define ATA_PRIMARY_IO 0x1F0
@@ -19,6 +23,29 @@
 #define ATA_MASTER 0x00
 #define ATA_SLAVE  0x01
 
+/* bus master IDE registers, relative to the busmaster I/O base */
+#define BM_REG_COMMAND 0x00
+#define BM_REG_STATUS  0x02
+#define BM_REG_PRDT    0x04
+
+#define BM_CMD_START 0x01
+#define BM_CMD_READ  0x08 /* the device writes to memory */
+
+#define BM_SR_ACTIVE 0x01
+#define BM_SR_ERR    0x02
+#define BM_SR_IRQ    0x04
+
+/* the most one command transfers, it has to fit in the bounce area */
+#define ATA_DMA_MAX_SECTORS 0x7f
+
+/* enough for every sector of a command to be in a page of its own */
+#define ATA_PRDT_ENTRIES (ATA_DMA_MAX_SECTORS + 1)
+#define PRDT_LAST 0x8000
+
+/* how long a request may wait before it is served out of order (ticks) */
+#define ATA_READ_EXPIRE  50
+#define ATA_WRITE_EXPIRE 500
+
 #define MODULE_NAME ata
 
 static struct device *ata_devices[4];
@@ -32,11 +59,36 @@ struct dma_prdt {
 
 struct ata_dma_priv {
     int adp_busmaster;
-    int adp_last_count;
     char *adp_dma_area;
     struct dma_prdt *adp_dma_prdt;
+
+    /* the current command goes through @adp_dma_area */
+    int adp_bounce;
+
+    /* requests waiting for the disk, sorted by sector */
+    struct list adp_queue;
+    spinlock_t adp_lock;
+
+    /* the requests the disk is working on, they are contiguous and in
+     * order, @adp_total sectors from @adp_sector */
+    struct list adp_active;
+    int adp_busy;
+    int adp_dir;
+    uint32_t adp_sector;
+    size_t adp_total;
+
+    /* the sectors that are done, and how many the current command
+     * transfers */
+    size_t adp_done;
+    size_t adp_chunk;
+
+    /* where the last command ends, for the elevator */
+    uint32_t adp_head;
 };
 
+/* the primary channel, once it does DMA */
+static struct ata_dma_priv *ata_primary_dma;
+
 void ide_select_drive(uint8_t bus, uint8_t i)
 {
     if (bus == ATA_PRIMARY)
@@ -170,8 +222,10 @@ ata_read_pio(struct device *dev, void *buf, size_t count)
     for (int i = 0; i < count; i++)
     {
         rc = ata_read_one_sector_pio(buf, pos + i);
-        if (rc == -EIO)
+        if (rc == -EIO) {
+            ENABLE_IRQ();
             return -EIO;
+        }
         buf += 512;
         read += 512;
     }
@@ -181,144 +235,172 @@ ata_read_pio(struct device *dev, void *buf, size_t count)
     return count;
 }
 
-int
-ata_read_one_sector_dma(struct ata_dma_priv *adp, char *buf, size_t lba)
-{
-    uint16_t io = ATA_PRIMARY_IO;
-    uint8_t  dr = ATA_MASTER;
-    /* XXX: io & dr need to be dynamic once multiple ATA devices
-     * are implemented
-     */
-
-    uint8_t cmd = 0xE0;
-    int errors = 0;
-    uint8_t slavebit = 0x00;
-
-    ata_wait(io, 0);
-
-    /* set up DMA transfer by sending STOP */
-    outportb(adp->adp_busmaster, 0x00);
-
-    /* send the PRDT */
-    outportl(adp->adp_busmaster + 0x04, kv2p(adp->adp_dma_prdt));
-
-    /* enable ERR & IRQ status */
-    outportb(adp->adp_busmaster + 0x02,
-                inportb(adp->adp_busmaster + 0x02) | 0x04 | 0x02);
-
-    /* set direction */
-    outportb(adp->adp_busmaster, 0x08);
+/*
+ * DMA requests are queued per channel. The command and the bus master
+ * are programmed, then the submitter goes to sleep in bio_wait(), the
+ * disk raises IRQ 14 when it is done and ide_prim_irq() completes the
+ * requests and starts the next command.
+ *
+ * The queue is sorted by sector and served C-LOOK, sweeping upwards from
+ * where the disk head is and starting again at the lowest sector once
+ * nothing is left above it. A request that waited past its deadline is
+ * served first regardless, reads expire much sooner than writes since
+ * somebody is usually waiting for them.
+ *
+ * Requests in the same direction that continue each other are merged
+ * into one command, as long as it fits in the bounce area. A single
+ * request that doesn't fit is done in several commands.
+ *
+ * The disk transfers straight to and from the requests' buffers, the
+ * PRDT has an entry for every physically contiguous piece of them. Only
+ * when a buffer can't be used that way, because it is not dword aligned
+ * or the PRDT is full, the command goes through the bounce area.
+ */
 
-    /* wait till the device is ready */
-	while (1) {
-		uint8_t status = inportb(io + ATA_REG_STATUS);
-		if (!(status & ATA_SR_BSY)) break;
-	}
+/* copy the part of the current command between the bounce area and
+ * the requests it is for */
+static void
+__ata_dma_copy(struct ata_dma_priv *adp, int to_area)
+{
+    size_t start = adp->adp_done, end = adp->adp_done + adp->adp_chunk;
+    size_t pos = 0, from, to;
+    struct list_elem *elem;
 
-    //printk("ata: lba: %d\n", lba);
-try_a:
-    outportb(io + ATA_REG_CONTROL, 0x00);
+    list_foreach_raw(&adp->adp_active, elem) {
+        struct bio *bio = list_entry(elem, struct bio, bio_elem);
+        char *data, *area;
 
-    outportb(io + ATA_REG_HDDEVSEL, (cmd | (uint8_t)((lba >> 24 & 0x0F))));
-    ata_io_wait(io);
-    outportb(io + ATA_REG_FEATURES, 0x00);
-    outportb(io + ATA_REG_SECCOUNT0, 1);
-    outportb(io + ATA_REG_LBA0, (uint8_t)(lba));
-    outportb(io + ATA_REG_LBA1, (uint8_t)(lba >> 8));
-    outportb(io + ATA_REG_LBA2, (uint8_t)(lba >> 16));
-
-	/* wait again */
-    //printk("about to wait 1\n");
-    while (1) {
-		uint8_t status = inportb(io + ATA_REG_STATUS);
-		if (!(status & ATA_SR_BSY) && (status & ATA_SR_DRDY)) break;
-	}
-    //printk("finished wait 1\n");
+        from = start > pos ? start : pos;
+        to = end < pos + bio->bio_count ? end : pos + bio->bio_count;
 
-    outportb(io + ATA_REG_COMMAND, ATA_CMD_READ_DMA);
+        if (from < to) {
+            data = bio->bio_data + (from - pos) * 512;
+            area = adp->adp_dma_area + (from - start) * 512;
 
-    //printk("about to wait 2\n");
-	ata_io_wait(io);
-    //printk("finished wait 2\n");
+            if (to_area)
+                memcpy(area, data, (to - from) * 512);
+            else
+                memcpy(data, area, (to - from) * 512);
+        }
 
-	outportb(adp->adp_busmaster, 0x08 | 0x01);
+        pos += bio->bio_count;
+    }
+}
 
-    //printk("about to wait 3\n");
-    while (1) {
-		int status = inportb(adp->adp_busmaster + 0x02);
-		int dstatus = inportb(io + ATA_REG_STATUS);
-		if (!(status & 0x04)) {
-			continue;
-		}
-		if (!(dstatus & ATA_SR_BSY)) {
-			break;
-		}
-	}
-    //printk("finished wait 3\n");
+/* add @len bytes at @phys to the PRDT, which has @n entries so far */
+static int
+__ata_prdt_add(struct ata_dma_priv *adp, int *n, uint32_t phys, size_t len)
+{
+    struct dma_prdt *prd;
+
+    /* continue the last entry, if that doesn't cross a 64K boundary */
+    if (*n) {
+        prd = &adp->adp_dma_prdt[*n - 1];
+        if (prd->prdt_offset + prd->prdt_bytes == phys
+                && (prd->prdt_offset >> 16) == ((phys + len - 1) >> 16)) {
+            prd->prdt_bytes += len;
+            return 0;
+        }
+    }
 
-    memcpy(buf, adp->adp_dma_area, 512);
+    if (*n == ATA_PRDT_ENTRIES)
+        return -1;
 
-    outportb(adp->adp_busmaster+ 0x2, inportb(adp->adp_busmaster + 0x02) | 0x04 | 0x02);
+    prd = &adp->adp_dma_prdt[(*n) ++];
+    prd->prdt_offset = phys;
+    prd->prdt_bytes = len;
+    prd->prdt_last = 0;
 
     return 0;
 }
 
-int
-ata_read_sectors_dma(struct ata_dma_priv *adp, char *buf, size_t lba, size_t count)
+/* point the PRDT at the requests' buffers for the current command */
+static int
+__ata_dma_map(struct ata_dma_priv *adp)
 {
-    if (count < 0 || count > 0x7f) {
-        mprintk("CRITICAL: reading >0x7f or <0 sectors is not supported\n");
-        return -EIO;
+    size_t start = adp->adp_done, end = adp->adp_done + adp->adp_chunk;
+    size_t pos, next = 0, from, to, len, seg;
+    struct list_elem *elem;
+    uint32_t phys;
+    int n = 0;
+
+    list_foreach_raw(&adp->adp_active, elem) {
+        struct bio *bio = list_entry(elem, struct bio, bio_elem);
+        char *data;
+
+        pos = next;
+        next += bio->bio_count;
+
+        from = start > pos ? start : pos;
+        to = end < next ? end : next;
+        if (from >= to)
+            continue;
+
+        data = bio->bio_data + (from - pos) * 512;
+        len = (to - from) * 512;
+
+        if ((uint32_t) data & 3)
+            return -1;
+
+        /* page by page, they need not be contiguous */
+        while (len) {
+            seg = 4096 - ((uint32_t) data & 0xfff);
+            if (seg > len)
+                seg = len;
+
+            phys = kvirt_to_phys(data);
+            if (!phys || __ata_prdt_add(adp, &n, phys, seg))
+                return -1;
+
+            data += seg;
+            len -= seg;
+        }
     }
 
+    adp->adp_dma_prdt[n - 1].prdt_last = PRDT_LAST;
+    return 0;
+}
+
+static void
+__ata_dma_start(struct ata_dma_priv *adp)
+{
     uint16_t io = ATA_PRIMARY_IO;
-    uint8_t  dr = ATA_MASTER;
-    /* XXX: io & dr need to be dynamic once multiple ATA devices
+    /* XXX: io needs to be dynamic once multiple ATA devices
      * are implemented
      */
-
-    uint8_t cmd = 0xE0;
-    int errors = 0;
-    uint8_t slavebit = 0x00;
-
-    ata_wait(io, 0);
-
-    /* if the PRDT is set for the same count then reuse */
-    if (count != adp->adp_last_count) {
-        /* free the previous */
-        na_free(4096, adp->adp_dma_area);
-
-        /* allocate new ones */
-        adp->adp_dma_area = na_malloc(count * 512, 4096);
-        adp->adp_dma_prdt->prdt_offset = kv2p(adp->adp_dma_area);
-        adp->adp_dma_prdt->prdt_bytes = count * 512;
-        adp->adp_dma_prdt->prdt_last = 0x8000;
+    int write = adp->adp_dir == BIO_WRITE;
+    uint8_t dir = write ? 0 : BM_CMD_READ;
+    size_t lba = adp->adp_sector + adp->adp_done;
+    size_t count = adp->adp_total - adp->adp_done;
+
+    if (count > ATA_DMA_MAX_SECTORS)
+        count = ATA_DMA_MAX_SECTORS;
+    adp->adp_chunk = count;
+
+    adp->adp_bounce = __ata_dma_map(adp) != 0;
+    if (adp->adp_bounce) {
+        if (write)
+            __ata_dma_copy(adp, 1);
+
+        adp->adp_dma_prdt[0].prdt_offset = kv2p(adp->adp_dma_area);
+        adp->adp_dma_prdt[0].prdt_bytes = count * 512;
+        adp->adp_dma_prdt[0].prdt_last = PRDT_LAST;
     }
 
-    /* set up DMA transfer by sending STOP */
-    outportb(adp->adp_busmaster, 0x00);
-
-    /* send the PRDT */
-    outportl(adp->adp_busmaster + 0x04, kv2p(adp->adp_dma_prdt));
+    /* stop the bus master, and clear the interrupt and error bits */
+    outportb(adp->adp_busmaster + BM_REG_COMMAND, 0x00);
+    outportl(adp->adp_busmaster + BM_REG_PRDT, kv2p(adp->adp_dma_prdt));
+    outportb(adp->adp_busmaster + BM_REG_STATUS,
+                inportb(adp->adp_busmaster + BM_REG_STATUS) | BM_SR_IRQ | BM_SR_ERR);
+    outportb(adp->adp_busmaster + BM_REG_COMMAND, dir);
 
-    /* enable ERR & IRQ status */
-    outportb(adp->adp_busmaster + 0x02,
-                inportb(adp->adp_busmaster + 0x02) | 0x04 | 0x02);
+    /* the previous command is done, so this is short */
+    ata_status_wait(io, -1);
 
-    /* set direction */
-    outportb(adp->adp_busmaster, 0x08);
+    /* nIEN clear, the disk interrupts when it is done */
+    outportb(ATA_PRIMARY_DCR_AS, 0x00);
 
-    /* wait till the device is ready */
-	while (1) {
-		uint8_t status = inportb(io + ATA_REG_STATUS);
-		if (!(status & ATA_SR_BSY)) break;
-	}
-
-    //printk("ata: lba: %d\n", lba);
-try_a:
-    outportb(io + ATA_REG_CONTROL, 0x00);
-
-    outportb(io + ATA_REG_HDDEVSEL, (cmd | (uint8_t)((lba >> 24 & 0x0F))));
+    outportb(io + ATA_REG_HDDEVSEL, (0xE0 | (uint8_t)((lba >> 24 & 0x0F))));
     ata_io_wait(io);
     outportb(io + ATA_REG_FEATURES, 0x00);
     outportb(io + ATA_REG_SECCOUNT0, count);
@@ -326,279 +408,151 @@ try_a:
     outportb(io + ATA_REG_LBA1, (uint8_t)(lba >> 8));
     outportb(io + ATA_REG_LBA2, (uint8_t)(lba >> 16));
 
-	/* wait again */
-    //printk("about to wait 1\n");
-    while (1) {
-		uint8_t status = inportb(io + ATA_REG_STATUS);
-		if (!(status & ATA_SR_BSY) && (status & ATA_SR_DRDY)) break;
-	}
-    //printk("finished wait 1\n");
-
-    outportb(io + ATA_REG_COMMAND, ATA_CMD_READ_DMA);
-
-    //printk("about to wait 2\n");
-	ata_io_wait(io);
-    //printk("finished wait 2\n");
-
-	outportb(adp->adp_busmaster, 0x08 | 0x01);
-
-    //printk("about to wait 3\n");
     while (1) {
-		int status = inportb(adp->adp_busmaster + 0x02);
-		int dstatus = inportb(io + ATA_REG_STATUS);
-		if (!(status & 0x04)) {
-			continue;
-		}
-		if (!(dstatus & ATA_SR_BSY)) {
-			break;
-		}
-	}
-    //printk("finished wait 3\n");
-
-    memcpy(buf, adp->adp_dma_area, count * 512);
-
-    outportb(adp->adp_busmaster+ 0x2, inportb(adp->adp_busmaster + 0x02) | 0x04 | 0x02);
-
-    adp->adp_last_count = count;
+        uint8_t status = inportb(io + ATA_REG_STATUS);
+        if (!(status & ATA_SR_BSY) && (status & ATA_SR_DRDY))
+            break;
+    }
 
-    return 0;
+    outportb(io + ATA_REG_COMMAND, write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA);
+    outportb(adp->adp_busmaster + BM_REG_COMMAND, dir | BM_CMD_START);
 
+    adp->adp_head = lba + count;
 }
 
-int
-ata_read_dma(struct device *dev, void *buf, size_t count)
+/* the request to serve next, the queue is not empty */
+static struct bio *
+__ata_dma_pick(struct ata_dma_priv *adp)
 {
-    unsigned long pos = dev->pos;
-    int rc = 0, read = 0;
+    struct bio *bio, *expired = NULL, *next = NULL;
+    uint32_t now = timer_ticks();
+    struct list_elem *elem;
+
+    list_foreach_raw(&adp->adp_queue, elem) {
+        bio = list_entry(elem, struct bio, bio_elem);
+
+        /* of the expired ones, reads go first, then the oldest */
+        if ((int32_t) (now - bio->bio_deadline) >= 0) {
+            if (!expired
+                    || (bio->bio_dir == BIO_READ && expired->bio_dir == BIO_WRITE)
+                    || (bio->bio_dir == expired->bio_dir
+                        && (int32_t) (bio->bio_deadline - expired->bio_deadline) < 0))
+                expired = bio;
+        }
 
-#ifdef CONFIG_ATA_SECBYSEC
-    for (int i = 0; i < count; i++)
-    {
-        rc = ata_read_one_sector_dma(dev->priv, buf, pos + i);
-        if (rc == -EIO)
-            return -EIO;
-        buf += 512;
-        read += 512;
+        if (!next && bio->bio_sector >= adp->adp_head)
+            next = bio;
     }
-    dev->pos += count;
-#else
-    rc = ata_read_sectors_dma(dev->priv, buf, pos, count);
-    if (rc == -EIO)
-        return -EIO;
-    dev->pos += count;
-#endif
 
-    return count;
-}
-
-int
-ata_write_sectors_dma(struct ata_dma_priv *adp, char *buf, size_t lba, size_t count)
-{
-    if (count < 0 || count > 0x7f) {
-        mprintk("CRITICAL: writing >0x7f or <0 sectors is not supported\n");
-        return -EIO;
-    }
+    if (expired)
+        return expired;
 
-    uint16_t io = ATA_PRIMARY_IO;
-    uint8_t  dr = ATA_MASTER;
-    /* XXX: io & dr need to be dynamic once multiple ATA devices
-     * are implemented
-     */
+    if (next)
+        return next;
 
-    uint8_t cmd = 0xE0;
-    int errors = 0;
-    uint8_t slavebit = 0x00;
-
-    ata_wait(io, 0);
+    return list_entry(list_begin(&adp->adp_queue), struct bio, bio_elem);
+}
 
-    /* if the PRDT is set for the same count then reuse */
-    if (count != adp->adp_last_count) {
-        /* free the previous */
-        na_free(4096, adp->adp_dma_area);
+/* start the next command, if anything is queued. adp_lock is held */
+static void
+__ata_dma_next(struct ata_dma_priv *adp)
+{
+    struct list_elem *elem;
+    struct bio *bio;
 
-        /* allocate new ones */
-        adp->adp_dma_area = na_malloc(count * 512, 4096);
-        adp->adp_dma_prdt->prdt_offset = kv2p(adp->adp_dma_area);
-        adp->adp_dma_prdt->prdt_bytes = count * 512;
-        adp->adp_dma_prdt->prdt_last = 0x8000;
-    }
+    adp->adp_busy = 0;
+    if (list_empty(&adp->adp_queue))
+        return;
 
-    memcpy(adp->adp_dma_area, buf, count * 512);
+    bio = __ata_dma_pick(adp);
+    elem = list_remove(&bio->bio_elem);
 
-    /* set up DMA transfer by sending STOP */
-    outportb(adp->adp_busmaster, 0x00);
+    bio->bio_state = BIO_ACTIVE;
+    list_push_back(&adp->adp_active, &bio->bio_elem);
+    adp->adp_dir = bio->bio_dir;
+    adp->adp_sector = bio->bio_sector;
+    adp->adp_total = bio->bio_count;
 
-    /* send the PRDT */
-    outportl(adp->adp_busmaster + 0x04, kv2p(adp->adp_dma_prdt));
+    /* take along what continues it, the queue is sorted */
+    while (elem != list_end(&adp->adp_queue)) {
+        bio = list_entry(elem, struct bio, bio_elem);
 
-    /* enable ERR & IRQ status */
-    outportb(adp->adp_busmaster + 0x02,
-                inportb(adp->adp_busmaster + 0x02) | 0x04 | 0x02);
+        if (bio->bio_sector != adp->adp_sector + adp->adp_total
+                || bio->bio_dir != adp->adp_dir
+                || adp->adp_total + bio->bio_count > ATA_DMA_MAX_SECTORS)
+            break;
 
-    /* set direction */
-    outportb(adp->adp_busmaster, inportb(adp->adp_busmaster) & ~8);
+        elem = list_remove(&bio->bio_elem);
 
-    /* wait till the device is ready */
-	while (1) {
-		uint8_t status = inportb(io + ATA_REG_STATUS);
-		if (!(status & ATA_SR_BSY)) break;
-	}
+        bio->bio_state = BIO_ACTIVE;
+        list_push_back(&adp->adp_active, &bio->bio_elem);
+        adp->adp_total += bio->bio_count;
+    }
 
-    //printk("ata: lba: %d\n", lba);
-try_a:
-    outportb(io + ATA_REG_CONTROL, 0x00);
+    adp->adp_busy = 1;
+    adp->adp_done = 0;
+    __ata_dma_start(adp);
+}
 
-    outportb(io + ATA_REG_HDDEVSEL, (cmd | (uint8_t)((lba >> 24 & 0x0F))));
-    ata_io_wait(io);
-    outportb(io + ATA_REG_FEATURES, 0x00);
-    outportb(io + ATA_REG_SECCOUNT0, count);
-    outportb(io + ATA_REG_LBA0, (uint8_t)(lba));
-    outportb(io + ATA_REG_LBA1, (uint8_t)(lba >> 8));
-    outportb(io + ATA_REG_LBA2, (uint8_t)(lba >> 16));
+/* ata_submit_bio - queue @bio, the disk starts on it right away if idle */
+int
+ata_submit_bio(struct device *dev, struct bio *bio)
+{
+    struct ata_dma_priv *adp = dev->priv;
+    struct list_elem *elem;
+    uint32_t flags;
 
-	/* wait again */
-    //printk("about to wait 1\n");
-    while (1) {
-		uint8_t status = inportb(io + ATA_REG_STATUS);
-		if (!(status & ATA_SR_BSY) && (status & ATA_SR_DRDY)) break;
-	}
-    //printk("finished wait 1\n");
+    if (!bio->bio_count) {
+        bio_complete(bio, 0);
+        return 0;
+    }
 
-    outportb(io + ATA_REG_COMMAND, ATA_CMD_WRITE_DMA);
+    bio->bio_state = BIO_QUEUED;
+    bio->bio_deadline = timer_ticks()
+        + (bio->bio_dir == BIO_READ ? ATA_READ_EXPIRE : ATA_WRITE_EXPIRE);
 
-    //printk("about to wait 2\n");
-	ata_io_wait(io);
-    //printk("finished wait 2\n");
+    flags = spin_lock_irqsave(&adp->adp_lock);
 
-	outportb(adp->adp_busmaster, 0x08 | 0x01);
+    /* after the ones for the same sector, so those keep their order */
+    list_foreach_raw(&adp->adp_queue, elem) {
+        struct bio *other = list_entry(elem, struct bio, bio_elem);
 
-    //printk("about to wait 3\n");
-    while (1) {
-		int status = inportb(adp->adp_busmaster + 0x02);
-		int dstatus = inportb(io + ATA_REG_STATUS);
-		if (!(status & 0x04)) {
-			continue;
-		}
-		if (!(dstatus & ATA_SR_BSY)) {
-			break;
-		}
-	}
-    //printk("finished wait 3\n");
+        if (other->bio_sector > bio->bio_sector)
+            break;
+    }
+    list_insert(elem, &bio->bio_elem);
 
-    outportb(adp->adp_busmaster+ 0x2, inportb(adp->adp_busmaster + 0x02) | 0x04 | 0x02);
+    if (!adp->adp_busy)
+        __ata_dma_next(adp);
 
-    adp->adp_last_count = count;
+    spin_unlock_irqrestore(&adp->adp_lock, flags);
 
     return 0;
-
 }
 
 int
-ata_write_one_sector_dma(struct ata_dma_priv *adp, char *buf, size_t lba)
+ata_read_dma(struct device *dev, void *buf, size_t count)
 {
-    uint16_t io = ATA_PRIMARY_IO;
-    uint8_t  dr = ATA_MASTER;
-    /* XXX: io & dr need to be dynamic once multiple ATA devices
-     * are implemented
-     */
-
-    uint8_t cmd = 0xE0;
-    int errors = 0;
-    uint8_t slavebit = 0x00;
-
-    ata_wait(io, 0);
-
-    /* set up DMA transfer by sending STOP */
-    outportb(adp->adp_busmaster, 0x00);
-
-    /* send the PRDT */
-    outportl(adp->adp_busmaster + 0x04, kv2p(adp->adp_dma_prdt));
-
-    /* enable ERR & IRQ status */
-    outportb(adp->adp_busmaster + 0x02,
-                inportb(adp->adp_busmaster + 0x02) | 0x04 | 0x02);
-
-    /* set direction */
-    outportb(adp->adp_busmaster, inportb(adp->adp_busmaster) & ~8);
-
-    /* copy our data */
-    memcpy(adp->adp_dma_area, buf, 512);
-
-    /* wait till the device is ready */
-	while (1) {
-		uint8_t status = inportb(io + ATA_REG_STATUS);
-		if (!(status & ATA_SR_BSY)) break;
-	}
-
-    //printk("ata: lba: %d\n", lba);
-try_a:
-    outportb(io + ATA_REG_CONTROL, 0x00);
-
-    outportb(io + ATA_REG_HDDEVSEL, (cmd | (uint8_t)((lba >> 24 & 0x0F))));
-    ata_io_wait(io);
-    outportb(io + ATA_REG_FEATURES, 0x00);
-    outportb(io + ATA_REG_SECCOUNT0, 1);
-    outportb(io + ATA_REG_LBA0, (uint8_t)(lba));
-    outportb(io + ATA_REG_LBA1, (uint8_t)(lba >> 8));
-    outportb(io + ATA_REG_LBA2, (uint8_t)(lba >> 16));
-
-	/* wait again */
-    //printk("about to wait 1\n");
-    while (1) {
-		uint8_t status = inportb(io + ATA_REG_STATUS);
-		if (!(status & ATA_SR_BSY) && (status & ATA_SR_DRDY)) break;
-	}
-    //printk("finished wait 1\n");
-
-    outportb(io + ATA_REG_COMMAND, ATA_CMD_WRITE_DMA);
+    int rc;
 
-    //printk("about to wait 2\n");
-	ata_io_wait(io);
-    //printk("finished wait 2\n");
+    rc = bio_rw(dev, BIO_READ, dev->pos, buf, count);
+    if (rc)
+        return rc;
 
-	outportb(adp->adp_busmaster, 0x08 | 0x01);
-
-    //printk("about to wait 3\n");
-    while (1) {
-		int status = inportb(adp->adp_busmaster + 0x02);
-		int dstatus = inportb(io + ATA_REG_STATUS);
-		if (!(status & 0x04)) {
-			continue;
-		}
-		if (!(dstatus & ATA_SR_BSY)) {
-			break;
-		}
-	}
-    //printk("finished wait 3\n");
-
-    outportb(adp->adp_busmaster+ 0x2, inportb(adp->adp_busmaster + 0x02) | 0x04 | 0x02);
-
-    return 0;
+    dev->pos += count;
+    return count;
 }
 
 int
 ata_write_dma(struct device *dev, void *buf, size_t count)
 {
-    unsigned long pos = dev->pos;
-    int rc = 0, read = 0;
+    int rc;
 
-#ifdef CONFIG_ATA_SECBYSEC
-    for (int i = 0; i < count; i++)
-    {
-        rc = ata_write_one_sector_dma(dev->priv, buf, pos + i);
-        if (rc == -EIO)
-            return -EIO;
-        buf += 512;
-        read += 512;
-    }
-    dev->pos += count;
-#else
-    rc = ata_write_sectors_dma(dev->priv, buf, pos, count);
-    if (rc == -EIO)
-        return -EIO;
-    dev->pos += count;
-#endif
+    rc = bio_rw(dev, BIO_WRITE, dev->pos, buf, count);
+    if (rc)
+        return rc;
 
+    dev->pos += count;
     return count;
 }
 
@@ -623,7 +577,10 @@ ata_write_one_sector_pio(uint16_t *buf, size_t lba)
     outportb(io + ATA_REG_LBA1, (uint8_t)(lba >> 8));
     outportb(io + ATA_REG_LBA2, (uint8_t)(lba >> 16));
     outportb(io + ATA_REG_COMMAND, ATA_CMD_WRITE_PIO);
-    ata_wait(io, 0);
+
+    /* the drive wants the data now, unless it failed the command */
+    if (ata_wait(io, 1))
+        return -EIO;
 
     for (int i = 0; i < 256; i++) {
         outportw(io + ATA_REG_DATA, buf[i]);
@@ -633,6 +590,9 @@ ata_write_one_sector_pio(uint16_t *buf, size_t lba)
 
     ata_wait(io, 0);
 
+    if (inportb(io + ATA_REG_STATUS) & (ATA_SR_ERR | ATA_SR_DF))
+        return -EIO;
+
     return 0;
 }
 
@@ -644,7 +604,10 @@ ata_write_pio(struct device *dev, void *buf, size_t count)
     DISABLE_IRQ();
     for (int i = 0; i < count; i++)
     {
-        ata_write_one_sector_pio(buf, pos + i);
+        if (ata_write_one_sector_pio(buf, pos + i)) {
+            ENABLE_IRQ();
+            return -EIO;
+        }
         buf += 512;
         for (int j = 0; j < 1000; j ++)
             ;
@@ -695,6 +658,7 @@ ide_identify(void)
 
         dev->read = ata_read_pio;
         dev->write = ata_write_pio;
+        dev->submit = NULL;
         dev->pos = 0;
         dev->type = DEV_TYPE_BLOCK;
         dev->subtype = DEV_TYPE_BLOCK_ATA;
@@ -719,16 +683,18 @@ do_ata_switch_dma(struct device *dev, uint16_t busmaster)
     struct ata_dma_priv *adp = malloc(sizeof(*adp));
 
     adp->adp_busmaster = busmaster;
-    adp->adp_dma_area = na_malloc(4096, 4096);
-    adp->adp_dma_prdt = malloc(sizeof(struct dma_prdt));
-    adp->adp_dma_prdt->prdt_offset = kv2p(adp->adp_dma_area);
-    adp->adp_dma_prdt->prdt_bytes = 512;
-    adp->adp_dma_prdt->prdt_last = 0x8000;
-    adp->adp_last_count = 1;
 
-    mprintk("PRDT (v 0x%x p 0x%x) AREA (v 0x%x p 0x%x)\n",
-                adp->adp_dma_prdt, kv2p(adp->adp_dma_prdt),
-                adp->adp_dma_area, kv2p(adp->adp_dma_area));
+    /* aligned so that it never crosses a 64K boundary */
+    adp->adp_dma_area = na_malloc(ATA_DMA_MAX_SECTORS * 512, 0x10000);
+    /* it must not cross a 64K boundary either */
+    adp->adp_dma_prdt = na_malloc(ATA_PRDT_ENTRIES * sizeof(struct dma_prdt),
+                                  ATA_PRDT_ENTRIES * sizeof(struct dma_prdt));
+
+    list_init(&adp->adp_queue);
+    list_init(&adp->adp_active);
+    spin_lock_init(&adp->adp_lock);
+    adp->adp_busy = 0;
+    adp->adp_head = 0;
 
     mprintk("PRDT (v 0x%x p 0x%x) AREA (v 0x%x p 0x%x)\n",
                 adp->adp_dma_prdt, kv2p(adp->adp_dma_prdt),
@@ -736,7 +702,11 @@ do_ata_switch_dma(struct device *dev, uint16_t busmaster)
 
     dev->read = ata_read_dma;
     dev->write = ata_write_dma;
+    dev->submit = ata_submit_bio;
     dev->priv = adp;
+
+    /* XXX: only the primary master is supported */
+    ata_primary_dma = adp;
 }
 
 /*
@@ -771,10 +741,65 @@ ata_probe(void)
     printk("ata: %d devices brought online\n", devs);
 }
 
+/*
+ * ide_prim_irq - the disk finished a command, complete the requests or
+ *                start the next piece of them
+ */
 void
 ide_prim_irq(struct pt_regs *r)
 {
-    return;
+    struct ata_dma_priv *adp = ata_primary_dma;
+    uint8_t status, bmstatus;
+    struct list done;
+    struct bio *bio;
+    int error = 0;
+
+    /* reading the status register acknowledges the interrupt */
+    if (!adp) {
+        inportb(ATA_PRIMARY_IO + ATA_REG_STATUS);
+        return;
+    }
+
+    list_init(&done);
+
+    spin_lock(&adp->adp_lock);
+
+    bmstatus = inportb(adp->adp_busmaster + BM_REG_STATUS);
+    status = inportb(ATA_PRIMARY_IO + ATA_REG_STATUS);
+
+    if (!adp->adp_busy || !(bmstatus & BM_SR_IRQ)) {
+        spin_unlock(&adp->adp_lock);
+        return;
+    }
+
+    outportb(adp->adp_busmaster + BM_REG_COMMAND, 0x00);
+    outportb(adp->adp_busmaster + BM_REG_STATUS, bmstatus | BM_SR_IRQ | BM_SR_ERR);
+
+    if ((status & (ATA_SR_ERR | ATA_SR_DF)) || (bmstatus & BM_SR_ERR)) {
+        mprintk("DMA error at sector %d, status 0x%x bus master 0x%x\n",
+                adp->adp_sector + adp->adp_done, status, bmstatus);
+        error = -EIO;
+    } else {
+        if (adp->adp_dir == BIO_READ && adp->adp_bounce)
+            __ata_dma_copy(adp, 0);
+        adp->adp_done += adp->adp_chunk;
+    }
+
+    if (!error && adp->adp_done < adp->adp_total) {
+        __ata_dma_start(adp);
+    } else {
+        while (!list_empty(&adp->adp_active))
+            list_push_back(&done, list_pop_front(&adp->adp_active));
+        __ata_dma_next(adp);
+    }
+
+    spin_unlock(&adp->adp_lock);
+
+    /* the submitters may free them as soon as they are complete */
+    while (!list_empty(&done)) {
+        bio = list_entry(list_pop_front(&done), struct bio, bio_elem);
+        bio_complete(bio, error);
+    }
 }
 
 void
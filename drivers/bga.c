@@ -91,7 +91,7 @@ int
 fb_file_close(struct file *f)
 {
     free(f->full_path);
-    free(f);
+    file_free(f);
 }
 
 struct __fb_arg {
@@ -151,9 +151,6 @@ int bga_pci_attach(struct pci_device *pdev) {
     priv->lfb_size = 8 * 1024 * 1024; /* XXX */
 
     fb_base_file.priv = priv;
-
-
-    __flush_tlb();
 }
 
 uint32_t
@@ -463,7 +463,7 @@ int
 kbd_file_close(struct file *f)
 {
     free(f->full_path);
-    free(f);
+    file_free(f);
 }
 
 struct file_operations kbd_fops = {
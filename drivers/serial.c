@@ -80,7 +80,7 @@ int
 serial_file_close(struct file *f)
 {
     free(f->full_path);
-    free(f);
+    file_free(f);
 }
 
 int
@@ -212,7 +212,7 @@ struct file_operations tty_fops = {
 struct file *
 tty_get_file(struct tty_device *tty)
 {
-    struct file *filp = malloc(sizeof(*filp));
+    struct file *filp = file_alloc();
     if (!filp)
         return NULL;
 
@@ -222,6 +222,7 @@ tty_get_file(struct tty_device *tty)
     filp->isdir = 0;
     filp->type = FILE_TYPE_TTY;
     filp->refc = 1;
+    filp->ino = 0;
     filp->respath = "console";
     filp->full_path = strdup("/dev/console");
     filp->priv = tty;
@@ -308,7 +309,7 @@ int
 ctty_file_close(struct file *f)
 {
     free(f->full_path);
-    free(f);
+    file_free(f);
 }
 
 struct file_operations ctty_fops = {
@@ -0,0 +1,592 @@
+#include <levos/kernel.h>
+#include <levos/bcache.h>
+#include <levos/bio.h>
+#include <levos/device.h>
+#include <levos/fs.h>
+#include <levos/hash.h>
+#include <levos/list.h>
+#include <levos/spinlock.h>
+#include <levos/task.h>
+#include <levos/work.h>
+
+#define MODULE_NAME bcache
+
+/*
+ * The buffer cache sits between the filesystems and the block devices,
+ * every block that is read or written goes through here. Buffers are
+ * hashed by (device, block) and kept on an LRU list, the least recently
+ * used unreferenced buffer is the one that gets evicted once the cache
+ * is full. Writes only dirty the buffer, the kworker writes them back
+ * every BCACHE_FLUSH_DELAY ticks.
+ *
+ * The cache lock is never held across disk I/O. A buffer that is being
+ * read in or written back is BUF_LOCKED and referenced, whoever else
+ * looks it up waits for that.
+ */
+
+static struct hash bcache_hash;
+static struct list bcache_lru;
+static spinlock_t bcache_lock;
+static int bcache_nr_buffers;
+
+static unsigned
+bcache_hash_buf(const struct hash_elem *elem, void *aux)
+{
+    struct buffer *buf = hash_entry(elem, struct buffer, buf_helem);
+
+    return hash_int((int) buf->buf_dev ^ buf->buf_block);
+}
+
+static bool
+bcache_less_buf(const struct hash_elem *ea,
+                const struct hash_elem *eb,
+                void *aux)
+{
+    struct buffer *a = hash_entry(ea, struct buffer, buf_helem);
+    struct buffer *b = hash_entry(eb, struct buffer, buf_helem);
+
+    if (a->buf_dev != b->buf_dev)
+        return a->buf_dev < b->buf_dev;
+
+    return a->buf_block < b->buf_block;
+}
+
+/* sectors per block of @buf */
+static int
+__bcache_spb(struct buffer *buf)
+{
+    int spb = buf->buf_size / 512;
+
+    return spb ? spb : 1;
+}
+
+static int
+__bcache_do_io(struct buffer *buf, int write)
+{
+    struct device *dev = buf->buf_dev;
+    int spb = __bcache_spb(buf);
+
+    if (write && !dev->write)
+        return -EROFS;
+
+    return bio_rw(dev, write ? BIO_WRITE : BIO_READ,
+                  buf->buf_block * spb, buf->buf_data, spb);
+}
+
+/*
+ * __bcache_writeback - write @buf back if it is dirty, the caller holds
+ *                      the cache lock, which is dropped meanwhile
+ *
+ * The dirty bit is cleared first, a change that races with the write
+ * dirties the buffer again.
+ */
+static int
+__bcache_writeback(struct buffer *buf)
+{
+    int rc;
+
+    if (!(buf->buf_flags & BUF_DIRTY))
+        return 0;
+
+    buf->buf_flags &= ~BUF_DIRTY;
+    buf->buf_flags |= BUF_LOCKED;
+    buf->buf_refc ++;
+    spin_unlock(&bcache_lock);
+
+    rc = __bcache_do_io(buf, 1);
+
+    spin_lock(&bcache_lock);
+    buf->buf_refc --;
+    buf->buf_flags &= ~BUF_LOCKED;
+    if (rc)
+        buf->buf_flags |= BUF_DIRTY;
+
+    return rc;
+}
+
+static struct buffer *
+__bcache_lookup(struct device *dev, uint32_t block)
+{
+    struct buffer cmp;
+    struct hash_elem *elem;
+
+    cmp.buf_dev = dev;
+    cmp.buf_block = block;
+
+    elem = hash_find(&bcache_hash, &cmp.buf_helem);
+    if (!elem)
+        return NULL;
+
+    return hash_entry(elem, struct buffer, buf_helem);
+}
+
+/*
+ * __bcache_lookup_wait - look up a buffer, waiting for it to be read
+ *                        in or written back if somebody is doing that
+ */
+static struct buffer *
+__bcache_lookup_wait(struct device *dev, uint32_t block)
+{
+    struct buffer *buf;
+
+    while ((buf = __bcache_lookup(dev, block)) && (buf->buf_flags & BUF_LOCKED)) {
+        spin_unlock(&bcache_lock);
+        sched_yield();
+        spin_lock(&bcache_lock);
+    }
+
+    return buf;
+}
+
+static void
+__bcache_destroy(struct buffer *buf)
+{
+    hash_delete(&bcache_hash, &buf->buf_helem);
+    list_remove(&buf->buf_lru_elem);
+    bcache_nr_buffers --;
+
+    free(buf->buf_data);
+    free(buf);
+}
+
+static int
+__bcache_unused(struct buffer *buf)
+{
+    return !buf->buf_refc && !(buf->buf_flags & BUF_LOCKED);
+}
+
+/*
+ * __bcache_lookup_size - look up the buffer of @block of @dev, one that
+ *                        has a size other than @size is written back and
+ *                        thrown out
+ *
+ * Returns NULL if there is no buffer, or an ERR_PTR().
+ */
+static struct buffer *
+__bcache_lookup_size(struct device *dev, uint32_t block, size_t size)
+{
+    struct buffer *buf;
+    int rc;
+
+    while ((buf = __bcache_lookup_wait(dev, block)) && buf->buf_size != size) {
+        /* someone is accessing the device with a different blocksize */
+        if (buf->buf_refc)
+            return ERR_PTR(-EBUSY);
+
+        /* the lock was dropped if it was dirty, look at it again */
+        if (buf->buf_flags & BUF_DIRTY) {
+            rc = __bcache_writeback(buf);
+            if (rc)
+                return ERR_PTR(rc);
+            continue;
+        }
+
+        __bcache_destroy(buf);
+    }
+
+    return buf;
+}
+
+/*
+ * __bcache_evict - throw out the least recently used buffer that
+ *                  nobody holds a reference to
+ *
+ * A dirty buffer that can't be written back stays, it is the only copy
+ * of that data. Writing one back drops the lock, so the cache may have
+ * changed by the time this returns.
+ */
+static int
+__bcache_evict(void)
+{
+    struct list_elem *elem;
+
+    list_foreach_raw(&bcache_lru, elem) {
+        struct buffer *buf = list_entry(elem, struct buffer, buf_lru_elem);
+
+        if (!__bcache_unused(buf))
+            continue;
+
+        /* the reference kept it on the list, but it may be in use again */
+        if (__bcache_writeback(buf))
+            continue;
+
+        if (!__bcache_unused(buf) || (buf->buf_flags & BUF_DIRTY))
+            continue;
+
+        __bcache_destroy(buf);
+        return 0;
+    }
+
+    return -ENOMEM;
+}
+
+/*
+ * __bcache_alloc - add a new buffer for @block of @dev to the cache
+ *
+ * Making room may drop the lock, if somebody else added the block in
+ * the meantime that buffer is returned instead.
+ */
+static struct buffer *
+__bcache_alloc(struct device *dev, uint32_t block, size_t size)
+{
+    struct hash_elem *old;
+    struct buffer *buf;
+    int rc;
+
+again:
+    while (bcache_nr_buffers >= BCACHE_MAX_BUFFERS) {
+        rc = __bcache_evict();
+
+        /* the lock may have been dropped even if nothing was evicted */
+        buf = __bcache_lookup_size(dev, block, size);
+        if (buf)
+            return buf;
+
+        if (rc)
+            break;
+    }
+
+    buf = malloc(sizeof(*buf));
+    if (!buf)
+        return ERR_PTR(-ENOMEM);
+
+    buf->buf_data = malloc(size);
+    if (!buf->buf_data) {
+        free(buf);
+        return ERR_PTR(-ENOMEM);
+    }
+
+    buf->buf_dev = dev;
+    buf->buf_block = block;
+    buf->buf_size = size;
+    buf->buf_flags = 0;
+    buf->buf_refc = 0;
+
+    /* a buffer that isn't hashed could never be found nor destroyed */
+    old = hash_insert(&bcache_hash, &buf->buf_helem);
+    if (old) {
+        free(buf->buf_data);
+        free(buf);
+
+        buf = __bcache_lookup_size(dev, block, size);
+        if (buf)
+            return buf;
+        goto again;
+    }
+
+    list_push_back(&bcache_lru, &buf->buf_lru_elem);
+    bcache_nr_buffers ++;
+
+    return buf;
+}
+
+/*
+ * bcache_get - get a referenced buffer for @block of @dev
+ *
+ * The contents are read from the device if they are not in memory yet.
+ * If that fails the error is returned, and the buffer stays without
+ * BUF_UPTODATE, so the next bcache_get() tries again. The reference
+ * must be dropped with bcache_put().
+ */
+struct buffer *
+bcache_get(struct device *dev, uint32_t block, size_t size)
+{
+    struct buffer *buf;
+    int rc;
+
+    spin_lock(&bcache_lock);
+
+    buf = __bcache_lookup_size(dev, block, size);
+    if (!buf)
+        buf = __bcache_alloc(dev, block, size);
+    if (IS_ERR(buf)) {
+        spin_unlock(&bcache_lock);
+        return buf;
+    }
+
+    /* move to the most recently used end */
+    list_remove(&buf->buf_lru_elem);
+    list_push_back(&bcache_lru, &buf->buf_lru_elem);
+
+    buf->buf_refc ++;
+
+    if (!(buf->buf_flags & BUF_UPTODATE)) {
+        /* the reference keeps it from being evicted meanwhile */
+        buf->buf_flags |= BUF_LOCKED;
+        spin_unlock(&bcache_lock);
+
+        rc = __bcache_do_io(buf, 0);
+
+        spin_lock(&bcache_lock);
+        buf->buf_flags &= ~BUF_LOCKED;
+        if (rc) {
+            buf->buf_refc --;
+            spin_unlock(&bcache_lock);
+            return ERR_PTR(rc);
+        }
+        buf->buf_flags |= BUF_UPTODATE;
+    }
+
+    spin_unlock(&bcache_lock);
+
+    return buf;
+}
+
+void
+bcache_put(struct buffer *buf)
+{
+    spin_lock(&bcache_lock);
+    panic_ifnot(buf->buf_refc > 0);
+    buf->buf_refc --;
+    spin_unlock(&bcache_lock);
+}
+
+void
+bcache_mark_dirty(struct buffer *buf)
+{
+    spin_lock(&bcache_lock);
+    buf->buf_flags |= BUF_DIRTY | BUF_UPTODATE;
+    spin_unlock(&bcache_lock);
+}
+
+/*
+ * bcache_read - copy the contents of a block into @data
+ */
+int
+bcache_read(struct device *dev, uint32_t block, size_t size, void *data)
+{
+    struct buffer *buf = bcache_get(dev, block, size);
+
+    if (IS_ERR(buf))
+        return PTR_ERR(buf);
+
+    memcpy(data, buf->buf_data, size);
+    bcache_put(buf);
+
+    return 0;
+}
+
+/*
+ * bcache_read_blocks - read the @nr blocks from @block on straight into
+ *                      @data, which must be kernel memory, without
+ *                      caching them
+ *
+ * For large reads that would push everything else out of the cache.
+ * The blocks that are in the cache are taken from there, they may be
+ * newer than what is on the disk.
+ */
+int
+bcache_read_blocks(struct device *dev, uint32_t block, int nr, size_t size,
+                   void *data)
+{
+    struct buffer *buf;
+    int spb = size / 512;
+    int i, rc;
+
+    if (!spb)
+        spb ++;
+
+    rc = bio_rw(dev, BIO_READ, block * spb, data, nr * spb);
+    if (rc)
+        return rc;
+
+    spin_lock(&bcache_lock);
+    for (i = 0; i < nr; i ++) {
+        buf = __bcache_lookup(dev, block + i);
+        if (buf && buf->buf_size == size && (buf->buf_flags & BUF_UPTODATE))
+            memcpy(data + i * size, buf->buf_data, size);
+    }
+    spin_unlock(&bcache_lock);
+
+    return 0;
+}
+
+/*
+ * bcache_write - replace the contents of a block with @data
+ *
+ * The block is only written to the device on the next flush.
+ */
+int
+bcache_write(struct device *dev, uint32_t block, size_t size, void *data)
+{
+    struct buffer *buf;
+
+    if (!dev->write)
+        return -EROFS;
+
+    spin_lock(&bcache_lock);
+
+    /* the whole block is overwritten, no need to read it in */
+    buf = __bcache_lookup_size(dev, block, size);
+    if (!buf)
+        buf = __bcache_alloc(dev, block, size);
+    if (IS_ERR(buf)) {
+        spin_unlock(&bcache_lock);
+        return PTR_ERR(buf);
+    }
+
+    list_remove(&buf->buf_lru_elem);
+    list_push_back(&bcache_lru, &buf->buf_lru_elem);
+
+    memcpy(buf->buf_data, data, size);
+    buf->buf_flags |= BUF_DIRTY | BUF_UPTODATE;
+
+    spin_unlock(&bcache_lock);
+
+    return 0;
+}
+
+/* the write back of one batch, only one bcache_sync() uses it at a time */
+static struct bio bcache_sync_bios[BCACHE_SYNC_BATCH];
+static struct buffer *bcache_sync_bufs[BCACHE_SYNC_BATCH];
+static int bcache_sync_busy;
+
+/*
+ * __bcache_sync_batch - write back the first @n buffers of the batch,
+ *                       all of them are submitted before waiting, so
+ *                       the disk can sort and merge them
+ *
+ * The buffers are locked and referenced, the cache lock is dropped for
+ * the I/O like in __bcache_writeback().
+ */
+static int
+__bcache_sync_batch(int n)
+{
+    int i, rc, ret = 0;
+
+    if (!n)
+        return 0;
+
+    spin_unlock(&bcache_lock);
+
+    for (i = 0; i < n; i ++)
+        submit_bio(&bcache_sync_bios[i]);
+
+    for (i = 0; i < n; i ++)
+        bio_wait(&bcache_sync_bios[i]);
+
+    spin_lock(&bcache_lock);
+
+    for (i = 0; i < n; i ++) {
+        struct buffer *buf = bcache_sync_bufs[i];
+
+        rc = bcache_sync_bios[i].bio_error;
+        if (rc) {
+            buf->buf_flags |= BUF_DIRTY;
+            ret = rc;
+        }
+
+        buf->buf_flags &= ~BUF_LOCKED;
+        buf->buf_refc --;
+    }
+
+    return ret;
+}
+
+/*
+ * bcache_sync - write back all dirty buffers of @dev, or of every
+ *               device if @dev is NULL
+ */
+int
+bcache_sync(struct device *dev)
+{
+    struct list_elem *elem;
+    int rc, n = 0, ret = 0;
+
+    spin_lock(&bcache_lock);
+
+    while (bcache_sync_busy) {
+        spin_unlock(&bcache_lock);
+        sched_yield();
+        spin_lock(&bcache_lock);
+    }
+    bcache_sync_busy = 1;
+
+    list_foreach_raw(&bcache_lru, elem) {
+        struct buffer *buf = list_entry(elem, struct buffer, buf_lru_elem);
+
+        if (dev && buf->buf_dev != dev)
+            continue;
+
+        /* somebody else is doing I/O on it already */
+        if (!(buf->buf_flags & BUF_DIRTY) || (buf->buf_flags & BUF_LOCKED))
+            continue;
+
+        if (!buf->buf_dev->write) {
+            ret = -EROFS;
+            continue;
+        }
+
+        /* like __bcache_writeback(), it is dirtied again on failure */
+        buf->buf_flags &= ~BUF_DIRTY;
+        buf->buf_flags |= BUF_LOCKED;
+        buf->buf_refc ++;
+
+        bio_init(&bcache_sync_bios[n], buf->buf_dev, BIO_WRITE,
+                 buf->buf_block * __bcache_spb(buf), buf->buf_data,
+                 __bcache_spb(buf));
+        bcache_sync_bufs[n ++] = buf;
+
+        /*
+         * the locked buffers can't be evicted or moved on the LRU list
+         * meanwhile, so the walk goes on from this one
+         */
+        if (n == BCACHE_SYNC_BATCH) {
+            rc = __bcache_sync_batch(n);
+            if (rc)
+                ret = rc;
+            n = 0;
+        }
+    }
+
+    rc = __bcache_sync_batch(n);
+    if (rc)
+        ret = rc;
+
+    bcache_sync_busy = 0;
+    spin_unlock(&bcache_lock);
+
+    return ret;
+}
+
+static void
+bcache_flush_work(void *aux)
+{
+    struct work *work;
+
+    /* this pushes the filesystems' dirty metadata to us as well */
+    vfs_sync();
+
+    work = work_create(bcache_flush_work, NULL);
+    if (!work) {
+        mprintk("CRITICAL: failed to reschedule the flusher\n");
+        return;
+    }
+
+    schedule_work_delay(work, BCACHE_FLUSH_DELAY);
+}
+
+/*
+ * bcache_flusher_init - start periodically writing back dirty buffers,
+ *                       needs the kworker to be up
+ */
+void
+bcache_flusher_init(void)
+{
+    struct work *work = work_create(bcache_flush_work, NULL);
+    if (!work)
+        panic("bcache: unable to create the flusher work\n");
+
+    schedule_work_delay(work, BCACHE_FLUSH_DELAY);
+}
+
+void
+bcache_init(void)
+{
+    spin_lock_init(&bcache_lock);
+    list_init(&bcache_lru);
+    hash_init(&bcache_hash, bcache_hash_buf, bcache_less_buf, NULL);
+    bcache_nr_buffers = 0;
+
+    mprintk("initialized, caching up to %d buffers\n", BCACHE_MAX_BUFFERS);
+}
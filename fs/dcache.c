@@ -0,0 +1,186 @@
+#include <levos/kernel.h>
+#include <levos/dcache.h>
+#include <levos/fs.h>
+#include <levos/hash.h>
+#include <levos/list.h>
+#include <levos/spinlock.h>
+
+#define MODULE_NAME dcache
+
+/*
+ * The dentry cache short-cuts path resolution: for every path component
+ * that the VFS resolves, the (filesystem, directory inode, name) triple
+ * is remembered along with the inode it resolved to, or the fact that it
+ * does not exist. Entries are kept on an LRU list and the least recently
+ * used one is thrown out once the cache is full.
+ *
+ * Names that are created must be invalidated with dcache_invalidate(),
+ * otherwise a stale negative entry would hide them.
+ */
+
+static struct hash dcache_hash;
+static struct list dcache_lru;
+static spinlock_t dcache_lock;
+static int dcache_nr_entries;
+
+static unsigned
+dcache_hash_dentry(const struct hash_elem *elem, void *aux)
+{
+    struct dentry *d = hash_entry(elem, struct dentry, d_helem);
+
+    return hash_bytes(d->d_name, d->d_len) ^ hash_int((int) d->d_fs ^ d->d_parent);
+}
+
+static bool
+dcache_less_dentry(const struct hash_elem *ea,
+                   const struct hash_elem *eb,
+                   void *aux)
+{
+    struct dentry *a = hash_entry(ea, struct dentry, d_helem);
+    struct dentry *b = hash_entry(eb, struct dentry, d_helem);
+
+    if (a->d_fs != b->d_fs)
+        return a->d_fs < b->d_fs;
+
+    if (a->d_parent != b->d_parent)
+        return a->d_parent < b->d_parent;
+
+    if (a->d_len != b->d_len)
+        return a->d_len < b->d_len;
+
+    return (int) strncmp(a->d_name, b->d_name, a->d_len) < 0;
+}
+
+static struct dentry *
+__dcache_lookup(struct filesystem *fs, int parent, char *name, size_t len)
+{
+    struct dentry cmp;
+    struct hash_elem *elem;
+
+    cmp.d_fs = fs;
+    cmp.d_parent = parent;
+    cmp.d_name = name;
+    cmp.d_len = len;
+
+    elem = hash_find(&dcache_hash, &cmp.d_helem);
+    if (!elem)
+        return NULL;
+
+    return hash_entry(elem, struct dentry, d_helem);
+}
+
+static void
+__dcache_destroy(struct dentry *d)
+{
+    hash_delete(&dcache_hash, &d->d_helem);
+    list_remove(&d->d_lru_elem);
+    dcache_nr_entries --;
+
+    free(d);
+}
+
+/*
+ * dcache_lookup - look up @name (@len bytes) in directory @parent of @fs
+ *
+ * Returns the inode number, -ENOENT if the name is known not to exist
+ * or DCACHE_MISS if nothing is cached about it.
+ */
+int
+dcache_lookup(struct filesystem *fs, int parent, char *name, size_t len)
+{
+    struct dentry *d;
+    int ret;
+
+    spin_lock(&dcache_lock);
+
+    d = __dcache_lookup(fs, parent, name, len);
+    if (!d) {
+        spin_unlock(&dcache_lock);
+        return DCACHE_MISS;
+    }
+
+    list_remove(&d->d_lru_elem);
+    list_push_back(&dcache_lru, &d->d_lru_elem);
+
+    ret = d->d_ino ? d->d_ino : -ENOENT;
+
+    spin_unlock(&dcache_lock);
+
+    return ret;
+}
+
+/*
+ * dcache_insert - remember that @name in directory @parent of @fs is
+ *                 inode @ino, an @ino <= 0 creates a negative entry
+ */
+void
+dcache_insert(struct filesystem *fs, int parent, char *name, size_t len, int ino)
+{
+    struct dentry *d;
+
+    if (ino < 0)
+        ino = 0;
+
+    spin_lock(&dcache_lock);
+
+    d = __dcache_lookup(fs, parent, name, len);
+    if (d) {
+        d->d_ino = ino;
+        spin_unlock(&dcache_lock);
+        return;
+    }
+
+    if (dcache_nr_entries >= DCACHE_MAX_ENTRIES)
+        __dcache_destroy(list_entry(list_front(&dcache_lru),
+                                    struct dentry, d_lru_elem));
+
+    /* the name is stored right after the dentry */
+    d = malloc(sizeof(*d) + len + 1);
+    if (!d) {
+        spin_unlock(&dcache_lock);
+        return;
+    }
+
+    d->d_fs = fs;
+    d->d_parent = parent;
+    d->d_ino = ino;
+    d->d_name = (char *) (d + 1);
+    d->d_len = len;
+    memcpy(d->d_name, name, len);
+    d->d_name[len] = 0;
+
+    hash_insert(&dcache_hash, &d->d_helem);
+    list_push_back(&dcache_lru, &d->d_lru_elem);
+    dcache_nr_entries ++;
+
+    spin_unlock(&dcache_lock);
+}
+
+/*
+ * dcache_invalidate - forget whatever is known about @name in directory
+ *                     @parent of @fs
+ */
+void
+dcache_invalidate(struct filesystem *fs, int parent, char *name, size_t len)
+{
+    struct dentry *d;
+
+    spin_lock(&dcache_lock);
+
+    d = __dcache_lookup(fs, parent, name, len);
+    if (d)
+        __dcache_destroy(d);
+
+    spin_unlock(&dcache_lock);
+}
+
+void
+dcache_init(void)
+{
+    spin_lock_init(&dcache_lock);
+    list_init(&dcache_lru);
+    hash_init(&dcache_hash, dcache_hash_dentry, dcache_less_dentry, NULL);
+    dcache_nr_entries = 0;
+
+    mprintk("initialized, caching up to %d entries\n", DCACHE_MAX_ENTRIES);
+}
@@ -33,7 +33,7 @@ int
 urandom_file_close(struct file *f)
 {
     free(f->full_path);
-    free(f);
+    file_free(f);
 }
 
 struct file_operations urandom_fops = {
@@ -85,7 +85,7 @@ int
 null_file_close(struct file *f)
 {
     free(f->full_path);
-    free(f);
+    file_free(f);
 }
 
 struct file_operations null_fops = {
@@ -133,7 +133,7 @@ int
 zero_file_close(struct file *f)
 {
     free(f->full_path);
-    free(f);
+    file_free(f);
 }
 
 struct file_operations zero_fops = {
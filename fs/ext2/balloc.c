@@ -0,0 +1,403 @@
+#include <levos/kernel.h>
+#include <levos/fs.h>
+#include <levos/ext2.h>
+#include <levos/bitmap.h>
+#include <levos/spinlock.h>
+
+#define MODULE_NAME ext2_balloc
+
+/*
+ * Block and inode allocation.
+ *
+ * The block group descriptors are read in at mount time, and the usage
+ * bitmaps of a group the first time it is allocated from. After that an
+ * allocation only flips bits and counts down in memory. The bitmaps, the
+ * descriptors and the superblock go back to the buffer cache together in
+ * ext2_alloc_sync(), when the filesystem is synced.
+ *
+ * Delayed allocations reserve their blocks at write() time, so that they
+ * are still there when the blocks are finally allocated. Everything else
+ * can only take the free blocks that are not reserved.
+ */
+
+int
+ext2_balloc_init(struct filesystem *fs)
+{
+    struct ext2_priv_data *p = EXT2_PRIV(fs);
+    uint32_t i;
+    int rc;
+
+    spin_lock_init(&p->alloc_lock);
+
+    p->bgdt_blocks = (p->number_of_bgs * sizeof(struct ext2_block_group_desc)
+                        + p->blocksize - 1) / p->blocksize;
+
+    p->bgdt = malloc(p->bgdt_blocks * p->blocksize);
+    p->groups = malloc(p->number_of_bgs * sizeof(*p->groups));
+    if (!p->bgdt || !p->groups) {
+        rc = -ENOMEM;
+        goto fail;
+    }
+
+    for (i = 0; i < p->bgdt_blocks; i ++) {
+        rc = ext2_read_block(fs, (void *) p->bgdt + i * p->blocksize,
+                             p->first_bgd + i);
+        if (rc)
+            goto fail;
+    }
+
+    memset(p->groups, 0, p->number_of_bgs * sizeof(*p->groups));
+    p->alloc_dirty = 0;
+    p->reserved_blocks = 0;
+    p->alloc_goal = 0;
+
+    return 0;
+
+fail:
+    free(p->bgdt);
+    free(p->groups);
+    return rc;
+}
+
+/* the block or inode usage bitmap of group @g, read in if needed */
+static uint8_t *
+__ext2_group_bitmap(struct filesystem *fs, uint32_t g, int inodes)
+{
+    struct ext2_priv_data *p = EXT2_PRIV(fs);
+    struct ext2_group_info *gi = &p->groups[g];
+    uint8_t **bitmap = inodes ? &gi->gi_inode_bitmap : &gi->gi_block_bitmap;
+    uint8_t *buf, *old;
+    uint32_t block;
+
+    if (*bitmap)
+        return *bitmap;
+
+    block = inodes ? p->bgdt[g].block_of_inode_usage_bitmap
+                   : p->bgdt[g].block_of_block_usage_bitmap;
+
+    buf = malloc(p->blocksize);
+    if (!buf)
+        return NULL;
+
+    if (ext2_read_block(fs, buf, block)) {
+        free(buf);
+        return NULL;
+    }
+
+    /* somebody else may have read it in the meantime */
+    spin_lock(&p->alloc_lock);
+    old = *bitmap;
+    if (!old)
+        *bitmap = buf;
+    spin_unlock(&p->alloc_lock);
+
+    if (old) {
+        free(buf);
+        return old;
+    }
+
+    return buf;
+}
+
+/*
+ * __ext2_alloc_run - take up to @count free blocks in a row from the
+ *                    block bitmap of group @g, from bit @start on
+ *
+ * If there is no room for all of them, the run starts at the first free
+ * block. Returns the first bit, the length of the run is in @got. The
+ * caller holds alloc_lock.
+ */
+static size_t
+__ext2_alloc_run(struct ext2_priv_data *p, uint32_t g, size_t start,
+                 uint32_t count, uint32_t *got)
+{
+    struct bitmap bm;
+    size_t bit, n;
+
+    bitmap_create_using_buffer(p->sb.blocks_in_blockgroup,
+            p->groups[g].gi_block_bitmap, &bm);
+
+    if (count > p->bgdt[g].num_of_unalloc_block)
+        count = p->bgdt[g].num_of_unalloc_block;
+
+    bit = bitmap_scan(&bm, start, count, false);
+    if (bit == BITMAP_ERROR)
+        bit = bitmap_scan(&bm, start, 1, false);
+    if (bit == BITMAP_ERROR && start)
+        bit = bitmap_scan(&bm, 0, 1, false);
+    if (bit == BITMAP_ERROR)
+        return BITMAP_ERROR;
+
+    for (n = 1; n < count && bit + n < bm.bit_cnt; n ++)
+        if (bitmap_test(&bm, bit + n))
+            break;
+
+    bitmap_set_multiple(&bm, bit, n, true);
+
+    *got = n;
+    return bit;
+}
+
+/*
+ * ext2_alloc_blocks - allocate up to @count blocks that follow each
+ *                     other on the disk
+ *
+ * The search starts at @goal, or where the last allocation ended if it
+ * is zero. Returns the first block, and how many there are in @got.
+ */
+int
+ext2_alloc_blocks(struct filesystem *fs, uint32_t goal, uint32_t count,
+                  uint32_t *got)
+{
+    struct ext2_priv_data *p = EXT2_PRIV(fs);
+    uint32_t per = p->sb.blocks_in_blockgroup;
+    uint32_t first = p->sb.superblock_id;
+    uint32_t i, g, start_g, start_bit, avail;
+    size_t bit;
+    int block;
+
+    if (!goal)
+        goal = p->alloc_goal;
+    if (goal < first || goal >= first + p->number_of_bgs * per)
+        goal = first;
+
+    start_g = (goal - first) / per;
+    start_bit = (goal - first) % per;
+
+    for (i = 0; i < p->number_of_bgs; i ++) {
+        g = (start_g + i) % p->number_of_bgs;
+
+        if (!p->bgdt[g].num_of_unalloc_block)
+            continue;
+
+        if (!__ext2_group_bitmap(fs, g, 0))
+            return -ENOMEM;
+
+        spin_lock(&p->alloc_lock);
+
+        /* the reserved blocks are not ours to take */
+        if (p->sb.unallocatedblocks <= p->reserved_blocks) {
+            spin_unlock(&p->alloc_lock);
+            return -ENOSPC;
+        }
+        avail = p->sb.unallocatedblocks - p->reserved_blocks;
+
+        bit = __ext2_alloc_run(p, g, i ? 0 : start_bit,
+                               count < avail ? count : avail, got);
+        if (bit == BITMAP_ERROR) {
+            spin_unlock(&p->alloc_lock);
+            mprintk("CRITICAL: inconsistent block bitmap in group %d\n", g);
+            continue;
+        }
+
+        p->bgdt[g].num_of_unalloc_block -= *got;
+        p->sb.unallocatedblocks -= *got;
+        p->groups[g].gi_flags |= GI_BLOCK_DIRTY;
+        p->alloc_dirty = 1;
+
+        block = first + g * per + bit;
+        p->alloc_goal = block + *got;
+
+        spin_unlock(&p->alloc_lock);
+
+        return block;
+    }
+
+    return -ENOSPC;
+}
+
+/* ext2_reserve_blocks - promise @count free blocks to a delayed allocation */
+int
+ext2_reserve_blocks(struct filesystem *fs, uint32_t count)
+{
+    struct ext2_priv_data *p = EXT2_PRIV(fs);
+    int rc = 0;
+
+    spin_lock(&p->alloc_lock);
+    if (p->sb.unallocatedblocks < p->reserved_blocks + count)
+        rc = -ENOSPC;
+    else
+        p->reserved_blocks += count;
+    spin_unlock(&p->alloc_lock);
+
+    return rc;
+}
+
+void
+ext2_release_blocks(struct filesystem *fs, uint32_t count)
+{
+    struct ext2_priv_data *p = EXT2_PRIV(fs);
+
+    spin_lock(&p->alloc_lock);
+    panic_ifnot(p->reserved_blocks >= count);
+    p->reserved_blocks -= count;
+    spin_unlock(&p->alloc_lock);
+}
+
+/*
+ * ext2_free_blocks - give back @count blocks from @block on, which came
+ *                    from one ext2_alloc_blocks() and were never used
+ */
+void
+ext2_free_blocks(struct filesystem *fs, uint32_t block, uint32_t count)
+{
+    struct ext2_priv_data *p = EXT2_PRIV(fs);
+    uint32_t per = p->sb.blocks_in_blockgroup;
+    uint32_t g = (block - p->sb.superblock_id) / per;
+    uint32_t bit = (block - p->sb.superblock_id) % per;
+    struct bitmap bm;
+
+    if (!count)
+        return;
+
+    /* a run never crosses into the next group */
+    panic_ifnot(bit + count <= per);
+
+    spin_lock(&p->alloc_lock);
+
+    bitmap_create_using_buffer(per, p->groups[g].gi_block_bitmap, &bm);
+    bitmap_set_multiple(&bm, bit, count, false);
+
+    p->bgdt[g].num_of_unalloc_block += count;
+    p->sb.unallocatedblocks += count;
+    p->groups[g].gi_flags |= GI_BLOCK_DIRTY;
+    p->alloc_dirty = 1;
+
+    spin_unlock(&p->alloc_lock);
+}
+
+int
+ext2_alloc_inode(struct filesystem *fs)
+{
+    struct ext2_priv_data *p = EXT2_PRIV(fs);
+    struct bitmap bm;
+    uint32_t g;
+    size_t bit;
+
+    for (g = 0; g < p->number_of_bgs; g ++) {
+        if (!p->bgdt[g].num_of_unalloc_inode)
+            continue;
+
+        if (!__ext2_group_bitmap(fs, g, 1))
+            return -ENOMEM;
+
+        spin_lock(&p->alloc_lock);
+
+        bitmap_create_using_buffer(p->sb.inodes_in_blockgroup,
+                p->groups[g].gi_inode_bitmap, &bm);
+
+        bit = bitmap_scan_and_flip(&bm, 0, 1, false);
+        if (bit == BITMAP_ERROR) {
+            spin_unlock(&p->alloc_lock);
+            mprintk("CRITICAL: inconsistent inode bitmap in group %d\n", g);
+            continue;
+        }
+
+        p->bgdt[g].num_of_unalloc_inode --;
+        p->sb.unallocatedinodes --;
+        p->groups[g].gi_flags |= GI_INODE_DIRTY;
+        p->alloc_dirty = 1;
+
+        spin_unlock(&p->alloc_lock);
+
+        return g * p->sb.inodes_in_blockgroup + bit + 1;
+    }
+
+    return -ENOSPC;
+}
+
+/* ext2_group_add_dir - count the new directory @ino in its block group */
+void
+ext2_group_add_dir(struct filesystem *fs, int ino)
+{
+    struct ext2_priv_data *p = EXT2_PRIV(fs);
+
+    spin_lock(&p->alloc_lock);
+    p->bgdt[(ino - 1) / p->sb.inodes_in_blockgroup].num_of_dirs ++;
+    p->alloc_dirty = 1;
+    spin_unlock(&p->alloc_lock);
+}
+
+/* hand one dirty bitmap to the buffer cache, it stays dirty on failure */
+static int
+__ext2_sync_bitmap(struct filesystem *fs, uint32_t g, int flag)
+{
+    struct ext2_priv_data *p = EXT2_PRIV(fs);
+    struct ext2_group_info *gi = &p->groups[g];
+    int dirty, rc;
+
+    spin_lock(&p->alloc_lock);
+    dirty = gi->gi_flags & flag;
+    gi->gi_flags &= ~flag;
+    spin_unlock(&p->alloc_lock);
+
+    if (!dirty)
+        return 0;
+
+    if (flag == GI_BLOCK_DIRTY)
+        rc = ext2_write_block(fs, gi->gi_block_bitmap,
+                              p->bgdt[g].block_of_block_usage_bitmap);
+    else
+        rc = ext2_write_block(fs, gi->gi_inode_bitmap,
+                              p->bgdt[g].block_of_inode_usage_bitmap);
+
+    if (rc) {
+        spin_lock(&p->alloc_lock);
+        gi->gi_flags |= flag;
+        spin_unlock(&p->alloc_lock);
+    }
+
+    return rc;
+}
+
+/*
+ * ext2_alloc_sync - write back the bitmaps, the block group descriptors
+ *                   and the superblock, if any allocation changed them
+ *
+ * The dirty flags are cleared before the copy is taken, an allocation
+ * that races with it dirties them again for the next sync.
+ */
+int
+ext2_alloc_sync(struct filesystem *fs)
+{
+    struct ext2_priv_data *p = EXT2_PRIV(fs);
+    uint32_t g, i;
+    int dirty, rc, ret = 0;
+
+    for (g = 0; g < p->number_of_bgs; g ++) {
+        rc = __ext2_sync_bitmap(fs, g, GI_BLOCK_DIRTY);
+        if (rc)
+            ret = rc;
+
+        rc = __ext2_sync_bitmap(fs, g, GI_INODE_DIRTY);
+        if (rc)
+            ret = rc;
+    }
+
+    spin_lock(&p->alloc_lock);
+    dirty = p->alloc_dirty;
+    p->alloc_dirty = 0;
+    spin_unlock(&p->alloc_lock);
+
+    if (!dirty)
+        return ret;
+
+    for (i = 0; i < p->bgdt_blocks; i ++) {
+        rc = ext2_write_block(fs, (void *) p->bgdt + i * p->blocksize,
+                              p->first_bgd + i);
+        if (rc)
+            ret = rc;
+    }
+
+    rc = ext2_write_superblock(fs);
+    if (rc)
+        ret = rc;
+
+    if (ret) {
+        spin_lock(&p->alloc_lock);
+        p->alloc_dirty = 1;
+        spin_unlock(&p->alloc_lock);
+    }
+
+    return ret;
+}
@@ -0,0 +1,144 @@
+#include <levos/kernel.h>
+#include <levos/fs.h>
+#include <levos/ext2.h>
+#include <levos/bcache.h>
+
+#define MODULE_NAME ext2_bmap
+
+/*
+ * Block mapping, from the blocks of a file to the blocks of the disk.
+ *
+ * The first 12 blocks are in the inode, the rest hang off up to three
+ * levels of indirect blocks. Those are looked at in place in the buffer
+ * cache, and the context keeps a reference to the last one of every
+ * level, so walking a run of blocks reads each indirect block once.
+ */
+
+void
+ext2_bmap_init(struct ext2_bmap_ctx *ctx, struct filesystem *fs,
+               struct ext2_inode *inode)
+{
+    int i;
+
+    ctx->bc_fs = fs;
+    ctx->bc_inode = inode;
+
+    for (i = 0; i < 3; i ++) {
+        ctx->bc_block[i] = 0;
+        ctx->bc_buf[i] = NULL;
+    }
+}
+
+/* ext2_bmap_done - drop the indirect blocks that @ctx holds on to */
+void
+ext2_bmap_done(struct ext2_bmap_ctx *ctx)
+{
+    int i;
+
+    for (i = 0; i < 3; i ++) {
+        if (ctx->bc_buf[i])
+            bcache_put(ctx->bc_buf[i]);
+        ctx->bc_buf[i] = NULL;
+        ctx->bc_block[i] = 0;
+    }
+}
+
+/* the contents of the indirect block @block, at @level of the tree */
+static uint32_t *
+__ext2_bmap_ind(struct ext2_bmap_ctx *ctx, int level, uint32_t block)
+{
+    struct buffer *buf;
+
+    if (ctx->bc_buf[level] && ctx->bc_block[level] == block)
+        return ctx->bc_buf[level]->buf_data;
+
+    buf = bcache_get(ctx->bc_fs->dev, block, EXT2_PRIV(ctx->bc_fs)->blocksize);
+    if (IS_ERR(buf))
+        return (void *) buf;
+
+    if (ctx->bc_buf[level])
+        bcache_put(ctx->bc_buf[level]);
+
+    ctx->bc_buf[level] = buf;
+    ctx->bc_block[level] = block;
+
+    return buf->buf_data;
+}
+
+/* the disk block of file block @b, 0 for a hole */
+static int
+__ext2_bmap_one(struct ext2_bmap_ctx *ctx, uint32_t b, uint32_t *pblock)
+{
+    struct ext2_inode *inode = ctx->bc_inode;
+    uint32_t p = EXT2_PRIV(ctx->bc_fs)->blocksize / sizeof(uint32_t);
+    uint32_t idx[3], block, *ind;
+    int depth, i;
+
+    if (b < 12) {
+        *pblock = inode->dbp[b];
+        return 0;
+    }
+
+    b -= 12;
+    if (b < p) {
+        depth = 1;
+        block = inode->singly_block;
+        idx[0] = b;
+    } else if ((b -= p) < p * p) {
+        depth = 2;
+        block = inode->doubly_block;
+        idx[0] = b / p;
+        idx[1] = b % p;
+    } else if ((b -= p * p) < p * p * p) {
+        depth = 3;
+        block = inode->triply_block;
+        idx[0] = b / (p * p);
+        idx[1] = (b / p) % p;
+        idx[2] = b % p;
+    } else {
+        return -EFBIG;
+    }
+
+    for (i = 0; i < depth && block; i ++) {
+        ind = __ext2_bmap_ind(ctx, i, block);
+        if (IS_ERR(ind))
+            return PTR_ERR(ind);
+
+        block = ind[idx[i]];
+    }
+
+    *pblock = block;
+    return 0;
+}
+
+/*
+ * ext2_bmap - map the file block @lblock to the disk block in @pblock,
+ *             and find out how far the extent it starts goes
+ *
+ * Returns how many of the @count blocks from @lblock on follow each
+ * other on the disk, at least one. A hole maps to block 0, and then it
+ * is the number of blocks that are holes as well.
+ */
+int
+ext2_bmap(struct ext2_bmap_ctx *ctx, uint32_t lblock, uint32_t count,
+          uint32_t *pblock)
+{
+    uint32_t first, next;
+    int rc, run;
+
+    rc = __ext2_bmap_one(ctx, lblock, &first);
+    if (rc)
+        return rc;
+
+    for (run = 1; run < count; run ++) {
+        rc = __ext2_bmap_one(ctx, lblock + run, &next);
+        if (rc)
+            break;
+
+        if (first ? next != first + run : next != 0)
+            break;
+    }
+
+    *pblock = first;
+    return run;
+}
@@ -0,0 +1,296 @@
+#include <levos/kernel.h>
+#include <levos/fs.h>
+#include <levos/ext2.h>
+#include <levos/list.h>
+#include <levos/spinlock.h>
+#include <levos/task.h>
+
+#define MODULE_NAME ext2_delalloc
+
+/*
+ * Delayed allocation.
+ *
+ * Writing to a part of a file that has no disk blocks only reserves the
+ * space, the data stays with the inode. The blocks are allocated when
+ * the inode is flushed: on close, before it is read, when too much has
+ * piled up, or when the filesystem is synced. By then whole runs of file
+ * blocks are known, and each gets blocks that follow each other on the
+ * disk, right after the block before it in the file if possible.
+ *
+ * The delayed blocks of an inode are sorted by file block. Flushing them
+ * does disk I/O, so they are protected by ii_busy, not by a spinlock.
+ */
+
+void
+ext2_delalloc_init(struct ext2_inode_info *ii)
+{
+    spin_lock_init(&ii->ii_lock);
+    ii->ii_busy = 0;
+    list_init(&ii->ii_delayed);
+    ii->ii_nr_delayed = 0;
+    ii->ii_reserved = 0;
+}
+
+/* ext2_inode_lock - take ii_busy, waiting for whoever has it */
+void
+ext2_inode_lock(struct ext2_inode_info *ii)
+{
+    spin_lock(&ii->ii_lock);
+    while (ii->ii_busy) {
+        spin_unlock(&ii->ii_lock);
+        sched_yield();
+        spin_lock(&ii->ii_lock);
+    }
+    ii->ii_busy = 1;
+    spin_unlock(&ii->ii_lock);
+}
+
+void
+ext2_inode_unlock(struct ext2_inode_info *ii)
+{
+    spin_lock(&ii->ii_lock);
+    ii->ii_busy = 0;
+    spin_unlock(&ii->ii_lock);
+}
+
+/*
+ * __ext2_da_find - find the delayed block @lblock of @ii
+ *
+ * If there is none, @prev is where it would go after. Appends are the
+ * common case, so the search goes from the end.
+ */
+static struct ext2_delayed_block *
+__ext2_da_find(struct ext2_inode_info *ii, uint32_t lblock,
+               struct list_elem **prev)
+{
+    struct ext2_delayed_block *db;
+    struct list_elem *elem;
+
+    for (elem = list_rbegin(&ii->ii_delayed);
+         elem != list_rend(&ii->ii_delayed);
+         elem = list_prev(elem)) {
+        db = list_entry(elem, struct ext2_delayed_block, db_elem);
+
+        if (db->db_lblock == lblock)
+            return db;
+
+        if (db->db_lblock < lblock)
+            break;
+    }
+
+    *prev = elem;
+    return NULL;
+}
+
+/*
+ * The blocks to reserve for file block @lblock: itself, and the indirect
+ * blocks that may have to be allocated for it. Those are only needed
+ * where a run of delayed blocks starts, or where it crosses into the
+ * next indirect block.
+ */
+static uint32_t
+__ext2_da_cost(struct ext2_inode_info *ii, uint32_t lblock,
+               struct list_elem *prev)
+{
+    uint32_t p = EXT2_PRIV(ii->ii_fs)->blocksize / sizeof(uint32_t);
+    uint32_t b = lblock - 12;
+    int depth;
+
+    if (lblock < 12)
+        return 1;
+
+    if (b < p)
+        depth = 1;
+    else if ((b -= p) < p * p)
+        depth = 2;
+    else
+        depth = 3;
+
+    if (b % p && prev != list_rend(&ii->ii_delayed) &&
+            list_entry(prev, struct ext2_delayed_block, db_elem)->db_lblock
+                == lblock - 1)
+        return 1;
+
+    return 1 + depth;
+}
+
+/*
+ * The caller holds ii_busy. The data goes to its block before the block
+ * is put on the map, so if either fails the rest of the run was never
+ * used and goes back.
+ */
+static int
+__ext2_delalloc_flush(struct ext2_inode_info *ii)
+{
+    struct filesystem *fs = ii->ii_fs;
+    struct ext2_priv_data *p = EXT2_PRIV(fs);
+    struct ext2_inode *inode = ii->ii_inode;
+    struct ext2_delayed_block *db;
+    struct list_elem *elem;
+    uint32_t first, n, got, goal, i, t;
+    int block, prev, rc = 0;
+
+    if (list_empty(&ii->ii_delayed))
+        return 0;
+
+    /* the reservation turns into real allocations now */
+    ext2_release_blocks(fs, ii->ii_reserved);
+    ii->ii_reserved = 0;
+
+    while (!list_empty(&ii->ii_delayed)) {
+        db = list_entry(list_front(&ii->ii_delayed),
+                        struct ext2_delayed_block, db_elem);
+        first = db->db_lblock;
+
+        /* how far the run of file blocks goes */
+        n = 1;
+        for (elem = list_next(&db->db_elem);
+             elem != list_end(&ii->ii_delayed);
+             elem = list_next(elem), n ++)
+            if (list_entry(elem, struct ext2_delayed_block,
+                           db_elem)->db_lblock != first + n)
+                break;
+
+        /* carry on where the file is on the disk */
+        goal = 0;
+        if (first) {
+            prev = ext2_inode_get_block(fs, inode, first - 1);
+            if (prev > 0)
+                goal = prev + 1;
+        }
+
+        block = ext2_alloc_blocks(fs, goal, n, &got);
+        if (block < 0) {
+            rc = block;
+            break;
+        }
+
+        for (i = 0; i < got; i ++) {
+            db = list_entry(list_front(&ii->ii_delayed),
+                            struct ext2_delayed_block, db_elem);
+
+            rc = ext2_write_block(fs, db->db_data, block + i);
+            if (!rc)
+                rc = set_block_number(fs, inode, ii->ii_ino, first + i,
+                                      block + i);
+            if (rc)
+                break;
+
+            list_remove(&db->db_elem);
+            ii->ii_nr_delayed --;
+            free(db->db_data);
+            free(db);
+        }
+
+        t = (first + i) * p->sectors_per_block;
+        if (inode->disk_sectors < t)
+            inode->disk_sectors = t;
+        ext2_imark_dirty(ii);
+
+        if (rc) {
+            ext2_free_blocks(fs, block + i, got - i);
+            break;
+        }
+    }
+
+    /* what is left over keeps its blocks reserved, if there still are */
+    if (rc && ext2_reserve_blocks(fs, ii->ii_nr_delayed) == 0)
+        ii->ii_reserved = ii->ii_nr_delayed;
+
+    if (rc)
+        mprintk("inode %d: failed to allocate %d delayed blocks: %s\n",
+                ii->ii_ino, ii->ii_nr_delayed, errno_to_string(rc));
+
+    return rc;
+}
+
+/*
+ * ext2_delalloc_write - put @len bytes from @src at @off into the file
+ *                       block @lblock of @ii, which has no disk block
+ *
+ * A new delayed block reserves its space, -ENOSPC if there is none. The
+ * caller holds ii_busy.
+ */
+int
+ext2_delalloc_write(struct ext2_inode_info *ii, uint32_t lblock,
+                    uint32_t off, const void *src, uint32_t len)
+{
+    uint32_t bs = EXT2_PRIV(ii->ii_fs)->blocksize;
+    struct ext2_delayed_block *db;
+    struct list_elem *prev;
+    uint32_t cost;
+    int rc;
+
+    db = __ext2_da_find(ii, lblock, &prev);
+    if (db) {
+        memcpy(db->db_data + off, src, len);
+        return 0;
+    }
+
+    cost = __ext2_da_cost(ii, lblock, prev);
+    rc = ext2_reserve_blocks(ii->ii_fs, cost);
+    if (rc)
+        return rc;
+
+    db = malloc(sizeof(*db));
+    if (db)
+        db->db_data = malloc(bs);
+    if (!db || !db->db_data) {
+        free(db);
+        ext2_release_blocks(ii->ii_fs, cost);
+        return -ENOMEM;
+    }
+
+    db->db_lblock = lblock;
+    if (len < bs)
+        memset(db->db_data, 0, bs);
+    memcpy(db->db_data + off, src, len);
+
+    list_insert(list_next(prev), &db->db_elem);
+    ii->ii_nr_delayed ++;
+    ii->ii_reserved += cost;
+
+    /* don't keep too much in memory */
+    if (ii->ii_nr_delayed >= EXT2_DELALLOC_MAX / bs)
+        __ext2_delalloc_flush(ii);
+
+    return 0;
+}
+
+/*
+ * ext2_delalloc_flush - allocate the delayed blocks of @ii, and hand
+ *                       their data to the buffer cache
+ */
+int
+ext2_delalloc_flush(struct ext2_inode_info *ii)
+{
+    int rc;
+
+    ext2_inode_lock(ii);
+    rc = __ext2_delalloc_flush(ii);
+    ext2_inode_unlock(ii);
+
+    return rc;
+}
+
+/* ext2_delalloc_drop - throw away the delayed blocks of @ii, on truncate */
+void
+ext2_delalloc_drop(struct ext2_inode_info *ii)
+{
+    struct ext2_delayed_block *db;
+
+    ext2_inode_lock(ii);
+
+    while (!list_empty(&ii->ii_delayed)) {
+        db = list_entry(list_pop_front(&ii->ii_delayed),
+                        struct ext2_delayed_block, db_elem);
+        free(db->db_data);
+        free(db);
+    }
+
+    ext2_release_blocks(ii->ii_fs, ii->ii_reserved);
+    ii->ii_nr_delayed = 0;
+    ii->ii_reserved = 0;
+
+    ext2_inode_unlock(ii);
+}
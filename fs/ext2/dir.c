@@ -1,6 +1,7 @@
 #include <levos/kernel.h>
 #include <levos/fs.h>
 #include <levos/ext2.h>
+#include <levos/task.h>
 
 int ext2_read_directory(struct filesystem *fs, int dino, char *f)
 {
@@ -311,6 +312,27 @@ done:;
     return 0;
 }
 
+static void
+__ext2_dir_lock(struct ext2_priv_data *p)
+{
+    spin_lock(&p->dir_lock);
+    while (p->dir_busy) {
+        spin_unlock(&p->dir_lock);
+        sched_yield();
+        spin_lock(&p->dir_lock);
+    }
+    p->dir_busy = 1;
+    spin_unlock(&p->dir_lock);
+}
+
+static void
+__ext2_dir_unlock(struct ext2_priv_data *p)
+{
+    spin_lock(&p->dir_lock);
+    p->dir_busy = 0;
+    spin_unlock(&p->dir_lock);
+}
+
 int
 ext2_place_dirent(struct filesystem *fs, int ino, struct ext2_dir *dirent)
 {
@@ -320,10 +342,13 @@ ext2_place_dirent(struct filesystem *fs, int ino, struct ext2_dir *dirent)
     if (!buf)
         return -ENOMEM;
 
-    ext2_read_inode(fs, buf, ino);
+    __ext2_dir_lock(EXT2_PRIV(fs));
 
+    ext2_read_inode(fs, buf, ino);
     ret = __ext2_place_dirent(fs, buf, ino, dirent);
 
+    __ext2_dir_unlock(EXT2_PRIV(fs));
+
     free(buf);
     return ret;
 }
@@ -360,7 +385,6 @@ ext2_new_dirent(int inode, char *name)
 int
 ext2_mkdir(struct filesystem *fs, char *path, int mode)
 {
-    struct ext2_priv_data *priv = EXT2_PRIV(fs);
     int this_inode_no, parent_inode_no, rc, len = strlen(path);
     char *path_buf;
     struct ext2_inode *inode_buffer;
@@ -497,18 +521,7 @@ ext2_mkdir(struct filesystem *fs, char *path, int mode)
     //printk("POOOP7\n");
     
     /* update the block group descriptor */
-    struct ext2_block_group_desc *bgd = malloc(priv->blocksize);
-    if (!bgd) {
-        rc = -ENOMEM;
-        goto ret5;
-    }
-    void *old_bgd = bgd;
-    ext2_read_block(fs, bgd, priv->first_bgd);
-    for(int i = 0; i < (this_inode_no - 1) / priv->sb.inodes_in_blockgroup; i++)
-        bgd ++;
-
-    bgd->num_of_dirs ++;
-    ext2_write_block(fs, old_bgd, priv->first_bgd);
+    ext2_group_add_dir(fs, this_inode_no);
 
     /* done! */
     rc = 0;
@@ -1,6 +1,9 @@
 #include <levos/kernel.h>
 #include <levos/fs.h>
 #include <levos/ext2.h>
+#include <levos/bcache.h>
+#include <levos/pagecache.h>
+#include <levos/uaccess.h>
 
 struct file *ext2_open(struct filesystem *, char *);
 
@@ -39,6 +42,16 @@ ext2_find_file_inode(struct filesystem *fs, char *path)
     return ino;
 }
 
+/*
+ * ext2_lookup - find @name in directory inode @dir, used by the VFS
+ *               to walk paths through the dentry cache
+ */
+int
+ext2_lookup(struct filesystem *fs, int dir, char *name)
+{
+    return ext2_read_directory(fs, dir, name);
+}
+
 int
 ext2_stat(struct filesystem *fs, char *p, struct stat *buf)
 {
@@ -49,6 +62,12 @@ ext2_stat(struct filesystem *fs, char *p, struct stat *buf)
     if (inode < 0)
         return inode;
 
+    return ext2_stat_inode(fs, inode, buf);
+}
+
+int
+ext2_stat_inode(struct filesystem *fs, int inode, struct stat *buf)
+{
     struct ext2_inode *ibuf = malloc(EXT2_PRIV(fs)->inodesize);
     if (!ibuf)
         return -ENOMEM;
@@ -70,14 +89,9 @@ ext2_stat(struct filesystem *fs, char *p, struct stat *buf)
 
 int ext2_file_fstat(struct file *f, struct stat *st)
 {
-    struct ext2_inode *ibuf = malloc(EXT2_PRIV(f->fs)->inodesize);
-    //int ino = ext2_find_file_inode(f->fs, f->respath);
+    struct ext2_inode *ibuf = EXT2_FILE_INODE(f);
     int ino = EXT2_FILE_PRIV(f)->inode_no;
 
-    if (!ibuf)
-        return -ENOMEM;
-
-    ext2_read_inode(f->fs, ibuf, ino);
     st->st_dev = 0;
     st->st_ino = ino;
     st->st_mode = ibuf->type;
@@ -87,98 +101,6 @@ int ext2_file_fstat(struct file *f, struct stat *st)
     st->st_rdev = 0;
     st->st_size = ibuf->size;
 
-    free(ibuf);
-
-    return 0;
-}
-
-int
-ext2_file_read_block(struct file *f, struct ext2_inode *ibuf, void *buf, size_t b)
-{
-    struct filesystem *fs = f->fs;
-    //struct ext2_inode *ibuf = malloc(EXT2_PRIV(fs)->inodesize);
-    //int ino = ext2_find_file_inode(fs, f->respath);
-    int ino = EXT2_FILE_PRIV(f)->inode_no;
-    int bs = EXT2_PRIV(fs)->blocksize;
-    uint32_t p = bs / sizeof(uint32_t);
-    if (ino < 0) {
-        free(ibuf);
-        return ino;
-    }
-
-    if (!ibuf)
-        return -ENOMEM;
-
-    //ext2_read_inode(fs, ibuf, ino);
-
-    if (b < 12) {
-        ext2_read_block(fs, buf, ibuf->dbp[b]);
-    } else {
-        if (b < 12 + p) {
-            uint32_t *bb = malloc(bs);
-            if (!bb) {
-                //free(ibuf);
-                return -ENOMEM;
-            }
-            //printk("SLB: %d\n", ibuf->singly_block);
-            ext2_read_block(fs, bb, ibuf->singly_block);
-            //printk("ORIG %d\n", b);
-            b = bb[b - 12];
-            //printk("TRY %d\n", b);
-            ext2_read_block(fs, buf, b);
-            free(bb);
-            goto exit;
-        } else if (b < 12 + p + p * p) {
-            int A = b - 12;
-            int B = A - p;
-            int C = B / p;
-            int D = B - C * p;
-
-            uint32_t *buf1 = malloc(bs);
-            if (!buf1)
-                return -ENOMEM;
-
-            //printk("reading %d in the doubly block %d\n", b, ibuf->doubly_block);
-            ext2_read_block(fs, buf1, ibuf->doubly_block);
-
-            uint32_t nblock = buf1[C];
-            //printk("reading in the refd block: %d from loc %d\n", nblock, C);
-            ext2_read_block(fs, buf1, nblock);
-
-            //printk("doubly: reading %d from loc %d\n", buf1[D], D);
-            ext2_read_block(fs, buf, buf1[D]);
-
-            free(buf1);
-            goto exit;
-        } else if (b < 12 + p + p * p + p) {
-            int a = b - 12;
-            int b = a - p;
-            int c = b - p * p;
-            int d = c / (p * p);
-            int e = c - d * p * p;
-            int f = e / p;
-            int g = e - f * p;
-
-            uint32_t *tmp = malloc(bs);
-            ext2_read_block(fs, tmp, ibuf->triply_block);
-
-            uint32_t nblock = ((uint32_t *)tmp)[d];
-            ext2_read_block(fs, tmp, nblock);
-
-            nblock = ((uint32_t *)tmp)[f];
-            ext2_read_block(fs, tmp, nblock);
-
-            unsigned int out = ((uint32_t  *)tmp)[g];
-            free(tmp);
-
-            ext2_read_block(fs, buf, out);
-            goto exit;
-        }
-        //panic("%s over the maximum read block %d", __func__, b);
-        return 0;
-    }
-
-exit:    //free(ibuf);
     return 0;
 }
 
@@ -236,10 +158,42 @@ exit:
     return 0;
 }
 
+/* the most that is read or written at once for userspace, through a
+ * kernel buffer */
+#define EXT2_READ_CHUNK  (64 * 1024)
+#define EXT2_WRITE_CHUNK (64 * 1024)
+
+/* copy to the reader's buffer, which may be in userspace */
+static int
+__ext2_copy_out(void *dst, const void *src, size_t n, int user)
+{
+    if (!user) {
+        memcpy(dst, src, n);
+        return 0;
+    }
+
+    return copy_to_user(dst, src, n) ? -EFAULT : 0;
+}
+
+/*
+ * ext2_read_file - read from the file position on
+ *
+ * The file is read extent by extent, every run of whole blocks that are
+ * next to each other on the disk is one request to the device. Those go
+ * straight into the reader's buffer if it is kernel memory, userspace
+ * gets them through a bounce buffer, up to EXT2_READ_CHUNK at a time.
+ * Partial blocks at either end go through the buffer cache. Delayed
+ * blocks are allocated first, so everything is on the block map.
+ */
 int
 ext2_read_file(struct file *f, void *buf, size_t count)
 {
-    int rc;
+    struct ext2_bmap_ctx ctx;
+    struct ext2_inode *inode;
+    uint32_t bs, pos, end, pblock, off, len, nr;
+    char *block = NULL, *bounce = NULL, *dst;
+    int user = (uint32_t) buf < VIRT_BASE;
+    int run, rc = 0;
 
     if (!count)
         return 0;
@@ -247,222 +201,234 @@ ext2_read_file(struct file *f, void *buf, size_t count)
     if (!f || !buf)
         return -EINVAL;
 
-    //int inode = ext2_find_file_inode(f->fs, f->respath);
-    int inode = EXT2_FILE_PRIV(f)->inode_no;
-    if (inode < 0)
-        return inode;
+    if (EXT2_FILE_PRIV(f)->ii->ii_nr_delayed) {
+        rc = ext2_delalloc_flush(EXT2_FILE_PRIV(f)->ii);
+        if (rc)
+            return rc;
+    }
 
-    int total = 0;
-    int bs = EXT2_PRIV(f->fs)->blocksize;
+    inode = EXT2_FILE_INODE(f);
+    bs = EXT2_PRIV(f->fs)->blocksize;
 
     /* determine if there is things left to read */
-    struct ext2_inode *theinode = malloc(EXT2_PRIV(f->fs)->inodesize);
-    if (!theinode)
-        return -ENOMEM;
+    if (f->fpos >= inode->size)
+        return 0;
 
-    ext2_read_inode(f->fs, theinode, inode);
+    pos = f->fpos;
+    end = pos + count;
+    if (end > inode->size || end < pos)
+        end = inode->size;
 
-    if (f->fpos >= theinode->size) {
-        free(theinode);
-        return 0;
-    }
+    ext2_bmap_init(&ctx, f->fs, inode);
 
-    /* determine how many blocks do we need */
-    int blocks = count / bs;
-    int off = count % bs;
-    int rblocks = 0; /* blocks read so far */
-
-    /* determine position */
-    int cblock = f->fpos / bs;
-    int coff = f->fpos % bs;
-
-    int start_block = f->fpos / bs;
-    uint32_t end = f->fpos + count;
-    if (end > theinode->size)
-        end = theinode->size;
-    int end_block = end / bs;
-    uint32_t end_size = end - end_block * bs;
-    uint32_t to_read = end - f->fpos;
-
-    uint8_t *buffer = malloc(bs);
-    if (!buffer) {
-        free(theinode);
-        return -ENOMEM;
+    while (pos < end) {
+        off = pos % bs;
+        dst = buf + (pos - f->fpos);
+
+        run = ext2_bmap(&ctx, pos / bs, (end - pos + off + bs - 1) / bs, &pblock);
+        if (run < 0) {
+            rc = run;
+            break;
+        }
+
+        if (off || end - pos < bs) {
+            /* a piece of a block */
+            len = bs - off;
+            if (len > end - pos)
+                len = end - pos;
+
+            if (!block && !(block = malloc(bs))) {
+                rc = -ENOMEM;
+                break;
+            }
+
+            if (pblock)
+                rc = ext2_read_block(f->fs, block, pblock);
+            else
+                memset(block, 0, bs);
+
+            if (!rc)
+                rc = __ext2_copy_out(dst, block + off, len, user);
+        } else {
+            /* whole blocks, as many as are contiguous on the disk */
+            nr = (end - pos) / bs;
+            if (nr > run)
+                nr = run;
+
+            if (user) {
+                if (nr > EXT2_READ_CHUNK / bs)
+                    nr = EXT2_READ_CHUNK / bs;
+
+                if (!bounce && !(bounce = malloc(EXT2_READ_CHUNK))) {
+                    rc = -ENOMEM;
+                    break;
+                }
+            }
+            len = nr * bs;
+
+            if (!pblock) {
+                memset(user ? bounce : dst, 0, len);
+            } else {
+                rc = bcache_read_blocks(f->fs->dev, pblock, nr, bs,
+                                        user ? bounce : dst);
+            }
+
+            if (!rc && user)
+                rc = __ext2_copy_out(dst, bounce, len, 1);
+        }
+
+        if (rc)
+            break;
+
+        pos += len;
     }
 
-	if (start_block == end_block) {
-		ext2_file_read_block(f, theinode, buffer, start_block);
-		memcpy(buf, (uint8_t *)(((uint32_t)buffer) + (f->fpos % bs)), to_read);
-        total += to_read;
-	} else {
-		uint32_t block_offset;
-		uint32_t blocks_read = 0;
-		for (block_offset = start_block; block_offset < end_block; block_offset++, blocks_read++) {
-			if (block_offset == start_block) {
-				ext2_file_read_block(f, theinode, buffer, block_offset);
-				memcpy(buf, (uint8_t *)(((uint32_t)buffer) + (f->fpos % bs)), bs - (f->fpos % bs));
-                total += (bs - (f->fpos % bs));
-			} else {
-				ext2_file_read_block(f, theinode, buffer, block_offset);
-				memcpy(buf + bs * blocks_read - (f->fpos % bs), buffer, bs);
-                total += bs;
-			}
-		}
-		if (end_size) {
-			ext2_file_read_block(f, theinode, buffer, end_block);
-			memcpy(buf + bs * blocks_read - (f->fpos % bs), buffer, end_size);
-            total += end_size;
-		}
-	}
-
-    f->fpos += total;
-
-    rc = total;
-exit:
-    free(theinode);
-    free(buffer);
+    ext2_bmap_done(&ctx);
+    free(block);
+    free(bounce);
+
+    /* report what was read, the error only if nothing was */
+    if (pos == f->fpos)
+        return rc;
+
+    rc = pos - f->fpos;
+    f->fpos = pos;
     return rc;
 }
 
-size_t
-ext2_write_file(struct file *f, void *buf, size_t count)
+/*
+ * __ext2_write_chunk - write @n bytes from the kernel buffer @src at
+ *                      @pos, which is moved past what was written
+ *
+ * @block is room for one block. The inode is locked meanwhile.
+ */
+static int
+__ext2_write_chunk(struct file *f, uint32_t *pos, const char *src, uint32_t n,
+                   char *block)
 {
-    int rc, i;
+    struct ext2_inode_info *ii = EXT2_FILE_PRIV(f)->ii;
+    struct ext2_inode *inode = ii->ii_inode;
+    struct ext2_bmap_ctx ctx;
+    uint32_t bs = EXT2_PRIV(f->fs)->blocksize;
+    uint32_t p = *pos, end = *pos + n, pblock, off, len;
+    int rc = 0;
+
+    ext2_inode_lock(ii);
+    ext2_bmap_init(&ctx, f->fs, inode);
+
+    while (p < end) {
+        off = p % bs;
+        len = bs - off;
+        if (len > end - p)
+            len = end - p;
+
+        rc = ext2_bmap(&ctx, p / bs, 1, &pblock);
+        if (rc < 0)
+            break;
+
+        rc = 0;
+        if (pblock) {
+            /* keep what is not overwritten */
+            if (len < bs)
+                rc = ext2_read_block(f->fs, block, pblock);
+            if (!rc) {
+                memcpy(block + off, src + (p - *pos), len);
+                rc = ext2_write_block(f->fs, block, pblock);
+            }
+        } else {
+            rc = ext2_delalloc_write(ii, p / bs, off, src + (p - *pos), len);
+        }
+        if (rc)
+            break;
 
-    if (!count) {
-        printk("REJECT 1\n");
-        return 0;
+        p += len;
     }
 
-    if (!f || !buf) {
-        printk("REJECT 2\n");
-        return -EINVAL;
-    }
+    ext2_bmap_done(&ctx);
 
-    //int ino = ext2_find_file_inode(f->fs, f->respath);
-    int ino = EXT2_FILE_PRIV(f)->inode_no;
-    if (ino < 0) {
-        printk("REJECT 3 %s\n", f->respath);
-        return ino;
+    if (p > inode->size) {
+        inode->size = p;
+        ext2_imark_dirty(ii);
+        f->length = inode->size;
     }
 
-    struct ext2_inode *inode = malloc(EXT2_PRIV(f->fs)->inodesize);
-    if (!inode) {
-        printk("REJECT 4\n");
-        return -ENOMEM;
-    }
+    ext2_inode_unlock(ii);
 
-    if (ext2_read_inode(f->fs, inode, ino)) {
-        free(inode);
-        printk("REJECT 5\n");
-        return -ENOMEM;
-    }
+    *pos = p;
+    return rc;
+}
 
-    struct filesystem *fs = f->fs;
+/*
+ * ext2_write_file - write at the file position
+ *
+ * Blocks that are on the disk already are updated in the buffer cache.
+ * Writes to the rest only reserve the space, the blocks are allocated
+ * later, in runs, see fs/ext2/delalloc.c
+ *
+ * Userspace data is copied in before the inode is locked, up to
+ * EXT2_WRITE_CHUNK at a time: a fault on it may need the inode, when
+ * the buffer is a mapping of this very file.
+ */
+size_t
+ext2_write_file(struct file *f, void *buf, size_t count)
+{
+    uint32_t pos, end, n;
+    int user = (uint32_t) buf < VIRT_BASE;
+    char *block, *bounce = NULL;
+    const char *src;
+    int rc = 0;
 
-    int total = 0;
-    int bs = EXT2_PRIV(f->fs)->blocksize;
+    if (!count)
+        return 0;
 
-    /* determine how many blocks do we need */
-    int blocks = count / bs;
-    int off = count % bs;
-    int rblocks = 0; /* blocks read so far */
+    if (!f || !buf)
+        return -EINVAL;
 
-    /* determine position */
-    int cblock = f->fpos / bs;
-    int coff = f->fpos % bs;
+    pos = f->fpos;
+    end = pos + count;
+    if (end < pos)
+        return -EFBIG;
 
-    if (f->fpos > inode->size) {
-        //free(inode);
-        //printk("POOOP fpos %d size %d\n", f->fpos, inode->size);
-        //return -EFBIG;
+    block = malloc(EXT2_PRIV(f->fs)->blocksize);
+    if (block && user)
+        bounce = malloc(count < EXT2_WRITE_CHUNK ? count : EXT2_WRITE_CHUNK);
+    if (!block || (user && !bounce)) {
+        free(block);
+        return -ENOMEM;
     }
 
-    uint32_t end          = f->fpos + count;
-    uint32_t start_block  = f->fpos / bs;
-	uint32_t end_block    = end / bs;
-	uint32_t end_size     = end - end_block * bs;
-	uint32_t size_to_read = end - f->fpos;
-
-    /*printk("end %d start_block %d end_block %d end_size %d s2read %d\n",
-            end, start_block, end_block, end_size, size_to_read);*/
+    while (pos < end) {
+        n = end - pos;
+        src = buf + (pos - f->fpos);
 
-    uint8_t *buffer = malloc(bs);
-    if (!buffer) {
-        free(inode);
-        return -ENOMEM;
-    }
+        if (user) {
+            if (n > EXT2_WRITE_CHUNK)
+                n = EXT2_WRITE_CHUNK;
 
-    /* do the write */
-    /*printk("start_block %d end %d end_block %d pos %d\n",
-            start_block, end, end_block, f->fpos);*/
-
-    if (start_block == end_block) {
-        //printk("CASE 1\n");
-        int b = ext2_inode_read_or_create(fs, ino, inode, start_block, buffer);
-        if (b < 0) {
-            free(buffer);
-            free(inode);
-            return b;
-        }
-        memcpy(buffer + coff, buf, size_to_read);
-        total += size_to_read;
-        //printk("GOT BLOCK %d\n", b);
-        ext2_write_block(fs, buffer, b);
-    } else {
-        //printk("CASE 2\n");
-        uint32_t block_offset;
-        uint32_t blocks_read = 0;
-        for (block_offset = start_block; block_offset < end_block; block_offset ++, blocks_read ++) {
-            if (block_offset == start_block) {
-                int b = ext2_inode_read_or_create(fs, ino, inode, block_offset, buffer);
-                if (b < 0) {
-                    free(buffer);
-                    free(inode);
-                    return b;
-                }
-                memcpy(buffer + coff, buf, bs - coff);
-                total += bs - coff;
-                ext2_write_block(fs, buffer, b);
-            } else {
-                int b = ext2_inode_read_or_create(fs, ino, inode, block_offset, buffer);
-                if (b < 0) {
-                    free(buffer);
-                    free(inode);
-                    return b;
-                }
-                //printk("%s: blocks_read %d, coff %d\n", __func__, blocks_read, coff);
-                memcpy(buffer, buf + bs * blocks_read - coff, bs);
-                total += bs;
-                ext2_write_block(fs, buffer, b);
+            if (copy_from_user(bounce, src, n)) {
+                rc = -EFAULT;
+                break;
             }
+            src = bounce;
         }
-        if (end_size) {
-            int b = ext2_inode_read_or_create(fs, ino, inode, end_block, buffer);
-            if (b < 0) {
-                free(buffer);
-                free(inode);
-                return b;
-            }
-            memcpy(buffer, buf + bs * blocks_read - coff, end_size);
-            total += end_size;
-            ext2_write_block(fs, buffer, b);
-        }
-    }
 
-done:
-    ext2_read_inode(fs, inode, ino);
-    if (end > inode->size) {
-        inode->size = end;
-        ext2_write_inode(fs, inode, ino);
-        f->length = inode->size;
+        rc = __ext2_write_chunk(f, &pos, src, n, block);
+        if (rc)
+            break;
     }
-    f->fpos += total;
 
-    rc = total;
-exit:
-    free(buffer);
-    free(inode);
+    free(block);
+    free(bounce);
+
+    /* report what was written, the error only if nothing was */
+    if (pos == f->fpos)
+        return rc;
+
+    /* mappings established from now on must see the new data */
+    pagecache_invalidate(f, f->fpos, pos);
+
+    rc = pos - f->fpos;
+    f->fpos = pos;
     return rc;
 }
 
@@ -478,6 +444,9 @@ ext2_dup_priv(void *priv)
 
     memcpy(ret, priv, sizeof(*ret));
 
+    /* the new file shares the inode */
+    ext2_igrab(ret->ii);
+
     return ret;
 }
 
@@ -532,30 +501,29 @@ int
 ext2_file_close(struct file *filp)
 {
     //free(filp->full_path);
+
+    /* what was written gets its blocks now */
+    ext2_delalloc_flush(EXT2_FILE_PRIV(filp)->ii);
+
+    ext2_iput(EXT2_FILE_PRIV(filp)->ii);
     free(filp->respath);
     free(filp->priv);
-    free(filp);
+    file_free(filp);
     return 0;
 }
 
 int
 ext2_truncate_file(struct file *f, int size)
 {
-    struct filesystem *fs = f->fs;
     struct ext2_inode *inode_buf;
-    int inode_no;
 
     /* FIXME: support truncate large files */
     if (size)
         return -EROFS;
 
-    inode_no = EXT2_FILE_PRIV(f)->inode_no;
+    inode_buf = EXT2_FILE_INODE(f);
 
-    inode_buf = malloc(EXT2_PRIV(fs)->inodesize);
-    if (!inode_buf)
-        return -ENOMEM;
-
-    ext2_read_inode(fs, inode_buf, inode_no);
+    ext2_delalloc_drop(EXT2_FILE_PRIV(f)->ii);
 
     inode_buf->size = 0;
     inode_buf->disk_sectors = 0;
@@ -568,13 +536,13 @@ ext2_truncate_file(struct file *f, int size)
     inode_buf->doubly_block = 0;
     inode_buf->triply_block = 0;
 
-    ext2_write_inode(fs, inode_buf, inode_no);
+    ext2_imark_dirty(EXT2_FILE_PRIV(f)->ii);
+
+    pagecache_invalidate(f, 0, 0xFFFFFFFF);
 
     f->length = 0;
     f->fpos = 0;
 
-    free(inode_buf);
-
     return 0;
 }
 
@@ -590,43 +558,51 @@ struct file_operations ext2_fops = {
 
 struct file *ext2_open(struct filesystem *fs, char *p)
 {
-    struct file *f;
-    struct ext2_inode *inode;
-    struct ext2_file_priv *priv;
     int ino;
 
     if (!fs || !p)
         return (void *) -EINVAL;
 
-    f = malloc(sizeof(*f));
-    if (!f)
-        return (void *) -ENOMEM;
+    ino = ext2_find_file_inode(fs, p);
+    if (ino < 0) {
+        //printk("NO FUCKING FILE %s FOUND BITCHEZ\n", p);
+        return ERR_PTR(ino);
+    }
 
-    inode = malloc(EXT2_PRIV(fs)->inodesize);
-    if (!inode) {
-        free(f);
+    return ext2_open_inode(fs, ino, p);
+}
+
+/*
+ * ext2_open_inode - open inode @ino of @fs, which was found at path @p
+ */
+struct file *ext2_open_inode(struct filesystem *fs, int ino, char *p)
+{
+    struct file *f;
+    struct ext2_inode *inode;
+    struct ext2_inode_info *ii;
+    struct ext2_file_priv *priv;
+
+    f = file_alloc();
+    if (!f)
         return (void *) -ENOMEM;
-    }
 
     priv = malloc(sizeof(*priv));
     if (!priv) {
-        free(inode);
-        free(f);
+        file_free(f);
         return ERR_PTR(-ENOMEM);
     }
 
-    ino = ext2_find_file_inode(fs, p);
-    if (ino == -ENOENT) {
+    /* the file holds a reference to the cached inode until close */
+    ii = ext2_iget(fs, ino);
+    if (IS_ERR(ii)) {
         free(priv);
-        free(inode);
-        free(f);
-        //printk("NO FUCKING FILE %s FOUND BITCHEZ\n", p);
-        return (void *) -ENOENT;
+        file_free(f);
+        return (void *) ii;
     }
 
     priv->inode_no = ino;
-
-    ext2_read_inode(fs, inode, ino);
+    priv->ii = ii;
+    inode = ii->ii_inode;
 
     f->fops = &ext2_fops;
     f->fs = fs;
@@ -635,9 +611,8 @@ struct file *ext2_open(struct filesystem *fs, char *p)
     f->fpos = 0;
     f->length = inode->size;
     f->refc = 1;
+    f->ino = ino;
     f->priv = priv;
 
-    free(inode);
-
     return f;
 }
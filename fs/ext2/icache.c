@@ -0,0 +1,414 @@
+#include <levos/kernel.h>
+#include <levos/fs.h>
+#include <levos/ext2.h>
+#include <levos/hash.h>
+#include <levos/list.h>
+#include <levos/spinlock.h>
+#include <levos/task.h>
+
+#define MODULE_NAME ext2_icache
+
+/*
+ * The inode cache keeps decoded on-disk inodes in memory, hashed by
+ * (filesystem, inode number). An open file holds a reference to its
+ * inode for as long as it lives, so reads and writes never have to go
+ * through the block group descriptors again.
+ *
+ * ext2_read_inode() and ext2_write_inode() go through here as well: a
+ * write to a cached inode only dirties it, it is written back to the
+ * buffer cache when the last reference is dropped, when it gets evicted
+ * or when the filesystem is synced.
+ *
+ * The lock is never held across disk I/O. An inode being read in is in
+ * the cache already, II_LOCKED, and whoever else looks it up waits for
+ * it. Writing an inode back takes a reference to keep it around.
+ */
+
+static struct hash icache_hash;
+static struct list icache_lru;
+static spinlock_t icache_lock;
+static int icache_nr_inodes;
+
+static unsigned
+icache_hash_ii(const struct hash_elem *elem, void *aux)
+{
+    struct ext2_inode_info *ii = hash_entry(elem, struct ext2_inode_info, ii_helem);
+
+    return hash_int((int) ii->ii_fs ^ ii->ii_ino);
+}
+
+static bool
+icache_less_ii(const struct hash_elem *ea,
+               const struct hash_elem *eb,
+               void *aux)
+{
+    struct ext2_inode_info *a = hash_entry(ea, struct ext2_inode_info, ii_helem);
+    struct ext2_inode_info *b = hash_entry(eb, struct ext2_inode_info, ii_helem);
+
+    if (a->ii_fs != b->ii_fs)
+        return a->ii_fs < b->ii_fs;
+
+    return a->ii_ino < b->ii_ino;
+}
+
+/*
+ * __icache_writeback - write @ii back to the buffer cache if it is dirty
+ *
+ * The icache lock is dropped meanwhile. The dirty bit is cleared first,
+ * a change that races with the write dirties the inode again.
+ */
+static int
+__icache_writeback(struct ext2_inode_info *ii)
+{
+    int rc;
+
+    if (!(ii->ii_flags & II_DIRTY))
+        return 0;
+
+    ii->ii_flags &= ~II_DIRTY;
+    ii->ii_refc ++;
+    spin_unlock(&icache_lock);
+
+    rc = ext2_write_inode_disk(ii->ii_fs, ii->ii_inode, ii->ii_ino);
+
+    spin_lock(&icache_lock);
+    ii->ii_refc --;
+    if (rc)
+        ii->ii_flags |= II_DIRTY;
+
+    return rc;
+}
+
+static struct ext2_inode_info *
+__icache_lookup(struct filesystem *fs, int ino)
+{
+    struct ext2_inode_info cmp;
+    struct hash_elem *elem;
+
+    cmp.ii_fs = fs;
+    cmp.ii_ino = ino;
+
+    elem = hash_find(&icache_hash, &cmp.ii_helem);
+    if (!elem)
+        return NULL;
+
+    return hash_entry(elem, struct ext2_inode_info, ii_helem);
+}
+
+/*
+ * __icache_lookup_wait - look up an inode, waiting for it to be read in
+ *                        if somebody is doing that
+ */
+static struct ext2_inode_info *
+__icache_lookup_wait(struct filesystem *fs, int ino)
+{
+    struct ext2_inode_info *ii;
+
+    while ((ii = __icache_lookup(fs, ino)) && (ii->ii_flags & II_LOCKED)) {
+        spin_unlock(&icache_lock);
+        sched_yield();
+        spin_lock(&icache_lock);
+    }
+
+    return ii;
+}
+
+static void
+__icache_destroy(struct ext2_inode_info *ii)
+{
+    hash_delete(&icache_hash, &ii->ii_helem);
+    list_remove(&ii->ii_lru_elem);
+    icache_nr_inodes --;
+
+    free(ii->ii_inode);
+    free(ii);
+}
+
+static int
+__icache_unused(struct ext2_inode_info *ii)
+{
+    return !ii->ii_refc && !ii->ii_nr_delayed && !(ii->ii_flags & II_LOCKED);
+}
+
+/*
+ * __icache_evict - throw out the least recently used inode that is
+ *                  not referenced by any file
+ *
+ * Writing a dirty one back drops the lock, so the cache may have changed
+ * by the time this returns.
+ */
+static int
+__icache_evict(void)
+{
+    struct list_elem *elem;
+
+    list_foreach_raw(&icache_lru, elem) {
+        struct ext2_inode_info *ii =
+            list_entry(elem, struct ext2_inode_info, ii_lru_elem);
+
+        if (!__icache_unused(ii))
+            continue;
+
+        /* it stays if its only copy can't be written */
+        if (__icache_writeback(ii))
+            continue;
+
+        if (!__icache_unused(ii) || (ii->ii_flags & II_DIRTY))
+            continue;
+
+        __icache_destroy(ii);
+        return 0;
+    }
+
+    return -ENOMEM;
+}
+
+static void
+__icache_touch(struct ext2_inode_info *ii)
+{
+    list_remove(&ii->ii_lru_elem);
+    list_push_back(&icache_lru, &ii->ii_lru_elem);
+}
+
+/*
+ * __icache_get - find or read in inode @ino of @fs, the caller must
+ *                hold the icache lock, which is dropped for the read
+ */
+static struct ext2_inode_info *
+__icache_get(struct filesystem *fs, int ino)
+{
+    struct ext2_inode_info *ii;
+    int rc;
+
+    if (icache_nr_inodes >= EXT2_ICACHE_MAX_INODES)
+        __icache_evict();
+
+    ii = __icache_lookup_wait(fs, ino);
+    if (ii) {
+        __icache_touch(ii);
+        return ii;
+    }
+
+    ii = malloc(sizeof(*ii));
+    if (!ii)
+        return ERR_PTR(-ENOMEM);
+
+    ii->ii_inode = malloc(EXT2_PRIV(fs)->inodesize);
+    if (!ii->ii_inode) {
+        free(ii);
+        return ERR_PTR(-ENOMEM);
+    }
+
+    ii->ii_fs = fs;
+    ii->ii_ino = ino;
+    ii->ii_flags = II_LOCKED;
+    ii->ii_refc = 0;
+    ext2_delalloc_init(ii);
+
+    hash_insert(&icache_hash, &ii->ii_helem);
+    list_push_back(&icache_lru, &ii->ii_lru_elem);
+    icache_nr_inodes ++;
+
+    spin_unlock(&icache_lock);
+    rc = ext2_read_inode_disk(fs, ii->ii_inode, ino);
+    spin_lock(&icache_lock);
+
+    if (rc) {
+        /* the ones waiting for it find nothing and try themselves */
+        __icache_destroy(ii);
+        return ERR_PTR(rc < 0 ? rc : -EIO);
+    }
+
+    ii->ii_flags &= ~II_LOCKED;
+    return ii;
+}
+
+/*
+ * ext2_iget - get a referenced in-memory copy of inode @ino of @fs
+ *
+ * The reference must be dropped with ext2_iput().
+ */
+struct ext2_inode_info *
+ext2_iget(struct filesystem *fs, int ino)
+{
+    struct ext2_inode_info *ii;
+
+    if (ino <= 0)
+        return ERR_PTR(-EINVAL);
+
+    spin_lock(&icache_lock);
+    ii = __icache_get(fs, ino);
+    if (!IS_ERR(ii))
+        ii->ii_refc ++;
+    spin_unlock(&icache_lock);
+
+    return ii;
+}
+
+/* ext2_igrab - take another reference to an inode that is already held */
+struct ext2_inode_info *
+ext2_igrab(struct ext2_inode_info *ii)
+{
+    spin_lock(&icache_lock);
+    panic_ifnot(ii->ii_refc > 0);
+    ii->ii_refc ++;
+    spin_unlock(&icache_lock);
+
+    return ii;
+}
+
+void
+ext2_iput(struct ext2_inode_info *ii)
+{
+    spin_lock(&icache_lock);
+    panic_ifnot(ii->ii_refc > 0);
+    ii->ii_refc --;
+    if (ii->ii_refc == 0)
+        __icache_writeback(ii);
+    spin_unlock(&icache_lock);
+}
+
+void
+ext2_imark_dirty(struct ext2_inode_info *ii)
+{
+    spin_lock(&icache_lock);
+    ii->ii_flags |= II_DIRTY;
+    spin_unlock(&icache_lock);
+}
+
+/*
+ * ext2_read_inode - copy inode @inode of @fs into @buf
+ */
+int
+ext2_read_inode(struct filesystem *fs, struct ext2_inode *buf, int inode)
+{
+    struct ext2_inode_info *ii;
+
+    if (inode == 0)
+        return -1;
+
+    spin_lock(&icache_lock);
+
+    ii = __icache_get(fs, inode);
+    if (IS_ERR(ii)) {
+        spin_unlock(&icache_lock);
+        return ext2_read_inode_disk(fs, buf, inode);
+    }
+
+    if (buf != ii->ii_inode)
+        memcpy(buf, ii->ii_inode, EXT2_PRIV(fs)->inodesize);
+
+    spin_unlock(&icache_lock);
+
+    return 0;
+}
+
+/*
+ * ext2_write_inode - replace inode @inode of @fs with @buf
+ *
+ * If the inode is cached, only the cached copy is updated and marked
+ * dirty.
+ */
+int
+ext2_write_inode(struct filesystem *fs, struct ext2_inode *buf, int inode)
+{
+    struct ext2_inode_info *ii;
+
+    spin_lock(&icache_lock);
+
+    ii = __icache_lookup_wait(fs, inode);
+    if (!ii) {
+        spin_unlock(&icache_lock);
+        return ext2_write_inode_disk(fs, buf, inode);
+    }
+
+    if (buf != ii->ii_inode)
+        memcpy(ii->ii_inode, buf, EXT2_PRIV(fs)->inodesize);
+    ii->ii_flags |= II_DIRTY;
+
+    spin_unlock(&icache_lock);
+
+    return 0;
+}
+
+/*
+ * ext2_icache_sync - write back every dirty inode of @fs to the
+ *                    buffer cache
+ */
+int
+ext2_icache_sync(struct filesystem *fs)
+{
+    struct list_elem *elem;
+    int rc, ret = 0;
+
+    spin_lock(&icache_lock);
+
+    list_foreach_raw(&icache_lru, elem) {
+        struct ext2_inode_info *ii =
+            list_entry(elem, struct ext2_inode_info, ii_lru_elem);
+
+        if (ii->ii_fs != fs)
+            continue;
+
+        /* it holds a reference meanwhile, so it is still on the list */
+        rc = __icache_writeback(ii);
+        if (rc)
+            ret = rc;
+    }
+
+    spin_unlock(&icache_lock);
+
+    return ret;
+}
+
+/*
+ * ext2_icache_flush - allocate the delayed blocks of every inode of @fs
+ *
+ * That needs the inode written, so it is done without the icache lock,
+ * the reference keeps the inode around in the meantime.
+ */
+int
+ext2_icache_flush(struct filesystem *fs)
+{
+    struct ext2_inode_info *ii;
+    struct list_elem *elem;
+    int rc, ret = 0;
+
+    spin_lock(&icache_lock);
+
+    elem = list_begin(&icache_lru);
+    while (elem != list_end(&icache_lru)) {
+        ii = list_entry(elem, struct ext2_inode_info, ii_lru_elem);
+
+        if (ii->ii_fs != fs || !ii->ii_nr_delayed) {
+            elem = list_next(elem);
+            continue;
+        }
+
+        ii->ii_refc ++;
+        spin_unlock(&icache_lock);
+
+        rc = ext2_delalloc_flush(ii);
+        if (rc)
+            ret = rc;
+
+        spin_lock(&icache_lock);
+        ii->ii_refc --;
+        elem = list_next(&ii->ii_lru_elem);
+    }
+
+    spin_unlock(&icache_lock);
+
+    return ret;
+}
+
+void
+ext2_icache_init(void)
+{
+    spin_lock_init(&icache_lock);
+    list_init(&icache_lru);
+    hash_init(&icache_hash, icache_hash_ii, icache_less_ii, NULL);
+    icache_nr_inodes = 0;
+
+    mprintk("initialized, caching up to %d inodes\n", EXT2_ICACHE_MAX_INODES);
+}
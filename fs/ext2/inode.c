@@ -1,9 +1,8 @@
 #include <levos/kernel.h>
 #include <levos/fs.h>
 #include <levos/ext2.h>
-#include <levos/bitmap.h>
 
-int ext2_read_inode(struct filesystem *fs, struct ext2_inode *buf, int inode)
+int ext2_read_inode_disk(struct filesystem *fs, struct ext2_inode *buf, int inode)
 {
     struct ext2_priv_data *p = EXT2_PRIV(fs);
     uint32_t bg = (inode - 1) / p->sb.inodes_in_blockgroup;
@@ -18,21 +17,19 @@ int ext2_read_inode(struct filesystem *fs, struct ext2_inode *buf, int inode)
     char *block_buf = malloc(p->blocksize);
     if (!block_buf)
         return -ENOMEM;
-    ext2_read_block(fs, block_buf, p->first_bgd);
-
-    struct ext2_block_group_desc *bgd = (void *)block_buf;
-    //printk("target inode %d BG %d inodesPbg: %d\n", inode, bg, p->sb.inodes_in_blockgroup);
-    //printk("bgd 0  target: %d is at 0x%x\n", bg, bgd);
-    for(i = 0; i < bg; i++) {
-        bgd ++;
-        //printk("bgd %d target: %d is at 0x%x\n", i, bg, bgd);
-    }
+
+    /* the descriptors are in memory, see fs/ext2/balloc.c */
+    struct ext2_block_group_desc *bgd = &p->bgdt[bg];
 
     //printk("bgd: block of inode table: %d\n", bgd->block_of_inode_table);
 
     uint32_t index = (inode - 1) % p->sb.inodes_in_blockgroup;
     uint32_t block = (index * EXT2_PRIV(fs)->inodesize) / p->blocksize;
-    ext2_read_block(fs, block_buf, bgd->block_of_inode_table + block);
+    int rc = ext2_read_block(fs, block_buf, bgd->block_of_inode_table + block);
+    if (rc) {
+        free(block_buf);
+        return rc;
+    }
     struct ext2_inode *_inode = (void *)block_buf;
     index = index % p->inodes_per_block;
     //printk("index of inode %d\n", index);
@@ -46,72 +43,6 @@ int ext2_read_inode(struct filesystem *fs, struct ext2_inode *buf, int inode)
 }
 
 
-int
-ext2_alloc_inode(struct filesystem *fs)
-{
-    struct ext2_priv_data *p = EXT2_PRIV(fs);
-    int i;
-
-    char *block_buf = malloc(p->blocksize);
-    if (!block_buf)
-        return -ENOMEM;
-
-    /* read in the BGDT */
-    ext2_read_block(fs, block_buf, p->first_bgd);
-
-    /* loop through the BGs */
-    struct ext2_block_group_desc *bgd = (void *)block_buf;
-    for(i = 0; i < p->number_of_bgs ; i++, bgd ++) {
-        if (bgd->num_of_unalloc_inode > 0) {
-            struct bitmap bm;
-            char *buffer;
-            size_t found_inode;
-
-            /* there is at least one inode here */
-            buffer = malloc(p->blocksize);
-            if (!buffer) {
-                free(block_buf);
-                return -ENOMEM;
-            }
-
-            /* read in the inode usage bitmap */
-            ext2_read_block(fs, buffer, bgd->block_of_inode_usage_bitmap);
-
-            /* open the bitmap */
-            bitmap_create_using_buffer(p->sb.inodes_in_blockgroup,
-                    buffer, &bm);
-
-            /* find a free bit */
-            found_inode = bitmap_scan_and_flip(&bm, 0, 1, 0);
-            if (found_inode == BITMAP_ERROR) {
-                printk("[ext2] CRITICAL: inconsistent inode bitmap\n");
-                free(buffer);
-                /* this is weird, try with the next bgd */
-                continue;
-            }
-            /* we found a block, commit the bitmap */
-            ext2_write_block(fs, buffer, bgd->block_of_inode_usage_bitmap);
-            
-            /* update the superblock */
-            p->sb.unallocatedinodes --;
-            ext2_write_superblock(fs);
-
-            /* now update the BGD */
-            bgd->num_of_unalloc_inode --;
-            ext2_write_block(fs, block_buf, p->first_bgd);
-
-            /* clean up */
-            free(buffer);
-            free(block_buf);
-
-            /* return the block id */
-            return i * p->sb.inodes_in_blockgroup + found_inode + 1;
-        }
-    }
-    free(block_buf);
-    return -1;
-}
-
 /* Creates a new inode in @inode, then allocates an inode number in @fs */
 int
 ext2_new_inode(struct filesystem *fs, struct ext2_inode *inode)
@@ -166,7 +97,7 @@ ext2_new_inode(struct filesystem *fs, struct ext2_inode *inode)
     return ino;
 }
 
-int ext2_write_inode(struct filesystem *fs, struct ext2_inode *buf, int inode)
+int ext2_write_inode_disk(struct filesystem *fs, struct ext2_inode *buf, int inode)
 {
     struct ext2_priv_data *p = EXT2_PRIV(fs);
     uint32_t bg = (inode - 1) / p->sb.inodes_in_blockgroup;
@@ -176,13 +107,8 @@ int ext2_write_inode(struct filesystem *fs, struct ext2_inode *buf, int inode)
     if (!block_buf)
         return -ENOMEM;
 
-    /* read in the BGDs */
-    ext2_read_block(fs, block_buf, p->first_bgd);
-
-    /* read the BGD */
-    struct ext2_block_group_desc *bgd = (void *)block_buf;
-    for(i = 0; i < bg; i++)
-        bgd ++;
+    /* the BGD */
+    struct ext2_block_group_desc *bgd = &p->bgdt[bg];
 
     /* find the block and its index in it of the inode */
     uint32_t index = (inode - 1) % p->sb.inodes_in_blockgroup;
@@ -190,7 +116,11 @@ int ext2_write_inode(struct filesystem *fs, struct ext2_inode *buf, int inode)
     int final = bgd->block_of_inode_table + block;
 
     /* read that block and generate a pointer */
-    ext2_read_block(fs, block_buf, final);
+    int rc = ext2_read_block(fs, block_buf, final);
+    if (rc) {
+        free(block_buf);
+        return rc;
+    }
     struct ext2_inode *_inode = (void *)block_buf;
     index = index % p->inodes_per_block;
     for (i = 0; i < index; i++)
@@ -200,62 +130,28 @@ int ext2_write_inode(struct filesystem *fs, struct ext2_inode *buf, int inode)
     memcpy(_inode, (void *) buf, EXT2_PRIV(fs)->inodesize);
 
     /* write back the block */
-    ext2_write_block(fs, block_buf, final);
+    rc = ext2_write_block(fs, block_buf, final);
 
     free(block_buf);
-    return 0;
+    return rc;
 }
 
+/* the disk block of block @b of the inode, 0 if it has none */
 int
 ext2_inode_get_block(struct filesystem *fs, struct ext2_inode *ibuf, int b)
 {
-    int bs = EXT2_PRIV(fs)->blocksize;
-    uint32_t p = bs / sizeof(uint32_t);
-
-    if (b < 12) {
-        return ibuf->dbp[b];
-    } else {
-        if (b < 12 + p) {
-            uint32_t *bb = malloc(bs);
-            if (!bb)
-                return -ENOMEM;
-            //printk("SLB: %d\n", ibuf->singly_block);
-            ext2_read_block(fs, bb, ibuf->singly_block);
-            //printk("ORIG %d\n", b);
-            b = bb[b - 12];
-            //printk("TRY %d\n", b);
-            free(bb);
-            return b;
-        } else if (b < 12 + p + p * p) {
-            int A = b - 12;
-            int B = A - p;
-            int C = B / p;
-            int D = B - C * p;
-
-            uint32_t *buf1 = malloc(bs);
-            if (!buf1)
-                return -ENOMEM;
-
-            ////printk("reading %d in the doubly block %d\n", b, ibuf->doubly_block);
-            ext2_read_block(fs, buf1, ibuf->doubly_block);
+    struct ext2_bmap_ctx ctx;
+    uint32_t block;
+    int rc;
 
-            uint32_t nblock = buf1[C];
-            if (buf1[C] == 0)
-                return -1;
-            //printk("reading in the refd block: %d from loc %d\n", nblock, C);
-            ext2_read_block(fs, buf1, nblock);
+    ext2_bmap_init(&ctx, fs, ibuf);
+    rc = ext2_bmap(&ctx, b, 1, &block);
+    ext2_bmap_done(&ctx);
 
-            //printk("doubly: reading %d from loc %d\n", buf1[D], D);
+    if (rc < 0)
+        return rc;
 
-            free(buf1);
-            return buf1[D];
-        }
-        printk("Triply block are not yet supported\n");
-        return -ENOSYS;
-    }
-    panic("%s: this can't happen\n", __func__);
-    __not_reached();
-    return -1;
+    return block;
 }
 
 int
@@ -304,8 +200,8 @@ set_block_number(struct filesystem *fs,
             panic("OOM\n");
 
 		if (!inode->singly_block) {
-			unsigned int block_no = ext2_alloc_block(fs);
-			if (!block_no) {
+			int block_no = ext2_alloc_block(fs);
+			if (block_no <= 0) {
                 free(tmp);
                 return -ENOSPC;
             }
@@ -332,25 +228,34 @@ set_block_number(struct filesystem *fs,
 		c = b / p;
 		d = b - c * p;
 
+		tmp = malloc(bs);
+        if (!tmp)
+            panic("OOM2\n");
+
 		if (!inode->doubly_block) {
-			unsigned int block_no = ext2_alloc_block(fs);
-			if (!block_no)
-                return -ENOSPC;
+			int block_no = ext2_alloc_block(fs);
+			if (block_no <= 0)
+                goto no_space_free;
 			inode->doubly_block = block_no;
 			ext2_write_inode(fs, inode, inode_no);
+
+            /* whatever was on the disk there is no block map */
+            memset(tmp, 0, bs);
+            ext2_write_block(fs, tmp, inode->doubly_block);
 		}
 
-		tmp = malloc(bs);
-        if (!tmp)
-            panic("OOM2\n");
 		ext2_read_block(fs, tmp, inode->doubly_block);
 
 		if (!((uint32_t *)tmp)[c]) {
-			unsigned int block_no = ext2_alloc_block(fs);
-			if (!block_no)
+			int block_no = ext2_alloc_block(fs);
+			if (block_no <= 0)
                 goto no_space_free;
 			((uint32_t *)tmp)[c] = block_no;
 			ext2_write_block(fs, tmp, inode->doubly_block);
+
+            memset(tmp, 0, bs);
+            ext2_write_block(fs, tmp, block_no);
+            ext2_read_block(fs, tmp, inode->doubly_block);
 		}
 
 		uint32_t nblock = ((uint32_t *)tmp)[c];
@@ -378,9 +283,9 @@ allocate_inode_block(struct filesystem *fs,
                      int block)
 {
     int bs = EXT2_PRIV(fs)->blocksize;
-	unsigned int block_no = ext2_alloc_block(fs);
+	int block_no = ext2_alloc_block(fs);
 
-	if (!block_no || block_no < 0) {
+	if (block_no <= 0) {
         //printk("OUCH THIS IS BAD block_no %d\n", block_no);
         return -ENOSPC;
     }
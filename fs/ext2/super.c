@@ -2,6 +2,7 @@
 #include <levos/fs.h>
 #include <levos/device.h>
 #include <levos/ext2.h>
+#include <levos/bcache.h>
 
 struct filesystem *ext2_mount(struct device *dev);
 int ext2_stat(struct filesystem *, char *, struct stat *);
@@ -15,6 +16,10 @@ struct fs_ops ext2_fs = {
     .stat = ext2_stat,
     .mkdir = ext2_mkdir,
     .create = ext2_create_file,
+    .sync = ext2_sync,
+    .lookup = ext2_lookup,
+    .open_ino = ext2_open_inode,
+    .stat_ino = ext2_stat_inode,
 };
 
 struct filesystem *ext2_mount(struct device *dev)
@@ -50,10 +55,22 @@ struct filesystem *ext2_mount(struct device *dev)
     free(buf);
 
 
-    dev->fs = fs;
     fs->priv_data = p;
     fs->fs_ops = &ext2_fs;
     fs->dev = dev;
+    fs->root_ino = 2;
+
+    spin_lock_init(&p->dir_lock);
+    p->dir_busy = 0;
+
+    if (ext2_balloc_init(fs)) {
+        printk("ext2: %s: failed to read the block group descriptors\n", dev->name);
+        free(fs);
+        free(p);
+        return NULL;
+    }
+
+    dev->fs = fs;
 
     return fs;
 }
@@ -61,19 +78,54 @@ struct filesystem *ext2_mount(struct device *dev)
 int
 ext2_write_superblock(struct filesystem *fs)
 {
-    void *buffer = &EXT2_PRIV(fs)->sb;
-    dev_seek(fs->dev, 2);
+    struct ext2_priv_data *p = EXT2_PRIV(fs);
+    struct buffer *buf;
+
     if (!fs->dev->write) {
         printk("[ext2]: CRIRTICAL: ROFS\n");
         return -EROFS;
     }
-    fs->dev->write(fs->dev, buffer, 2);
+
+    /* the superblock lives at byte 1024, update it in the cache */
+    buf = bcache_get(fs->dev, 1024 / p->blocksize, p->blocksize);
+    if (IS_ERR(buf))
+        return PTR_ERR(buf);
+
+    memcpy(buf->buf_data + 1024 % p->blocksize, &p->sb, sizeof(p->sb));
+    bcache_mark_dirty(buf);
+    bcache_put(buf);
+
     //printk("[ext2]: WARNING: writing superblock has been done\n");
+    return 0;
+}
+
+/*
+ * ext2_sync - push what only lives in memory to the buffer cache: the
+ *             delayed blocks get allocated, then the inodes and the
+ *             allocation state are written back
+ */
+int
+ext2_sync(struct filesystem *fs)
+{
+    int rc, ret;
+
+    ret = ext2_icache_flush(fs);
+
+    rc = ext2_icache_sync(fs);
+    if (rc)
+        ret = rc;
+
+    rc = ext2_alloc_sync(fs);
+    if (rc)
+        ret = rc;
+
+    return ret;
 }
 
 int ext2_init()
 {
     printk("ext2: registered filesystem to vfs\n");
+    ext2_icache_init();
     struct fs_ops *f = malloc(sizeof(*f));
     memcpy(f, (void *) &ext2_fs, sizeof(*f));
     register_fs(f);
@@ -46,6 +46,7 @@ extern size_t palloc_proc_memfree(int, void *, size_t, char *);
 extern size_t palloc_proc_memused(int, void *, size_t, char *);
 extern size_t palloc_proc_memtotal(int, void *, size_t, char *);
 extern size_t heap_proc_heapstats(int, void *, size_t, char *);
+extern size_t slab_proc_slabinfo(int, void *, size_t, char *);
 
 static struct procfs_file _files[] = {
     { 0x80000001, "/version", generic_write_buf, procfs_version},
@@ -55,6 +56,7 @@ static struct procfs_file _files[] = {
     { 0x80000005, "/memtotal", palloc_proc_memtotal, NULL},
     { 0x80000006, "/heapstats", heap_proc_heapstats, NULL},
     { 0x80000007, "/uptime", proc_uptime, NULL},
+    { 0x80000008, "/slabinfo", slab_proc_slabinfo, NULL},
     { 0x00000000, NULL, NULL},
 };
 
@@ -190,7 +192,7 @@ int
 procfs_close(struct file *filp)
 {
     free(filp->respath);
-    free(filp);
+    file_free(filp);
     return 0;
 }
 
@@ -300,7 +302,7 @@ procfs_open(struct filesystem *fs, char *path)
     if (inode == -1)
         return -ENOENT;
     
-    filp = malloc(sizeof(*filp));
+    filp = file_alloc();
     if (!filp)
         return NULL;
 
@@ -312,6 +314,7 @@ procfs_open(struct filesystem *fs, char *path)
     filp->refc = 1;
     filp->respath = strdup(path);
     filp->type = FILE_TYPE_NORMAL;
+    filp->ino = 0;
     filp->priv = inode;
 
     //printk("%s: %s\n", __func__, path);
@@ -4,6 +4,10 @@
 #include <levos/string.h>
 #include <levos/list.h>
 #include <levos/task.h>
+#include <levos/bcache.h>
+#include <levos/dcache.h>
+#include <levos/limits.h>
+#include <levos/slab.h>
 
 #define MAX_MOUNTS 256
 
@@ -15,6 +19,15 @@ struct mount *root_mount = 0;
 struct fs_ops *fs_ops_s[8];
 static int fs_ops_n = 0;
 
+/*
+ * Mounts are only ever added, so the table is read without a lock. The
+ * new entry is in place before nmounts counts it.
+ */
+static spinlock_t mount_lock;
+
+/* the reference counts of files, which tasks share after fork(2) */
+static spinlock_t file_refc_lock;
+
 void
 file_seek(struct file *file, int pos)
 {
@@ -49,45 +62,153 @@ int __vfs_set_mount(char *p, struct device *dev, struct filesystem *fs)
         return -ENOMEM;
 
     m->point = p;
+    m->point_len = strlen(p);
     m->fs = fs;
     m->dev = dev;
+    fs->fs_ra_pages = FS_RA_PAGES_DEFAULT;
+    fs->fs_fault_around = FS_FAULT_AROUND_DEFAULT;
+
+    spin_lock(&mount_lock);
+    if (nmounts == MAX_MOUNTS) {
+        spin_unlock(&mount_lock);
+        free(m);
+        return -ENOSPC;
+    }
     mounts[nmounts] = m;
+    barrier();
     nmounts ++;
     //printk("vfs: mounted %s on %s to %s\n", fs->fs_ops->fsname, dev->name, p);
     if (strcmp(p, "/") == 0)
         root_mount = m;
+    spin_unlock(&mount_lock);
+
     return 0;
 }
 
 /*
  * find_mount - Finds the internal mount structure for
- * a particular path
+ * a particular path, i.e. the mount with the longest point
+ * that is a prefix of it
  */
 struct mount *find_mount(char *path)
 {
     struct mount *ret = root_mount;
-    char *str;
-
-    /* create a copy of the string */
-    str = malloc(strlen(path) + 1);
-    memcpy(str, path, strlen(path) + 1);
-    if (strcmp(str, "/") == 0)
-        goto out;
-
-    while (strlen(str) > 1) {
-        //printk("Checking str %s\n", str);
-        ret = __check_mounts(str);
-        if (ret)
-            goto out;
-        str[strlen(str) - 1] = 0;
+    size_t best = 1;
+    int i;
+
+    for (i = 0; i < nmounts; i ++) {
+        struct mount *m = mounts[i];
+
+        if (m->point_len <= best)
+            continue;
+
+        if (strncmp(m->point, path, m->point_len) != 0)
+            continue;
+
+        if (path[m->point_len] != 0 && path[m->point_len] != '/')
+            continue;
+
+        ret = m;
+        best = m->point_len;
     }
 
-    ret = root_mount;
-out:
-    free(str);
     return ret;
 }
 
+/*
+ * __mount_relpath - Returns @path relative to the mount point of @m
+ *
+ * @internal
+ */
+static inline char *
+__mount_relpath(struct mount *m, char *path)
+{
+    if (path[m->point_len] == 0)
+        return "/";
+
+    return path + m->point_len;
+}
+
+/*
+ * __vfs_lookup - Resolves @path on @fs one component at a time,
+ * going to the filesystem only for names the dentry cache knows
+ * nothing about. If @parent is non-NULL, the inode of the directory
+ * holding the last component is stored there, and @name and @len
+ * are set to point to that component.
+ *
+ * @internal
+ */
+static int
+__vfs_lookup(struct filesystem *fs, char *path,
+             int *parent, char **name, size_t *len)
+{
+    char buf[NAME_MAX + 1];
+    int ino = fs->root_ino, dir = ino;
+    char *p = path, *comp = NULL;
+    size_t clen = 0;
+
+    while (1) {
+        while (*p == '/')
+            p ++;
+
+        if (*p == 0)
+            break;
+
+        /* a directory on the way does not exist */
+        if (ino < 0)
+            return ino;
+
+        comp = p;
+        while (*p != 0 && *p != '/')
+            p ++;
+        clen = p - comp;
+
+        dir = ino;
+        ino = dcache_lookup(fs, dir, comp, clen);
+        if (ino != DCACHE_MISS)
+            continue;
+
+        if (clen > NAME_MAX)
+            return -ENOENT;
+
+        memcpy(buf, comp, clen);
+        buf[clen] = 0;
+
+        ino = fs->fs_ops->lookup(fs, dir, buf);
+        if (ino > 0 || ino == -ENOENT)
+            dcache_insert(fs, dir, comp, clen, ino);
+    }
+
+    if (parent) {
+        *parent = dir;
+        *name = comp;
+        *len = clen;
+    }
+
+    return ino;
+}
+
+/*
+ * __vfs_lookup_parent - Resolves the directory that would hold @path
+ * on @fs, so that the entry can be invalidated once it is created.
+ * Returns the result of looking up @path itself.
+ *
+ * @internal
+ */
+static int
+__vfs_lookup_parent(struct filesystem *fs, char *path,
+                    int *parent, char **name, size_t *len)
+{
+    *parent = -1;
+    *name = NULL;
+    *len = 0;
+
+    if (!fs->fs_ops->lookup)
+        return -ENOSYS;
+
+    return __vfs_lookup(fs, path, parent, name, len);
+}
+
 /*
  * vfs_mount_fs - Finds a filesystem that is willing to be
  * mounted on this particular device.
@@ -139,6 +260,25 @@ int vfs_mount(char *path, struct device *dev)
     return __vfs_set_mount(path, dev, fs);
 }
 
+/*
+ * vfs_set_readahead - Sets the largest read-ahead window and the
+ * fault-around size, in pages, of file backed mappings of files
+ * on the mount at @path. Negative values are left unchanged.
+ */
+int vfs_set_readahead(char *path, int ra_pages, int fault_around)
+{
+    struct mount *m = __check_mounts(path);
+    if (!m)
+        return -ENOENT;
+
+    if (ra_pages >= 0)
+        m->fs->fs_ra_pages = ra_pages;
+    if (fault_around >= 0)
+        m->fs->fs_fault_around = fault_around;
+
+    return 0;
+}
+
 /*
  * vfs_root_mounted - Returns whether root directory was mounted
  * or not
@@ -175,21 +315,23 @@ struct file *vfs_open(char *path)
         //return dup_file(&null_base_file);
 
     struct mount *m = find_mount(path);
+    struct fs_ops *ops = m->fs->fs_ops;
+    struct file *f;
 
-    char *exppath;
-    if (strlen(path) == strlen(m->point)) {
-        exppath = "/";
-    } else {
-        exppath = path + strlen(m->point);
-    }
+    char *exppath = __mount_relpath(m, path);
 
     //printk("exppath is %s\n", exppath);
 
-    //printk("experimental path would be for \"%s\": \"%s\"\n",
-            //path, exppath);
+    if (ops->lookup && ops->open_ino) {
+        int ino = __vfs_lookup(m->fs, exppath, NULL, NULL, NULL);
+        if (ino < 0)
+            return ERR_PTR(ino);
+
+        f = ops->open_ino(m->fs, ino, exppath);
+    } else {
+        f = ops->open(m->fs, exppath);
+    }
 
-    /* FIXME: the path is wrong if multiple mounts exist */
-   struct file *f = m->fs->fs_ops->open(m->fs, exppath);
    if (f && !IS_ERR(f)) {
        f->refc = 1;
        f->full_path = strdup(path);
@@ -201,12 +343,15 @@ struct file *vfs_open(char *path)
 void
 vfs_close(struct file *f)
 {
+    int refc;
 
     //printk("CLOSING %s refc %d\n", f->respath, f->refc);
 
-    f->refc --;
+    spin_lock(&file_refc_lock);
+    refc = -- f->refc;
+    spin_unlock(&file_refc_lock);
 
-    if (f->refc == 0) {
+    if (refc == 0) {
         free(f->full_path);
         f->fops->close(f);
     }
@@ -214,11 +359,39 @@ vfs_close(struct file *f)
     //dump_stack(8);
 }
 
+/*
+ * vfs_sync - Makes every mounted filesystem push its dirty
+ * in-memory state to the buffer cache, then writes that back
+ */
+int
+vfs_sync(void)
+{
+    int i, rc, ret = 0;
+
+    for (i = 0; i < nmounts; i ++) {
+        struct filesystem *fs = mounts[i]->fs;
+
+        if (fs->fs_ops->sync) {
+            rc = fs->fs_ops->sync(fs);
+            if (rc)
+                ret = rc;
+        }
+    }
+
+    rc = bcache_sync(NULL);
+    if (rc)
+        ret = rc;
+
+    return ret;
+}
+
 void
 vfs_inc_refc(struct file *f)
 {
     //printk("file %s increased refc from %d\n", f->respath, f->refc);
+    spin_lock(&file_refc_lock);
     f->refc ++;
+    spin_unlock(&file_refc_lock);
     //dump_stack(8);
 }
 
@@ -226,15 +399,27 @@ struct file *
 vfs_create(char *path)
 {
     struct mount *m = find_mount(path);
+    struct file *f;
+    char *name;
+    size_t len;
+    int parent;
 
     //printk("experimental path would be for \"%s\": \"%s\"\n",
             //path, path + strlen(m->point) - 1);
 
+    if (!m->fs->fs_ops->create)
+        return ERR_PTR(-EROFS);
+
+    __vfs_lookup_parent(m->fs, __mount_relpath(m, path), &parent, &name, &len);
+
     /* FIXME: the path is wrong if multiple mounts exist */
-    if (m->fs->fs_ops->create)
-        return m->fs->fs_ops->create(m->fs, path);
+    f = m->fs->fs_ops->create(m->fs, path);
+
+    /* the name exists now, drop any negative entry */
+    if (name && !IS_ERR(f))
+        dcache_invalidate(m->fs, parent, name, len);
 
-    return ERR_PTR(-EROFS);
+    return f;
 }
 
 int
@@ -246,10 +431,25 @@ vfs_truncate(struct file *f)
     return -EROFS;
 }
 
+static struct kmem_cache *file_cache;
+
+/* file_alloc - allocate a zeroed struct file, free it with file_free() */
+struct file *
+file_alloc(void)
+{
+    return kmem_cache_zalloc(file_cache);
+}
+
+void
+file_free(struct file *f)
+{
+    kmem_cache_free(file_cache, f);
+}
+
 struct file *
 dup_file(struct file *f)
 {
-    struct file *ret = malloc(sizeof(*ret));
+    struct file *ret = file_alloc();
     if (!ret)
         return (void *) -ENOMEM;
 
@@ -266,6 +466,7 @@ dup_file(struct file *f)
     ret->type = f->type;
     ret->length = f->length;
     ret->refc = 1;
+    ret->ino = f->ino;
     if (f->full_path)
         ret->full_path = strdup(f->full_path);
 
@@ -292,11 +493,14 @@ int vfs_stat(char *p, struct stat *buf)
     if (!m->fs->fs_ops->stat)
         return -ENOSYS;
 
-    char *exppath;
-    if (strlen(p) == strlen(m->point)) {
-        exppath = "/";
-    } else {
-        exppath = p + strlen(m->point);
+    char *exppath = __mount_relpath(m, p);
+
+    if (m->fs->fs_ops->lookup && m->fs->fs_ops->stat_ino) {
+        int ino = __vfs_lookup(m->fs, exppath, NULL, NULL, NULL);
+        if (ino < 0)
+            return ino;
+
+        return m->fs->fs_ops->stat_ino(m->fs, ino, buf);
     }
 
     return m->fs->fs_ops->stat(m->fs, exppath, buf);
@@ -317,7 +521,21 @@ int vfs_mkdir(char *p, int mode)
     if (!m->fs->fs_ops->mkdir)
         return -ENOSYS;
 
-    return m->fs->fs_ops->mkdir(m->fs, p, mode);
+    char *name;
+    size_t len;
+    int parent, rc;
+
+    rc = __vfs_lookup_parent(m->fs, __mount_relpath(m, p), &parent, &name, &len);
+    if (rc > 0)
+        return -EEXIST;
+
+    rc = m->fs->fs_ops->mkdir(m->fs, p, mode);
+
+    /* the name exists now, drop any negative entry */
+    if (name && rc == 0)
+        dcache_invalidate(m->fs, parent, name, len);
+
+    return rc;
 }
 
 /*
@@ -327,6 +545,15 @@ int vfs_init(void)
 {
     printk("vfs: loading filesystems\n");
     fs_ops_n = 0;
+    spin_lock_init(&mount_lock);
+    spin_lock_init(&file_refc_lock);
+
+    file_cache = kmem_cache_create("file", sizeof(struct file), NULL);
+    if (!file_cache)
+        panic("vfs: unable to create the file cache\n");
+
+    bcache_init();
+    dcache_init();
 
     ext2_init();
     procfs_init();
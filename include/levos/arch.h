@@ -4,6 +4,7 @@
 #include <stdint.h>
 
 struct intr_frame;
+struct task;
 
 extern uint32_t *_bss_start;
 extern uint32_t *_bss_end;
@@ -26,6 +27,12 @@ struct console *arch_get_console(void);
 
 void arch_switch_timer_sched(void);
 
+/* lazy FPU switching, see arch/x86/init.c */
+void arch_fpu_init(char *);
+void arch_fpu_switch(struct task *);
+void arch_fpu_flush(struct task *);
+void arch_fpu_release(struct task *);
+
 void arch_spin_lock(volatile int *);
 void arch_spin_unlock(volatile int *);
 
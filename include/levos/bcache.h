@@ -0,0 +1,56 @@
+#ifndef __LEVOS_BCACHE_H
+#define __LEVOS_BCACHE_H
+
+#include <levos/types.h>
+#include <levos/list.h>
+#include <levos/hash.h>
+#include <levos/device.h>
+
+/* maximum number of buffers that are kept in memory */
+#define BCACHE_MAX_BUFFERS 512
+
+/* how many dirty buffers are written back at once, the disk merges
+ * neighbouring ones into larger transfers */
+#define BCACHE_SYNC_BATCH 64
+
+/* how often the kworker flushes dirty buffers (in ticks) */
+#define BCACHE_FLUSH_DELAY 500
+
+/*
+ * A buffer is a cached copy of one block of a block device, the block
+ * being @buf_size bytes large and starting at sector
+ * @buf_block * @buf_size / 512.
+ */
+struct buffer {
+    struct device *buf_dev;
+    uint32_t buf_block;
+    size_t buf_size;
+
+#define BUF_UPTODATE (1 << 0) /* the data matches the disk (or newer) */
+#define BUF_DIRTY    (1 << 1) /* the data needs to be written back */
+#define BUF_LOCKED   (1 << 2) /* being read in or written back */
+    int buf_flags;
+
+    /* number of users of this buffer, only unused ones can be evicted */
+    int buf_refc;
+
+    void *buf_data;
+
+    struct hash_elem buf_helem;
+    struct list_elem buf_lru_elem;
+};
+
+void bcache_init(void);
+void bcache_flusher_init(void);
+
+struct buffer *bcache_get(struct device *, uint32_t, size_t);
+void bcache_put(struct buffer *);
+void bcache_mark_dirty(struct buffer *);
+
+int bcache_read(struct device *, uint32_t, size_t, void *);
+int bcache_write(struct device *, uint32_t, size_t, void *);
+int bcache_read_blocks(struct device *, uint32_t, int, size_t, void *);
+
+int bcache_sync(struct device *);
+
+#endif /* __LEVOS_BCACHE_H */
@@ -0,0 +1,51 @@
+#ifndef __LEVOS_BIO_H
+#define __LEVOS_BIO_H
+
+#include <levos/types.h>
+#include <levos/list.h>
+
+struct device;
+struct task;
+
+/*
+ * A block I/O request, @bio_count sectors of @bio_dev starting at
+ * @bio_sector, to or from @bio_data. Unlike dev->read and dev->write it
+ * doesn't go through dev->pos, so any number of them can be in flight.
+ *
+ * The submitter owns the bio, it must stay around until bio_wait()
+ * returned. @bio_data is kernel memory, drivers may get to it from
+ * their interrupt handlers, in whatever address space is current.
+ */
+struct bio {
+    struct device *bio_dev;
+    uint32_t bio_sector;
+    size_t bio_count;
+    void *bio_data;
+
+#define BIO_READ  0
+#define BIO_WRITE 1
+    int bio_dir;
+
+#define BIO_QUEUED 0 /* waiting for the driver */
+#define BIO_ACTIVE 1 /* the device is working on it */
+#define BIO_DONE   2
+    int bio_state;
+    int bio_error;
+
+    /* sleeping in bio_wait() */
+    struct task *bio_waiter;
+
+    /* for the driver's request queue, and when it is to be served */
+    struct list_elem bio_elem;
+    uint32_t bio_deadline;
+};
+
+void bio_init(struct bio *, struct device *, int, uint32_t, void *, size_t);
+
+int submit_bio(struct bio *);
+int bio_wait(struct bio *);
+void bio_complete(struct bio *, int);
+
+int bio_rw(struct device *, int, uint32_t, void *, size_t);
+
+#endif /* __LEVOS_BIO_H */
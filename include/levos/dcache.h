@@ -0,0 +1,39 @@
+#ifndef __LEVOS_DCACHE_H
+#define __LEVOS_DCACHE_H
+
+#include <levos/types.h>
+#include <levos/list.h>
+#include <levos/hash.h>
+
+struct filesystem;
+
+/* maximum number of directory entries that are kept in memory */
+#define DCACHE_MAX_ENTRIES 512
+
+/* returned by dcache_lookup() when the name is not cached */
+#define DCACHE_MISS (-EAGAIN)
+
+/*
+ * A dentry remembers what name @d_name in directory @d_parent of
+ * filesystem @d_fs resolved to. A @d_ino of zero denotes a negative
+ * entry, i.e. the name is known not to exist.
+ */
+struct dentry {
+    struct filesystem *d_fs;
+    int d_parent;
+    int d_ino;
+
+    char *d_name;
+    size_t d_len;
+
+    struct hash_elem d_helem;
+    struct list_elem d_lru_elem;
+};
+
+void dcache_init(void);
+
+int dcache_lookup(struct filesystem *, int, char *, size_t);
+void dcache_insert(struct filesystem *, int, char *, size_t, int);
+void dcache_invalidate(struct filesystem *, int, char *, size_t);
+
+#endif /* __LEVOS_DCACHE_H */
@@ -5,6 +5,7 @@
 
 struct filesystem;
 struct tty_device;
+struct bio;
 
 struct device
 {
@@ -23,6 +24,9 @@ struct device
     size_t (*read)(struct device *, void *, size_t);
     size_t (*write)(struct device *, void *, size_t);
 
+    /* queue a request, the driver completes it with bio_complete() */
+    int (*submit)(struct device *, struct bio *);
+
     int (*tty_interrupt_output)(struct device *, struct tty_device *, int);
     int (*tty_signup_input)(struct device *, struct tty_device *);
 
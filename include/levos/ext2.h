@@ -3,9 +3,16 @@
 
 #include <levos/kernel.h>
 #include <levos/types.h>
+#include <levos/hash.h>
+#include <levos/list.h>
+#include <levos/spinlock.h>
 
 #define EXT2_SIGNATURE 0xEF53
 
+struct filesystem;
+struct stat;
+struct buffer;
+
 struct ext2_superblock {
     uint32_t inodes;
     uint32_t blocks;
@@ -87,6 +94,17 @@ struct ext2_dir {
     /* name here */
 } __attribute__((packed));
 
+/* the in-memory state of a block group, see fs/ext2/balloc.c */
+struct ext2_group_info {
+    /* the usage bitmaps, read in when first allocated from */
+    uint8_t *gi_block_bitmap;
+    uint8_t *gi_inode_bitmap;
+
+#define GI_BLOCK_DIRTY (1 << 0)
+#define GI_INODE_DIRTY (1 << 1)
+    int gi_flags;
+};
+
 struct ext2_priv_data {
     struct ext2_superblock sb;
     uint32_t first_bgd;
@@ -95,23 +113,110 @@ struct ext2_priv_data {
     uint32_t inodesize;
     uint32_t sectors_per_block;
     uint32_t inodes_per_block;
+
+    /*
+     * The allocation state lives in memory, and goes back to the buffer
+     * cache when the filesystem is synced. alloc_lock protects it, and
+     * the free counts in @sb.
+     */
+    spinlock_t alloc_lock;
+    struct ext2_block_group_desc *bgdt;
+    uint32_t bgdt_blocks;
+    struct ext2_group_info *groups;
+    int alloc_dirty; /* the descriptors and the superblock */
+
+    /* free blocks promised to delayed allocations */
+    uint32_t reserved_blocks;
+
+    /* where the last allocation ended, the next one looks from there */
+    uint32_t alloc_goal;
+
+    /*
+     * Adding an entry to a directory rewrites its blocks, only one of
+     * those runs at a time. dir_busy is held across the disk I/O, so
+     * the others wait for it by yielding.
+     */
+    spinlock_t dir_lock;
+    int dir_busy;
+};
+
+/* maximum number of inodes that are kept in memory */
+#define EXT2_ICACHE_MAX_INODES 256
+
+/*
+ * An in-memory copy of an on-disk inode, see fs/ext2/icache.c
+ */
+struct ext2_inode_info {
+    struct filesystem *ii_fs;
+    int ii_ino;
+
+#define II_DIRTY  (1 << 0) /* the inode needs to be written back */
+#define II_LOCKED (1 << 1) /* being read in, the inode isn't there yet */
+    int ii_flags;
+
+    /* number of users, only unused inodes can be evicted */
+    int ii_refc;
+
+    struct ext2_inode *ii_inode;
+
+    struct hash_elem ii_helem;
+    struct list_elem ii_lru_elem;
+
+    /*
+     * File blocks that were written but have no disk blocks yet, sorted,
+     * and how many blocks are reserved for them. See fs/ext2/delalloc.c
+     *
+     * They and the writes to the file are serialized by ii_busy, which
+     * is held across disk I/O, so the others wait for it by yielding.
+     */
+    spinlock_t ii_lock;
+    int ii_busy;
+    struct list ii_delayed;
+    int ii_nr_delayed;
+    uint32_t ii_reserved;
+};
+
+/* the data of a file block that is waiting to be allocated */
+struct ext2_delayed_block {
+    uint32_t db_lblock;
+    void *db_data;
+    struct list_elem db_elem;
+};
+
+/* the most data an inode keeps in delayed blocks before it is flushed */
+#define EXT2_DELALLOC_MAX (256 * 1024)
+
+/* a walk over the block map of an inode, see fs/ext2/bmap.c */
+struct ext2_bmap_ctx {
+    struct filesystem *bc_fs;
+    struct ext2_inode *bc_inode;
+
+    /* the last indirect block looked at on every level */
+    uint32_t bc_block[3];
+    struct buffer *bc_buf[3];
 };
 
 struct ext2_file_priv {
     int inode_no;
+    struct ext2_inode_info *ii;
 };
 
 struct filesystem *ext2_mount(struct device *);
 struct file *ext2_open(struct filesystem *, char *);
+struct file *ext2_open_inode(struct filesystem *, int, char *);
 int ext2_init();
 int ext2_write_superblock(struct filesystem *);
+int ext2_sync(struct filesystem *);
 
 
 #define EXT2_PRIV(fs) ((struct ext2_priv_data *)((fs)->priv_data))
 #define EXT2_FILE_PRIV(f) ((struct ext2_file_priv *)((f)->priv))
+#define EXT2_FILE_INODE(f) (EXT2_FILE_PRIV(f)->ii->ii_inode)
 
 /* file */
 extern int ext2_find_file_inode(struct filesystem *, char *);
+int ext2_lookup(struct filesystem *, int, char *);
+int ext2_stat_inode(struct filesystem *, int, struct stat *);
 
 /* directory */
 extern int ext2_read_directory(struct filesystem *, int, char *);
@@ -124,15 +229,53 @@ void dirent_free(void *);
 /* inode */
 extern int ext2_read_inode(struct filesystem *, struct ext2_inode *, int);
 extern int ext2_write_inode(struct filesystem *, struct ext2_inode *, int);
+int ext2_read_inode_disk(struct filesystem *, struct ext2_inode *, int);
+int ext2_write_inode_disk(struct filesystem *, struct ext2_inode *, int);
 extern int ext2_new_inode(struct filesystem *, struct ext2_inode *);
 int ext2_inode_add_block(struct filesystem *, int, int, struct ext2_inode *);
 int ext2_inode_read_or_create(struct filesystem *, int, struct ext2_inode *,
         int, void *);
+int ext2_inode_get_block(struct filesystem *, struct ext2_inode *, int);
+int set_block_number(struct filesystem *, struct ext2_inode *, int, int, int);
 //int ext2_inode_add_block(struct filesystem *, int, void *);
 
+/* inode cache */
+void ext2_icache_init(void);
+struct ext2_inode_info *ext2_iget(struct filesystem *, int);
+struct ext2_inode_info *ext2_igrab(struct ext2_inode_info *);
+void ext2_iput(struct ext2_inode_info *);
+void ext2_imark_dirty(struct ext2_inode_info *);
+int ext2_icache_sync(struct filesystem *);
+int ext2_icache_flush(struct filesystem *);
+
+/* block mapping */
+void ext2_bmap_init(struct ext2_bmap_ctx *, struct filesystem *,
+                    struct ext2_inode *);
+void ext2_bmap_done(struct ext2_bmap_ctx *);
+int ext2_bmap(struct ext2_bmap_ctx *, uint32_t, uint32_t, uint32_t *);
+
 /* block */
 extern int ext2_read_block(struct filesystem *, void *, uint32_t);
 extern int ext2_write_block(struct filesystem *, void *, uint32_t);
 extern int ext2_alloc_block(struct filesystem *);
 
+/* allocation */
+int ext2_balloc_init(struct filesystem *);
+int ext2_alloc_blocks(struct filesystem *, uint32_t, uint32_t, uint32_t *);
+int ext2_reserve_blocks(struct filesystem *, uint32_t);
+void ext2_release_blocks(struct filesystem *, uint32_t);
+void ext2_free_blocks(struct filesystem *, uint32_t, uint32_t);
+int ext2_alloc_inode(struct filesystem *);
+void ext2_group_add_dir(struct filesystem *, int);
+int ext2_alloc_sync(struct filesystem *);
+
+/* delayed allocation */
+void ext2_delalloc_init(struct ext2_inode_info *);
+void ext2_inode_lock(struct ext2_inode_info *);
+void ext2_inode_unlock(struct ext2_inode_info *);
+int ext2_delalloc_write(struct ext2_inode_info *, uint32_t, uint32_t,
+                        const void *, uint32_t);
+int ext2_delalloc_flush(struct ext2_inode_info *);
+void ext2_delalloc_drop(struct ext2_inode_info *);
+
 #endif
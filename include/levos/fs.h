@@ -10,6 +10,7 @@ struct filesystem;
 /* a mount is a filesystem (@fs) mounted on device @dev at point @point */
 struct mount {
     char *point;
+    size_t point_len;
     struct filesystem *fs;
     struct device *dev;
 };
@@ -72,6 +73,8 @@ struct file {
     int length;
     int type;
     int refc;
+    /* inode number on @fs, zero if the file can't be page cached */
+    uint32_t ino;
     char *full_path;
     char *respath;
     void *priv;
@@ -96,6 +99,15 @@ struct fs_ops {
     struct file *(*create)(struct filesystem *, char *);
     int (*mkdir)(struct filesystem *, char *, int);
     struct filesystem *(*mount)(struct device *);
+    int (*sync)(struct filesystem *);
+
+    /*
+     * optional, filesystems that resolve names by inode number let
+     * the VFS walk paths through the dentry cache
+     */
+    int (*lookup)(struct filesystem *, int, char *);
+    struct file *(*open_ino)(struct filesystem *, int, char *);
+    int (*stat_ino)(struct filesystem *, int, struct stat *);
 };
 
 /* a filesystem */
@@ -103,8 +115,16 @@ struct filesystem {
     void *priv_data;
     struct device *dev;
     struct fs_ops *fs_ops;
+    /* inode of the root directory, used with fs_ops->lookup */
+    int root_ino;
+    /* paging in file backed mappings, both in pages, see mm/vma.c */
+    int fs_ra_pages;     /* the largest read-ahead window, 0 disables it */
+    int fs_fault_around; /* cached pages mapped along with a fault */
 };
 
+#define FS_RA_PAGES_DEFAULT     32
+#define FS_FAULT_AROUND_DEFAULT 16
+
 #define SEEK_SET 0
 #define SEEK_CUR 1
 #define SEEK_END 2
@@ -116,12 +136,17 @@ struct filesystem {
 void file_seek(struct file *, int);
 int vfs_init(void);
 int vfs_mount(char *, struct device *);
+int vfs_set_readahead(char *, int, int);
 int register_fs(struct fs_ops *fs);
 struct file *vfs_open(char *);
 int vfs_stat(char *, struct stat *);
 struct file *dup_file(struct file *);
+struct file *file_alloc(void);
+void file_free(struct file *);
 struct file *vfs_create(char *);
 void vfs_close(struct file *);
+void vfs_inc_refc(struct file *);
+int vfs_sync(void);
 
 /* path manipulation stuff */
 inline char *
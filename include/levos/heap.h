@@ -16,6 +16,10 @@ void *na_malloc(size_t, size_t);
 /* custom aligned free */
 void na_free(size_t, void *);
 
+/* whole pages of the heap area */
+void *heap_get_pages(size_t);
+void heap_free_pages(void *, size_t);
+
 void heap_init(void);
 
 #endif /* __LEVOS_HEAP_H */
@@ -2,5 +2,6 @@
 #define __LEVOS_LIMITS_H
 
 #define PATH_MAX 4096
+#define NAME_MAX 255
 
 #endif /* __LEVOS_LIMITS_H */
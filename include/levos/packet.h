@@ -109,6 +109,7 @@ void packet_processor_thread();
 packet_t *packet_allocate(void);
 int packet_grow(packet_t *, int);
 void packet_destroy(packet_t *);
+void packet_init(void);
 void packet_push_queue(struct net_info *, void *, size_t);
 
 struct work *
@@ -20,6 +20,7 @@ typedef pde_t       *pagedir_t;
 #define PTE_ZERO_MASK       (~(1 << PTE_ZERO_SHIFT))
 #define PTE_GLOB_SHIFT      8
 #define PTE_COW_SHIFT       9
+#define PTE_UNMAP_SHIFT     10 /* being unmapped, see unmap_user_pages() */
 #define PTE_AVAIL_MASK      (~((1 << 9) | (1 << 10) | (1 << 11)))
 #define PTE_ADDR_SHIFT      12
 
@@ -46,35 +47,94 @@ typedef pde_t       *pagedir_t;
 #define PG_RND_DOWN(a) ROUND_DOWN(a, 0x1000)
 #define PG_RND_UP(a) ROUND_UP(a, 0x1000)
 
+/* the frame table of palloc, 16 bytes for every 4K of RAM */
+#define PALLOC_TABLE_BASE 0xF0000000
+
+/* the last 4MB of the address space hold the temporary kmap slots */
+#define KMAP_TEMP_BASE  0xFFC00000
+#define KMAP_TEMP_SLOTS 1024
+
 void paging_init(void);
 int map_page(pagedir_t, uint32_t, uint32_t, int);
 int map_page_curr(uint32_t, uint32_t, int);
 int map_page_kernel(uint32_t, uint32_t, int);
 pagedir_t new_page_directory(void);
 pagedir_t copy_page_dir(pagedir_t);
+pagedir_t copy_page_dir_fork(pagedir_t);
 void replace_page(pagedir_t, uint32_t, pde_t);
 
 void handle_pagefault(struct pt_regs *);
 
 
 page_t *get_page_from_curr(uint32_t);
+page_t *get_page_from_pgd(pagedir_t, uint32_t);
+page_t create_pte(uint32_t, int, int);
 
 void pte_mark_read_only(page_t *);
 void pte_mark_writeable(page_t *);
 int pte_present(page_t);
 int pte_writeable(page_t);
 void mark_all_user_pages_cow(pagedir_t);
+void unmap_user_pages(pagedir_t, uint32_t, uint32_t);
 
 void pte_mark_cow(page_t *);
+void pte_unmark_cow(page_t *);
 void pde_mark_writeable(pde_t *);
 
 int page_mapped(pagedir_t, uint32_t);
 int page_mapped_curr(uint32_t);
 
+/* demand-zero pages, see mm/zero.c */
+extern uintptr_t zero_page_phys;
+void zero_init(void);
+void map_zero_page_curr(uint32_t, int);
+
 
 extern pde_t kernel_pgd[1024] __page_align;
 void __flush_tlb(void);
 
+static inline void __flush_tlb_page(uint32_t vaddr)
+{
+    asm volatile("invlpg (%0)"::"r"(vaddr):"memory");
+}
+
+/*
+ * TLB maintenance after changing the page tables of a directory, see
+ * mm/tlb.c. User addresses only need it while the directory is loaded.
+ */
+void tlb_flush_local(uint32_t, uint32_t);
+void tlb_flush_page(pagedir_t, uint32_t);
+void tlb_flush_range(pagedir_t, uint32_t, uint32_t);
+void tlb_flush_mm(pagedir_t);
+
+/* collects the pages a bulk operation touched, to flush them in one go */
+struct tlb_batch {
+    pagedir_t tb_pgd;
+    uint32_t tb_start;
+    uint32_t tb_end;
+};
+
+static inline void
+tlb_batch_init(struct tlb_batch *tb, pagedir_t pgd)
+{
+    tb->tb_pgd = pgd;
+    tb->tb_start = 0xFFFFFFFF;
+    tb->tb_end = 0;
+}
+
+static inline void
+tlb_batch_add(struct tlb_batch *tb, uint32_t vaddr)
+{
+    vaddr = PG_RND_DOWN(vaddr);
+
+    if (vaddr < tb->tb_start)
+        tb->tb_start = vaddr;
+    if (vaddr + 4096 > tb->tb_end)
+        tb->tb_end = vaddr + 4096;
+}
+
+void tlb_batch_flush(struct tlb_batch *);
+
 inline void activate_pgd(pagedir_t pgd)
 {
     asm volatile("mov %0, %%cr3"::"r"((int)pgd - (int)VIRT_BASE));
@@ -108,6 +168,9 @@ void virt_kmap_init(void);
 void *kmap_get_free_address(void);
 void *kmap_get_page(void);
 void *kmap_map_page(uint32_t);
+void *kmap_temp(uint32_t);
+void kunmap_temp(void *);
+uint32_t kvirt_to_phys(void *);
 
 
 #endif /* __LEVOS_PAGE_H */
@@ -0,0 +1,39 @@
+#ifndef __LEVOS_PAGECACHE_H
+#define __LEVOS_PAGECACHE_H
+
+#include <levos/types.h>
+#include <levos/list.h>
+#include <levos/hash.h>
+
+struct file;
+struct filesystem;
+
+/*
+ * A cached_page is one page worth of a file's contents, starting at the
+ * page aligned @cp_offset, held in the physical frame @cp_phys.
+ */
+struct cached_page {
+    struct filesystem *cp_fs;
+    uint32_t cp_ino;
+    uint32_t cp_offset;
+
+    uintptr_t cp_phys;
+
+#define CP_LOCKED (1 << 0) /* being read in, @cp_phys is not there yet */
+#define CP_STALE  (1 << 1) /* invalidated while it was being read in */
+    int cp_flags;
+
+    struct hash_elem cp_helem;
+    struct list_elem cp_list_elem;
+};
+
+void pagecache_init(void);
+
+int pagecache_cacheable(struct file *);
+int pagecache_get(struct file *, uint32_t, uintptr_t *);
+uintptr_t pagecache_lookup(struct file *, uint32_t);
+void pagecache_readahead(struct file *, uint32_t, int);
+void pagecache_invalidate(struct file *, uint32_t, uint32_t);
+int pagecache_shrink(int);
+
+#endif /* __LEVOS_PAGECACHE_H */
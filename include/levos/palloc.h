@@ -1,11 +1,49 @@
 #ifndef __LEVOS_PALLOC_H
 #define __LEVOS_PALLOC_H
 
+#include <levos/types.h>
+#include <levos/list.h>
+
+/* the largest block the buddy allocator manages is 2^10 frames (4 MB) */
+#define PALLOC_MAX_ORDER 10
+
+/*
+ * Every physical frame has one of these once palloc_reinit() ran.
+ *
+ * @pg_refc counts the users of the frame: the one who allocated it, each
+ * user PTE that maps it and the page cache. The frame is given back when
+ * it drops to zero. Frames that were handed out before the table existed
+ * have a count of zero and are never freed.
+ */
+struct page {
+    int pg_refc;
+
+#define PG_BUDDY (1 << 0) /* heads a free block of order @pg_order */
+    uint16_t pg_flags;
+    uint16_t pg_order;
+
+    /* links free blocks of the same order */
+    struct list_elem pg_elem;
+};
+
 void palloc_init(void);
+void palloc_reinit(void);
 
 uintptr_t palloc_get_page(void);
 uintptr_t palloc_get_pages(int num);
+uintptr_t palloc_try_get_page(void);
+uintptr_t palloc_try_get_pages(int num);
+uintptr_t palloc_get_zeroed_page(void);
+void palloc_free_page(void *);
+void palloc_free_pages(void *, int);
 
 void palloc_mark_address(uintptr_t);
 
+struct page *phys_to_page(uintptr_t);
+void palloc_ref_page(uintptr_t);
+void palloc_unref_page(uintptr_t);
+int palloc_page_refc(uintptr_t);
+
+int palloc_get_total(void);
+
 #endif /* __LEVOS_PALLOC_H */
@@ -0,0 +1,52 @@
+#ifndef __LEVOS_RBTREE_H
+#define __LEVOS_RBTREE_H
+
+#include <levos/kernel.h>
+#include <stdint.h>
+
+/*
+ * Red-black tree, see lib/rbtree.c
+ *
+ * Like with lists, the nodes are embedded in the structures that are kept
+ * in the tree and rb_entry() gets back to them. The tree doesn't compare
+ * anything itself, the caller walks down from the root to find where a
+ * new node goes and hands the spot to rb_insert().
+ *
+ * A tree can carry data about whole subtrees in its nodes, e.g. the
+ * largest value below a node. The augment callback recomputes that of a
+ * node from its own and its children's, the tree calls it whenever the
+ * children of a node change.
+ */
+
+#define RB_RED   0
+#define RB_BLACK 1
+
+struct rb_node {
+    struct rb_node *rb_parent;
+    struct rb_node *rb_left;
+    struct rb_node *rb_right;
+    int rb_color;
+};
+
+typedef void rb_augment_func(struct rb_node *);
+
+struct rb_tree {
+    struct rb_node *rb_root;
+    rb_augment_func *rb_augment;
+};
+
+#define rb_entry(RB_NODE, STRUCT, MEMBER)                   \
+        ((STRUCT *) ((uint8_t *) (RB_NODE)                  \
+                     - offsetof (STRUCT, MEMBER)))
+
+void rb_init(struct rb_tree *, rb_augment_func *);
+void rb_insert(struct rb_tree *, struct rb_node *, struct rb_node **,
+               struct rb_node *);
+void rb_remove(struct rb_tree *, struct rb_node *);
+void rb_augment_path(struct rb_tree *, struct rb_node *);
+
+struct rb_node *rb_first(struct rb_tree *);
+struct rb_node *rb_next(struct rb_node *);
+struct rb_node *rb_prev(struct rb_node *);
+
+#endif /* __LEVOS_RBTREE_H */
@@ -0,0 +1,51 @@
+#ifndef __LEVOS_SEQLOCK_H
+#define __LEVOS_SEQLOCK_H
+
+#include <levos/compiler.h>
+#include <stdint.h>
+
+/*
+ * Sequence counters, for data that is read much more often than it is
+ * written and whose readers can't take a lock, like the clock in the
+ * vsyscall page. The count is odd while the writer is changing the data,
+ * readers retry when it was odd or has changed under them.
+ *
+ * x86 keeps stores in order, and loads too, so compiler barriers are
+ * enough. There is no lock in here, the caller serializes the writers.
+ */
+typedef volatile uint32_t seqcount_t;
+
+static inline void
+write_seqcount_begin(seqcount_t *s)
+{
+    (*s) ++;
+    barrier();
+}
+
+static inline void
+write_seqcount_end(seqcount_t *s)
+{
+    barrier();
+    (*s) ++;
+}
+
+static inline uint32_t
+read_seqcount_begin(seqcount_t *s)
+{
+    uint32_t seq;
+
+    while ((seq = *s) & 1)
+        asm volatile("pause");
+
+    barrier();
+    return seq;
+}
+
+static inline int
+read_seqcount_retry(seqcount_t *s, uint32_t seq)
+{
+    barrier();
+    return *s != seq;
+}
+
+#endif /* __LEVOS_SEQLOCK_H */
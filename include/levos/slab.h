@@ -0,0 +1,62 @@
+#ifndef __LEVOS_SLAB_H
+#define __LEVOS_SLAB_H
+
+#include <levos/types.h>
+#include <levos/list.h>
+#include <levos/spinlock.h>
+
+/* how many completely free slabs a cache keeps around */
+#define KMEM_CACHE_MAX_EMPTY 2
+
+/*
+ * A slab is one page of the heap area, this header sits at the start of
+ * it and the objects follow. Free objects are chained through their
+ * first word, or through a word past the object if the cache has a
+ * constructor.
+ */
+struct kmem_slab {
+    struct kmem_cache *slab_cache;
+    void *slab_free;
+    int slab_inuse;
+    struct list_elem slab_elem;
+};
+
+/*
+ * A cache hands out objects of one fixed size. Slabs move between the
+ * partial, full and empty lists as objects are allocated and freed.
+ */
+struct kmem_cache {
+    const char *kc_name;
+    size_t kc_objsize;  /* as requested */
+    size_t kc_size;     /* rounded up for alignment */
+    size_t kc_free_off; /* of the free chain link in an object */
+    int kc_per_slab;
+
+    /*
+     * called once on every object when its slab is created, the object
+     * is handed back to kmem_cache_free() in its constructed state
+     */
+    void (*kc_ctor)(void *);
+
+    spinlock_t kc_lock;
+    struct list kc_partial;
+    struct list kc_full;
+    struct list kc_empty;
+    int kc_nr_empty;
+
+    /* statistics, see /proc/slabinfo */
+    int kc_nr_slabs;
+    int kc_nr_active;
+    unsigned int kc_nr_allocs;
+
+    struct list_elem kc_elem;
+};
+
+void kmem_cache_init(void);
+
+struct kmem_cache *kmem_cache_create(const char *, size_t, void (*)(void *));
+void *kmem_cache_alloc(struct kmem_cache *);
+void *kmem_cache_zalloc(struct kmem_cache *);
+void kmem_cache_free(struct kmem_cache *, void *);
+
+#endif /* __LEVOS_SLAB_H */
@@ -0,0 +1,86 @@
+#ifndef __LEVOS_SMP_H
+#define __LEVOS_SMP_H
+
+#include <levos/types.h>
+#include <levos/arch.h>
+#include <levos/list.h>
+#include <levos/spinlock.h>
+
+/*
+ * The most processors there is room for. Only the boot processor is
+ * running for now, nothing brings up the others yet.
+ */
+#define MAX_CPUS 8
+
+struct task;
+
+/*
+ * Scheduling priorities, 0 is the highest. A nice value of n maps to
+ * priority n + 20.
+ */
+#define SCHED_NR_PRIO 40
+#define NICE_MIN      (-20)
+#define NICE_MAX      19
+#define NICE_TO_PRIO(n) ((n) + 20)
+
+#define SCHED_BITMAP_WORDS ((SCHED_NR_PRIO + 31) / 32)
+
+/*
+ * A queue of runnable tasks for every priority, and a bitmap of the
+ * queues that are not empty so the next task is found in O(1).
+ */
+struct prio_array {
+    int pa_nr_active;
+    uint32_t pa_bitmap[SCHED_BITMAP_WORDS];
+    struct list pa_queue[SCHED_NR_PRIO];
+};
+
+/*
+ * Everything the scheduler keeps per processor. A task is placed on the
+ * run queue of one CPU when it is created and only ever runs there.
+ *
+ * Tasks that wake up go to the active array, a task that was running
+ * goes to the expired one. Once the active array runs dry the two are
+ * swapped, so every runnable task gets its turn. Sleeping and blocked
+ * tasks are on neither, a sleeper is woken up by its sleep timer.
+ */
+struct cpu {
+    int cpu_id;         /* index into cpus[] */
+    volatile int cpu_online;
+
+    struct task *cpu_current;
+    struct task *cpu_idle;
+
+    int cpu_preempt_enabled;
+
+    /* whose FPU state is in the registers, see arch_fpu_switch() */
+    struct task *cpu_fpu_owner;
+
+    /* tasks that run on this CPU, linked through task->rq_elem */
+    spinlock_t cpu_rq_lock;
+    struct prio_array cpu_arrays[2];
+    struct prio_array *cpu_active;
+    struct prio_array *cpu_expired;
+    int cpu_nr_running; /* queued in either array */
+};
+
+extern struct cpu cpus[MAX_CPUS];
+extern int nr_cpus;
+
+static inline int
+cpu_id(void)
+{
+    return arch_cpu_id();
+}
+
+static inline struct cpu *
+this_cpu(void)
+{
+    return &cpus[arch_cpu_id()];
+}
+
+#define for_each_online_cpu(cpu) \
+    for ((cpu) = &cpus[0]; (cpu) < &cpus[nr_cpus]; (cpu) ++) \
+        if ((cpu)->cpu_online)
+
+#endif /* __LEVOS_SMP_H */
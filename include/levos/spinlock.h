@@ -1,6 +1,7 @@
 #ifndef __LEVOS_SPINLOCK_H
 #define __LEVOS_SPINLOCK_H
 
+#include <stdint.h>
 #include <levos/compiler.h>
 
 struct task;
@@ -15,5 +16,10 @@ typedef struct __spinlock_t spinlock_t;
 void spin_lock_init(spinlock_t *);
 void spin_lock(spinlock_t *);
 void spin_unlock(spinlock_t *);
+int spin_lock_would_deadlock(spinlock_t *);
+
+/* for locks that are also taken from interrupt handlers */
+uint32_t spin_lock_irqsave(spinlock_t *);
+void spin_unlock_irqrestore(spinlock_t *, uint32_t);
 
 #endif /* __LEVOS_SPINLOCK_H */
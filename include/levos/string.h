@@ -5,6 +5,25 @@
 
 void *memset(void *, int, size_t);
 void *memcpy(void *, const void *, size_t);
+void *memmove(void *, const void *, size_t);
+
+/* whole pages, both addresses page aligned */
+void copy_page(void *, const void *);
+void clear_page(void *);
+
+/* the routines for large copies, see string_init() */
+struct string_ops {
+    char *so_name;
+    void *(*so_memcpy)(void *, const void *, size_t);
+    void *(*so_memset)(void *, int, size_t);
+    void (*so_copy_page)(void *, const void *);
+    void (*so_clear_page)(void *);
+};
+
+extern struct string_ops *string_ops;
+
+void string_init(void);
+void string_bench(void);
 
 int strcmp (const char *, const char *);
 char *strdup(char *);
@@ -12,5 +31,6 @@ size_t strlen(const char *);
 size_t strncmp(char *, char *, size_t);
 char *strtok_r(char *, const char *, char **);
 void itoa(unsigned, unsigned, char *);
+int atoi_10(char *);
 
 #endif /* __LEVOS_STRING_H */
@@ -10,6 +10,8 @@
 #include <levos/list.h>
 #include <levos/vma.h>
 #include <levos/spinlock.h>
+#include <levos/smp.h>
+#include <levos/timer.h>
 
 
 #define WAIT_CODE(info, code) ((int)((uint16_t)(((info) << 8 | (code)))))
@@ -98,6 +100,11 @@ struct task
     int state;
 
 #define FD_MAX 32
+    /*
+     * Only the task itself changes its file table, or fork(2) before the
+     * child runs, so it needs no lock. The files in it are shared, their
+     * reference counts are changed under a lock in the VFS.
+     */
     struct file *file_table[FD_MAX];
 
     /* FIXME: get rid of this and use 'struct fd' */
@@ -120,6 +127,8 @@ struct task
 
     spinlock_t vm_lock;
     struct list vma_list;
+    struct rb_tree vma_tree;
+    struct vm_area *vma_last;   /* the last VMA vma_find() found */
 
     /* controlling terminal of this task */
     struct tty_device *ctty;
@@ -143,12 +152,20 @@ struct task
 
     struct list_elem all_elem;
 
+    /* the CPU this task runs on, and its place in that run queue */
+    int cpu;
+    int nice;
+    int prio;
+    struct prio_array *rq_array; /* NULL if not queued */
+    struct list_elem rq_elem;
+
     uint32_t *irq_stack_top;
     uint32_t *irq_stack_bot;
 
     struct pt_regs *new_stack;
 
-    uint32_t wake_time;
+    /* wakes the task up from task_sleep() */
+    struct timer sleep_timer;
 
     pagedir_t mm;
 
@@ -173,6 +190,7 @@ int task_do_wait(struct task *, struct process *);
 void task_exit(struct task *t);
 void task_unblock(struct task *t);
 void task_block(struct task *t);
+void task_block_noresched(struct task *t);
 
 struct task *create_user_task_fork(void (*)(void));
 struct task *create_kernel_task(void (*)(void));
@@ -191,12 +209,20 @@ struct process *sched_get_child(struct task *, pid_t);
 void preempt_enable(void);
 void preempt_disable(void);
 
+void sched_set_nice(struct task *, int);
+
 void task_sleep(struct task *, uint32_t);
 void task_kick(struct task *);
 void sleep(uint32_t);
 
 void setup_filetable(struct task *);
 
-extern struct task *current_task;
+void wait_init(void);
+
+/* the task running on this CPU */
+#define current_task (this_cpu()->cpu_current)
+
+int sched_init_cpu(struct cpu *);
+void __noreturn sched_idle_loop(void);
 
 #endif /* __LEVOS_TASK_H */
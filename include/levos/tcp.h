@@ -129,5 +129,6 @@ bool tcp_less_tcp_info(const struct hash_elem *,
 unsigned tcp_hash_tcp_info(const struct hash_elem *, void *);
 
 int tcp_handle_packet(struct net_info *, packet_t *, struct tcp_header *);
+void tcp_init(void);
 
 #endif /* __LEVOS_TCP_H */
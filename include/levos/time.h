@@ -17,5 +17,6 @@ struct timesource {
 int time_init();
 int rtc_init();
 int gettimeofday(struct timeval *, void *);
+void time_tick(void);
 
 #endif
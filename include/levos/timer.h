@@ -0,0 +1,47 @@
+#ifndef __LEVOS_TIMER_H
+#define __LEVOS_TIMER_H
+
+#include <levos/types.h>
+#include <levos/list.h>
+
+/* the rate at which timer_tick() is called, the PIT frequency */
+#define HZ 200
+
+#define TIMER_FLAG_PENDING (1 << 0)
+
+/*
+ * A one-shot callback run from the timer interrupt once the tick count
+ * reaches timer_expires. The callback runs with interrupts disabled and
+ * must not sleep, it usually just wakes somebody up.
+ */
+struct timer {
+    void (*timer_func)(void *);
+    void *timer_aux;
+
+    uint32_t timer_expires;
+
+    int timer_flags;
+
+    struct list_elem elem;
+};
+
+void timer_init(void);
+void timer_setup(struct timer *, void (*)(void *), void *);
+
+/* arming takes an absolute tick count */
+void timer_add(struct timer *, uint32_t);
+
+/* disarming, returns 1 if the timer was pending */
+int timer_del(struct timer *);
+int timer_del_sync(struct timer *);
+
+uint32_t timer_ticks(void);
+void timer_tick(void);
+
+static inline int
+timer_pending(struct timer *timer)
+{
+    return timer->timer_flags & TIMER_FLAG_PENDING;
+}
+
+#endif /* __LEVOS_TIMER_H */
@@ -0,0 +1,96 @@
+#ifndef __LEVOS_UACCESS_H
+#define __LEVOS_UACCESS_H
+
+#include <levos/types.h>
+#include <levos/kernel.h>
+#include <levos/errno.h>
+
+/*
+ * Copying from and to user memory without checking the page tables
+ * first, see arch/x86/usercopy.S. A bad pointer makes the copy fail
+ * instead of faulting the kernel.
+ */
+
+/* the part of the address space that user pointers may point into */
+static inline int
+access_ok(const void *p, size_t n)
+{
+    uint32_t start = (uint32_t) p;
+
+    return start >= 4096 && start + n >= start && start + n <= VIRT_BASE;
+}
+
+size_t __copy_user(void *, const void *, size_t);
+long __strncpy_from_user(char *, const char *, long);
+long __strnlen_user(const char *, long);
+
+/* copy_from_user - returns the number of bytes that could not be copied */
+static inline size_t
+copy_from_user(void *dst, const void *src, size_t n)
+{
+    if (!access_ok(src, n))
+        return n;
+
+    return __copy_user(dst, src, n);
+}
+
+/* copy_to_user - returns the number of bytes that could not be copied */
+static inline size_t
+copy_to_user(void *dst, const void *src, size_t n)
+{
+    if (!access_ok(dst, n))
+        return n;
+
+    return __copy_user(dst, src, n);
+}
+
+/* never look past the end of user memory for the terminating NUL */
+static inline long
+__user_str_limit(const char *src, long n)
+{
+    if ((uint32_t) src < 4096 || (uint32_t) src >= VIRT_BASE)
+        return -EFAULT;
+
+    if (n > VIRT_BASE - (uint32_t) src)
+        n = VIRT_BASE - (uint32_t) src;
+
+    return n;
+}
+
+/*
+ * strncpy_from_user - copy the string at @src, but at most @n bytes,
+ *                     returns its length, @n if it didn't fit or -EFAULT
+ */
+static inline long
+strncpy_from_user(char *dst, const char *src, long n)
+{
+    n = __user_str_limit(src, n);
+    if (n < 0)
+        return n;
+
+    return __strncpy_from_user(dst, src, n);
+}
+
+/*
+ * strnlen_user - the length of the string at @src, @n if it is longer
+ *                than that or -EFAULT
+ */
+static inline long
+strnlen_user(const char *src, long n)
+{
+    n = __user_str_limit(src, n);
+    if (n < 0)
+        return n;
+
+    return __strnlen_user(src, n);
+}
+
+/* kernel/extable.c */
+struct exception_table_entry {
+    uint32_t insn;
+    uint32_t fixup;
+};
+
+uint32_t search_exception_table(uint32_t);
+
+#endif /* __LEVOS_UACCESS_H */
@@ -5,6 +5,7 @@
 #include <levos/types.h>
 #include <levos/kernel.h>
 #include <levos/list.h>
+#include <levos/rbtree.h>
 
 /* sys/mman.h */
 #define PROT_EXEC (1 << 0)
@@ -19,6 +20,10 @@
 #define MAP_ANONYMOUS MAP_ANON
 
 #define MAP_FAILED ((void *)-1)
+
+#define MADV_NORMAL   0
+#define MADV_WILLNEED 3
+#define MADV_DONTNEED 4
 /* * */
 
 #define VMA_ANONYMOUS (1 << 0) /* this is an ANONYMOUS VMA, swap backing */
@@ -49,7 +54,34 @@ struct vm_area {
 
     int vma_flags;
 
+    /* the last read-ahead window of a file backed VMA, see vma_load() */
+    uint32_t vma_ra_start;  /* file offset */
+    int vma_ra_size;        /* in pages, 0 until faults look sequential */
+
     struct list_elem vma_list_elem;
+
+    /* the per task tree of VMAs, see mm/vma.c */
+    struct rb_node vma_rb;
+    uint32_t vma_gap;       /* free space between this and the VMA below */
+    uint32_t vma_max_gap;   /* the largest vma_gap in this subtree */
 };
 
+struct task;
+
+void vma_cache_init(void);
+
+/* @write is set when the faulting access was a write */
+int vma_load(struct vm_area *, uint32_t, int);
+int vma_handle_pagefault(struct task *, uint32_t, int);
+struct vm_area *vma_find(struct task *, uint32_t);
+struct vm_area *vm_area_create_insert(uint32_t, uint32_t, uint32_t,
+                                      struct task *, int);
+
+void mapping_map_cached(uintptr_t, void *, int);
+
+void *do_mmap(void *, size_t, int, int, struct file *, size_t);
+int do_munmap(void *, size_t);
+int do_mprotect(void *, size_t, int);
+int do_madvise(void *, size_t, int);
+
 #endif /* __LEVOS_VMA_H */
@@ -0,0 +1,55 @@
+#ifndef __LEVOS_VSYSCALL_H
+#define __LEVOS_VSYSCALL_H
+
+#include <stdint.h>
+#include <levos/seqlock.h>
+
+/*
+ * The vsyscall pages, see arch/x86/vsyscall.c
+ *
+ * Every process has them mapped read-only at VSYSCALL_BASE, just below
+ * the stack. Calling VSYSCALL_BASE with the registers set up like for
+ * int $0x80 makes the system call whichever way is the fastest on this
+ * CPU, all registers but %eax are preserved.
+ *
+ * Some calls don't need the kernel at all, they have entry points of
+ * their own that are called like the C functions, with the arguments on
+ * the stack. They read what they need from the data pages, which the
+ * kernel keeps up to date.
+ */
+#define VSYSCALL_BASE  0xBFC00000
+#define VSYSCALL_PAGES 3
+
+#define VSYSCALL_GETPID       (VSYSCALL_BASE + 0x40)
+#define VSYSCALL_GETTIMEOFDAY (VSYSCALL_BASE + 0x80)
+
+/* shared by everyone, sysenter.S knows the layout */
+#define VSYSCALL_DATA  (VSYSCALL_BASE + 0x1000)
+
+struct vsyscall_data {
+    seqcount_t vd_seq;
+    uint32_t vd_tsc_mult;   /* usecs per TSC cycle << 32, 0 without TSC */
+    uint64_t vd_sec;        /* the wall time at the last timer tick */
+    uint32_t vd_usec;
+    uint32_t vd_tick_usec;  /* the length of a tick */
+    uint64_t vd_tsc;        /* the TSC at the last timer tick */
+};
+
+/* one for every process */
+#define VSYSCALL_TASK  (VSYSCALL_BASE + 0x2000)
+
+struct vsyscall_task {
+    int vt_pid;
+};
+
+struct task;
+
+extern int x86_sysenter;
+extern struct vsyscall_data *vsyscall_data;
+
+void vsyscall_init(void);
+void vsyscall_cpu_init(void);
+int vsyscall_map(struct task *);
+int vsyscall_fork(struct task *);
+
+#endif /* __LEVOS_VSYSCALL_H */
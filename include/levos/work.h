@@ -3,9 +3,11 @@
 
 #include <levos/types.h>
 #include <levos/list.h>
+#include <levos/timer.h>
 
 #define WORK_FLAG_CANCELLED (1 << 0)
-#define WORK_FLAG_QUEUED    (1 << 1)
+#define WORK_FLAG_QUEUED    (1 << 1) /* armed or waiting for the worker */
+#define WORK_FLAG_READY     (1 << 2) /* waiting for the worker */
 
 struct work {
     void (*work_func)(void *);
@@ -15,6 +17,9 @@ struct work {
 
     int work_flags;
 
+    /* fires at work_at and hands the work to the worker */
+    struct timer work_timer;
+
     struct list_elem elem;
 };
 
@@ -35,5 +40,6 @@ int work_cancel_current(void);
 
 /* creating work */
 struct work *work_create(void (*)(void *), void *);
+void work_destroy(struct work *);
 
 #endif /* __LEVOS_WORK_H */
@@ -42,8 +42,94 @@ uint32_t inportl(uint16_t portid);
 void pic_init(void);
 void pic_eoi(int);
 void pit_init(void);
+void enable_pge(void);
 
 #define ENABLE_IRQ() asm volatile("sti")
 #define DISABLE_IRQ() asm volatile("cli")
 
+#define X86_EFLAGS_IF (1 << 9)
+
+#define X86_CR0_TS         (1 << 3)
+#define X86_CR4_PGE        (1 << 7)
+#define X86_CPUID_EDX_TSC  (1 << 4)
+#define X86_CPUID_EDX_SEP  (1 << 11)
+#define X86_CPUID_EDX_PGE  (1 << 13)
+#define X86_CPUID_EDX_SSE2 (1 << 26)
+
+/*
+ * arch_fpu_usable - are the FPU registers the current task's, so that
+ *                   using them doesn't trap, see arch_fpu_switch()
+ */
+static inline int
+arch_fpu_usable(void)
+{
+    uint32_t cr0;
+
+    asm volatile("mov %%cr0, %0":"=r"(cr0));
+    return !(cr0 & X86_CR0_TS);
+}
+
+/* arch_cpuid_edx - the feature flags of CPUID leaf 1 that are in EDX */
+static inline uint32_t
+arch_cpuid_edx(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+
+    asm volatile("cpuid":"=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx):"a"(1));
+    return edx;
+}
+
+static inline uint64_t
+arch_rdtsc(void)
+{
+    uint64_t ret;
+
+    asm volatile("rdtsc":"=A"(ret));
+    return ret;
+}
+
+#define X86_MSR_SYSENTER_CS  0x174
+#define X86_MSR_SYSENTER_ESP 0x175
+#define X86_MSR_SYSENTER_EIP 0x176
+
+static inline void
+arch_wrmsr(uint32_t msr, uint64_t val)
+{
+    asm volatile("wrmsr"::"c"(msr), "A"(val));
+}
+
+/* disable interrupts, returning whether they were enabled before */
+static inline uint32_t
+arch_irq_save(void)
+{
+    uint32_t flags;
+
+    asm volatile("pushfl; popl %0; cli":"=r"(flags)::"memory");
+    return flags;
+}
+
+static inline void
+arch_irq_restore(uint32_t flags)
+{
+    if (flags & X86_EFLAGS_IF)
+        asm volatile("sti":::"memory");
+}
+
+/* the first TSS selector, see arch/x86/gdt.h */
+#define X86_SEL_TSS 0x28
+
+/*
+ * arch_cpu_id - index of the executing CPU
+ *
+ * Every CPU loads its own TSS, so the task register tells them apart.
+ */
+static inline int
+arch_cpu_id(void)
+{
+    uint16_t sel;
+
+    asm volatile("str %0":"=r"(sel));
+    return sel > X86_SEL_TSS ? (sel - X86_SEL_TSS) / 8 : 0;
+}
+
 #endif /* __LEVOS_ARCH_X86_H */
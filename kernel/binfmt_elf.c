@@ -6,6 +6,7 @@
 #include <levos/task.h>
 #include <levos/palloc.h>
 #include <levos/string.h>
+#include <levos/vsyscall.h>
 
 int
 elf_probe(struct file *f)
@@ -121,7 +122,6 @@ load_elf(struct file *f, char **argvp, char **envp)
                 if (ph->p_vaddr + i > last_page)
                     last_page = ph->p_vaddr + i;
             }
-            __flush_tlb();
 
             file_seek(f, ph->p_offset);
             f->fops->read(f, ph->p_vaddr, ph->p_filesz);
@@ -208,7 +208,8 @@ finish:
     current_task->bstate.brk_vma =
         vm_area_create_insert(last_page, 0, last_page + 128 * 1024 * 1024,
                 current_task, VMA_WRITEABLE | VMA_ANONYMOUS | VMA_RESERVED);
-    return 0;
+
+    return vsyscall_map(current_task);
 }
 
 int
@@ -312,8 +313,6 @@ do_exec_elf(void)
     uint32_t stack = VIRT_BASE;
     void *f0, *f1, *f2, *f3;
 
-    __flush_tlb();
-
     vma_try_prefault(current_task, VIRT_BASE - 0x1000, 0x1000);
     /*uint32_t p = palloc_get_page();
     map_page_curr(p, VIRT_BASE - 4096, 1);
@@ -333,8 +332,6 @@ do_exec_elf(void)
     free(f2);
     free(f3);
 
-    __flush_tlb();
-
     //printk("start of binary is at 0x%x\n", bs->entry);
 
     asm volatile ( "movl %%eax, %%esp;"
@@ -0,0 +1,143 @@
+#include <levos/kernel.h>
+#include <levos/bio.h>
+#include <levos/device.h>
+#include <levos/spinlock.h>
+#include <levos/task.h>
+
+#define MODULE_NAME bio
+
+/*
+ * Block requests. A driver that has a submit method queues the bio and
+ * completes it from its interrupt handler, in the meantime the
+ * submitter sleeps in bio_wait() and the CPU runs something else.
+ *
+ * Taken with interrupts off, completions come from interrupt handlers
+ * and possibly another CPU.
+ */
+static spinlock_t bio_lock;
+
+/* a device without a submit method is used by one submitter at a time */
+static int bio_sync_busy;
+
+void
+bio_init(struct bio *bio, struct device *dev, int dir,
+         uint32_t sector, void *data, size_t count)
+{
+    bio->bio_dev = dev;
+    bio->bio_dir = dir;
+    bio->bio_sector = sector;
+    bio->bio_data = data;
+    bio->bio_count = count;
+    bio->bio_state = BIO_QUEUED;
+    bio->bio_error = 0;
+    bio->bio_waiter = NULL;
+}
+
+/*
+ * submit_bio - hand @bio to its device, it may complete before this
+ *              returns
+ *
+ * Devices that can't queue requests get the old dev->read and dev->write
+ * calls, those go through dev->pos, so they are done one at a time.
+ */
+int
+submit_bio(struct bio *bio)
+{
+    struct device *dev = bio->bio_dev;
+    uint32_t flags;
+    size_t rc;
+
+    if (dev->submit)
+        return dev->submit(dev, bio);
+
+    if (bio->bio_dir == BIO_WRITE && !dev->write) {
+        bio_complete(bio, -EROFS);
+        return 0;
+    }
+
+    flags = spin_lock_irqsave(&bio_lock);
+    while (bio_sync_busy) {
+        spin_unlock_irqrestore(&bio_lock, flags);
+        sched_yield();
+        flags = spin_lock_irqsave(&bio_lock);
+    }
+    bio_sync_busy = 1;
+    spin_unlock_irqrestore(&bio_lock, flags);
+
+    dev_seek(dev, bio->bio_sector);
+
+    if (bio->bio_dir == BIO_WRITE)
+        rc = dev->write(dev, bio->bio_data, bio->bio_count);
+    else
+        rc = dev->read(dev, bio->bio_data, bio->bio_count);
+
+    barrier();
+    bio_sync_busy = 0;
+
+    /* a short transfer is as much of a failure as an error */
+    if ((int) rc >= 0 && rc != bio->bio_count)
+        rc = -EIO;
+
+    bio_complete(bio, (int) rc < 0 ? (int) rc : 0);
+    return 0;
+}
+
+/* bio_complete - the driver is done with @bio, wake up whoever waits */
+void
+bio_complete(struct bio *bio, int error)
+{
+    struct task *waiter;
+    uint32_t flags;
+
+    flags = spin_lock_irqsave(&bio_lock);
+    bio->bio_error = error;
+    bio->bio_state = BIO_DONE;
+    waiter = bio->bio_waiter;
+    spin_unlock_irqrestore(&bio_lock, flags);
+
+    if (waiter)
+        task_kick(waiter);
+}
+
+/*
+ * bio_wait - sleep until @bio is complete, returns its error
+ *
+ * This sleeps, so the caller must not hold any spinlock.
+ */
+int
+bio_wait(struct bio *bio)
+{
+    uint32_t flags;
+
+    flags = spin_lock_irqsave(&bio_lock);
+    while (bio->bio_state != BIO_DONE) {
+        /* block with the lock held, so that the completion isn't lost */
+        bio->bio_waiter = current_task;
+        task_block_noresched(current_task);
+        spin_unlock_irqrestore(&bio_lock, flags);
+
+        sched_yield();
+
+        flags = spin_lock_irqsave(&bio_lock);
+    }
+    bio->bio_waiter = NULL;
+    spin_unlock_irqrestore(&bio_lock, flags);
+
+    return bio->bio_error;
+}
+
+/* bio_rw - read or write @count sectors at @sector and wait for it */
+int
+bio_rw(struct device *dev, int dir, uint32_t sector, void *data, size_t count)
+{
+    struct bio bio;
+    int rc;
+
+    bio_init(&bio, dev, dir, sector, data, count);
+
+    rc = submit_bio(&bio);
+    if (rc)
+        return rc;
+
+    return bio_wait(&bio);
+}
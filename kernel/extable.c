@@ -0,0 +1,23 @@
+#include <levos/kernel.h>
+#include <levos/uaccess.h>
+
+/* the fixups of the user copy routines, collected by the linker script */
+extern struct exception_table_entry __ex_table_start[];
+extern struct exception_table_entry __ex_table_end[];
+
+/*
+ * search_exception_table - where to continue after a page fault at
+ *                          @eip that can't be resolved, 0 if the fault
+ *                          is a real kernel bug
+ */
+uint32_t
+search_exception_table(uint32_t eip)
+{
+    struct exception_table_entry *e;
+
+    for (e = __ex_table_start; e < __ex_table_end; e ++)
+        if (e->insn == eip)
+            return e->fixup;
+
+    return 0;
+}
@@ -14,6 +14,7 @@
 #include <levos/packet.h>
 #include <levos/spinlock.h>
 #include <levos/work.h>
+#include <levos/timer.h>
 #include <levos/pci.h>
 #include <levos/arp.h>
 #include <levos/socket.h>
@@ -27,6 +28,10 @@
 #include <levos/tty.h>
 #include <levos/multiboot.h>
 #include <levos/time.h>
+#include <levos/bcache.h>
+#include <levos/pagecache.h>
+#include <levos/slab.h>
+#include <levos/vsyscall.h>
 
 static char kernel_cmdline[512];
 
@@ -61,6 +66,12 @@ cmdline_parse(char *cmdline)
             default_user_device = videocon_get_for_vt(0);
         } else if (strcmp(pch, "tracesys") == 0) {
             __sysctl_trace_sys = 1;
+        } else if (strcmp(pch, "membench") == 0) {
+            string_bench();
+        } else if (strncmp(pch, "readahead=", 10) == 0) {
+            vfs_set_readahead("/", atoi_10(pch + 10), -1);
+        } else if (strncmp(pch, "faultaround=", 12) == 0) {
+            vfs_set_readahead("/", -1, atoi_10(pch + 12));
         }
         pch = strtok_r(NULL, " ", &lasts);
     }
@@ -101,6 +112,10 @@ kernel_main(uint32_t boot_sig, void *ptr)
 
     //printk("so far used: %d of %d, free: %d\n", palloc_get_used(), 
             //palloc_get_total(), palloc_get_free());
+    string_init();
+
+    timer_init();
+
     printk("main: enabling interrupts\n");
     arch_preirq_init();
     ENABLE_IRQ();
@@ -118,6 +133,8 @@ kernel_main(uint32_t boot_sig, void *ptr)
 
     palloc_reinit();
 
+    kmem_cache_init();
+
     multiboot_get_cmdline(VIRT_BASE + ptr);
     
     sched_init();
@@ -341,6 +358,8 @@ late_init(void)
 {
     char c;
 
+    vsyscall_init();
+
     dev_init();
 
     ata_init();
@@ -359,6 +378,10 @@ late_init(void)
 
     work_init();
 
+    zero_init();
+
+    bcache_flusher_init();
+
     pci_init();
 
 #ifdef CONFIG_TCP_TEST
@@ -367,6 +390,7 @@ late_init(void)
 #endif
 
     mapping_init();
+    pagecache_init();
 
     video_console_init();
 
@@ -385,11 +409,9 @@ late_init(void)
         console_emit(c);
     }
 #endif
-    /* become the idle task */
-    extern struct task *current_task;
-    printk("main: idle process idling from now\n");
-    while (1)
-        sched_yield();
+    /* the idle task takes over from here */
+    printk("main: swapper is done, idling from now\n");
+    task_block(current_task);
 
     __not_reached();
 }
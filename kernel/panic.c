@@ -91,7 +91,6 @@ panic(char *fmt, ...)
     vprintk(fmt, ap);
 
     dump_stack(16);
-    extern struct task *current_task;
     dump_registers(current_task->regs);
     __dump_code_at(current_task->regs->eip);
     /* dump user stack */
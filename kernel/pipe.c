@@ -89,7 +89,7 @@ pipe_close(struct file *filp)
         pip->pipe_flags |= PIPFLAG_WRITE_CLOSED;
         pip->pipe_write = NULL;
     }
-    free(filp);
+    file_free(filp);
     return 0;
 }
 
@@ -117,7 +117,7 @@ struct file_operations pipe_fops = {
 struct file *
 pipe_create_file(struct pipe *pip)
 {
-    struct file *filp = malloc(sizeof(*filp));
+    struct file *filp = file_alloc();
     if (!filp)
         return NULL;
 
@@ -130,6 +130,7 @@ pipe_create_file(struct pipe *pip)
     filp->isdir = 0;
     filp->type = FILE_TYPE_PIPE;
     filp->refc = 1;
+    filp->ino = 0;
     //filp->respath = NULL;
     filp->priv = pip;
     return filp;
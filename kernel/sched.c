@@ -9,12 +9,15 @@
 #include <levos/page.h>
 #include <levos/spinlock.h>
 #include <levos/list.h>
+#include <levos/timer.h>
+#include <levos/vsyscall.h>
 
 #define TIME_SLICE 15
 
 static pid_t last_pid = 0;
-struct task *current_task;
+static spinlock_t pid_lock;
 
+/* every task in the system, whichever CPU it runs on */
 static spinlock_t all_tasks_lock;
 static struct list all_tasks;
 
@@ -22,11 +25,10 @@ struct list *__ALL_TASKS_PTR = &all_tasks;
 
 //static int last_task;
 
-int __task_need_cleanup;
-
 struct list zombie_processes;
 
-static int __preempt_enabled;
+struct cpu cpus[MAX_CPUS];
+int nr_cpus = 1;
 
 void __noreturn late_init(void);
 void __noreturn __idle_thread(void);
@@ -35,16 +37,18 @@ void intr_yield(struct pt_regs *);
 void sched_yield(void);
 void reschedule(void);
 
+static int __kernel_task_stack(struct task *, void (*)(void));
+
 void
 preempt_enable(void)
 {
-    __preempt_enabled = 1;
+    this_cpu()->cpu_preempt_enabled = 1;
 }
 
 void
 preempt_disable(void)
 {
-    __preempt_enabled = 0;
+    this_cpu()->cpu_preempt_enabled = 0;
 }
 
 inline int
@@ -56,40 +60,227 @@ task_is_kernel(struct task *t)
 pid_t
 allocate_pid(void)
 {
-    return ++last_pid;
+    pid_t pid;
+
+    spin_lock(&pid_lock);
+    pid = ++ last_pid;
+    spin_unlock(&pid_lock);
+
+    return pid;
+}
+
+static inline int
+task_timeslice(struct task *task)
+{
+    int slice = TIME_SLICE * (SCHED_NR_PRIO - task->prio) / 20;
+
+    return slice ? slice : 1;
+}
+
+static void
+__prio_array_init(struct prio_array *pa)
+{
+    int i;
+
+    pa->pa_nr_active = 0;
+    for (i = 0; i < SCHED_BITMAP_WORDS; i ++)
+        pa->pa_bitmap[i] = 0;
+    for (i = 0; i < SCHED_NR_PRIO; i ++)
+        list_init(&pa->pa_queue[i]);
+}
+
+/* the highest priority that has a task queued, or -1 */
+static int
+__prio_array_first(struct prio_array *pa)
+{
+    int i;
+
+    for (i = 0; i < SCHED_BITMAP_WORDS; i ++)
+        if (pa->pa_bitmap[i])
+            return i * 32 + __builtin_ctz(pa->pa_bitmap[i]);
+
+    return -1;
+}
+
+/* the run queue lock of @cpu must be held for everything down to sched_add_rq */
+static void
+__enqueue(struct cpu *cpu, struct task *task, struct prio_array *pa)
+{
+    list_push_back(&pa->pa_queue[task->prio], &task->rq_elem);
+    pa->pa_bitmap[task->prio / 32] |= 1 << (task->prio % 32);
+    pa->pa_nr_active ++;
+    task->rq_array = pa;
+    cpu->cpu_nr_running ++;
+}
+
+static void
+__dequeue(struct cpu *cpu, struct task *task)
+{
+    struct prio_array *pa = task->rq_array;
+
+    list_remove(&task->rq_elem);
+    if (list_empty(&pa->pa_queue[task->prio]))
+        pa->pa_bitmap[task->prio / 32] &= ~(1 << (task->prio % 32));
+    pa->pa_nr_active --;
+    task->rq_array = NULL;
+    cpu->cpu_nr_running --;
+}
+
+/* take @task off the run queue if it is on it */
+static void
+__task_unqueue(struct cpu *cpu, struct task *task)
+{
+    if (task->rq_array)
+        __dequeue(cpu, task);
+}
+
+/* make @task runnable and queue it, unless it already is */
+static void
+__task_wake(struct cpu *cpu, struct task *task)
+{
+    task->state = TASK_PREEMPTED;
+
+    if (!task->rq_array && task != cpu->cpu_idle)
+        __enqueue(cpu, task, cpu->cpu_active);
+}
+
+static inline struct cpu *
+task_cpu(struct task *task)
+{
+    return &cpus[task->cpu];
+}
+
+/*
+ * __sleep_timer_fn - the sleep timer of @aux expired, wake it up unless
+ *                    something else already did
+ */
+static void
+__sleep_timer_fn(void *aux)
+{
+    struct task *task = aux;
+    struct cpu *cpu = task_cpu(task);
+
+    spin_lock(&cpu->cpu_rq_lock);
+    if (task->state == TASK_SLEEPING)
+        __task_wake(cpu, task);
+    spin_unlock(&cpu->cpu_rq_lock);
+}
+
+/*
+ * __idle_task_create - create the task that stands for what a CPU was
+ *                      running before it started scheduling
+ */
+static struct task *
+__idle_task_create(void)
+{
+    struct task *task;
+    char *fxsave;
+
+    task = malloc(sizeof(*task));
+    if (!task)
+        return NULL;
+
+    fxsave = na_malloc(512, 16);
+    if (!fxsave) {
+        free(task);
+        return NULL;
+    }
+
+    memset(task, 0, sizeof(*task));
+    arch_fpu_init(fxsave);
+
+    task->mm = 0;
+    task->pid = 0;
+    task->pgid = 0;
+    task->ppid = 0;
+    task->sid = 0;
+    task->state = TASK_RUNNING;
+    task->time_ran = 0;
+    task->prio = NICE_TO_PRIO(0);
+    signal_init(task);
+    vma_init(task);
+    spin_lock_init(&task->vm_lock);
+    list_init(&task->wait_ev_list);
+    spin_lock_init(&task->wait_ev_lock);
+    timer_setup(&task->sleep_timer, __sleep_timer_fn, task);
+    task->sse_save = fxsave;
+
+    return task;
+}
+
+/*
+ * sched_init_cpu - set up the run queue and the idle task of @cpu,
+ *                  before it is started
+ */
+int
+sched_init_cpu(struct cpu *cpu)
+{
+    spin_lock_init(&cpu->cpu_rq_lock);
+    __prio_array_init(&cpu->cpu_arrays[0]);
+    __prio_array_init(&cpu->cpu_arrays[1]);
+    cpu->cpu_active = &cpu->cpu_arrays[0];
+    cpu->cpu_expired = &cpu->cpu_arrays[1];
+    cpu->cpu_nr_running = 0;
+    cpu->cpu_preempt_enabled = 0;
+
+    cpu->cpu_idle = __idle_task_create();
+    if (!cpu->cpu_idle)
+        return -ENOMEM;
+
+    cpu->cpu_idle->cpu = cpu->cpu_id;
+    cpu->cpu_idle->comm = "idle";
+
+    return 0;
+}
+
+/*
+ * sched_idle_loop - what a CPU runs when there is nothing else to do, the
+ *                   next timer tick switches away if something woke up
+ */
+void __noreturn
+sched_idle_loop(void)
+{
+    while (1)
+        asm volatile("sti; hlt");
+
+    __not_reached();
 }
 
 void __noreturn
 sched_init(void)
 {
     uint32_t kernel_stack, new_stack;
+    struct task *idle;
 
     printk("sched: init\n");
 
     list_init(&zombie_processes);
     list_init(&all_tasks);
     spin_lock_init(&all_tasks_lock);
+    spin_lock_init(&pid_lock);
+
+    wait_init();
+    vma_cache_init();
 
-    current_task = malloc(sizeof(*current_task));
-    if (!current_task)
+    /* the boot processor is the only one running so far */
+    cpus[0].cpu_id = 0;
+    if (sched_init_cpu(&cpus[0]))
         panic("Kernel ran out of memory when starting threading\n");
 
-    current_task->mm = 0;
-    current_task->pid = 0;
-    current_task->pgid = 0;
-    current_task->ppid = 0;
-    current_task->sid = 0;
-    current_task->state = TASK_RUNNING;
-    current_task->time_ran = 0;
-    signal_init(current_task);
-    vma_init(current_task);
-    spin_lock_init(&current_task->vm_lock);
-    list_init(&current_task->wait_ev_list);
-    spin_lock_init(&current_task->wait_ev_lock);
-    char *fxsave = na_malloc(512, 16);
-    memset(fxsave, 0, 512);
-    current_task->sse_save = fxsave;
-    do_sse_save(current_task);
+    /*
+     * what we are running right now becomes the swapper, which runs
+     * late_init() like any other task, so the boot processor gets an
+     * idle task of its own
+     */
+    current_task = cpus[0].cpu_idle;
+    cpus[0].cpu_fpu_owner = current_task;
+
+    idle = __idle_task_create();
+    if (!idle || __kernel_task_stack(idle, sched_idle_loop))
+        panic("Kernel ran out of memory when starting threading\n");
+    idle->comm = "idle";
+    idle->state = TASK_PREEMPTED;
+    cpus[0].cpu_idle = idle;
 
     //memset(all_tasks, 0, sizeof(struct task *) * 128);
     //all_tasks[0] = current_task;
@@ -98,6 +289,8 @@ sched_init(void)
     spin_unlock(&all_tasks_lock);
     //last_task = 0;
 
+    cpus[0].cpu_online = 1;
+
     intr_register_user(0x2f, intr_yield);
 
     /* map a new stack */
@@ -157,6 +350,7 @@ __task_init(struct task *task)
     task->pgid = 0;
     task->state = TASK_PREEMPTED;
     task->time_ran = 0;
+    task->prio = NICE_TO_PRIO(0);
     task->parent = NULL;
     task->exit_code = 0;
     task->mm = kernel_pgd;
@@ -165,6 +359,7 @@ __task_init(struct task *task)
     list_init(&task->children_list);
     list_init(&task->wait_ev_list);
     spin_lock_init(&task->wait_ev_lock);
+    timer_setup(&task->sleep_timer, __sleep_timer_fn, task);
     vma_init(task);
     spin_lock_init(&task->vm_lock);
     signal_init(task);
@@ -175,7 +370,7 @@ __task_init(struct task *task)
         return -ENOMEM;
     }
     char *fxsave = na_malloc(512, 16);
-    memset(fxsave, 0, 512);
+    arch_fpu_init(fxsave);
     task->sse_save = fxsave;
     task->owner->status = 0;
     task->owner->exit_code = 0;
@@ -183,29 +378,21 @@ __task_init(struct task *task)
     return 0;
 }
 
-struct task *create_kernel_task(void (*func)(void))
+/*
+ * __kernel_task_stack - give @task a stack that starts executing @func
+ *                       in the kernel when it is first switched to
+ */
+static int
+__kernel_task_stack(struct task *task, void (*func)(void))
 {
     uint32_t *new_stack, tmp;
-    struct task *task = malloc(sizeof(*task));
-    int rc;
-
-    if (!task)
-        return NULL;
-
-    rc = __task_init(task);
-    if (rc)
-        return NULL;
-
-    task->comm = strdup("kthread");
 
     /* get a stack for the task, since this is a kernel thread
      * we can use malloc
      */
     new_stack = malloc(4096);
-    if (!new_stack) {
-        free(task);
-        return NULL;
-    }
+    if (!new_stack)
+        return -ENOMEM;
     memset(new_stack, 0, 4096);
 
     new_stack = (uint32_t *)((int)new_stack + 4096);
@@ -239,13 +426,41 @@ struct task *create_kernel_task(void (*func)(void))
 
     task->regs = (void *) new_stack;
     task->new_stack = (void *) new_stack;
+    return 0;
+}
+
+struct task *create_kernel_task(void (*func)(void))
+{
+    struct task *task = malloc(sizeof(*task));
+    int rc;
+
+    if (!task)
+        return NULL;
+
+    rc = __task_init(task);
+    if (rc)
+        return NULL;
+
+    task->comm = strdup("kthread");
+
+    if (__kernel_task_stack(task, func)) {
+        free(task);
+        return NULL;
+    }
+
     return task;
 }
 
 void
 task_block_noresched(struct task *task)
 {
+    struct cpu *cpu = task_cpu(task);
+    uint32_t flags;
+
+    flags = spin_lock_irqsave(&cpu->cpu_rq_lock);
+    __task_unqueue(cpu, task);
     task->state = TASK_BLOCKED;
+    spin_unlock_irqrestore(&cpu->cpu_rq_lock, flags);
     //printk("%s: pid %d (%s)\n", __func__, task->pid, task->comm);
 }
 
@@ -282,27 +497,45 @@ task_continue(struct task *task)
     task_unblock(task);
 }
 
+/* task_sleep - put @task to sleep until the tick count reaches @ticks */
 void
 task_sleep(struct task *task, uint32_t ticks)
 {
-    task->wake_time = ticks;
+    struct cpu *cpu = task_cpu(task);
+    uint32_t flags;
+
+    flags = spin_lock_irqsave(&cpu->cpu_rq_lock);
+    __task_unqueue(cpu, task);
     task->state = TASK_SLEEPING;
+    spin_unlock_irqrestore(&cpu->cpu_rq_lock, flags);
+
+    timer_add(&task->sleep_timer, ticks);
 }
 
+/* task_kick - make @task runnable again, whether it sleeps or is blocked */
     void
 task_kick(struct task *task)
 {
+    struct cpu *cpu = task_cpu(task);
+    uint32_t flags;
+
     //panic_ifnot(task->state == TASK_SLEEPING);
-    task->wake_time = 0;
-    task->state = TASK_PREEMPTED;
+
+    /* woken up early, the sleep timer has nothing left to do */
+    if (timer_pending(&task->sleep_timer))
+        timer_del(&task->sleep_timer);
+
+    flags = spin_lock_irqsave(&cpu->cpu_rq_lock);
+    if (task->state != TASK_ZOMBIE && task->state != TASK_DYING)
+        __task_wake(cpu, task);
+    spin_unlock_irqrestore(&cpu->cpu_rq_lock, flags);
     //printk("sched: kicked task %d\n", task->pid);
 }
 
     void
 sleep(uint32_t ticks)
 {
-    extern uint32_t __pit_ticks;
-    task_sleep(current_task, __pit_ticks + 1 + ticks);
+    task_sleep(current_task, timer_ticks() + 1 + ticks);
     sched_yield();
 }
 
@@ -310,7 +543,36 @@ sleep(uint32_t ticks)
 task_unblock(struct task *task)
 {
     panic_ifnot(task != current_task);
-    task->state = TASK_PREEMPTED;
+    task_kick(task);
+}
+
+/*
+ * sched_set_nice - change the nice value of @task, which is clamped to
+ *                  [NICE_MIN, NICE_MAX]
+ */
+void
+sched_set_nice(struct task *task, int nice)
+{
+    struct cpu *cpu = task_cpu(task);
+    struct prio_array *pa;
+    uint32_t flags;
+
+    if (nice < NICE_MIN)
+        nice = NICE_MIN;
+    if (nice > NICE_MAX)
+        nice = NICE_MAX;
+
+    flags = spin_lock_irqsave(&cpu->cpu_rq_lock);
+    pa = task->rq_array;
+    if (pa)
+        __dequeue(cpu, task);
+
+    task->nice = nice;
+    task->prio = NICE_TO_PRIO(nice);
+
+    if (pa)
+        __enqueue(cpu, task, pa);
+    spin_unlock_irqrestore(&cpu->cpu_rq_lock, flags);
 }
 
     char *
@@ -429,8 +691,15 @@ task_unblock_waiters(struct task *t)
 void
 task_exit(struct task *t)
 {
+    struct cpu *cpu = task_cpu(t);
+    uint32_t flags;
+
     /* TODO: preliminary cleanup, but don't get rid of thread */
+    flags = spin_lock_irqsave(&cpu->cpu_rq_lock);
+    __task_unqueue(cpu, t);
     t->state = TASK_ZOMBIE;
+    spin_unlock_irqrestore(&cpu->cpu_rq_lock, flags);
+    timer_del_sync(&t->sleep_timer);
     if (t->pid == 1)
         panic("Attempting to exit from init\n");
     if (t->pid == 0)
@@ -477,16 +746,22 @@ task_exit(struct task *t)
     }
 
     free(t->comm);
+    arch_fpu_release(t);
     na_free(16, t->sse_save);
     free(t->bstate.switch_stack);
     close_filetable(t);
     list_remove(&t->children_elem);
     free(t->cwd);
     free(t->irq_stack_bot);
+
+    flags = spin_lock_irqsave(&all_tasks_lock);
     list_remove(&t->all_elem);
+    spin_unlock_irqrestore(&all_tasks_lock, flags);
+
     vma_unload_all(t);
     activate_pgd(kernel_pgd);
     mm_destroy(t->mm);
+    palloc_unref_page(t->signal.stack_phys_page);
     free(t);
 }
 
@@ -715,7 +990,7 @@ struct task *
 create_user_task_fork(void (*func)(void))
 {
     struct task *new;
-    pagedir_t mm = copy_page_dir(current_task->mm);
+    pagedir_t mm = copy_page_dir_fork(current_task->mm);
 
     /* mark the pages COW */
     mark_all_user_pages_cow(current_task->mm);
@@ -735,6 +1010,9 @@ create_user_task_fork(void (*func)(void))
     /* copy VMAs */
     copy_vmas(new, current_task);
 
+    /* the vsyscall page has to return the child's own pid */
+    vsyscall_fork(new);
+
     /* copy signals */
     copy_signals(new, current_task);
 
@@ -743,11 +1021,16 @@ create_user_task_fork(void (*func)(void))
     new->cwd = strdup(current_task->cwd);
 
     /* copy SSE data */
+    arch_fpu_flush(current_task);
     memcpy(new->sse_save, current_task->sse_save, 512);
 
     /* copy controlling terminal */
     new->ctty = current_task->ctty;
 
+    /* the child is as nice as the parent */
+    new->nice = current_task->nice;
+    new->prio = current_task->prio;
+
     /* copy BRK stuff */
     new->bstate.logical_brk = current_task->bstate.logical_brk;
     new->bstate.actual_brk = current_task->bstate.actual_brk;
@@ -802,21 +1085,30 @@ kernel_task_exit()
     sched_yield();
 }
 
+/*
+ * sched_add_rq - make @task known and put it on the run queue of the
+ *                online CPU that has the fewest tasks, it stays there
+ */
 void
 sched_add_rq(struct task *task)
 {
+    struct cpu *cpu, *best = &cpus[0];
+    uint32_t flags;
+
     //printk("%s: task->pid: %d task->regs: 0x%x\n", __func__, task->pid, task->regs);
-    /*for (int i = 0; i < 128; i ++) {
-        if (all_tasks[i] == 0) {
-            all_tasks[i] = task;
-            return;
-        }
-    }*/
-    //spin_lock(&all_tasks_lock);
+    flags = spin_lock_irqsave(&all_tasks_lock);
     list_push_back(&all_tasks, &task->all_elem);
-    //spin_unlock(&all_tasks_lock); 
-    return;
-    panic("RQ is full\n");
+    spin_unlock_irqrestore(&all_tasks_lock, flags);
+
+    for_each_online_cpu(cpu) {
+        if (cpu->cpu_nr_running < best->cpu_nr_running)
+            best = cpu;
+    }
+
+    flags = spin_lock_irqsave(&best->cpu_rq_lock);
+    task->cpu = best->cpu_id;
+    __enqueue(best, task, best->cpu_active);
+    spin_unlock_irqrestore(&best->cpu_rq_lock, flags);
 }
 
 extern void init_task(void);
@@ -824,7 +1116,7 @@ void __noreturn
 __idle_thread(void)
 {
     struct task *n;
-    __preempt_enabled = 1;
+    preempt_enable();
     arch_switch_timer_sched();
 
     /* XXX 4/22/17 review: I am not entirely sure why this is/was
@@ -847,67 +1139,67 @@ __idle_thread(void)
     __not_reached();
 }
 
+/*
+ * pick_next_task - choose what this CPU runs next: the first task of the
+ *                  highest priority that has one queued in the active
+ *                  array, or the idle task if nothing is runnable
+ */
 struct task *
 pick_next_task(void)
 {
     //printk("%s\n", __func__);
-    extern uint32_t __pit_ticks;
-    struct list_elem *elem;
-    struct task *task = current_task, *t;
+    struct cpu *cpu = this_cpu();
+    struct task *next = cpu->cpu_idle;
+    struct prio_array *pa;
+    int prio;
+
+    /* a task that exits is released once it has been switched away from */
+    if (current_task->state == TASK_DYING) {
+        //printk("rejected %d because it's dying\n", current_task->pid);
+        task_exit(current_task);
+    }
 
-    if (__task_need_cleanup > 0) {
-        list_foreach_raw(&all_tasks, elem) {
-            t = list_entry(elem, struct task, all_elem);
+    spin_lock(&cpu->cpu_rq_lock);
 
-            if (t->state == TASK_DYING)
-                task_exit(t);
-        }
-        __task_need_cleanup = 0;
+    if (cpu->cpu_active->pa_nr_active == 0) {
+        pa = cpu->cpu_active;
+        cpu->cpu_active = cpu->cpu_expired;
+        cpu->cpu_expired = pa;
     }
 
-    //spin_lock(&all_tasks_lock);
-/*retry:
-    for (int i = last_task; i < 128; i ++) {
-        if (all_tasks[i] != 0) { 
-            if (all_tasks[i]->state == TASK_DYING) {
-                task_exit(all_tasks[i]);
-                continue;
-            } else if (all_tasks[i]->state == TASK_SLEEPING &&
-                    all_tasks[i]->wake_time <= __pit_ticks) {
-                all_tasks[i]->state = TASK_PREEMPTED;
-            } else if (!task_runnable(all_tasks[i]))
-                continue;
-            last_task = i + 1;
-            //if (all_tasks[i]->pid == 2)
-                //printk("pid:%d\n", all_tasks[i]->pid);
-            return all_tasks[i];
-        }
+    prio = __prio_array_first(cpu->cpu_active);
+    if (prio >= 0) {
+        next = list_entry(list_front(&cpu->cpu_active->pa_queue[prio]),
+                          struct task, rq_elem);
+        __dequeue(cpu, next);
     }
 
-    if (last_task == 0)
-        panic("No task to run\n");
-    last_task = 0;
-    */
+    spin_unlock(&cpu->cpu_rq_lock);
 
-retry:
-    elem = list_next(&task->all_elem);
-    if (elem == list_tail(&all_tasks))
-        elem = list_begin(&all_tasks);
-    task = list_entry(elem, struct task, all_elem);
-
-    if (task->state == TASK_DYING) {
-        //printk("rejected %d because it's dying\n", task->pid);
-        task_exit(task);
-        goto retry;
-    } else if (task->state == TASK_SLEEPING && task->wake_time <= __pit_ticks) {
-        task->state = TASK_PREEMPTED;
-    } else if (!task_runnable(task)) {
-        //printk("rejected %d because it was not runnable\n", task->pid);
-        goto retry;
+    return next;
+}
+
+/*
+ * put_prev_task - requeue the task that was running, it waits in the
+ *                 expired array until everybody else had a turn
+ */
+static void
+put_prev_task(struct task *prev)
+{
+    struct cpu *cpu = this_cpu();
+
+    if (prev == cpu->cpu_idle) {
+        prev->state = TASK_PREEMPTED;
+        return;
     }
 
-    //spin_unlock(&all_tasks_lock); 
-    return task;
+    spin_lock(&cpu->cpu_rq_lock);
+    if (prev->state == TASK_RUNNING)
+        prev->state = TASK_PREEMPTED;
+
+    if (task_runnable(prev) && !prev->rq_array)
+        __enqueue(cpu, prev, cpu->cpu_expired);
+    spin_unlock(&cpu->cpu_rq_lock);
 }
 
 void
@@ -931,8 +1223,8 @@ __reschedule_to(struct task *next)
     next->time_ran = 0;
     next->state = TASK_RUNNING;
     //current_task->sys_regs = current_task->regs;
-    do_sse_save(current_task);
     current_task = next;
+    arch_fpu_switch(next);
 
     if (current_task->mm)
         activate_pgd(current_task->mm);
@@ -950,14 +1242,21 @@ __reschedule_to(struct task *next)
 
     next->flags &= ~TFLAG_NO_SIGNAL;
 
-    do_sse_restore(next);
-    /* switch stack */
-    asm volatile("movl %0, %%esp;"
-                 "movw $0x20, %%dx;"
-                 "movb $0x20, %%al;"
-                 "outb %%al, %%dx;"
-                 "sti;"
-                 "jmp intr_exit"::"r"(next->regs));
+    /*
+     * switch stack, the boot processor has the legacy PIC to acknowledge,
+     * the others have already acknowledged their local APIC timer
+     */
+    if (cpu_id() == 0)
+        asm volatile("movl %0, %%esp;"
+                     "movw $0x20, %%dx;"
+                     "movb $0x20, %%al;"
+                     "outb %%al, %%dx;"
+                     "sti;"
+                     "jmp intr_exit"::"r"(next->regs));
+    else
+        asm volatile("movl %0, %%esp;"
+                     "sti;"
+                     "jmp intr_exit"::"r"(next->regs));
     __not_reached();
 }
 
@@ -966,6 +1265,7 @@ reschedule_to(struct task *next)
 {
 retry:
     __reschedule_to(next);
+    put_prev_task(current_task);
     next = pick_next_task();
     goto retry;
 }
@@ -975,11 +1275,10 @@ reschedule(void)
 {
     struct task *next;
     DISABLE_IRQ();
-    if (__preempt_enabled == 0)
+    if (this_cpu()->cpu_preempt_enabled == 0)
         reschedule_to(current_task);
 
-    if (current_task->state == TASK_RUNNING)
-        current_task->state = TASK_PREEMPTED;
+    put_prev_task(current_task);
     next = pick_next_task();
     reschedule_to(next);
 }
@@ -987,9 +1286,19 @@ reschedule(void)
 void
 sched_tick(struct pt_regs *r)
 {
+    struct cpu *cpu = this_cpu();
+
     current_task->time_ran ++;
     current_task->regs = r;
     //printk("TICK\n");
-    if (current_task->time_ran > TIME_SLICE)
+
+    /* the idle task gives way as soon as there is something else to do */
+    if (current_task == cpu->cpu_idle) {
+        if (cpu->cpu_nr_running)
+            reschedule();
+        return;
+    }
+
+    if (current_task->time_ran > task_timeslice(current_task))
         reschedule();
 }
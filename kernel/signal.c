@@ -80,7 +80,7 @@ __send_signal(struct task *task, int signal)
         //printk("SIGCONT is now queued in %d\n", task->pid);
         task->flags &= ~(TFLAG_WAITED);
         task->owner->status = 0;
-        task->state = TASK_PREEMPTED;
+        task_kick(task);
         return;
 
         struct list_elem *elem;
@@ -101,7 +101,7 @@ __send_signal(struct task *task, int signal)
 
     if (task->state == TASK_SLEEPING) {
         task->flags |= TFLAG_INTERRUPTED;
-        task->state = TASK_PREEMPTED;
+        task_kick(task);
     }
 
     list_push_back(&task->signal.pending_signals, &sig->elem);
@@ -282,9 +282,14 @@ do_signal_handle(struct task *task, int signum, sighandler_t handler)
     //printk("Wooohoo\n");
     //dump_registers(task->sys_regs);
 
-    /* map the signal stack */
+    /* map the signal stack, the mapping holds its own reference */
+    pgptr = get_page_from_pgd(task->mm, (uint32_t) sig->unused_stack_bot);
+    if (!pgptr || !pte_present(*pgptr) || PG_RND_DOWN(*pgptr) != sig->stack_phys_page) {
+        if (pgptr && pte_present(*pgptr))
+            palloc_unref_page(PG_RND_DOWN(*pgptr));
+        palloc_ref_page(sig->stack_phys_page);
+    }
     map_page(task->mm, sig->stack_phys_page, (uint32_t) sig->unused_stack_bot, 1);
-    __flush_tlb();
 
     //pagedir_t pgd = activate_pgd_save(task->mm);
 
@@ -24,6 +24,30 @@ spin_unlock(spinlock_t *l)
     arch_spin_unlock(&l->value);
 }
 
+/*
+ * spin_lock_irqsave - disable interrupts on this CPU and take @l, the
+ *                     returned flags go to spin_unlock_irqrestore()
+ *
+ * An interrupt handler spinning on a lock that the code it interrupted
+ * holds would never get it, so locks shared with handlers are taken
+ * this way.
+ */
+uint32_t
+spin_lock_irqsave(spinlock_t *l)
+{
+    uint32_t flags = arch_irq_save();
+
+    spin_lock(l);
+    return flags;
+}
+
+void
+spin_unlock_irqrestore(spinlock_t *l, uint32_t flags)
+{
+    spin_unlock(l);
+    arch_irq_restore(flags);
+}
+
 int
 spin_lock_would_deadlock(spinlock_t *lock)
 {
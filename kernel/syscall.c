@@ -10,6 +10,8 @@
 #include <levos/socket.h>
 #include <levos/work.h>
 #include <levos/tty.h>
+#include <levos/uaccess.h>
+#include <levos/time.h>
 
 #define ARGS_MAX 16
 #define ENVS_MAX 16
@@ -20,121 +22,92 @@ syscall_undefined(uint32_t no)
     printk("WARNING: undefined systemcall %d\n", no);
 }
 
+/*
+ * verify_user_range - check that [@p, @p + @sz) is covered by VMAs of the
+ *                     current task that allow the access
+ *
+ * This is for the buffers that file operations read and write with plain
+ * memcpy(), the pages are faulted in as they are touched, see
+ * do_kernel_pagefault(). Everything else goes through copy_from_user()
+ * and copy_to_user(), which need no checking up front.
+ */
 static int
-__verify_buffer(uint32_t start, size_t sz)
+verify_user_range(void *p, size_t sz, int write)
 {
-    int i;
-
-    //printk("%s: start 0x%x sz %d\n", __func__, start, sz);
+    struct task *task = current_task;
+    uint32_t addr = (uint32_t) p, end = addr + sz;
+    struct vm_area *vma;
 
-    /* is the buffer a valid user address? */
-    if (start > VIRT_BASE || start + sz > VIRT_BASE) {
-        //printk("Case KERN\n");
+    if (!access_ok(p, sz))
         return 1;
-    }
 
-    /* if a null pointer or looks like one then bail */
-    if (start < 4096) {
-        //printk("Case NULL\n");
-        return 1;
-    }
+    while (addr < end) {
+        vma = vma_find(task, addr);
+        if (!vma)
+            return 1;
 
-    if (start % 0x1000 == 0) {
-        //printk("Case 1\n");
-        /* we are on a page boundary, should be easy to check */
-        for (i = 0; i < sz; i += 0x1000) {
-            if (!page_mapped_curr(start + i))
-                return 1;
-        }
-    } else {
-        /* first, check if the size concerns the next page */
-        uint32_t this_page = PG_RND_DOWN(start);
-        uint32_t next_page = PG_RND_DOWN(start + sz);
-        //printk("Case 2 this: 0x%x next: 0x%x\n", this_page, next_page);
-
-        /* the buffer is as a whole on the same page */
-        if (this_page == next_page) {
-            //printk("Case 2.1\n");
-            if (page_mapped_curr(start)) {
-                //printk("Case 2.1.T\n");
-                return 0;
-            }
-            //printk("Case 2.1.F\n");
+        if (write && !(vma->vma_flags & VMA_WRITEABLE))
             return 1;
-        } else {
-            //printk("Case 2.2");
-            /* check the next pages */
-            for (i = 0; i < sz; i += 0x1000) {
-                if (!page_mapped_curr(start + i)) {
-             //       printk("Case 2.2.F");
-                    return 1;
-                }
-            }
-            //printk("Case 2.2.T");
-            return 0;
-        }
+
+        /* the heap is mapped by sbrk(2), up to the break */
+        if (vma->vma_flags & VMA_RESERVED)
+            return end > task->bstate.actual_brk;
+
+        addr = vma->vma_end;
     }
 
-    /* all done, the buffer is valid */
     return 0;
 }
 
-static int
-verify_buffer(void *p, size_t sz)
-{
-    if (p > VIRT_BASE || p + sz > VIRT_BASE)
-        return 1;
-    vma_try_prefault(current_task, p, sz);
-    return __verify_buffer((uint32_t) p, sz);
-}
-
-int
-verify_buffer_string(char *string, int max)
+/*
+ * getname - copy the path at @user into a new kernel buffer, which is
+ *           freed with free()
+ */
+static char *
+getname(const char *user)
 {
-    int i;
-    char c;
-    char *p = (char *)string;
-
-    /* First check if the whole buffer would fit anyway */
-    if (verify_buffer(string, max) == 0)
-        return 0;
-
-    /* check if the first byte is valid */
-    if (verify_buffer(string, 0) != 0)
-        return 1;
-
-    /*
-     * the whole buffer doesnt fit, check byte-by-byte until a zero
-     * byte is found
-     */
-    for (i = 0; i < max; i ++) {
-        c = p[i];
+    char *name;
+    long len;
 
-        /* found end, good to go */
-        if (c == 0)
-            return 0;
+    name = malloc(PATH_MAX);
+    if (!name)
+        return ERR_PTR(-ENOMEM);
 
-        /* verify that the next access is correct */
-        if (verify_buffer(&p[i+1], 0) != 0)
-            return 1;
+    len = strncpy_from_user(name, user, PATH_MAX);
+    if (len < 0 || len == PATH_MAX) {
+        free(name);
+        return ERR_PTR(-EFAULT);
     }
 
-    /* overflowed the max */
-    return 1;
+    return name;
 }
 
+/*
+ * copy_array_from_user - copy the NULL terminated array of strings at
+ *                        @ptr, the strings end up in one buffer
+ */
 char **
 copy_array_from_user(char **ptr, int max)
 {
     int c = 0, i = 0;
     int len = 0, sofar = 0;
-    char *buf = NULL;
+    long slen;
+    char *buf = NULL, *uptr;
     char **arr = NULL;
 
-    /* FIXME: proper check */
+    for (c = 0; ; c ++) {
+        if (copy_from_user(&uptr, &ptr[c], sizeof(uptr)))
+            return ERR_PTR(-EFAULT);
+
+        if (uptr == NULL)
+            break;
+
+        slen = strnlen_user(uptr, PATH_MAX);
+        if (slen < 0 || slen == PATH_MAX)
+            return ERR_PTR(-EFAULT);
 
-    for (c = 0; ptr[c] != NULL; c ++)
-        len += strlen(ptr[c]) + 2;
+        len += slen + 1;
+    }
 
     //printk("%s total len %d\n", __func__, len);
 
@@ -150,13 +123,25 @@ copy_array_from_user(char **ptr, int max)
     memset(arr, 0, (c + 1) * sizeof(uintptr_t));
 
     for (i = 0; i < c; i ++) {
-        memcpy(buf + sofar, ptr[i], strlen(ptr[i]) + 1);
+        /* the strings may have changed since they were measured */
+        if (copy_from_user(&uptr, &ptr[i], sizeof(uptr)) || uptr == NULL)
+            goto fault;
+
+        slen = strncpy_from_user(buf + sofar, uptr, len - sofar);
+        if (slen < 0 || slen == len - sofar)
+            goto fault;
+
         //printk("buf+sofar(%d) is %s\n", sofar, buf + sofar);
         arr[i] = buf + sofar;
-        sofar += strlen(ptr[i]) + 1;
+        sofar += slen + 1;
     }
 
     return arr;
+
+fault:
+    free(buf);
+    free(arr);
+    return ERR_PTR(-EFAULT);
 }
 
 void
@@ -167,8 +152,9 @@ free_copied_array(char **arr)
 }
 
 
+/* do_open - open(2) with @__filename already copied from the user */
 static int
-sys_open(char *__filename, int flags, int mode)
+do_open(char *__filename, int flags, int mode)
 {
     struct file *f;
     struct task *task = current_task;
@@ -177,9 +163,6 @@ sys_open(char *__filename, int flags, int mode)
 
     //printk("%s\n", __func__);
 
-    if (verify_buffer_string(__filename, PATH_MAX))
-        return -EFAULT;
-
     if (flags & ~(O_TRUNC | O_NOCTTY | O_CLOEXEC | O_CREAT | O_WRONLY | O_RDWR | O_EXCL))
         printk("pid %d: unsupported openflag detected in 0x%x isol: 0x%x\n",
                 current_task->pid, flags,
@@ -191,7 +174,6 @@ sys_open(char *__filename, int flags, int mode)
             flags & O_WRONLY == 0)
         return -EINVAL;
 
-    /* can I derefence this? fixme */
     if (__filename[0] != '/') {
         filename = __canonicalize_path(current_task->cwd, __filename);
         need_free = 1;
@@ -283,6 +265,22 @@ xc:
     return -EMFILE;
 }
 
+static int
+sys_open(char *u_filename, int flags, int mode)
+{
+    char *filename;
+    int rc;
+
+    filename = getname(u_filename);
+    if (IS_ERR(filename))
+        return PTR_ERR(filename);
+
+    rc = do_open(filename, flags, mode);
+    free(filename);
+
+    return rc;
+}
+
 static int
 do_close(int fd)
 {
@@ -311,50 +309,100 @@ sys_getpid(void)
     return current_task->pid;
 }
 
+#define PRIO_PROCESS 0
+
 static int
-sys_stat(char *__fn, struct stat *st)
+sys_nice(int inc)
 {
-    char *fn, need_free = 0;
-    int rc;
+    sched_set_nice(current_task, current_task->nice + inc);
+    return 0;
+}
 
-    if (verify_buffer_string(__fn, PATH_MAX))
-        return -EFAULT;
+/*
+ * like Linux, the raw system call returns 20 - nice, so that the
+ * result is never negative
+ */
+static int
+sys_getpriority(int which, int who)
+{
+    struct task *task = current_task;
 
-    if (verify_buffer(st, sizeof(*st)))
-        return -EFAULT;
+    if (which != PRIO_PROCESS)
+        return -EINVAL;
+
+    if (who) {
+        task = get_task_for_pid(who);
+        if (!task)
+            return -ESRCH;
+    }
+
+    return 20 - task->nice;
+}
+
+static int
+sys_setpriority(int which, int who, int nice)
+{
+    struct task *task = current_task;
+
+    if (which != PRIO_PROCESS)
+        return -EINVAL;
+
+    if (who) {
+        task = get_task_for_pid(who);
+        if (!task)
+            return -ESRCH;
+    }
+
+    sched_set_nice(task, nice);
+    return 0;
+}
+
+static int
+sys_stat(char *u_fn, struct stat *u_st)
+{
+    char *__fn, *fn, need_free = 0;
+    struct stat st;
+    int rc;
+
+    __fn = getname(u_fn);
+    if (IS_ERR(__fn))
+        return PTR_ERR(__fn);
 
     if (__fn[0] != '/') {
         fn =  __canonicalize_path(current_task->cwd, __fn);
         need_free = 1;
     } else fn = __fn;
 
-    memset(st, 0, sizeof(*st));
+    memset(&st, 0, sizeof(st));
 
     //printk("%s: canonical filename: %s\n", __func__, fn);
 
-    rc = vfs_stat(fn, st);
+    rc = vfs_stat(fn, &st);
     if (need_free)
         free(fn);
+    free(__fn);
+
+    if (rc == 0 && copy_to_user(u_st, &st, sizeof(st)))
+        return -EFAULT;
 
     return rc;
 }
 
 static int
-sys_fstat(int fd, struct stat *st)
+sys_fstat(int fd, struct stat *u_st)
 {
     struct file *f;
+    struct stat st;
+    int rc;
 
     if (fd < 0 || fd >= FD_MAX)
         return -EBADF;
 
-    if (verify_buffer(st, sizeof(*st)))
-        return -EFAULT;
-
     f = current_task->file_table[fd];
     if (!f)
             return -EBADF;
 
-    memset(st, 0, sizeof(*st));
+    memset(&st, 0, sizeof(st));
 
     /*
     printk("well fops is at 0x%x\n", f->fops);
@@ -364,7 +412,11 @@ sys_fstat(int fd, struct stat *st)
         printk("doesnt have a full_path so the fops is at 0x%x\n", f->fops);
     }*/
 
-    return f->fops->fstat(f, st);
+    rc = f->fops->fstat(f, &st);
+    if (rc == 0 && copy_to_user(u_st, &st, sizeof(st)))
+        return -EFAULT;
+
+    return rc;
 }
 
 static int
@@ -373,14 +425,9 @@ sys_execve(char *fn, char **u_argvp, char **u_envp)
     int rc = 0;
     char **argvp, **envp;
 
-    if (verify_buffer_string(fn, PATH_MAX))
-        return -EFAULT;
-
-    char *kfn = malloc(strlen(fn) + 1);
-    if (!kfn)
-        return -ENOMEM;
-    memset(kfn, 0, strlen(fn) + 1);
-    memcpy(kfn, fn, strlen(fn));
+    char *kfn = getname(fn);
+    if (IS_ERR(kfn))
+        return PTR_ERR(kfn);
 
     char *full_path = __canonicalize_path(current_task->cwd, kfn);
     free(kfn);
@@ -393,19 +440,17 @@ sys_execve(char *fn, char **u_argvp, char **u_envp)
         return -ENOENT;
     }
 
-    __flush_tlb();
-
     argvp = copy_array_from_user(u_argvp, ARGS_MAX);
-    if (IS_ERR(argvp) && PTR_ERR(argvp) == -EFAULT) {
+    if (IS_ERR(argvp)) {
         free(kfn);
-        return -EFAULT;
+        return PTR_ERR(argvp);
     }
 
     envp = copy_array_from_user(u_envp, ENVS_MAX);
-    if (IS_ERR(envp) && PTR_ERR(envp) == -EFAULT) {
+    if (IS_ERR(envp)) {
         free_copied_array(argvp);
         free(kfn);
-        return -EFAULT;
+        return PTR_ERR(envp);
     }
 
     //printk("EXECVE %d: FULL_PATH %s KFN %s\n", current_task->pid, f->full_path, kfn);
@@ -436,8 +481,6 @@ sys_execve(char *fn, char **u_argvp, char **u_envp)
         return rc;
     }
 
-    __flush_tlb();
-
     task_do_cloexec(current_task);
 
     signal_reset_for_execve(current_task);
@@ -463,8 +506,6 @@ sys_exit(int err_code)
     current_task->exit_code = err_code;
     current_task->owner->exit_code = err_code;
     current_task->owner->status = TASK_EXITED;
-    extern int __task_need_cleanup;
-    __task_need_cleanup ++;
     //printk("pid %d(%s) exited with exit code %d\n", current_task->pid, current_task->comm, err_code);
     sched_yield();
     __not_reached();
@@ -488,7 +529,7 @@ sys_write(int fd, char *buf, size_t count)
     if (count == 0)
         return 0;
 
-    if (verify_buffer(buf, count))
+    if (verify_user_range(buf, count, 0))
         return -EFAULT;
 
     return f->fops->write(f, buf, count);
@@ -535,19 +576,20 @@ sys_read(int fd, char *buf, size_t count)
     if (count == 0)
         return 0;
 
-    if (verify_buffer(buf, count))
+    if (verify_user_range(buf, count, 1))
         return -EFAULT;
 
     return f->fops->read(f, buf, count);
 }
 
 int
-sys_uname(struct uname *un)
+sys_uname(struct uname *u_un)
 {
-    if (verify_buffer(un, sizeof(*un)))
-        return -EFAULT;
+    struct uname un;
 
-    do_uname(un);
+    do_uname(&un);
+    if (copy_to_user(u_un, &un, sizeof(un)))
+        return -EFAULT;
 
     //vma_dump(current_task);
 
@@ -582,10 +624,12 @@ sys_socket(int domain, int family, int proto)
 }
 
 int
-sys_connect(int sockfd, void *sockaddr, size_t len)
+sys_connect(int sockfd, void *u_sockaddr, size_t len)
 {
     struct file *f;
     struct socket *sock;
+    void *sockaddr;
+    int rc;
 
     if (sockfd < 0 || sockfd >= FD_MAX)
         return -EBADF;
@@ -597,22 +641,32 @@ sys_connect(int sockfd, void *sockaddr, size_t len)
     if (f->type != FILE_TYPE_SOCKET)
         return -ENOTSOCK;
 
-    if (verify_buffer(sockaddr, len))
+    if (len > 4096)
+        return -EINVAL;
+
+    sockaddr = malloc(len);
+    if (!sockaddr)
+        return -ENOMEM;
+
+    if (copy_from_user(sockaddr, u_sockaddr, len)) {
+        free(sockaddr);
         return -EFAULT;
+    }
 
     sock = f->priv;
 
-    return sock->sock_ops->connect(sock, sockaddr, len);
+    rc = sock->sock_ops->connect(sock, sockaddr, len);
+    free(sockaddr);
+
+    return rc;
 }
 
-int
-sys_waitpid(pid_t pid, int *wstatus, int opts)
+/* do_waitpid - waitpid(2), the status is stored to the kernel's @wstatus */
+static int
+do_waitpid(pid_t pid, int *wstatus, int opts)
 {
     struct process *target;
 
-    if (verify_buffer(wstatus, sizeof(int)))
-        return -EFAULT;
-
     /* TODO: support the opts field */
     //if (opts != 0)
         //return -EINVAL;
@@ -700,6 +754,19 @@ retry:
     return -ENOSYS;
 }
 
+int
+sys_waitpid(pid_t pid, int *u_wstatus, int opts)
+{
+    int wstatus = 0, rc;
+
+    rc = do_waitpid(pid, &wstatus, opts);
+    if (rc > 0 && u_wstatus &&
+            copy_to_user(u_wstatus, &wstatus, sizeof(wstatus)))
+        return -EFAULT;
+
+    return rc;
+}
+
 int
 sys_lseek(int fd, size_t off, int whence)
 {
@@ -800,7 +867,7 @@ sys_readdir(int fd, struct linux_dirent *buf, int count)
     if (!f->isdir)
         return -ENOTDIR;
 
-    if (verify_buffer(buf, sizeof(struct linux_dirent)))
+    if (verify_user_range(buf, sizeof(struct linux_dirent), 1))
         return -EFAULT;
 
     return f->fops->readdir(f, buf);
@@ -954,9 +1021,6 @@ sys_pipe(int *fildes)
     int kfds[2] = { -1, -1 };
     int rc;
 
-    if (verify_buffer(fildes, sizeof(int) * 2))
-        return -EFAULT;
-
     /* check if there is enough space in the file_table */
     for (i = 0; i < FD_MAX; i ++)
         if (current_task->file_table[i] == NULL) {
@@ -975,8 +1039,8 @@ sys_pipe(int *fildes)
     if (rc)
         return rc;
 
-    fildes[0] = kfds[0];
-    fildes[1] = kfds[1];
+    if (copy_to_user(fildes, kfds, sizeof(kfds)))
+        return -EFAULT;
 
     return 0;
 }
@@ -984,20 +1048,12 @@ sys_pipe(int *fildes)
 int
 sys_chdir(char *fn)
 {
-    int len;
     char *kbuf;
     char *ptr;
 
-    if (verify_buffer_string(fn, PATH_MAX))
-        return -EFAULT;
-
-    len = strlen(fn);
-    kbuf = malloc(len + 1);
-    if (!kbuf)
-        return -ENOMEM;
-
-    memset(kbuf, 0, len + 1);
-    memcpy(kbuf, fn, len);
+    kbuf = getname(fn);
+    if (IS_ERR(kbuf))
+        return PTR_ERR(kbuf);
 
     ptr = canonicalize_path(current_task->cwd, kbuf);
     if (IS_ERR(ptr)) {
@@ -1033,8 +1089,17 @@ sys_sbrk(int incr)
         //panic("WARNING: application %d is trying to free %d bytes of memory\n",
                 //t->pid, -incr);
 
+        if (bs->logical_brk - bs->base_brk < (uintptr_t) -incr)
+            return -ENOMEM;
+
         bs->logical_brk -= (-1) * incr;
 
+        /* give back the pages the heap no longer reaches */
+        if (PG_RND_UP(bs->logical_brk) < bs->actual_brk) {
+            unmap_user_pages(t->mm, PG_RND_UP(bs->logical_brk), bs->actual_brk);
+            bs->actual_brk = PG_RND_UP(bs->logical_brk);
+        }
+
         return ret;
     }
 
@@ -1052,17 +1117,19 @@ sys_sbrk(int incr)
         int i, num = 1;
         uintptr_t ret = bs->logical_brk;
         uintptr_t i_ret = ret;
+        uintptr_t old_brk = bs->actual_brk;
         ret = (ret + 0xfff) & ~0xfff; /* Rounds ret to 0x1000 in O(1) */
         bs->logical_brk += (ret - i_ret) + incr;
 
+        /* new heap pages take up a frame only once they are written to */
         while (bs->logical_brk > bs->actual_brk) {
-            uintptr_t phys = palloc_get_page();
-            map_page_curr(phys, bs->actual_brk, 1);
-            //memset(bs->actual_brk, 0, 4096);
+            map_zero_page_curr(bs->actual_brk, 1);
             bs->actual_brk += 0x1000;
         }
 
-        memset(ret, 0, incr);
+        /* only what was mapped before can hold stale data */
+        if (ret < old_brk)
+            memset(ret, 0, old_brk - ret);
 
         //printk("STATE HARD: actual: 0x%x logical 0x%x ret 0x%x\n",
                 //bs->actual_brk, bs->logical_brk, ret);
@@ -1078,15 +1145,11 @@ sys_getcwd(char *buf, unsigned long size)
     if (!size || !buf)
         return -EINVAL;
 
-    if (verify_buffer(buf, size))
-        return -EFAULT;
-
     if ((strlen(current_task->cwd) + 1) > size)
         return -ERANGE;
 
-    memset(buf, 0, size);
-
-    memcpy(buf, current_task->cwd, strlen(current_task->cwd));
+    if (copy_to_user(buf, current_task->cwd, strlen(current_task->cwd) + 1))
+        return -EFAULT;
 
     return 0;
 }
@@ -1148,13 +1211,14 @@ sys_sysconf(int req)
 }
 
 int
-sys_mkdir(char *pathname, int mode)
+sys_mkdir(char *u_pathname, int mode)
 {
-    char *fn, need_free = 0;
+    char *pathname, *fn, need_free = 0;
     int rc;
 
-    if (verify_buffer_string(pathname, PATH_MAX))
-        return -EFAULT;
+    pathname = getname(u_pathname);
+    if (IS_ERR(pathname))
+        return PTR_ERR(pathname);
 
     if (pathname[0] != '/') {
         fn =  __canonicalize_path(current_task->cwd, pathname);
@@ -1164,6 +1228,7 @@ sys_mkdir(char *pathname, int mode)
     rc = vfs_mkdir(fn, mode);
     if (need_free)
         free(fn);
+    free(pathname);
 
     return rc;
 }
@@ -1173,6 +1238,8 @@ __deliver_alarm(void *aux)
 {
     struct task *task = aux;
 
+    /* the work is freed once we return */
+    task->alarm_work = NULL;
     send_signal(task, SIGALRM);
 }
 
@@ -1218,9 +1285,16 @@ sys_secsleep(int secs)
 }
 
 int
-sys_gettimeofday(struct timeval *tv, void *z)
+sys_gettimeofday(struct timeval *u_tv, void *z)
 {
-    return gettimeofday(tv, z);
+    struct timeval tv;
+    int rc;
+
+    rc = gettimeofday(&tv, NULL);
+    if (rc == 0 && u_tv && copy_to_user(u_tv, &tv, sizeof(tv)))
+        return -EFAULT;
+
+    return rc;
 }
 
 struct mmap_arg_struct {
@@ -1233,29 +1307,42 @@ struct mmap_arg_struct {
 };
 
 int
-sys_mmap(struct mmap_arg_struct *arg)
+sys_mmap(struct mmap_arg_struct *u_arg)
 {
+    struct mmap_arg_struct arg;
     struct file *f = NULL;
 
-    if (verify_buffer(arg, sizeof(*arg)))
+    if (copy_from_user(&arg, u_arg, sizeof(arg)))
         return -EFAULT;
 
-    if (!(arg->flags & MAP_ANONYMOUS)) {
-        if (arg->fd < 0 || arg->fd >= FD_MAX)
+    if (!(arg.flags & MAP_ANONYMOUS)) {
+        if (arg.fd < 0 || arg.fd >= FD_MAX)
             return -EBADF;
 
-        f = current_task->file_table[arg->fd];
+        f = current_task->file_table[arg.fd];
         if (!f)
             return -EBADF;
     }
 
-    return (int) do_mmap(arg->addr, arg->len, arg->prot, arg->flags, f, arg->offset);
+    return (int) do_mmap(arg.addr, arg.len, arg.prot, arg.flags, f, arg.offset);
 }
 
 int
 sys_munmap(void *addr, size_t len)
 {
-    return -ENOSYS;
+    return do_munmap(addr, len);
+}
+
+int
+sys_mprotect(void *addr, size_t len, int prot)
+{
+    return do_mprotect(addr, len, prot);
+}
+
+int
+sys_madvise(void *addr, size_t len, int advice)
+{
+    return do_madvise(addr, len, advice);
 }
 
 int
@@ -1265,13 +1352,17 @@ sys_getppid()
 }
 
 int
-sys_sigprocmask(int how, unsigned long *new, unsigned long *old)
+sys_sigprocmask(int how, unsigned long *u_new, unsigned long *old)
 {
     uint64_t old_mask = signal_get_mask(current_task);
+    unsigned long mask, *new = &mask;
 
-    if (new == NULL)
+    if (u_new == NULL)
         goto set_old;
 
+    if (copy_from_user(&mask, u_new, sizeof(mask)))
+        return -EFAULT;
+
     if (how == SIG_BLOCK) {
         signal_set_mask(current_task, old_mask | (uint32_t)*new);
         goto set_old;
@@ -1287,12 +1378,13 @@ sys_sigprocmask(int how, unsigned long *new, unsigned long *old)
 
 set_old:
         //reschedule_to(current_task);
-        if (old == NULL) {
+        if (old == NULL)
             return 0;
-        } else if (verify_buffer(old, sizeof(unsigned long)))
+
+        mask = (uint32_t) old_mask;
+        if (copy_to_user(old, &mask, sizeof(mask)))
             return -EFAULT;
 
-        *old = (uint32_t) old_mask;
         return 0;
 }
 
@@ -1377,6 +1469,9 @@ __trace_syscall(int no, uint32_t a, uint32_t b, uint32_t c, uint32_t d)
         case 0x1f:
             printk("pid %d sys_connect(%d, 0x%x, %d)\n", pid, a, b, c);
             return;
+        case 0x22:
+            printk("pid %d sys_nice(%d)\n", pid, a);
+            return;
         case 0x23:
             printk("pid %d sys_sbrk(0x%x)\n", pid, a);
             return;
@@ -1428,9 +1523,18 @@ __trace_syscall(int no, uint32_t a, uint32_t b, uint32_t c, uint32_t d)
         case 0x5b:
             printk("pid %d sys_munmap(0x%x, 0x%x)\n", pid, a, b);
             return;
+        case 0x60:
+            printk("pid %d sys_getpriority(%d, %d)\n", pid, a, b);
+            return;
+        case 0x61:
+            printk("pid %d sys_setpriority(%d, %d, %d)\n", pid, a, b, c);
+            return;
         case 0x6d:
             printk("pid %d sys_uname(0x%x)\n", pid, a);
             return;
+        case 0x7d:
+            printk("pid %d sys_mprotect(0x%x, 0x%x, %d)\n", pid, a, b, c);
+            return;
         case 0x7e:
             printk("pid %d sys_sigprocmask(%d, 0x%x, 0x%x)\n", pid, a, b, c);
             return;
@@ -1443,6 +1547,9 @@ __trace_syscall(int no, uint32_t a, uint32_t b, uint32_t c, uint32_t d)
         case 0xb7:
             printk("pid %d sys_getcwd(0x%x, %d)\n", pid, a, b);
             return;
+        case 0xdb:
+            printk("pid %d sys_madvise(0x%x, 0x%x, %d)\n", pid, a, b, c);
+            return;
     }
 }
 
@@ -1453,6 +1560,61 @@ __trace_return(int rc)
             current_task->pid, rc, errno_to_string(rc));
 }
 
+/*
+ * The system calls by their Linux/i386 numbers. They are called with all
+ * four argument registers, the ones a call doesn't declare are just
+ * ignored by it, like with any cdecl function.
+ */
+typedef int (*syscall_func)(uint32_t, uint32_t, uint32_t, uint32_t);
+
+#define NR_SYSCALLS 0x100
+
+static const syscall_func syscall_table[NR_SYSCALLS] = {
+    [0x01] = (syscall_func) sys_exit,
+    [0x02] = (syscall_func) sys_fork,
+    [0x03] = (syscall_func) sys_read,
+    [0x04] = (syscall_func) sys_write,
+    [0x05] = (syscall_func) sys_open,
+    [0x06] = (syscall_func) sys_close,
+    [0x07] = (syscall_func) sys_waitpid,
+    [0x0b] = (syscall_func) sys_execve,
+    [0x0c] = (syscall_func) sys_chdir,
+    [0x11] = (syscall_func) sys_socket,
+    [0x12] = (syscall_func) sys_stat,
+    [0x13] = (syscall_func) sys_lseek,
+    [0x14] = (syscall_func) sys_getpid,
+    [0x1b] = (syscall_func) sys_alarm,
+    [0x1c] = (syscall_func) sys_fstat,
+    [0x1f] = (syscall_func) sys_connect,
+    [0x22] = (syscall_func) sys_nice,
+    [0x23] = (syscall_func) sys_sbrk,
+    [0x25] = (syscall_func) sys_kill,
+    [0x27] = (syscall_func) sys_mkdir,
+    [0x29] = (syscall_func) sys_dup,
+    [0x2a] = (syscall_func) sys_pipe,
+    [0x2c] = (syscall_func) sys_sysconf,
+    [0x30] = (syscall_func) sys_signal,
+    [0x36] = (syscall_func) sys_ioctl,
+    [0x37] = (syscall_func) sys_fcntl,
+    [0x39] = (syscall_func) sys_setpgid,
+    [0x3f] = (syscall_func) sys_dup2,
+    [0x40] = (syscall_func) sys_getppid,
+    [0x42] = (syscall_func) sys_setsid,
+    [0x4e] = (syscall_func) sys_gettimeofday,
+    [0x59] = (syscall_func) sys_readdir,
+    [0x5a] = (syscall_func) sys_mmap,
+    [0x5b] = (syscall_func) sys_munmap,
+    [0x60] = (syscall_func) sys_getpriority,
+    [0x61] = (syscall_func) sys_setpriority,
+    [0x6d] = (syscall_func) sys_uname,
+    [0x7d] = (syscall_func) sys_mprotect,
+    [0x7e] = (syscall_func) sys_sigprocmask,
+    [0x84] = (syscall_func) sys_getpgid,
+    [0xa2] = (syscall_func) sys_secsleep,
+    [0xb7] = (syscall_func) sys_getcwd,
+    [0xdb] = (syscall_func) sys_madvise,
+};
+
 int __sysctl_trace_sys = 0;
 
 int
@@ -1467,124 +1629,12 @@ syscall_hub(int no, uint32_t a, uint32_t b, uint32_t c, uint32_t d)
     if (__sysctl_trace_sys)
         __trace_syscall(no, a, b, c, d);
     int rc;
-    switch(no) {
-        case 0x1:
-            sys_exit((int) a);
-            __not_reached();
-        case 0x2:
-            rc = sys_fork();
-            break;
-        case 0x3:
-            rc = sys_read((int) a, (char *)b, (size_t) c);
-            break;
-        case 0x4:
-            rc = sys_write((int) a, (char *)b, (size_t) c);
-            break;
-        case 0x5:
-            rc = sys_open((char *) a, (int) b, (int) c);
-            break;
-        case 0x6:
-            rc = sys_close((int) a);
-            break;
-        case 0x7:
-            rc = sys_waitpid((pid_t) a, (int *) b, (int) c);
-            break;
-        case 0xB:
-            rc = sys_execve((char *) a, (char **) b, (char **) c);
-            break;
-        case 0xC:
-            rc = sys_chdir((char *) a);
-            break;
-        case 0x11:
-            rc = sys_socket((int) a, (int) b, (int) c);
-            break;
-        case 0x12:
-            rc = sys_stat((char *) a, (struct stat *) b);
-            break;
-        case 0x13:
-            rc = sys_lseek((int) a, (size_t) b, (int) c);
-            break;
-        case 0x14:
-            rc = sys_getpid();
-            break;
-        case 0x1b:
-            rc = sys_alarm((int) a);
-            break;
-        case 0x1c:
-            rc = sys_fstat((int) a, (struct stat *) b);
-            break;
-        case 0x1f:
-            rc = sys_connect((int) a, (void *) b, (size_t) c);
-            break;
-        case 0x23:
-            rc = sys_sbrk((int) a);
-            break;
-        case 0x25:
-            rc = sys_kill((int) a, (int) b);
-            break;
-        case 0x27:
-            rc = sys_mkdir((char *) a, (int) b);
-            break;
-        case 0x29:
-            rc = sys_dup((int) a);
-            break;
-        case 0x2a:
-            rc = sys_pipe((int *) a);
-            break;
-        case 0x2c:
-            rc = sys_sysconf((int) a);
-            break;
-        case 0x30:
-            rc = sys_signal((int) a, (sighandler_t) b);
-            break;
-        case 0x36:
-            rc = sys_ioctl((int) a, (unsigned int) b, (unsigned int) c);
-            break;
-        case 0x37:
-            rc = sys_fcntl((int) a, (int) b, (int) c);
-            break;
-        case 0x39:
-            rc = sys_setpgid((int) a, (int) b);
-            break;
-        case 0x3f:
-            rc = sys_dup2((int) a, (int) b);
-            break;
-        case 0x40:
-            rc = sys_getppid();
-            break;
-        case 0x42:
-            rc = sys_setsid();
-            break;
-        case 0x4e:
-            rc = sys_gettimeofday((void *) a, (void *) b);
-        case 0x59:
-            rc = sys_readdir((int) a, (struct linux_dirent *) b, (int) c);
-            break;
-        case 0x5a:
-            rc = sys_mmap((void *) a);
-            break;
-        case 0x5b:
-            rc = sys_munmap((unsigned long) a, (size_t) b);
-            break;
-        case 0x6d:
-            rc = sys_uname((struct uname *) a);
-            break;
-        case 0x7e:
-            rc = sys_sigprocmask((int) a, (void *) b, (void *)c);
-            break;
-        case 0x84:
-            rc = sys_getpgid((int) a);
-            break;
-        case 0xa2:
-            rc = sys_secsleep((int) a);
-            break;
-        case 0xb7:
-            rc = sys_getcwd((char *) a, (unsigned long) b);
-            break;
-        default:
-            syscall_undefined(no);
-            rc = -ENOSYS;
-            break;
+
+    if ((uint32_t) no < NR_SYSCALLS && syscall_table[no]) {
+        rc = syscall_table[no](a, b, c, d);
+    } else {
+        syscall_undefined(no);
+        rc = -ENOSYS;
     }
 
     if (__sysctl_trace_sys)
@@ -1595,8 +1645,6 @@ syscall_hub(int no, uint32_t a, uint32_t b, uint32_t c, uint32_t d)
             //current_task->pid, no, no, a, b, c, d);
     }
 
-    __flush_tlb();
-
     if (!signal_processing(current_task))
         current_task->flags &= ~TFLAG_PROCESSING_SYSCALL;
 
@@ -1,5 +1,8 @@
 #include <levos/kernel.h>
+#include <levos/arch.h>
 #include <levos/time.h>
+#include <levos/timer.h>
+#include <levos/vsyscall.h>
 
 #define MODULE_NAME time
 
@@ -7,6 +10,127 @@ static struct timesource *current_timesource;
 
 static uint64_t __boot_time;
 
+/*
+ * The clock. Every timer tick moves the wall time on by the length of a
+ * tick, and the TSC tells how far a reader is into the current one. The
+ * data is in a page of its own, as userspace reads it too, through the
+ * vsyscall page. Only the boot processor gets the PIT interrupt, so
+ * there is only ever one writer.
+ */
+static union {
+    struct vsyscall_data vd;
+    char page[4096];
+} __clock_page __page_align;
+
+struct vsyscall_data *vsyscall_data = &__clock_page.vd;
+
+/* the TSC is measured against this many ticks */
+#define TSC_CALIB_SHIFT 4
+#define TSC_CALIB_TICKS (1 << TSC_CALIB_SHIFT)
+
+static int __have_tsc;
+static int __tsc_calib_ticks;
+static uint64_t __tsc_calib_start;
+
+static void
+__tsc_calibrate(uint64_t tsc)
+{
+    struct vsyscall_data *vd = vsyscall_data;
+    uint32_t per_tick, mult, rem;
+
+    if (__tsc_calib_ticks ++ == 0) {
+        __tsc_calib_start = tsc;
+        return;
+    }
+
+    if (__tsc_calib_ticks <= TSC_CALIB_TICKS)
+        return;
+
+    per_tick = (uint32_t) ((tsc - __tsc_calib_start) >> TSC_CALIB_SHIFT);
+
+    /* the quotient has to fit in 32 bits, the TSC is never that slow */
+    if (per_tick <= vd->vd_tick_usec)
+        return;
+
+    asm("divl %2":"=a"(mult), "=d"(rem):"r"(per_tick), "a"(0),
+            "d"(vd->vd_tick_usec));
+    vd->vd_tsc_mult = mult;
+
+    mprintk("TSC runs at %d cycles per tick\n", per_tick);
+}
+
+/* time_tick - advance the clock by a tick, from the PIT interrupt */
+void
+time_tick(void)
+{
+    struct vsyscall_data *vd = vsyscall_data;
+    uint64_t tsc = 0;
+
+    if (__have_tsc)
+        tsc = arch_rdtsc();
+
+    write_seqcount_begin(&vd->vd_seq);
+
+    vd->vd_usec += vd->vd_tick_usec;
+    if (vd->vd_usec >= 1000000) {
+        vd->vd_usec -= 1000000;
+        vd->vd_sec ++;
+    }
+    vd->vd_tsc = tsc;
+
+    if (tsc && !vd->vd_tsc_mult)
+        __tsc_calibrate(tsc);
+
+    write_seqcount_end(&vd->vd_seq);
+}
+
+/* like the gettimeofday of the vsyscall page, see arch/x86/sysenter.S */
+static int
+clock_gettimeofday(struct timeval *tv, void *tz)
+{
+    struct vsyscall_data *vd = vsyscall_data;
+    uint32_t seq, usec, delta;
+    uint64_t sec, tsc;
+
+    do {
+        seq = read_seqcount_begin(&vd->vd_seq);
+
+        sec = vd->vd_sec;
+        usec = vd->vd_usec;
+
+        if (vd->vd_tsc_mult) {
+            tsc = arch_rdtsc() - vd->vd_tsc;
+
+            /* a reader on another CPU may see its TSC a little behind */
+            if (tsc >> 32)
+                delta = 0;
+            else
+                delta = ((uint64_t) (uint32_t) tsc * vd->vd_tsc_mult) >> 32;
+
+            /* never past the next tick */
+            if (delta >= vd->vd_tick_usec)
+                delta = vd->vd_tick_usec - 1;
+
+            usec += delta;
+        }
+    } while (read_seqcount_retry(&vd->vd_seq, seq));
+
+    if (usec >= 1000000) {
+        usec -= 1000000;
+        sec ++;
+    }
+
+    tv->tv_sec = sec;
+    tv->tv_usec = usec;
+
+    return 0;
+}
+
+static struct timesource clock_timesource = {
+    .name = "PIT+TSC",
+    .gettimeofday = clock_gettimeofday,
+};
+
 void
 timesource_set(struct timesource *ts)
 {
@@ -17,6 +141,8 @@ timesource_set(struct timesource *ts)
 int
 time_init(void)
 {
+    uint32_t flags;
+
     mprintk("initializing\n");
 
     rtc_init();
@@ -27,6 +153,18 @@ time_init(void)
 
     mprintk("UNIX timestamp of boot: %d\n", __boot_time);
 
+    /* the RTC only has seconds, the clock counts on from there */
+    flags = arch_irq_save();
+    write_seqcount_begin(&vsyscall_data->vd_seq);
+    vsyscall_data->vd_tick_usec = 1000000 / HZ;
+    vsyscall_data->vd_sec = __boot_time;
+    vsyscall_data->vd_usec = 0;
+    write_seqcount_end(&vsyscall_data->vd_seq);
+    __have_tsc = !!(arch_cpuid_edx() & X86_CPUID_EDX_TSC);
+    arch_irq_restore(flags);
+
+    timesource_set(&clock_timesource);
+
     return 0;
 }
 
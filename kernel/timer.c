@@ -0,0 +1,221 @@
+#include <levos/kernel.h>
+#include <levos/timer.h>
+#include <levos/list.h>
+#include <levos/spinlock.h>
+
+#define MODULE_NAME timer
+
+/*
+ * A hierarchical timer wheel. The first level has a slot for each of
+ * the next 256 ticks, every level above it has 64 slots that each cover
+ * as many ticks as the whole level below. Arming a timer is putting it
+ * on the list of the slot its expiry falls in, and every time the first
+ * level wraps around the next slot of the level above is spread out
+ * over the one below, so nothing is ever sorted or scanned.
+ *
+ * The wheel is driven by the PIT interrupt, which only the boot CPU
+ * takes, so the callbacks all run there with interrupts disabled.
+ */
+
+#define TVR_BITS 8
+#define TVN_BITS 6
+#define TVR_SIZE (1 << TVR_BITS)
+#define TVN_SIZE (1 << TVN_BITS)
+#define TVR_MASK (TVR_SIZE - 1)
+#define TVN_MASK (TVN_SIZE - 1)
+
+/* the levels above the first one */
+#define TVN_LEVELS 4
+
+extern volatile uint32_t __pit_ticks;
+
+static struct list tv1[TVR_SIZE];
+static struct list tvn[TVN_LEVELS][TVN_SIZE];
+
+/* the next tick whose timers have not been run */
+static uint32_t timer_jiffies;
+
+static spinlock_t timer_lock;
+
+/* the timer whose callback is being run right now */
+static struct timer *volatile timer_running;
+
+static inline int
+__tvn_index(uint32_t ticks, int level)
+{
+    return (ticks >> (TVR_BITS + level * TVN_BITS)) & TVN_MASK;
+}
+
+/* timer_lock must be held */
+static void
+__timer_enqueue(struct timer *timer)
+{
+    uint32_t expires = timer->timer_expires;
+    uint32_t idx = expires - timer_jiffies;
+    struct list *vec;
+    int level;
+
+    if ((int32_t) idx < 0) {
+        /* already due, it runs on the next tick */
+        vec = &tv1[timer_jiffies & TVR_MASK];
+    } else if (idx < TVR_SIZE) {
+        vec = &tv1[expires & TVR_MASK];
+    } else {
+        for (level = 0; level < TVN_LEVELS - 1; level ++)
+            if (idx < 1U << (TVR_BITS + (level + 1) * TVN_BITS))
+                break;
+
+        vec = &tvn[level][__tvn_index(expires, level)];
+    }
+
+    list_push_back(vec, &timer->elem);
+}
+
+/* spread the current slot of @level over the levels below it */
+static int
+__timer_cascade(int level)
+{
+    int index = __tvn_index(timer_jiffies, level);
+    struct list *vec = &tvn[level][index];
+
+    while (!list_empty(vec))
+        __timer_enqueue(list_entry(list_pop_front(vec), struct timer, elem));
+
+    return index;
+}
+
+/* timer_setup - prepare @timer to call @func with @aux once it expires */
+void
+timer_setup(struct timer *timer, void (*func)(void *), void *aux)
+{
+    timer->timer_func = func;
+    timer->timer_aux = aux;
+    timer->timer_expires = 0;
+    timer->timer_flags = 0;
+}
+
+/*
+ * timer_add - arm @timer to expire once the tick count reaches @expires,
+ *             a timer that is already pending is moved
+ */
+void
+timer_add(struct timer *timer, uint32_t expires)
+{
+    uint32_t flags;
+
+    flags = spin_lock_irqsave(&timer_lock);
+    if (timer_pending(timer))
+        list_remove(&timer->elem);
+    timer->timer_expires = expires;
+    timer->timer_flags |= TIMER_FLAG_PENDING;
+    __timer_enqueue(timer);
+    spin_unlock_irqrestore(&timer_lock, flags);
+}
+
+/*
+ * timer_del - disarm @timer, returns 1 if it was still pending, 0 if it
+ *             has already expired or was never armed
+ */
+int
+timer_del(struct timer *timer)
+{
+    uint32_t flags;
+    int ret = 0;
+
+    flags = spin_lock_irqsave(&timer_lock);
+    if (timer_pending(timer)) {
+        list_remove(&timer->elem);
+        timer->timer_flags &= ~TIMER_FLAG_PENDING;
+        ret = 1;
+    }
+    spin_unlock_irqrestore(&timer_lock, flags);
+
+    return ret;
+}
+
+/*
+ * timer_del_sync - like timer_del(), but also wait for the callback to
+ *                  return if it is running on another CPU, so that the
+ *                  structure holding @timer can be freed afterwards.
+ *                  Never call it from the callback itself.
+ */
+int
+timer_del_sync(struct timer *timer)
+{
+    int ret = timer_del(timer);
+
+    while (timer_running == timer)
+        asm volatile("pause");
+
+    return ret;
+}
+
+uint32_t
+timer_ticks(void)
+{
+    return __pit_ticks;
+}
+
+/*
+ * timer_tick - run every timer that expired up to the current tick,
+ *              called from the PIT interrupt
+ */
+void
+timer_tick(void)
+{
+    struct list expired;
+    struct list *vec;
+    struct timer *timer;
+    int index, level;
+
+    spin_lock(&timer_lock);
+
+    while ((int32_t) (__pit_ticks - timer_jiffies) >= 0) {
+        index = timer_jiffies & TVR_MASK;
+
+        /* the first level wrapped around, refill it from above */
+        if (index == 0)
+            for (level = 0; level < TVN_LEVELS; level ++)
+                if (__timer_cascade(level) != 0)
+                    break;
+
+        timer_jiffies ++;
+
+        vec = &tv1[index];
+        list_init(&expired);
+        list_splice(list_end(&expired), list_begin(vec), list_end(vec));
+
+        while (!list_empty(&expired)) {
+            timer = list_entry(list_pop_front(&expired), struct timer, elem);
+            timer->timer_flags &= ~TIMER_FLAG_PENDING;
+            timer_running = timer;
+
+            spin_unlock(&timer_lock);
+            timer->timer_func(timer->timer_aux);
+            spin_lock(&timer_lock);
+
+            timer_running = NULL;
+        }
+    }
+
+    spin_unlock(&timer_lock);
+}
+
+void
+timer_init(void)
+{
+    int i, level;
+
+    spin_lock_init(&timer_lock);
+
+    for (i = 0; i < TVR_SIZE; i ++)
+        list_init(&tv1[i]);
+
+    for (level = 0; level < TVN_LEVELS; level ++)
+        for (i = 0; i < TVN_SIZE; i ++)
+            list_init(&tvn[level][i]);
+
+    timer_jiffies = __pit_ticks;
+
+    mprintk("timer wheel initialized\n");
+}
@@ -1,5 +1,8 @@
 #include <levos/kernel.h>
 #include <levos/task.h>
+#include <levos/slab.h>
+
+static struct kmem_cache *wait_ev_cache;
 
 /*
  * wait_ev_create - create a wait event
@@ -11,7 +14,7 @@
 struct wait_ev *
 wait_ev_create(struct process *who, int what, int extra)
 {
-    struct wait_ev *ev = malloc(sizeof(*ev));
+    struct wait_ev *ev = kmem_cache_alloc(wait_ev_cache);
     if (!ev)
         return NULL;
 
@@ -45,5 +48,13 @@ wait_ev_queue(struct task *task, struct wait_ev *wev)
 void
 wait_ev_destroy(struct wait_ev *ev)
 {
-    free(ev);
+    kmem_cache_free(wait_ev_cache, ev);
+}
+
+void
+wait_init(void)
+{
+    wait_ev_cache = kmem_cache_create("wait_ev", sizeof(struct wait_ev), NULL);
+    if (!wait_ev_cache)
+        panic("wait: unable to create the wait event cache\n");
 }
@@ -3,52 +3,91 @@
 #include <levos/list.h>
 #include <levos/spinlock.h>
 #include <levos/task.h>
+#include <levos/slab.h>
+#include <levos/timer.h>
 
+/* work whose time has come, waiting for the worker in order */
 struct list work_list;
 spinlock_t work_lock;
 struct work *current_work;
 
-extern uint32_t __pit_ticks;
-
 struct task *worker_task;
 
 uint32_t
 work_get_ticks()
 {
-    /* XXX: x86 specific */
-    return __pit_ticks;
+    return timer_ticks();
 }
 
-bool
-work_less(const struct list_elem *ea, const struct list_elem *eb, void *aux)
+/* work_lock must be held */
+static void
+__work_ready(struct work *work)
 {
-    struct work *a = list_entry(ea, struct work, elem);
-    struct work *b = list_entry(eb, struct work, elem);
+    work->work_flags |= WORK_FLAG_READY;
+    list_push_back(&work_list, &work->elem);
+}
+
+/*
+ * __work_timer_fn - the timer of a work item expired, hand it to the
+ *                   worker. Runs from the timer interrupt.
+ */
+static void
+__work_timer_fn(void *aux)
+{
+    struct work *work = aux;
+
+    spin_lock(&work_lock);
 
-    return a->work_at < b->work_at;
+    /* work_cancel() raced with us and left the freeing to us */
+    if (work->work_flags & WORK_FLAG_CANCELLED) {
+        work->work_flags &= ~WORK_FLAG_QUEUED;
+        if (work != current_work)
+            work_destroy(work);
+        spin_unlock(&work_lock);
+        return;
+    }
+
+    __work_ready(work);
+    spin_unlock(&work_lock);
+
+    task_kick(worker_task);
 }
 
+/* schedule_work - run @work as soon as the worker gets to it */
 int
 schedule_work(struct work *work)
 {
-    spin_lock(&work_lock);
-    list_insert_ordered(&work_list, &work->elem, work_less, NULL);
-    spin_unlock(&work_lock);
+    uint32_t flags;
+
+    flags = spin_lock_irqsave(&work_lock);
+    work->work_flags |= WORK_FLAG_QUEUED;
+    __work_ready(work);
+    spin_unlock_irqrestore(&work_lock, flags);
 
     task_kick(worker_task);
 
     return 0;
 }
 
+/*
+ * schedule_work_at - run @work once the tick count reaches @abs, returns
+ *                    1 without queueing it if that is in the past
+ */
 int
 schedule_work_at(struct work *work, uint32_t abs)
 {
+    uint32_t flags;
+
     if (abs < work_get_ticks())
         return 1;
 
+    flags = spin_lock_irqsave(&work_lock);
     work->work_at = abs;
+    work->work_flags |= WORK_FLAG_QUEUED;
+    timer_add(&work->work_timer, abs);
+    spin_unlock_irqrestore(&work_lock, flags);
 
-    return schedule_work(work);
+    return 0;
 }
 
 int
@@ -70,24 +109,44 @@ work_reschedule(uint32_t delay)
     return 0;
 }
 
+/*
+ * work_cancel - make sure @work does not run (again) and free it, unless
+ *               it is running right now, then it is freed once it returns
+ */
 int
 work_cancel(struct work *work)
 {
-    spin_lock(&work_lock);
+    uint32_t flags;
+    int rc = 0;
+
+    flags = spin_lock_irqsave(&work_lock);
 
-    if (work == current_work) {
+    if (!(work->work_flags & WORK_FLAG_QUEUED)) {
         /* if the currently running work is being cancelled, set a flag */
-        work->work_flags |= WORK_FLAG_CANCELLED;
-    } else if (work->work_flags & WORK_FLAG_QUEUED == 0) {
-        return -1;
-    } else {
-        list_remove(&work->elem);
-        work_destroy(work);
+        if (work == current_work)
+            work->work_flags |= WORK_FLAG_CANCELLED;
+        else
+            rc = -1;
+
+        spin_unlock_irqrestore(&work_lock, flags);
+        return rc;
     }
 
-    spin_unlock(&work_lock);
+    work->work_flags |= WORK_FLAG_CANCELLED;
 
-    return 0;
+    if (timer_del(&work->work_timer) || (work->work_flags & WORK_FLAG_READY)) {
+        if (work->work_flags & WORK_FLAG_READY)
+            list_remove(&work->elem);
+        work->work_flags &= ~(WORK_FLAG_QUEUED | WORK_FLAG_READY);
+        if (work != current_work)
+            work_destroy(work);
+    }
+
+    /* otherwise the timer is firing right now and __work_timer_fn frees it */
+
+    spin_unlock_irqrestore(&work_lock, flags);
+
+    return rc;
 }
 
 int
@@ -98,10 +157,12 @@ work_cancel_current(void)
     return work_cancel(current_work);
 }
 
+static struct kmem_cache *work_cache;
+
 struct work *
 work_create(void (*f)(void *), void *aux)
 {
-    struct work *work = malloc(sizeof(*work));
+    struct work *work = kmem_cache_alloc(work_cache);
     if (!work)
         return NULL;
 
@@ -109,6 +170,7 @@ work_create(void (*f)(void *), void *aux)
     work->work_aux = aux;
     work->work_at = 0;
     work->work_flags = 0;
+    timer_setup(&work->work_timer, __work_timer_fn, work);
 
     return work;
 }
@@ -116,39 +178,52 @@ work_create(void (*f)(void *), void *aux)
 void
 work_destroy(struct work *work)
 {
-    free(work);
+    kmem_cache_free(work_cache, work);
 }
 
 void
 do_work(struct work *work)
 {
+    uint32_t flags;
+    int requeued;
+
     current_work = work;
 
     work->work_func(work->work_aux);
-    
-    work_destroy(work);
+
+    /* the work might have rescheduled itself with work_reschedule() */
+    flags = spin_lock_irqsave(&work_lock);
+    current_work = NULL;
+    requeued = work->work_flags & WORK_FLAG_QUEUED;
+    spin_unlock_irqrestore(&work_lock, flags);
+
+    if (!requeued)
+        work_destroy(work);
 }
 
 void
 worker_thread(void)
 {
     struct work *work;
+    uint32_t flags;
 
     while (1) {
+        flags = spin_lock_irqsave(&work_lock);
+
+        /*
+         * block with the lock held, so that a work item that gets ready
+         * right after we looked still kicks us
+         */
         if (list_empty(&work_list)) {
+            task_block_noresched(current_task);
+            spin_unlock_irqrestore(&work_lock, flags);
             sched_yield();
             continue;
         }
 
-        spin_lock(&work_lock);
         work = list_entry(list_pop_front(&work_list), struct work, elem);
-        if (work->work_at >= work_get_ticks()) {
-            list_push_front(&work_list, &work->elem);
-            spin_unlock(&work_lock);
-            sleep(work->work_at - work_get_ticks());
-            continue;
-        }
-        spin_unlock(&work_lock);
+        work->work_flags &= ~(WORK_FLAG_QUEUED | WORK_FLAG_READY);
+        spin_unlock_irqrestore(&work_lock, flags);
 
         do_work(work);
     }
@@ -160,6 +235,10 @@ work_init(void)
     spin_lock_init(&work_lock);
     list_init(&work_list);
 
+    work_cache = kmem_cache_create("work", sizeof(struct work), NULL);
+    if (!work_cache)
+        panic("work: unable to create the work cache\n");
+
     worker_task = create_kernel_task(worker_thread);
     sched_add_rq(worker_task);
 
@@ -0,0 +1,322 @@
+#include <levos/kernel.h>
+#include <levos/rbtree.h>
+
+/*
+ * Red-black tree, after the one in CLRS but without a sentinel, so a
+ * missing child is simply NULL.
+ */
+
+static inline int
+__rb_is_red(struct rb_node *n)
+{
+    return n && n->rb_color == RB_RED;
+}
+
+static inline void
+__rb_augment(struct rb_tree *tree, struct rb_node *n)
+{
+    if (tree->rb_augment)
+        tree->rb_augment(n);
+}
+
+/* make @new take the place of @old under @old's parent */
+static void
+__rb_replace_child(struct rb_tree *tree, struct rb_node *old,
+                   struct rb_node *new)
+{
+    struct rb_node *parent = old->rb_parent;
+
+    if (!parent)
+        tree->rb_root = new;
+    else if (parent->rb_left == old)
+        parent->rb_left = new;
+    else
+        parent->rb_right = new;
+
+    if (new)
+        new->rb_parent = parent;
+}
+
+static void
+__rb_rotate_left(struct rb_tree *tree, struct rb_node *x)
+{
+    struct rb_node *y = x->rb_right;
+
+    x->rb_right = y->rb_left;
+    if (y->rb_left)
+        y->rb_left->rb_parent = x;
+
+    __rb_replace_child(tree, x, y);
+
+    y->rb_left = x;
+    x->rb_parent = y;
+
+    /* @x is below @y now, so it goes first */
+    __rb_augment(tree, x);
+    __rb_augment(tree, y);
+}
+
+static void
+__rb_rotate_right(struct rb_tree *tree, struct rb_node *x)
+{
+    struct rb_node *y = x->rb_left;
+
+    x->rb_left = y->rb_right;
+    if (y->rb_right)
+        y->rb_right->rb_parent = x;
+
+    __rb_replace_child(tree, x, y);
+
+    y->rb_right = x;
+    x->rb_parent = y;
+
+    __rb_augment(tree, x);
+    __rb_augment(tree, y);
+}
+
+void
+rb_init(struct rb_tree *tree, rb_augment_func *augment)
+{
+    tree->rb_root = NULL;
+    tree->rb_augment = augment;
+}
+
+/*
+ * rb_augment_path - recompute the augmented data of @n and everything
+ *                   above it, after it changed in @n
+ */
+void
+rb_augment_path(struct rb_tree *tree, struct rb_node *n)
+{
+    if (!tree->rb_augment)
+        return;
+
+    for (; n; n = n->rb_parent)
+        tree->rb_augment(n);
+}
+
+/*
+ * rb_insert - link @node in at @link, a NULL child pointer of @parent
+ *             (or the root pointer if @parent is NULL), and rebalance
+ */
+void
+rb_insert(struct rb_tree *tree, struct rb_node *parent,
+          struct rb_node **link, struct rb_node *node)
+{
+    struct rb_node *gparent, *uncle;
+
+    node->rb_parent = parent;
+    node->rb_left = node->rb_right = NULL;
+    node->rb_color = RB_RED;
+    *link = node;
+
+    rb_augment_path(tree, node);
+
+    while (__rb_is_red(parent = node->rb_parent)) {
+        gparent = parent->rb_parent;
+
+        if (parent == gparent->rb_left) {
+            uncle = gparent->rb_right;
+            if (__rb_is_red(uncle)) {
+                parent->rb_color = uncle->rb_color = RB_BLACK;
+                gparent->rb_color = RB_RED;
+                node = gparent;
+                continue;
+            }
+
+            if (node == parent->rb_right) {
+                __rb_rotate_left(tree, parent);
+                node = parent;
+                parent = node->rb_parent;
+            }
+
+            parent->rb_color = RB_BLACK;
+            gparent->rb_color = RB_RED;
+            __rb_rotate_right(tree, gparent);
+        } else {
+            uncle = gparent->rb_left;
+            if (__rb_is_red(uncle)) {
+                parent->rb_color = uncle->rb_color = RB_BLACK;
+                gparent->rb_color = RB_RED;
+                node = gparent;
+                continue;
+            }
+
+            if (node == parent->rb_left) {
+                __rb_rotate_right(tree, parent);
+                node = parent;
+                parent = node->rb_parent;
+            }
+
+            parent->rb_color = RB_BLACK;
+            gparent->rb_color = RB_RED;
+            __rb_rotate_left(tree, gparent);
+        }
+    }
+
+    tree->rb_root->rb_color = RB_BLACK;
+}
+
+/* restore the black heights after a black node was taken out above @x */
+static void
+__rb_remove_fixup(struct rb_tree *tree, struct rb_node *x,
+                  struct rb_node *parent)
+{
+    struct rb_node *w;
+
+    while (x != tree->rb_root && !__rb_is_red(x)) {
+        if (x == parent->rb_left) {
+            w = parent->rb_right;
+            if (__rb_is_red(w)) {
+                w->rb_color = RB_BLACK;
+                parent->rb_color = RB_RED;
+                __rb_rotate_left(tree, parent);
+                w = parent->rb_right;
+            }
+
+            if (!__rb_is_red(w->rb_left) && !__rb_is_red(w->rb_right)) {
+                w->rb_color = RB_RED;
+                x = parent;
+                parent = x->rb_parent;
+                continue;
+            }
+
+            if (!__rb_is_red(w->rb_right)) {
+                w->rb_left->rb_color = RB_BLACK;
+                w->rb_color = RB_RED;
+                __rb_rotate_right(tree, w);
+                w = parent->rb_right;
+            }
+
+            w->rb_color = parent->rb_color;
+            parent->rb_color = RB_BLACK;
+            w->rb_right->rb_color = RB_BLACK;
+            __rb_rotate_left(tree, parent);
+        } else {
+            w = parent->rb_left;
+            if (__rb_is_red(w)) {
+                w->rb_color = RB_BLACK;
+                parent->rb_color = RB_RED;
+                __rb_rotate_right(tree, parent);
+                w = parent->rb_left;
+            }
+
+            if (!__rb_is_red(w->rb_left) && !__rb_is_red(w->rb_right)) {
+                w->rb_color = RB_RED;
+                x = parent;
+                parent = x->rb_parent;
+                continue;
+            }
+
+            if (!__rb_is_red(w->rb_left)) {
+                w->rb_right->rb_color = RB_BLACK;
+                w->rb_color = RB_RED;
+                __rb_rotate_left(tree, w);
+                w = parent->rb_left;
+            }
+
+            w->rb_color = parent->rb_color;
+            parent->rb_color = RB_BLACK;
+            w->rb_left->rb_color = RB_BLACK;
+            __rb_rotate_right(tree, parent);
+        }
+
+        x = tree->rb_root;
+        break;
+    }
+
+    if (x)
+        x->rb_color = RB_BLACK;
+}
+
+/* rb_remove - unlink @z from @tree and rebalance */
+void
+rb_remove(struct rb_tree *tree, struct rb_node *z)
+{
+    struct rb_node *y, *x, *parent;
+    int color;
+
+    if (!z->rb_left || !z->rb_right) {
+        /* at most one child, it takes @z's place */
+        x = z->rb_left ? z->rb_left : z->rb_right;
+        parent = z->rb_parent;
+        color = z->rb_color;
+
+        __rb_replace_child(tree, z, x);
+        rb_augment_path(tree, parent);
+    } else {
+        /* @z's successor has no left child, it moves into @z's place */
+        y = z->rb_right;
+        while (y->rb_left)
+            y = y->rb_left;
+
+        x = y->rb_right;
+        color = y->rb_color;
+
+        if (y->rb_parent == z) {
+            parent = y;
+        } else {
+            parent = y->rb_parent;
+            __rb_replace_child(tree, y, x);
+            y->rb_right = z->rb_right;
+            y->rb_right->rb_parent = y;
+        }
+
+        __rb_replace_child(tree, z, y);
+        y->rb_left = z->rb_left;
+        y->rb_left->rb_parent = y;
+        y->rb_color = z->rb_color;
+
+        /* the path from where @y was up to the root passes through @y */
+        rb_augment_path(tree, parent);
+    }
+
+    if (color == RB_BLACK)
+        __rb_remove_fixup(tree, x, parent);
+}
+
+struct rb_node *
+rb_first(struct rb_tree *tree)
+{
+    struct rb_node *n = tree->rb_root;
+
+    if (!n)
+        return NULL;
+
+    while (n->rb_left)
+        n = n->rb_left;
+
+    return n;
+}
+
+struct rb_node *
+rb_next(struct rb_node *n)
+{
+    if (n->rb_right) {
+        n = n->rb_right;
+        while (n->rb_left)
+            n = n->rb_left;
+        return n;
+    }
+
+    while (n->rb_parent && n == n->rb_parent->rb_right)
+        n = n->rb_parent;
+
+    return n->rb_parent;
+}
+
+struct rb_node *
+rb_prev(struct rb_node *n)
+{
+    if (n->rb_left) {
+        n = n->rb_left;
+        while (n->rb_right)
+            n = n->rb_right;
+        return n;
+    }
+
+    while (n->rb_parent && n == n->rb_parent->rb_left)
+        n = n->rb_parent;
+
+    return n->rb_parent;
+}
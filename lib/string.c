@@ -1,11 +1,221 @@
 #include <levos/string.h>
 #include <levos/types.h>
 #include <levos/kernel.h>
+#include <levos/arch.h>
     
+/*
+ * The memory primitives pick a strategy by size: byte loops for the
+ * tiny copies where starting a string instruction costs more than it
+ * saves, rep movsl/stosl for everything up to STRING_LARGE, and past
+ * that whatever string_init() found best for the CPU. With SSE2 that is
+ * non-temporal stores, which do not drag the destination through the
+ * cache, the right thing for framebuffer blits and pages that the
+ * kernel is not going to look at again.
+ *
+ * The SSE2 routines save the XMM registers they use, they may be called
+ * from interrupt handlers while a task's registers are live. They only
+ * run while the current task owns the FPU anyway. Otherwise the first
+ * XMM instruction would trap with #NM and take the FPU over, which lazy
+ * FPU switching is there to avoid, so kernel threads like the page
+ * zeroing one stay with rep stosl/movsl.
+ */
+#define STRING_SMALL 16
+#define STRING_LARGE 16384
+
+static void *
+__memcpy_rep (void *dst, const void *src, size_t size)
+{
+  int d0, d1, d2;
+
+  asm volatile ("rep movsl; movl %4, %%ecx; rep movsb"
+                : "=&c" (d0), "=&D" (d1), "=&S" (d2)
+                : "0" (size / 4), "g" (size % 4), "1" (dst), "2" (src)
+                : "memory");
+  return dst;
+}
+
+static void *
+__memset_rep (void *dst, int value, size_t size)
+{
+  uint32_t v = (value & 0xff) * 0x01010101;
+  int d0, d1;
+
+  asm volatile ("rep stosl; movl %3, %%ecx; rep stosb"
+                : "=&c" (d0), "=&D" (d1)
+                : "a" (v), "g" (size % 4), "0" (size / 4), "1" (dst)
+                : "memory");
+  return dst;
+}
+
+static void
+__copy_page_rep (void *dst, const void *src)
+{
+  __memcpy_rep (dst, src, 4096);
+}
+
+static void
+__clear_page_rep (void *dst)
+{
+  __memset_rep (dst, 0, 4096);
+}
+
+#define XMM_CLOBBERS "xmm0", "xmm1", "xmm2", "xmm3"
+
+#define XMM_SAVE(buf) \
+  asm volatile ("movdqu %%xmm0, 0(%0); movdqu %%xmm1, 16(%0);"   \
+                "movdqu %%xmm2, 32(%0); movdqu %%xmm3, 48(%0)"   \
+                :: "r" (buf) : "memory")
+
+#define XMM_RESTORE(buf) \
+  asm volatile ("movdqu 0(%0), %%xmm0; movdqu 16(%0), %%xmm1;"   \
+                "movdqu 32(%0), %%xmm2; movdqu 48(%0), %%xmm3"   \
+                :: "r" (buf) : "memory", XMM_CLOBBERS)
+
+/* stream @n 64 byte blocks from @src to the 16 byte aligned @dst */
+static void
+__copy_nt (void *dst, const void *src, size_t n)
+{
+  char xmm[64];
+
+  XMM_SAVE (xmm);
+  while (n-- > 0)
+    {
+      asm volatile ("movdqu 0(%1), %%xmm0; movdqu 16(%1), %%xmm1;"
+                    "movdqu 32(%1), %%xmm2; movdqu 48(%1), %%xmm3;"
+                    "movntdq %%xmm0, 0(%0); movntdq %%xmm1, 16(%0);"
+                    "movntdq %%xmm2, 32(%0); movntdq %%xmm3, 48(%0)"
+                    :: "r" (dst), "r" (src) : "memory", XMM_CLOBBERS);
+      dst += 64;
+      src += 64;
+    }
+  asm volatile ("sfence" ::: "memory");
+  XMM_RESTORE (xmm);
+}
+
+/* fill @n 64 byte blocks of the 16 byte aligned @dst with @v */
+static void
+__set_nt (void *dst, uint32_t v, size_t n)
+{
+  char xmm[64];
+
+  XMM_SAVE (xmm);
+  asm volatile ("movd %0, %%xmm0; pshufd $0, %%xmm0, %%xmm0"
+                :: "r" (v) : XMM_CLOBBERS);
+  while (n-- > 0)
+    {
+      asm volatile ("movntdq %%xmm0, 0(%0); movntdq %%xmm0, 16(%0);"
+                    "movntdq %%xmm0, 32(%0); movntdq %%xmm0, 48(%0)"
+                    :: "r" (dst) : "memory", XMM_CLOBBERS);
+      dst += 64;
+    }
+  asm volatile ("sfence" ::: "memory");
+  XMM_RESTORE (xmm);
+}
+
+static void *
+__memcpy_sse2 (void *dst_, const void *src_, size_t size)
+{
+  unsigned char *dst = dst_;
+  const unsigned char *src = src_;
+  size_t head = -(uintptr_t) dst & 15;
+
+  __memcpy_rep (dst, src, head);
+  dst += head;
+  src += head;
+  size -= head;
+
+  __copy_nt (dst, src, size / 64);
+  __memcpy_rep (dst + (size & ~63), src + (size & ~63), size & 63);
+
+  return dst_;
+}
+
+static void *
+__memset_sse2 (void *dst_, int value, size_t size)
+{
+  unsigned char *dst = dst_;
+  size_t head = -(uintptr_t) dst & 15;
+
+  __memset_rep (dst, value, head);
+  dst += head;
+  size -= head;
+
+  __set_nt (dst, (value & 0xff) * 0x01010101, size / 64);
+  __memset_rep (dst + (size & ~63), value, size & 63);
+
+  return dst_;
+}
+
+static void
+__copy_page_sse2 (void *dst, const void *src)
+{
+  __copy_nt (dst, src, 4096 / 64);
+}
+
+static void
+__clear_page_sse2 (void *dst)
+{
+  __set_nt (dst, 0, 4096 / 64);
+}
+
+static struct string_ops string_ops_rep = {
+  .so_name = "rep",
+  .so_memcpy = __memcpy_rep,
+  .so_memset = __memset_rep,
+  .so_copy_page = __copy_page_rep,
+  .so_clear_page = __clear_page_rep,
+};
+
+static struct string_ops string_ops_sse2 = {
+  .so_name = "sse2",
+  .so_memcpy = __memcpy_sse2,
+  .so_memset = __memset_sse2,
+  .so_copy_page = __copy_page_sse2,
+  .so_clear_page = __clear_page_sse2,
+};
+
+/* what the large copies, copy_page() and clear_page() go through */
+struct string_ops *string_ops = &string_ops_rep;
+
+/* string_ops, if using it doesn't take the FPU from another task */
+static inline struct string_ops *
+__large_ops (void)
+{
+  return arch_fpu_usable () ? string_ops : &string_ops_rep;
+}
+
+/* string_init - choose the large copy routines for this CPU */
+void
+string_init (void)
+{
+  if (arch_cpuid_edx () & X86_CPUID_EDX_SSE2)
+    string_ops = &string_ops_sse2;
+
+  printk ("string: using %s for large copies\n", string_ops->so_name);
+}
+
+void
+copy_page (void *dst, const void *src)
+{
+  __large_ops ()->so_copy_page (dst, src);
+}
+
+void
+clear_page (void *dst)
+{
+  __large_ops ()->so_clear_page (dst);
+}
+
 void *
 memset (void *dst_, int value, size_t size) 
 {
   unsigned char *dst = dst_;
+
+  if (size >= STRING_LARGE)
+    return __large_ops ()->so_memset (dst_, value, size);
+
+  if (size >= STRING_SMALL)
+    return __memset_rep (dst_, value, size);
   
   while (size-- > 0)
     *dst++ = value;
@@ -32,12 +242,37 @@ memcpy (void *dst_, const void *src_, size_t size)
   unsigned char *dst = dst_;
   const unsigned char *src = src_;
 
+  if (size >= STRING_LARGE)
+    return __large_ops ()->so_memcpy (dst_, src_, size);
+
+  if (size >= STRING_SMALL)
+    return __memcpy_rep (dst_, src_, size);
+
   while (size-- > 0)
     *dst++ = *src++;
 
   return dst_;
 }
 
+/* memmove - like memcpy(), but @dst and @src may overlap */
+void *
+memmove (void *dst_, const void *src_, size_t size)
+{
+  unsigned char *dst = dst_;
+  const unsigned char *src = src_;
+
+  if (dst <= src || dst >= src + size)
+    return memcpy (dst_, src_, size);
+
+  /* copy backwards, starting with the last byte */
+  dst += size;
+  src += size;
+  while (size-- > 0)
+    *--dst = *--src;
+
+  return dst_;
+}
+
 void *
 memcpyl(uint32_t *dst_, uint32_t *src_, size_t size)
 {
@@ -193,3 +428,102 @@ strtok_r (char *s, const char *delimiters, char **save_ptr)
     *save_ptr = s;
   return token;
 }
+
+#define BENCH_ROUNDS 32
+#define BENCH_MAX    65536
+
+/* @n / @base, there is no libgcc for the 64 bit division */
+static uint64_t
+__div64_32 (uint64_t n, uint32_t base)
+{
+  uint32_t hi = n >> 32, lo = n, qhi, qlo, rem;
+
+  qhi = hi / base;
+  rem = hi % base;
+  asm ("divl %4" : "=a" (qlo), "=d" (rem) : "0" (lo), "1" (rem), "rm" (base));
+
+  return ((uint64_t) qhi << 32) | qlo;
+}
+
+static void
+__bench_report (char *what, size_t size, uint64_t cycles)
+{
+  /* hundredths of a cycle, a few seconds worth of cycles overflow 32 bits */
+  uint32_t cpb = __div64_32 (cycles * 100, size * BENCH_ROUNDS);
+
+  printk ("string: %s %d bytes: %d.%d%d cycles/byte\n", what, size,
+          cpb / 100, (cpb / 10) % 10, cpb % 10);
+}
+
+/*
+ * string_bench - time the primitives at a few sizes and the large copy
+ *                routines of every flavour the CPU has, in cycles per
+ *                byte. Runs when "membench" is on the command line.
+ */
+void
+string_bench (void)
+{
+  static const size_t sizes[] = { 16, 256, 1536, 4096, BENCH_MAX };
+  struct string_ops *ops[2];
+  uint64_t t;
+  uint32_t flags;
+  char *src, *dst;
+  int i, j, n = 0;
+
+  src = na_malloc (BENCH_MAX, 4096);
+  dst = na_malloc (BENCH_MAX, 4096);
+  if (!src || !dst)
+    {
+      printk ("string: not enough memory to benchmark\n");
+      goto out;
+    }
+
+  memset (src, 0x5a, BENCH_MAX);
+
+  ops[n++] = &string_ops_rep;
+  if (string_ops != &string_ops_rep)
+    ops[n++] = string_ops;
+
+  flags = arch_irq_save ();
+
+  for (i = 0; i < sizeof (sizes) / sizeof (sizes[0]); i ++)
+    {
+      t = arch_rdtsc ();
+      for (j = 0; j < BENCH_ROUNDS; j ++)
+        memcpy (dst, src, sizes[i]);
+      __bench_report ("memcpy", sizes[i], arch_rdtsc () - t);
+
+      t = arch_rdtsc ();
+      for (j = 0; j < BENCH_ROUNDS; j ++)
+        memset (dst, 0, sizes[i]);
+      __bench_report ("memset", sizes[i], arch_rdtsc () - t);
+    }
+
+  for (i = 0; i < n; i ++)
+    {
+      printk ("string: %s:\n", ops[i]->so_name);
+
+      t = arch_rdtsc ();
+      for (j = 0; j < BENCH_ROUNDS; j ++)
+        ops[i]->so_copy_page (dst, src);
+      __bench_report ("copy_page", 4096, arch_rdtsc () - t);
+
+      t = arch_rdtsc ();
+      for (j = 0; j < BENCH_ROUNDS; j ++)
+        ops[i]->so_clear_page (dst);
+      __bench_report ("clear_page", 4096, arch_rdtsc () - t);
+
+      t = arch_rdtsc ();
+      for (j = 0; j < BENCH_ROUNDS; j ++)
+        ops[i]->so_memcpy (dst, src, BENCH_MAX);
+      __bench_report ("large memcpy", BENCH_MAX, arch_rdtsc () - t);
+    }
+
+  arch_irq_restore (flags);
+
+out:
+  if (src)
+    na_free (BENCH_MAX, src);
+  if (dst)
+    na_free (BENCH_MAX, dst);
+}
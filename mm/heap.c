@@ -119,6 +119,30 @@ int liballoc_free(void *ptr, size_t pages) {
     return 0;
 }
 
+/*
+ * heap_get_pages - hand out @pages whole pages of the heap area, they
+ *                  are page aligned and mapped in every address space
+ */
+void *
+heap_get_pages(size_t pages)
+{
+    void *ret;
+
+    liballoc_lock();
+    ret = liballoc_alloc(pages);
+    liballoc_unlock();
+
+    return ret;
+}
+
+void
+heap_free_pages(void *ptr, size_t pages)
+{
+    liballoc_lock();
+    liballoc_free(ptr, pages);
+    liballoc_unlock();
+}
+
 /** This macro will conveniently align our pointer upwards */
 #define ALIGN(align, ptr )													\
 		if ( align > 1 )											\
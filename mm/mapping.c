@@ -4,6 +4,8 @@
 #include <levos/spinlock.h>
 #include <levos/task.h>
 #include <levos/list.h>
+#include <levos/pagecache.h>
+#include <levos/palloc.h>
 
 struct list map_list;
 
@@ -22,26 +24,117 @@ mapping_find_or_create(struct file *f)
     return map;
 }
 
+/*
+ * mapping_map_cached - map the page cache frame @cphys at @addr, taking
+ *                      over the caller's reference to it
+ */
+void
+mapping_map_cached(uintptr_t cphys, void *addr, int flags)
+{
+    page_t *page;
+
+    map_page_curr(cphys, (uint32_t) addr, 1);
+
+    page = get_page_from_curr((uint32_t) addr);
+    pte_mark_read_only(page);
+    if (flags & VMA_WRITEABLE)
+        pte_mark_cow(page);
+    __flush_tlb_page((uint32_t) addr);
+}
+
+/*
+ * __mapping_load_cached - map the page of @map at @offset through the
+ *                         page cache
+ *
+ * Whole pages are mapped straight from the cache, read-only and, for
+ * private writable mappings, copy-on-write. The mapping keeps the
+ * reference that pagecache_get() handed out. A page that the mapping
+ * only partially covers gets a private copy of the covered part.
+ */
+static int
+__mapping_load_cached(struct mapping *map, void *addr, uint32_t offset,
+                      uint32_t max_len, int flags)
+{
+    uintptr_t phys, cphys;
+    page_t *page;
+    void *src;
+    int rc;
+
+    rc = pagecache_get(map->map_backing, offset, &cphys);
+    if (rc)
+        return rc;
+
+    if (max_len == 4096) {
+        mapping_map_cached(cphys, addr, flags);
+        return 0;
+    }
+
+    phys = palloc_get_page();
+    if (!phys) {
+        palloc_unref_page(cphys);
+        return -ENOMEM;
+    }
+    map_page_curr(phys, (uint32_t) addr, 1);
+
+    src = kmap_temp(cphys);
+    memcpy(addr, src, max_len);
+    kunmap_temp(src);
+    palloc_unref_page(cphys);
+    memset(addr + max_len, 0, 4096 - max_len);
+
+    if (!(flags & VMA_WRITEABLE)) {
+        page = get_page_from_curr((uint32_t) addr);
+        pte_mark_read_only(page);
+        __flush_tlb_page((uint32_t) addr);
+    }
+
+    return 0;
+}
+
+/*
+ * mapping_load - bring in the page of @map at @offset at @addr, @max_len
+ *                bytes of it come from the file and the rest is zeroes
+ *
+ * Nothing is mapped if the file can't be read, the error is returned.
+ */
 int
 mapping_load(struct mapping *map, void *addr, uint32_t offset, uint32_t max_len, int flags)
 {
     int len = 0;
     uintptr_t phys;
+    void *vaddr;
 
     panic_ifnot((int)addr % 4096 == 0);
 
+    /*
+     * shared writable mappings would have to write the cache back to the
+     * file, so they keep getting private pages for now
+     */
+    if (max_len != 0 && pagecache_cacheable(map->map_backing) &&
+            (flags & (VMA_SHARED | VMA_WRITEABLE)) != (VMA_SHARED | VMA_WRITEABLE))
+        return __mapping_load_cached(map, addr, offset, max_len, flags);
+
     //printk("%s: pid %d addr 0x%x max_len 0x%x offset 0x%x\n",
             //__func__, current_task->pid, addr, max_len, offset);
 
     file_seek(map->map_backing, offset);
 
-    phys = palloc_get_page();
-    map_page_curr(phys, addr, 1);
+    phys = palloc_get_zeroed_page();
+    if (!phys)
+        return -ENOMEM;
 
-    memset(addr, 0, 4096);
+    if (max_len != 0) {
+        vaddr = kmap_temp(phys);
+        len = map->map_backing->fops->read(map->map_backing, vaddr, max_len);
+        kunmap_temp(vaddr);
 
-    if (max_len != 0)
-        len = map->map_backing->fops->read(map->map_backing, addr, max_len);
+        if (len < 0) {
+            palloc_unref_page(phys);
+            return len;
+        }
+    }
+
+    map_page_curr(phys, addr, 1);
 
     /*if (4096 - max_len)
         memset(addr + len, 0, 4096 - max_len);*/
@@ -51,6 +144,7 @@ mapping_load(struct mapping *map, void *addr, uint32_t offset, uint32_t max_len,
     if (!(flags & VMA_WRITEABLE)) {
         page_t *page = get_page_from_curr(addr);
         pte_mark_read_only(page);
+        __flush_tlb_page((uint32_t) addr);
     }
 
     //printk("mapping finished\n");
@@ -5,6 +5,7 @@
 #include <levos/task.h>
 #include <levos/palloc.h>
 #include <levos/string.h>
+#include <levos/uaccess.h>
 
 pde_t kernel_pgd[1024] __page_align;
 
@@ -17,6 +18,7 @@ static page_t kernel_pgt[1024] __page_align; /* 768 */
 static page_t heap_1_pgt[1024] __page_align; /* 769 */
 static page_t heap_2_pgt[1024] __page_align; /* 770 */
 static page_t kernel_virt_pgt[1024] __page_align; /* IDK FIXME */
+static page_t kmap_temp_pgt[1024] __page_align; /* 1023 */
 
 inline int pde_index(uint32_t addr)
 {
@@ -68,23 +70,36 @@ inline pde_t create_pde(uint32_t phys_addr, int user, int rw)
 		   (phys_addr << PDE_ADDR_SHIFT);
 }
 
-void __noreturn
+void
 do_kernel_pagefault(page_t *page, struct pt_regs *regs, uint32_t cr2)
 {
+    uint32_t fixup;
+
     /* check if the kernel pagefaulted accessing user region */
     if (cr2 < VIRT_BASE) {
         //panic("ERMHAGERD\n");
         //printk("VOILA MOTHER FUCKERS\n");
-        if ((page && !*page) || !page) {
-            int rc = vma_handle_pagefault(current_task, cr2);
-            if (rc) {
-                printk("unable to handle a missing user page accessed from kernelspace at 0x%x!\n", cr2);
-                dump_registers(regs);
-                dump_stack(8);
-                vma_dump(current_task);
-                send_signal(current_task, SIGSEGV);
-            }
+        int rc = 1;
+
+        if ((page && !*page) || !page)
+            rc = vma_handle_pagefault(current_task, cr2,
+                                    regs->error_code & (1 << 1));
+        if (rc == 0)
+            return;
 
+        /* a user copy routine, it fails with -EFAULT */
+        fixup = search_exception_table((uint32_t) regs->eip);
+        if (fixup) {
+            regs->eip = (void *) fixup;
+            return;
+        }
+
+        if ((page && !*page) || !page) {
+            printk("unable to handle a missing user page accessed from kernelspace at 0x%x!\n", cr2);
+            dump_registers(regs);
+            dump_stack(8);
+            vma_dump(current_task);
+            send_signal(current_task, SIGSEGV);
             return;
         }
         //printk("OH FUCK page 0x%x *page 0x%x\n", page, page != 0 ? *page : -1);
@@ -145,51 +160,62 @@ get_page_from_curr(uint32_t vaddr)
     else return get_page_from_pgd(kernel_pgd, vaddr);
 }
 
-void
+/*
+ * __do_cow - resolve a write to a copy-on-write page of @target
+ *
+ * If nobody else maps the frame any longer, it simply becomes writeable
+ * again, otherwise the task gets a copy of its own and drops its
+ * reference to the shared one. Fails with -ENOMEM if there is no frame
+ * for the copy, the page is left as it was.
+ */
+int
 __do_cow(struct task *target, uint32_t cr2)
 {
-    char *buffer = malloc(4096);
-    uintptr_t p_np;
     uintptr_t the_page = PG_RND_DOWN(cr2);
-    pagedir_t pgd = target->mm;
-    page_t *pte = get_page_from_pgd(pgd, the_page);
-    if (!buffer)
-        send_signal(target, SIGSEGV);
-
-    if (*pte - VIRT_BASE < 14 * 1024 * 1024) {
-        printk("freeing: 0x%x\n", PG_RND_DOWN(*pte) + VIRT_BASE);
-        na_free(0x1000, PG_RND_DOWN(*pte) + VIRT_BASE);
-    }
+    uintptr_t p_old, p_np;
+    page_t *pte = get_page_from_pgd(target->mm, the_page);
+    void *dst;
 
-    //printk("COW by %d for page 0x%x\n", target->pid, the_page);
+    p_old = PG_RND_DOWN(*pte);
 
-    memcpy(buffer, (void *) the_page, 4096);
+    //printk("COW by %d for page 0x%x\n", target->pid, the_page);
 
-    /*printk("OUR BUFFER\n");
-    if (the_page == VIRT_BASE - 0x1000)
-        __hex_dump(the_page, buffer, 4096, 0);*/
+    /* the first write to a demand-zero page, there is nothing to copy */
+    if (p_old == zero_page_phys) {
+        p_np = palloc_get_zeroed_page();
+        if (!p_np)
+            return -ENOMEM;
 
-    /*printk("THE ORIGINAL\n");
-    if (the_page == VIRT_BASE - 0x1000)
-        __hex_dump(the_page, the_page, 4096, 0);*/
+        replace_page(target->mm, the_page, create_pte(p_np, 1, 1));
+        palloc_unref_page(p_old);
+        return 0;
+    }
 
-    p_np = palloc_get_page();
-    replace_page(target->mm, the_page, create_pte(p_np, 1, 1));
+    if (palloc_page_refc(p_old) == 1) {
+        pte_unmark_cow(pte);
+        pte_mark_writeable(pte);
+        __flush_tlb_page(the_page);
+        return 0;
+    }
 
-    //page_t *page = get_page_from_curr(cr2);
-    //pte_mark_writeable(page);
+    p_np = palloc_try_get_page();
+    if (!p_np)
+        return -ENOMEM;
 
-    memcpy((void *) the_page, buffer, 4096);
+    dst = kmap_temp(p_np);
+    copy_page(dst, (void *) the_page);
+    kunmap_temp(dst);
 
-    free(buffer);
+    replace_page(target->mm, the_page, create_pte(p_np, 1, 1));
 
-    return;
+    palloc_unref_page(p_old);
+    return 0;
 }
 
-void
+int
 do_cow(uint32_t cr2)
 {
-    __do_cow(current_task, cr2);
+    return __do_cow(current_task, cr2);
 }
 
 int
@@ -226,7 +252,8 @@ do_user_pagefault(page_t *page, struct pt_regs *regs, uint32_t cr2)
     }
 
     if ((page && !*page) || !page) {
-        int rc = vma_handle_pagefault(current_task, cr2);
+        int rc = vma_handle_pagefault(current_task, cr2,
+                                regs->error_code & (1 << 1));
         if (rc) {
             printk("unable to handle a missing page at 0x%x!\n", cr2);
             dump_registers(regs);
@@ -243,6 +270,15 @@ do_user_pagefault(page_t *page, struct pt_regs *regs, uint32_t cr2)
     __not_reached();
 }
 
+/* may a write to @addr be resolved by copying the page? */
+static int
+__cow_allowed(uint32_t addr)
+{
+    struct vm_area *vma = vma_find(current_task, PG_RND_DOWN(addr));
+
+    return vma && (vma->vma_flags & VMA_WRITEABLE);
+}
+
 void
 handle_pagefault(struct pt_regs *regs)
 {
@@ -265,15 +301,32 @@ handle_pagefault(struct pt_regs *regs)
 
     current_task->sys_regs = regs;
 
-    /* if a COW page is written then fetch new page and map */
+    /*
+     * if a COW page is written then fetch new page and map, unless the
+     * mapping is read-only: then it is a plain permission error
+     */
     page = get_page_from_curr(PG_RND_DOWN(cr2));
-    if (page && (regs->error_code & (1 << 1)) && pte_is_cow(*page)) {
-        do_cow(cr2);
+    if (page && (regs->error_code & (1 << 1)) && pte_is_cow(*page) &&
+            __cow_allowed(cr2)) {
+        if (do_cow(cr2) == 0)
+            return;
+
+        /* out of memory, a user copy from the kernel fails with -EFAULT */
+        if ((unsigned long) regs->eip > (unsigned long) VIRT_BASE) {
+            do_kernel_pagefault(page, regs, cr2);
+            return;
+        }
+
+        printk("pid %d: out of memory on a copy-on-write fault at 0x%x\n",
+                current_task->pid, cr2);
+        send_signal(current_task, SIGKILL);
         return;
     }
 
-    if ((unsigned long) regs->eip > (unsigned long) VIRT_BASE)
+    if ((unsigned long) regs->eip > (unsigned long) VIRT_BASE) {
         do_kernel_pagefault(page, regs, cr2);
+        return;
+    }
 
     do_user_pagefault(page, regs, cr2);
 }
@@ -323,7 +376,7 @@ map_page(pagedir_t pgd, uint32_t phys_addr, uint32_t virt_addr, int perm)
         /* map the page table */
         pgd[ipde] = create_pde(kv2p(pgt), perm, 1);
     }
-    __flush_tlb();
+    tlb_flush_page(pgd, virt_addr);
 
     return 0;
 }
@@ -354,7 +407,6 @@ page_mapped_curr(uint32_t virt_addr)
 int
 map_page_curr(uint32_t p, uint32_t v, int perm)
 {
-    extern struct task *current_task;
 
     if (!current_task)
         panic("invalid mappagecurr\n");
@@ -383,9 +435,7 @@ __page_insert_pde(pde_t pde)
 int
 map_page_kernel(uint32_t p, uint32_t v, int perm)
 {
-    int ret = map_page(kernel_pgd, p, v, perm);
-    __flush_tlb();
-    return ret;
+    return map_page(kernel_pgd, p, v, perm);
 }
 
 pagedir_t
@@ -457,8 +507,11 @@ mm_destroy(pagedir_t pgd)
 void
 mark_all_user_pages_cow(pagedir_t pgd)
 {
+    struct tlb_batch tb;
     int i, j;
 
+    tlb_batch_init(&tb, pgd);
+
     /* loop throught the pagetables */
     for (i = 0; i < 768; i ++) {
         /* if this pagetable exists, then mark it as R/W */
@@ -468,31 +521,97 @@ mark_all_user_pages_cow(pagedir_t pgd)
 
             /* now loop through its pages */
             for (j = 0; j < 1024; j ++) {
-                if (!pte_present(pde_addr[j])) //|| !pte_writeable(pde_addr[j]))
+                if (!pte_present(pde_addr[j]))
+                    continue;
+
+                /*
+                 * read-only pages, like the vsyscall ones, are shared
+                 * as they are: nobody may write to them anyway
+                 */
+                if (!pte_writeable(pde_addr[j]) && !pte_is_cow(pde_addr[j]))
                     continue;
 
                 pte_mark_read_only(&pde_addr[j]);
                 pte_mark_cow(&pde_addr[j]);
+                tlb_batch_add(&tb, (i << 22) | (j << 12));
             }
         }
     }
-    __flush_tlb();
+    tlb_batch_flush(&tb);
 }
 
 void
 map_unload_user_pages(pagedir_t pgd)
 {
+    struct tlb_batch tb;
+
+    tlb_batch_init(&tb, pgd);
+
     /* 767 because the stack needs not be unmapped, we reuse it */
     for (int i = 0; i < 768; i++) {
         if (pgd[i] != 0) {
             uint32_t *pde_addr = (void *) VIRT_BASE + ((pgd[i] >> PDE_ADDR_SHIFT) << 12);
+
+            /* every mapping holds a reference to its frame */
+            for (int j = 0; j < 1024; j ++) {
+                if (pte_present(pde_addr[j])) {
+                    palloc_unref_page(PG_RND_DOWN(pde_addr[j]));
+                    tlb_batch_add(&tb, (i << 22) | (j << 12));
+                }
+            }
+
             //printk("unloaded page table 0x%x - 0x%x\n", i * 4 * 1024 * 1024, (i + 1) * 4096 * 1024);
             //printk("2FREE: 0x%x\n", pde_addr);
             na_free(0x1000, pde_addr);
             pgd[i] = 0;
         }
     }
-    __flush_tlb();
+    tlb_batch_flush(&tb);
+}
+
+/*
+ * unmap_user_pages - unmap the user pages in [@start, @end) of @pgd and
+ *                    drop the references their PTEs held
+ *
+ * The PTEs are only made non-present at first, so that no frame is given
+ * back while it may still be reached through the TLB. They are
+ * tagged so that the second pass only drops those, the batch range can
+ * cover PTEs that were never ours to drop.
+ */
+void
+unmap_user_pages(pagedir_t pgd, uint32_t start, uint32_t end)
+{
+    struct tlb_batch tb;
+    uint32_t vaddr;
+    page_t *page;
+
+    tlb_batch_init(&tb, pgd);
+
+    for (vaddr = start; vaddr < end; vaddr += 4096) {
+        page = get_page_from_pgd(pgd, vaddr);
+        if (!page || !pte_present(*page))
+            continue;
+
+        *page &= ~(1 << PTE_PRESENT_SHIFT);
+        *page |= 1 << PTE_UNMAP_SHIFT;
+        tlb_batch_add(&tb, vaddr);
+    }
+
+    if (tb.tb_start >= tb.tb_end)
+        return;
+
+    start = tb.tb_start;
+    end = tb.tb_end;
+    tlb_batch_flush(&tb);
+
+    for (vaddr = start; vaddr < end; vaddr += 4096) {
+        page = get_page_from_pgd(pgd, vaddr);
+        if (!page || !(*page & (1 << PTE_UNMAP_SHIFT)))
+            continue;
+
+        palloc_unref_page(PG_RND_DOWN(*page));
+        *page = 0;
+    }
 }
 
 int
@@ -525,6 +644,12 @@ pte_mark_cow(page_t *p)
     *p |= 1 << PTE_COW_SHIFT;
 }
 
+void
+pte_unmark_cow(page_t *p)
+{
+    *p &= ~(1 << PTE_COW_SHIFT);
+}
+
 int
 pte_is_cow(page_t p)
 {
@@ -566,13 +691,30 @@ replace_page(pagedir_t pgd, uint32_t virt_addr, page_t entry)
 {
     page_t *ptr = get_page_from_pgd(pgd, virt_addr);
     *ptr = entry;
+    tlb_flush_page(pgd, virt_addr);
 }
 
 
+/*
+ * copy_page_dir_fork - copy the user part of @orig for a child, the
+ *                      child's PTEs reference the same frames
+ */
 pagedir_t
 copy_page_dir_fork(pagedir_t orig)
 {
     pde_t *ret = copy_page_dir(orig);
+    int i, j;
+
+    for (i = 0; i < 768; i ++) {
+        if (ret[i] != 0) {
+            uint32_t *pde_addr = (void *) VIRT_BASE + ((ret[i] >> PDE_ADDR_SHIFT) << 12);
+
+            for (j = 0; j < 1024; j ++)
+                if (pte_present(pde_addr[j]))
+                    palloc_ref_page(PG_RND_DOWN(pde_addr[j]));
+        }
+    }
+
     return ret;
 }
 
@@ -584,22 +726,23 @@ paging_init(void)
     DISABLE_IRQ();
     printk("page: creating kernel page directory\n");
     /* map the first 4 MB to high half */
+    /* the direct mapping is the same everywhere, keep it across CR3 loads */
     for (i = 0 * 1024 * 1024; i < 4 * 1024 * 1024; i += 4096) {
-        page_t pg = create_pte(i, 0, 1);
+        page_t pg = create_pte(i, 0, 1) | (1 << PTE_GLOB_SHIFT);
         kernel_pgt[pte_index(i)] = pg;
     }
     kernel_pgd[pde_index(VIRT_BASE)] = create_pde(kv2p(kernel_pgt), 0, 1);
 
     /* map 8MB for the heap */
     for (; i < 8 * 1024 * 1024; i += 4096) {
-        page_t pg = create_pte(i, 0, 1);
+        page_t pg = create_pte(i, 0, 1) | (1 << PTE_GLOB_SHIFT);
         heap_1_pgt[pte_index(i)] = pg;
     }
     kernel_pgd[pde_index(VIRT_BASE + 4 * 1024 * 1024)]
             = create_pde(kv2p(heap_1_pgt), 0, 1);
 
     for (; i < 12 * 1024 * 1024; i += 4096) {
-        page_t pg = create_pte(i, 0, 1);
+        page_t pg = create_pte(i, 0, 1) | (1 << PTE_GLOB_SHIFT);
         heap_2_pgt[pte_index(i)] = pg;
     }
     kernel_pgd[pde_index(VIRT_BASE + 8 * 1024 * 1024)]
@@ -607,7 +750,12 @@ paging_init(void)
     kernel_pgd[pde_index(VIRT_BASE + 16 * 10124 * 1024)]
             = create_pde(kv2p(kernel_virt_pgt), 0, 1);
 
+    /* every page directory shares this one, see kmap_temp() */
+    kernel_pgd[pde_index(KMAP_TEMP_BASE)]
+            = create_pde(kv2p(kmap_temp_pgt), 0, 1);
+
     activate_pgd(kernel_pgd);
+    enable_pge();
     printk("page: kernel directory activated\n");
     ENABLE_IRQ();
 }
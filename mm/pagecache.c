@@ -0,0 +1,539 @@
+#include <levos/kernel.h>
+#include <levos/pagecache.h>
+#include <levos/page.h>
+#include <levos/palloc.h>
+#include <levos/fs.h>
+#include <levos/hash.h>
+#include <levos/list.h>
+#include <levos/spinlock.h>
+#include <levos/task.h>
+#include <levos/work.h>
+
+#define MODULE_NAME pagecache
+
+/*
+ * The page cache holds the contents of files that are mapped into
+ * memory, hashed by (filesystem, inode, page offset). File backed VMAs
+ * map these frames directly instead of reading a private copy on every
+ * fault, so every task running the same binary shares one copy of its
+ * text.
+ *
+ * The frames are only ever mapped read-only, private writable mappings
+ * get them copy-on-write. The cache holds one reference to each frame and
+ * every mapping holds another, so a frame lives on after being dropped
+ * from the cache until the last task unmaps it.
+ *
+ * A page is read in with pagecache_lock dropped. Until it is there, its
+ * entry is CP_LOCKED and everybody else who wants it waits. The list is
+ * kept in LRU order, the cache is held to a quarter of the memory and
+ * gives back the frames that nobody has mapped when palloc runs out.
+ *
+ * Read-ahead puts CP_LOCKED entries for the whole window into the cache
+ * right away and leaves the reading to the worker thread, so a fault
+ * doesn't wait for more than its own page.
+ */
+
+/* the most pages one read-ahead work item reads */
+#define PAGECACHE_RA_MAX 32
+
+static struct hash pagecache_hash;
+static struct list pagecache_list;
+static spinlock_t pagecache_lock;
+static int pagecache_nr_pages;
+static int pagecache_max_pages;
+
+static unsigned
+pagecache_hash_page(const struct hash_elem *elem, void *aux)
+{
+    struct cached_page *cp = hash_entry(elem, struct cached_page, cp_helem);
+
+    return hash_int((int) cp->cp_fs ^ cp->cp_ino ^ cp->cp_offset);
+}
+
+static bool
+pagecache_less_page(const struct hash_elem *ea,
+                    const struct hash_elem *eb,
+                    void *aux)
+{
+    struct cached_page *a = hash_entry(ea, struct cached_page, cp_helem);
+    struct cached_page *b = hash_entry(eb, struct cached_page, cp_helem);
+
+    if (a->cp_fs != b->cp_fs)
+        return a->cp_fs < b->cp_fs;
+
+    if (a->cp_ino != b->cp_ino)
+        return a->cp_ino < b->cp_ino;
+
+    return a->cp_offset < b->cp_offset;
+}
+
+static struct cached_page *
+__pagecache_lookup(struct filesystem *fs, uint32_t ino, uint32_t offset)
+{
+    struct cached_page cmp;
+    struct hash_elem *elem;
+
+    cmp.cp_fs = fs;
+    cmp.cp_ino = ino;
+    cmp.cp_offset = offset;
+
+    elem = hash_find(&pagecache_hash, &cmp.cp_helem);
+    if (!elem)
+        return NULL;
+
+    return hash_entry(elem, struct cached_page, cp_helem);
+}
+
+/* like __pagecache_lookup(), but wait for a page that is being read in */
+static struct cached_page *
+__pagecache_lookup_wait(struct filesystem *fs, uint32_t ino, uint32_t offset)
+{
+    struct cached_page *cp;
+
+    while ((cp = __pagecache_lookup(fs, ino, offset)) &&
+            cp->cp_flags & CP_LOCKED) {
+        spin_unlock(&pagecache_lock);
+        sched_yield();
+        spin_lock(&pagecache_lock);
+    }
+
+    return cp;
+}
+
+/* move @cp to the back of the LRU list */
+static void
+__pagecache_touch(struct cached_page *cp)
+{
+    list_remove(&cp->cp_list_elem);
+    list_push_back(&pagecache_list, &cp->cp_list_elem);
+}
+
+/*
+ * __pagecache_drop - remove a page from the cache, the frame is left to
+ *                    the tasks that still have it mapped
+ */
+static void
+__pagecache_drop(struct cached_page *cp)
+{
+    hash_delete(&pagecache_hash, &cp->cp_helem);
+    list_remove(&cp->cp_list_elem);
+    pagecache_nr_pages --;
+
+    if (cp->cp_phys)
+        palloc_unref_page(cp->cp_phys);
+    free(cp);
+}
+
+/*
+ * __pagecache_shrink - drop up to @nr pages that are not being read in,
+ *                      the least recently used first
+ *
+ * Only the pages that no task has mapped give their frame back, those go
+ * first. With @mapped set the others are dropped as well, to keep the
+ * cache under its size. Returns how many pages were dropped.
+ */
+static int
+__pagecache_shrink(int nr, int mapped)
+{
+    struct list_elem *elem, *next;
+    struct cached_page *cp;
+    int pass, done = 0;
+
+    for (pass = 0; pass < (mapped ? 2 : 1); pass ++) {
+        for (elem = list_begin(&pagecache_list);
+                elem != list_end(&pagecache_list) && done < nr;
+                elem = next) {
+            next = list_next(elem);
+            cp = list_entry(elem, struct cached_page, cp_list_elem);
+
+            if (cp->cp_flags & CP_LOCKED)
+                continue;
+
+            if (pass == 0 && palloc_page_refc(cp->cp_phys) != 1)
+                continue;
+
+            __pagecache_drop(cp);
+            done ++;
+        }
+    }
+
+    return done;
+}
+
+/*
+ * pagecache_shrink - give up to @nr frames back, palloc calls this when
+ *                    it runs out of memory
+ */
+int
+pagecache_shrink(int nr)
+{
+    int done;
+
+    /* the allocation came from inside the cache */
+    if (spin_lock_would_deadlock(&pagecache_lock))
+        return 0;
+
+    spin_lock(&pagecache_lock);
+    done = __pagecache_shrink(nr, 0);
+    spin_unlock(&pagecache_lock);
+
+    if (done)
+        mprintk("reclaimed %d pages\n", done);
+
+    return done;
+}
+
+/* pagecache_cacheable - can the contents of @f be kept in the cache? */
+int
+pagecache_cacheable(struct file *f)
+{
+    return f->fs && f->ino;
+}
+
+/* read the page of @f at @offset into the frame @phys */
+static int
+__pagecache_read(struct file *f, uint32_t offset, uintptr_t phys)
+{
+    struct file tmp = *f;
+    void *vaddr;
+    int rc;
+
+    /* a copy, so that the position of @f isn't moved under its users */
+    tmp.fpos = offset;
+
+    vaddr = kmap_temp(phys);
+    rc = tmp.fops->read(&tmp, vaddr, 4096);
+    kunmap_temp(vaddr);
+
+    return rc < 0 ? rc : 0;
+}
+
+/*
+ * __pagecache_reserve - put a CP_LOCKED entry for the page of @f at
+ *                       @offset into the cache, for __pagecache_read_in()
+ *                       to fill. pagecache_lock must be held.
+ */
+static struct cached_page *
+__pagecache_reserve(struct file *f, uint32_t offset)
+{
+    struct cached_page *cp;
+
+    if (pagecache_nr_pages >= pagecache_max_pages)
+        __pagecache_shrink(pagecache_nr_pages - pagecache_max_pages + 1, 1);
+
+    cp = malloc(sizeof(*cp));
+    if (!cp)
+        return NULL;
+
+    cp->cp_fs = f->fs;
+    cp->cp_ino = f->ino;
+    cp->cp_offset = offset;
+    cp->cp_phys = 0;
+    cp->cp_flags = CP_LOCKED;
+
+    hash_insert(&pagecache_hash, &cp->cp_helem);
+    list_push_back(&pagecache_list, &cp->cp_list_elem);
+    pagecache_nr_pages ++;
+
+    return cp;
+}
+
+/*
+ * __pagecache_read_in - read the page of @f that the reserved entry @cp
+ *                       stands for
+ *
+ * pagecache_lock is held, but dropped while the page is read in. If the
+ * page can't be read the entry goes away again and the error is
+ * returned.
+ */
+static int
+__pagecache_read_in(struct cached_page *cp, struct file *f)
+{
+    uintptr_t phys;
+    int rc;
+
+    spin_unlock(&pagecache_lock);
+
+    /* the part past the end of the file reads as zeroes */
+    phys = palloc_get_zeroed_page();
+    rc = phys ? __pagecache_read(f, cp->cp_offset, phys) : -ENOMEM;
+
+    spin_lock(&pagecache_lock);
+
+    cp->cp_phys = phys;
+
+    /* the file was written to while it was being read */
+    if (!rc && cp->cp_flags & CP_STALE)
+        rc = -EAGAIN;
+
+    if (rc) {
+        __pagecache_drop(cp);
+        return rc;
+    }
+
+    cp->cp_flags &= ~CP_LOCKED;
+    return 0;
+}
+
+/*
+ * __pagecache_fill - read the page of @f at @offset into a new cache
+ *                    entry, see __pagecache_read_in()
+ */
+static struct cached_page *
+__pagecache_fill(struct file *f, uint32_t offset)
+{
+    struct cached_page *cp;
+    int rc;
+
+    cp = __pagecache_reserve(f, offset);
+    if (!cp)
+        return ERR_PTR(-ENOMEM);
+
+    rc = __pagecache_read_in(cp, f);
+    if (rc)
+        return ERR_PTR(rc);
+
+    return cp;
+}
+
+/*
+ * pagecache_get - get the physical frame that holds the page of @f that
+ *                 starts at @offset into @phys, reading it in if
+ *                 necessary
+ *
+ * The frame comes with a reference for the caller, which either passes
+ * it on to a mapping or drops it with palloc_unref_page().
+ */
+int
+pagecache_get(struct file *f, uint32_t offset, uintptr_t *phys)
+{
+    struct cached_page *cp;
+
+    panic_ifnot(offset % 4096 == 0);
+
+    if (!pagecache_cacheable(f))
+        return -EINVAL;
+
+    spin_lock(&pagecache_lock);
+
+    do {
+        cp = __pagecache_lookup_wait(f->fs, f->ino, offset);
+        if (cp)
+            __pagecache_touch(cp);
+        else
+            cp = __pagecache_fill(f, offset);
+    } while (IS_ERR(cp) && PTR_ERR(cp) == -EAGAIN);
+
+    if (IS_ERR(cp)) {
+        spin_unlock(&pagecache_lock);
+        return PTR_ERR(cp);
+    }
+
+    palloc_ref_page(cp->cp_phys);
+    *phys = cp->cp_phys;
+
+    spin_unlock(&pagecache_lock);
+
+    return 0;
+}
+
+/*
+ * pagecache_lookup - like pagecache_get(), but only if the page is
+ *                    already cached, nothing is read or waited for.
+ *                    Returns zero if it is not.
+ */
+uintptr_t
+pagecache_lookup(struct file *f, uint32_t offset)
+{
+    struct cached_page *cp;
+    uintptr_t phys = 0;
+
+    if (!pagecache_cacheable(f))
+        return 0;
+
+    spin_lock(&pagecache_lock);
+
+    cp = __pagecache_lookup(f->fs, f->ino, offset);
+    if (cp && !(cp->cp_flags & CP_LOCKED)) {
+        __pagecache_touch(cp);
+        palloc_ref_page(cp->cp_phys);
+        phys = cp->cp_phys;
+    }
+
+    spin_unlock(&pagecache_lock);
+
+    return phys;
+}
+
+/* a read-ahead window that the worker reads in */
+struct pagecache_ra {
+    struct file *ra_file;
+    int ra_nr;
+    struct cached_page *ra_pages[PAGECACHE_RA_MAX];
+};
+
+static void
+__pagecache_ra_work(void *aux)
+{
+    struct pagecache_ra *ra = aux;
+    int i;
+
+    /* a page that can't be read is dropped, its fault will try again */
+    spin_lock(&pagecache_lock);
+    for (i = 0; i < ra->ra_nr; i ++)
+        __pagecache_read_in(ra->ra_pages[i], ra->ra_file);
+    spin_unlock(&pagecache_lock);
+
+    vfs_close(ra->ra_file);
+    free(ra);
+}
+
+/*
+ * __pagecache_ra_start - reserve the pages of @f that are not cached yet
+ *                        from *@offset on, up to @end or PAGECACHE_RA_MAX
+ *                        of them, and have the worker read them in
+ */
+static int
+__pagecache_ra_start(struct file *f, uint32_t *offset, uint32_t end)
+{
+    struct pagecache_ra *ra;
+    struct cached_page *cp;
+    struct work *work;
+    int i, rc = 0;
+
+    ra = malloc(sizeof(*ra));
+    if (!ra)
+        return -ENOMEM;
+
+    ra->ra_file = f;
+    ra->ra_nr = 0;
+
+    spin_lock(&pagecache_lock);
+
+    for (; *offset < end && ra->ra_nr < PAGECACHE_RA_MAX; *offset += 4096) {
+        if (__pagecache_lookup(f->fs, f->ino, *offset))
+            continue;
+
+        cp = __pagecache_reserve(f, *offset);
+        if (!cp) {
+            rc = -ENOMEM;
+            break;
+        }
+
+        ra->ra_pages[ra->ra_nr ++] = cp;
+    }
+
+    work = ra->ra_nr ? work_create(__pagecache_ra_work, ra) : NULL;
+    if (!work) {
+        /* whoever waits for these reads them in themselves */
+        if (ra->ra_nr)
+            rc = -ENOMEM;
+        for (i = 0; i < ra->ra_nr; i ++)
+            __pagecache_drop(ra->ra_pages[i]);
+        spin_unlock(&pagecache_lock);
+
+        free(ra);
+        return rc;
+    }
+
+    spin_unlock(&pagecache_lock);
+
+    vfs_inc_refc(f);
+    schedule_work(work);
+
+    return rc;
+}
+
+/*
+ * pagecache_readahead - start reading the @nr pages of @f from @offset
+ *                       on into the cache, stopping at the end of the
+ *                       file. Doesn't wait for them.
+ */
+void
+pagecache_readahead(struct file *f, uint32_t offset, int nr)
+{
+    uint32_t end = offset + nr * 4096;
+
+    panic_ifnot(offset % 4096 == 0);
+
+    if (!pagecache_cacheable(f))
+        return;
+
+    if (end > PG_RND_UP(f->length))
+        end = PG_RND_UP(f->length);
+
+    while (offset < end)
+        if (__pagecache_ra_start(f, &offset, end))
+            break;
+}
+
+/*
+ * __pagecache_forget - drop @cp, or if it is being read in, have it
+ *                      thrown away once it is there
+ */
+static void
+__pagecache_forget(struct cached_page *cp)
+{
+    if (cp->cp_flags & CP_LOCKED)
+        cp->cp_flags |= CP_STALE;
+    else
+        __pagecache_drop(cp);
+}
+
+/*
+ * pagecache_invalidate - forget the cached pages of @f that overlap the
+ *                        byte range [@start, @end)
+ */
+void
+pagecache_invalidate(struct file *f, uint32_t start, uint32_t end)
+{
+    struct list_elem *elem, *next;
+    struct cached_page *cp;
+    uint32_t offset;
+
+    if (!pagecache_cacheable(f) || start >= end)
+        return;
+
+    start = PG_RND_DOWN(start);
+
+    spin_lock(&pagecache_lock);
+
+    if (!pagecache_nr_pages)
+        goto out;
+
+    /* small ranges are cheaper to look up page by page */
+    if ((end - start) / 4096 < pagecache_nr_pages) {
+        for (offset = start; offset < end; offset += 4096) {
+            cp = __pagecache_lookup(f->fs, f->ino, offset);
+            if (cp)
+                __pagecache_forget(cp);
+        }
+        goto out;
+    }
+
+    for (elem = list_begin(&pagecache_list);
+            elem != list_end(&pagecache_list);
+            elem = next) {
+        next = list_next(elem);
+        cp = list_entry(elem, struct cached_page, cp_list_elem);
+
+        if (cp->cp_fs == f->fs && cp->cp_ino == f->ino &&
+                cp->cp_offset + 4096 > start && cp->cp_offset < end)
+            __pagecache_forget(cp);
+    }
+
+out:
+    spin_unlock(&pagecache_lock);
+}
+
+void
+pagecache_init(void)
+{
+    spin_lock_init(&pagecache_lock);
+    list_init(&pagecache_list);
+    hash_init(&pagecache_hash, pagecache_hash_page, pagecache_less_page, NULL);
+    pagecache_nr_pages = 0;
+    pagecache_max_pages = palloc_get_total() / 4;
+
+    mprintk("initialized, holding up to %d pages\n", pagecache_max_pages);
+}
@@ -2,9 +2,43 @@
 #include <levos/palloc.h>
 #include <levos/arch.h>
 #include <levos/bitmap.h>
+#include <levos/list.h>
+#include <levos/spinlock.h>
+#include <levos/page.h>
+#include <levos/pagecache.h>
+
+/*
+ * Physical frames are handed out by a buddy allocator: a free block of
+ * order n is 2^n frames large and aligned to its size, its buddy is the
+ * block it was split off from. Freeing a block merges it with its buddy
+ * for as long as that one is free as well, so large contiguous ranges
+ * come back together.
+ *
+ * Until palloc_reinit() runs there is no frame table, the few frames
+ * needed by then come from a static bitmap. The table itself is too big
+ * for the heap once there are a few GB of RAM, its frames are taken from
+ * the bitmap too and mapped at PALLOC_TABLE_BASE.
+ */
 
 static int palloc_total_pages;
 
+/* frames to ask the page cache for when the free lists run dry */
+#define PALLOC_RECLAIM_PAGES 32
+
+/* the frame table, see struct page */
+static struct page *palloc_pages;
+static spinlock_t palloc_lock;
+
+struct free_area {
+    struct list free_list;
+    int nr_free;
+};
+
+static struct free_area free_areas[PALLOC_MAX_ORDER + 1];
+
+/* number of free frames, summed over all orders */
+static int palloc_nr_free;
+
 static char palloc_bitmap_bits[8192];
 
 static struct bitmap pre_palloc_bitmap = {
@@ -14,12 +48,101 @@ static struct bitmap pre_palloc_bitmap = {
 
 static struct bitmap *palloc_bitmap = &pre_palloc_bitmap;
 
+static inline int
+page_to_pfn(struct page *page)
+{
+    return page - palloc_pages;
+}
+
+static void
+__buddy_push(struct page *page, int order)
+{
+    page->pg_flags |= PG_BUDDY;
+    page->pg_order = order;
+    list_push_front(&free_areas[order].free_list, &page->pg_elem);
+    free_areas[order].nr_free ++;
+    palloc_nr_free += 1 << order;
+}
+
+static void
+__buddy_remove(struct page *page)
+{
+    int order = page->pg_order;
+
+    page->pg_flags &= ~PG_BUDDY;
+    list_remove(&page->pg_elem);
+    free_areas[order].nr_free --;
+    palloc_nr_free -= 1 << order;
+}
+
+/*
+ * __buddy_free - give frame @pfn back and merge it with its buddies
+ */
+static void
+__buddy_free(int pfn)
+{
+    int order = 0, buddy;
+
+    while (order < PALLOC_MAX_ORDER) {
+        buddy = pfn ^ (1 << order);
+        if (buddy + (1 << order) > palloc_total_pages)
+            break;
+
+        if (!(palloc_pages[buddy].pg_flags & PG_BUDDY) ||
+                palloc_pages[buddy].pg_order != order)
+            break;
+
+        __buddy_remove(&palloc_pages[buddy]);
+        pfn &= ~(1 << order);
+        order ++;
+    }
+
+    __buddy_push(&palloc_pages[pfn], order);
+}
+
+/*
+ * __buddy_alloc - take a block of 2^@order frames off the free lists,
+ *                 splitting a larger one if needed
+ *
+ * Returns the first frame number, or -1 if there is no such block.
+ */
+static int
+__buddy_alloc(int order)
+{
+    struct page *page;
+    int o, pfn;
+
+    for (o = order; o <= PALLOC_MAX_ORDER; o ++)
+        if (!list_empty(&free_areas[o].free_list))
+            break;
+
+    if (o > PALLOC_MAX_ORDER)
+        return -1;
+
+    page = list_entry(list_front(&free_areas[o].free_list),
+                      struct page, pg_elem);
+    __buddy_remove(page);
+    pfn = page_to_pfn(page);
+
+    /* put the upper halves back */
+    while (o > order) {
+        o --;
+        __buddy_push(&palloc_pages[pfn + (1 << o)], o);
+    }
+
+    return pfn;
+}
+
 static void
 palloc_mark(int id)
 {
     bitmap_mark(palloc_bitmap, id);
 }
 
+/*
+ * palloc_mark_address - reserve the frame at @ptr, only meaningful
+ *                       before palloc_reinit()
+ */
 void
 palloc_mark_address(uintptr_t ptr)
 {
@@ -29,10 +152,22 @@ palloc_mark_address(uintptr_t ptr)
 void
 palloc_free_pages(void *addr, int num)
 {
+    int pfn = (int) addr / 4096, i;
+    uint32_t flags;
+
     panic_ifnot((int) addr % 4096 == 0);
 
-    bitmap_set_multiple(palloc_bitmap, ((int)addr / 4096), num, 0);
-    return;
+    if (!palloc_pages) {
+        bitmap_set_multiple(palloc_bitmap, pfn, num, 0);
+        return;
+    }
+
+    flags = spin_lock_irqsave(&palloc_lock);
+    for (i = 0; i < num; i ++) {
+        palloc_pages[pfn + i].pg_refc = 0;
+        __buddy_free(pfn + i);
+    }
+    spin_unlock_irqrestore(&palloc_lock, flags);
 }
 
 void
@@ -41,36 +176,165 @@ palloc_free_page(void *addr)
     palloc_free_pages(addr, 1);
 }
 
+/*
+ * palloc_try_get_pages - allocate @num contiguous frames, or return zero
+ *                        if there are none, even after asking the page
+ *                        cache for its frames
+ */
 uintptr_t
-palloc_get_pages(int num)
+palloc_try_get_pages(int num)
 {
     size_t pg;
+    int order = 0, i;
+    uint32_t flags;
 
-    pg = bitmap_scan_and_flip(palloc_bitmap, 0, num, 0);
-    if (pg == BITMAP_ERROR)
-        panic("Out of physical memory\n");
+    if (!palloc_pages) {
+        pg = bitmap_scan_and_flip(palloc_bitmap, 0, num, 0);
+        if (pg == BITMAP_ERROR)
+            return 0;
+
+        return pg * 4096;
+    }
+
+    while ((1 << order) < num)
+        order ++;
+
+    if (order > PALLOC_MAX_ORDER)
+        panic("palloc: request of %d pages is too large\n", num);
+
+    flags = spin_lock_irqsave(&palloc_lock);
+
+    pg = __buddy_alloc(order);
+    if ((int) pg == -1) {
+        /* the page cache may hold frames that nobody has mapped */
+        spin_unlock_irqrestore(&palloc_lock, flags);
+        pagecache_shrink((1 << order) > PALLOC_RECLAIM_PAGES ?
+                            (1 << order) : PALLOC_RECLAIM_PAGES);
+        flags = spin_lock_irqsave(&palloc_lock);
+
+        pg = __buddy_alloc(order);
+    }
+
+    if ((int) pg == -1) {
+        spin_unlock_irqrestore(&palloc_lock, flags);
+        return 0;
+    }
+
+    /* the caller holds the first reference */
+    for (i = 0; i < num; i ++)
+        palloc_pages[pg + i].pg_refc = 1;
+
+    /* give back the tail that rounding up to the order added */
+    for (i = num; i < (1 << order); i ++)
+        __buddy_free(pg + i);
+
+    spin_unlock_irqrestore(&palloc_lock, flags);
 
     return pg * 4096;
 }
 
+/* palloc_get_pages - like palloc_try_get_pages(), but never fails */
+uintptr_t
+palloc_get_pages(int num)
+{
+    uintptr_t phys = palloc_try_get_pages(num);
+
+    if (!phys)
+        panic("Out of physical memory\n");
+
+    return phys;
+}
+
 uintptr_t
 palloc_get_page(void)
 {
     return palloc_get_pages(1);
 }
 
+uintptr_t
+palloc_try_get_page(void)
+{
+    return palloc_try_get_pages(1);
+}
+
+struct page *
+phys_to_page(uintptr_t phys)
+{
+    if (!palloc_pages || phys / 4096 >= palloc_total_pages)
+        return NULL;
+
+    return &palloc_pages[phys / 4096];
+}
+
+/*
+ * palloc_ref_page - take another reference to the frame at @phys
+ *
+ * Frames that are not reference counted are left alone.
+ */
+void
+palloc_ref_page(uintptr_t phys)
+{
+    struct page *page = phys_to_page(phys);
+    uint32_t flags;
+
+    if (!page)
+        return;
+
+    flags = spin_lock_irqsave(&palloc_lock);
+    if (page->pg_refc)
+        page->pg_refc ++;
+    spin_unlock_irqrestore(&palloc_lock, flags);
+}
+
+/*
+ * palloc_unref_page - drop a reference to the frame at @phys, the frame
+ *                     is freed once the last one is gone
+ */
+void
+palloc_unref_page(uintptr_t phys)
+{
+    struct page *page = phys_to_page(phys);
+    uint32_t flags;
+
+    if (!page)
+        return;
+
+    flags = spin_lock_irqsave(&palloc_lock);
+    if (page->pg_refc) {
+        page->pg_refc --;
+        if (page->pg_refc == 0)
+            __buddy_free(page_to_pfn(page));
+    }
+    spin_unlock_irqrestore(&palloc_lock, flags);
+}
+
+int
+palloc_page_refc(uintptr_t phys)
+{
+    struct page *page = phys_to_page(phys);
+
+    if (!page)
+        return 0;
+
+    return page->pg_refc;
+}
+
 size_t
 palloc_get_free(void)
 {
-    int ret = bitmap_count(palloc_bitmap, 0, palloc_bitmap->bit_cnt, 0);
-    //printk("%d pages are marked as 0\n", ret);
-    return ret;
+    if (!palloc_pages)
+        return bitmap_count(palloc_bitmap, 0, palloc_bitmap->bit_cnt, 0);
+
+    return palloc_nr_free;
 }
 
 int
 palloc_get_total(void)
 {
-    return palloc_bitmap->bit_cnt;
+    if (!palloc_pages)
+        return palloc_bitmap->bit_cnt;
+
+    return palloc_total_pages;
 }
 
 size_t
@@ -139,14 +403,54 @@ palloc_proc_memtotal(int pos, void *buf, size_t len, char *__arg)
     return len;
 }
 
+/* map frames for the table of @total frames, they are never given back */
+static struct page *
+__palloc_map_table(int total)
+{
+    uint32_t size = PG_RND_UP(total * sizeof(struct page)), off;
+
+    if (size > KMAP_TEMP_BASE - PALLOC_TABLE_BASE)
+        panic("no room for the page frame table of %d frames\n", total);
+
+    for (off = 0; off < size; off += 4096)
+        map_page_kernel(palloc_get_page(), PALLOC_TABLE_BASE + off, 0);
+
+    memset((void *) PALLOC_TABLE_BASE, 0, size);
+
+    return (struct page *) PALLOC_TABLE_BASE;
+}
+
+/*
+ * palloc_reinit - switch over to the buddy allocator, every frame that
+ *                 is still free in the boot bitmap goes on the free lists
+ *
+ * This has to run before the first task copies the kernel page
+ * directory, so that they all see the frame table.
+ */
 void
 palloc_reinit(void)
 {
+    int total = arch_get_total_ram() / 4096, i;
+    struct page *pages;
+
+    pages = __palloc_map_table(total);
+
     DISABLE_IRQ();
-    palloc_bitmap = bitmap_create(arch_get_total_ram() / 4096) ;
-    if (palloc_bitmap == NULL)
-        panic("failed to reinitalize palloc\n");
-    memcpy(palloc_bitmap->bits, palloc_bitmap_bits, 8192);
+
+    spin_lock_init(&palloc_lock);
+    for (i = 0; i <= PALLOC_MAX_ORDER; i ++) {
+        list_init(&free_areas[i].free_list);
+        free_areas[i].nr_free = 0;
+    }
+    palloc_nr_free = 0;
+
+    palloc_total_pages = total;
+    palloc_pages = pages;
+
+    for (i = 0; i < total; i ++)
+        if (i >= palloc_bitmap->bit_cnt || !bitmap_test(palloc_bitmap, i))
+            __buddy_free(i);
+
     ENABLE_IRQ();
 }
 
@@ -0,0 +1,299 @@
+#include <levos/kernel.h>
+#include <levos/slab.h>
+#include <levos/page.h>
+#include <levos/list.h>
+#include <levos/spinlock.h>
+
+#define MODULE_NAME slab
+
+/*
+ * Object caches for the small fixed-size structures the kernel keeps
+ * allocating and freeing, like packets, work items and files. Every
+ * cache carves its objects out of single pages of the heap area, so an
+ * allocation is a pop off the free chain of a partially used slab and a
+ * free finds its slab by rounding the address down to the page.
+ *
+ * The pages do not come from palloc, frames above the directly mapped
+ * region would need a kmap for every one of them.
+ */
+
+static struct list cache_list;
+static spinlock_t cache_list_lock;
+
+#define SLAB_HDR_SIZE ROUND_UP(sizeof(struct kmem_slab), 8)
+
+static inline struct kmem_slab *
+obj_to_slab(void *obj)
+{
+    return (struct kmem_slab *) PG_RND_DOWN((uintptr_t) obj);
+}
+
+/* where the free chain goes through @obj */
+static inline void **
+obj_free_link(struct kmem_cache *kc, void *obj)
+{
+    return (void **) ((char *) obj + kc->kc_free_off);
+}
+
+static struct kmem_slab *
+__slab_create(struct kmem_cache *kc)
+{
+    struct kmem_slab *slab;
+    char *obj;
+    int i;
+
+    slab = heap_get_pages(1);
+    if (!slab)
+        return NULL;
+
+    slab->slab_cache = kc;
+    slab->slab_inuse = 0;
+    slab->slab_free = NULL;
+
+    /* chain the objects up, lowest address first */
+    obj = (char *) slab + SLAB_HDR_SIZE + (kc->kc_per_slab - 1) * kc->kc_size;
+    for (i = 0; i < kc->kc_per_slab; i ++, obj -= kc->kc_size) {
+        if (kc->kc_ctor)
+            kc->kc_ctor(obj);
+
+        *obj_free_link(kc, obj) = slab->slab_free;
+        slab->slab_free = obj;
+    }
+
+    kc->kc_nr_slabs ++;
+
+    return slab;
+}
+
+static void
+__slab_destroy(struct kmem_cache *kc, struct kmem_slab *slab)
+{
+    kc->kc_nr_slabs --;
+    heap_free_pages(slab, 1);
+}
+
+/*
+ * kmem_cache_create - create a cache of objects that are @size bytes
+ *                     large, @ctor may be NULL
+ */
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size, void (*ctor)(void *))
+{
+    struct kmem_cache *kc;
+
+    kc = malloc(sizeof(*kc));
+    if (!kc)
+        return NULL;
+
+    memset(kc, 0, sizeof(*kc));
+
+    kc->kc_name = name;
+    kc->kc_objsize = size;
+    kc->kc_ctor = ctor;
+
+    /*
+     * a constructed object has to stay that way while it is free, so
+     * the free chain can't go through it and gets a word of its own
+     */
+    if (ctor) {
+        kc->kc_free_off = ROUND_UP(size, sizeof(void *));
+        size = kc->kc_free_off + sizeof(void *);
+    } else {
+        kc->kc_free_off = 0;
+        if (size < sizeof(void *))
+            size = sizeof(void *);
+    }
+
+    kc->kc_size = ROUND_UP(size, 8);
+    kc->kc_per_slab = (4096 - SLAB_HDR_SIZE) / kc->kc_size;
+
+    panic_on(kc->kc_per_slab < 1, "slab: objects of cache %s are too large\n", name);
+
+    spin_lock_init(&kc->kc_lock);
+    list_init(&kc->kc_partial);
+    list_init(&kc->kc_full);
+    list_init(&kc->kc_empty);
+
+    spin_lock(&cache_list_lock);
+    list_push_back(&cache_list, &kc->kc_elem);
+    spin_unlock(&cache_list_lock);
+
+    return kc;
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+    struct kmem_slab *slab;
+    uint32_t flags;
+    void *obj;
+
+    flags = spin_lock_irqsave(&kc->kc_lock);
+
+    if (!list_empty(&kc->kc_partial)) {
+        slab = list_entry(list_front(&kc->kc_partial), struct kmem_slab, slab_elem);
+    } else if (!list_empty(&kc->kc_empty)) {
+        slab = list_entry(list_pop_front(&kc->kc_empty), struct kmem_slab, slab_elem);
+        kc->kc_nr_empty --;
+        list_push_front(&kc->kc_partial, &slab->slab_elem);
+    } else {
+        slab = __slab_create(kc);
+        if (!slab) {
+            spin_unlock_irqrestore(&kc->kc_lock, flags);
+            return NULL;
+        }
+        list_push_front(&kc->kc_partial, &slab->slab_elem);
+    }
+
+    obj = slab->slab_free;
+    slab->slab_free = *obj_free_link(kc, obj);
+    slab->slab_inuse ++;
+
+    if (slab->slab_inuse == kc->kc_per_slab) {
+        list_remove(&slab->slab_elem);
+        list_push_back(&kc->kc_full, &slab->slab_elem);
+    }
+
+    kc->kc_nr_active ++;
+    kc->kc_nr_allocs ++;
+
+    spin_unlock_irqrestore(&kc->kc_lock, flags);
+
+    return obj;
+}
+
+/*
+ * kmem_cache_zalloc - like kmem_cache_alloc(), but zero the object, which
+ *                     would undo a constructor
+ */
+void *
+kmem_cache_zalloc(struct kmem_cache *kc)
+{
+    void *obj;
+
+    panic_on(kc->kc_ctor, "slab: zalloc from cache %s, it has a constructor\n",
+            kc->kc_name);
+
+    obj = kmem_cache_alloc(kc);
+
+    if (obj)
+        memset(obj, 0, kc->kc_objsize);
+
+    return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+    struct kmem_slab *slab;
+    uint32_t flags;
+
+    if (!obj)
+        return;
+
+    slab = obj_to_slab(obj);
+    panic_ifnot(slab->slab_cache == kc);
+
+    flags = spin_lock_irqsave(&kc->kc_lock);
+
+    /* a full slab becomes partial again */
+    if (slab->slab_inuse == kc->kc_per_slab) {
+        list_remove(&slab->slab_elem);
+        list_push_front(&kc->kc_partial, &slab->slab_elem);
+    }
+
+    *obj_free_link(kc, obj) = slab->slab_free;
+    slab->slab_free = obj;
+    slab->slab_inuse --;
+    kc->kc_nr_active --;
+
+    if (slab->slab_inuse == 0) {
+        list_remove(&slab->slab_elem);
+        if (kc->kc_nr_empty < KMEM_CACHE_MAX_EMPTY) {
+            list_push_back(&kc->kc_empty, &slab->slab_elem);
+            kc->kc_nr_empty ++;
+        } else
+            __slab_destroy(kc, slab);
+    }
+
+    spin_unlock_irqrestore(&kc->kc_lock, flags);
+}
+
+static int
+__slabinfo_append(char *buf, int pos, int max, const char *str)
+{
+    int len = strlen(str);
+
+    if (pos + len > max)
+        len = max - pos;
+
+    memcpy(buf + pos, str, len);
+    return pos + len;
+}
+
+/*
+ * slab_proc_slabinfo - one line per cache: name, objects in use, total
+ *                      objects, object size, slabs and allocations so far
+ */
+size_t
+slab_proc_slabinfo(int pos, void *buf, size_t len, char *__arg)
+{
+    struct list_elem *elem;
+    char num[16];
+    char *info;
+    int actlen = 0, max = 4096;
+
+    /* nothing to read, the return value can't carry an error */
+    info = malloc(max);
+    if (!info)
+        return 0;
+
+#define APPEND(s) actlen = __slabinfo_append(info, actlen, max, s)
+#define APPEND_INT(v) itoa(v, 10, num); APPEND(num)
+
+    APPEND("name active total objsize slabs allocs\n");
+
+    spin_lock(&cache_list_lock);
+    list_foreach_raw(&cache_list, elem) {
+        struct kmem_cache *kc = list_entry(elem, struct kmem_cache, kc_elem);
+
+        APPEND(kc->kc_name);
+        APPEND(" ");
+        APPEND_INT(kc->kc_nr_active);
+        APPEND(" ");
+        APPEND_INT(kc->kc_nr_slabs * kc->kc_per_slab);
+        APPEND(" ");
+        APPEND_INT(kc->kc_objsize);
+        APPEND(" ");
+        APPEND_INT(kc->kc_nr_slabs);
+        APPEND(" ");
+        APPEND_INT(kc->kc_nr_allocs);
+        APPEND("\n");
+    }
+    spin_unlock(&cache_list_lock);
+
+#undef APPEND_INT
+#undef APPEND
+
+    if (pos > actlen) {
+        free(info);
+        return 0;
+    }
+
+    if (pos + len > actlen)
+        len = actlen - pos;
+
+    memcpy(buf, info + pos, len);
+    free(info);
+
+    return len;
+}
+
+void
+kmem_cache_init(void)
+{
+    list_init(&cache_list);
+    spin_lock_init(&cache_list_lock);
+
+    mprintk("initialized\n");
+}
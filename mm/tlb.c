@@ -0,0 +1,60 @@
+#include <levos/kernel.h>
+#include <levos/page.h>
+
+/*
+ * Keeping the TLB coherent with the page tables. A change to the user
+ * part of a directory only matters while it is loaded, otherwise it is
+ * picked up when CR3 is reloaded on the next switch to it. The kernel
+ * part is shared by every directory and mapped global, so changes there
+ * are always flushed.
+ *
+ * Past this many pages reloading CR3 is cheaper than invalidating them
+ * one by one, global kernel mappings survive the reload.
+ */
+#define TLB_FLUSH_MAX_PAGES 32
+
+/* tlb_flush_local - drop the translations of [@start, @end) */
+void
+tlb_flush_local(uint32_t start, uint32_t end)
+{
+    uint32_t vaddr;
+
+    if (end <= VIRT_BASE && (end - start) / 4096 > TLB_FLUSH_MAX_PAGES) {
+        __flush_tlb();
+        return;
+    }
+
+    for (vaddr = start; vaddr < end; vaddr += 4096)
+        __flush_tlb_page(vaddr);
+}
+
+void
+tlb_flush_range(pagedir_t pgd, uint32_t start, uint32_t end)
+{
+    if (start >= VIRT_BASE || pgd == __save_pgd())
+        tlb_flush_local(start, end);
+}
+
+void
+tlb_flush_page(pagedir_t pgd, uint32_t vaddr)
+{
+    vaddr = PG_RND_DOWN(vaddr);
+
+    tlb_flush_range(pgd, vaddr, vaddr + 4096);
+}
+
+/* tlb_flush_mm - drop every user translation of @pgd */
+void
+tlb_flush_mm(pagedir_t pgd)
+{
+    tlb_flush_range(pgd, 0, VIRT_BASE);
+}
+
+void
+tlb_batch_flush(struct tlb_batch *tb)
+{
+    if (tb->tb_start < tb->tb_end)
+        tlb_flush_range(tb->tb_pgd, tb->tb_start, tb->tb_end);
+
+    tlb_batch_init(tb, tb->tb_pgd);
+}
@@ -2,9 +2,14 @@
 #include <levos/page.h>
 #include <levos/bitmap.h>
 #include <levos/palloc.h>
+#include <levos/spinlock.h>
 
 static int kmap_setup_done = 0;
 
+static char kmap_temp_bits[KMAP_TEMP_SLOTS / 8];
+static struct bitmap kmap_temp_bmap;
+static spinlock_t kmap_temp_lock;
+
 #ifdef CONFIG_KMAP_USE_BITMAP
   static struct bitmap *kmap_bmap;
 #else
@@ -28,6 +33,10 @@ virt_kmap_init(void)
     printk("kmap: starting at 0x%x\n", last_kmap_addr);
 #endif
 
+    memset(kmap_temp_bits, 0, sizeof(kmap_temp_bits));
+    bitmap_create_using_buffer(KMAP_TEMP_SLOTS, kmap_temp_bits, &kmap_temp_bmap);
+    spin_lock_init(&kmap_temp_lock);
+
     printk("kmap: setup done\n");
     kmap_setup_done = 1;
 }
@@ -55,7 +64,6 @@ kmap_map_page(uint32_t phys)
 {
     void *vaddr = kmap_get_free_address();
     map_page_kernel(phys, (uint32_t) vaddr, 1);
-    __flush_tlb();
 
     return vaddr;
 }
@@ -78,7 +86,70 @@ kmap_get_page(void)
     printk("kmap: paddr 0x%x -> vaddr 0x%x\n", paddr, vaddr);
 
     map_page_kernel((uint32_t) paddr, (uint32_t) vaddr, 1);
-    __flush_tlb();
 
     return vaddr;
 }
+
+/*
+ * kmap_temp - map the physical page @phys into the kernel for a short
+ *             while, the mapping must be torn down with kunmap_temp()
+ *
+ * The slots live in a page table that is shared by every page directory,
+ * so unlike kmap_map_page() this can be used at any time and it does not
+ * use up kernel virtual space.
+ */
+void *
+kmap_temp(uint32_t phys)
+{
+    uint32_t vaddr;
+    page_t *pte;
+    size_t slot;
+
+    spin_lock(&kmap_temp_lock);
+    slot = bitmap_scan_and_flip(&kmap_temp_bmap, 0, 1, 0);
+    spin_unlock(&kmap_temp_lock);
+
+    if (slot == BITMAP_ERROR)
+        panic("kmap: out of temporary slots\n");
+
+    vaddr = KMAP_TEMP_BASE + slot * 4096;
+    pte = get_page_from_pgd(kernel_pgd, vaddr);
+    *pte = create_pte(PG_RND_DOWN(phys), 0, 1);
+    __flush_tlb_page(vaddr);
+
+    return (void *) vaddr;
+}
+
+void
+kunmap_temp(void *addr)
+{
+    uint32_t vaddr = PG_RND_DOWN((uint32_t) addr);
+    page_t *pte;
+
+    panic_ifnot(vaddr >= KMAP_TEMP_BASE);
+
+    pte = get_page_from_pgd(kernel_pgd, vaddr);
+    *pte = 0;
+    __flush_tlb_page(vaddr);
+
+    spin_lock(&kmap_temp_lock);
+    bitmap_reset(&kmap_temp_bmap, (vaddr - KMAP_TEMP_BASE) / 4096);
+    spin_unlock(&kmap_temp_lock);
+}
+
+/*
+ * kvirt_to_phys - the physical address behind the kernel address @addr,
+ *                 0 if nothing is mapped there
+ */
+uint32_t
+kvirt_to_phys(void *addr)
+{
+    uint32_t vaddr = (uint32_t) addr;
+    page_t *pte;
+
+    pte = get_page_from_pgd(kernel_pgd, vaddr);
+    if (!pte || !pte_present(*pte))
+        return 0;
+
+    return PG_RND_DOWN(*pte) | (vaddr & 0xfff);
+}
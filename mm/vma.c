@@ -1,16 +1,51 @@
 #include <levos/kernel.h>
 #include <levos/page.h>
+#include <levos/palloc.h>
 #include <levos/vma.h>
 #include <levos/spinlock.h>
 #include <levos/task.h>
+#include <levos/slab.h>
+#include <levos/pagecache.h>
+
+static struct kmem_cache *vma_cache;
+
+/*
+ * The VMAs of a task are kept both on a list sorted by address, for
+ * walking them in order, and in a red-black tree keyed by vma_start, for
+ * finding them. Every node also knows the gap between its VMA and the
+ * one below it and the largest such gap in its subtree, so that a free
+ * region can be found without looking at every VMA.
+ */
+#define rb_vma(n) rb_entry(n, struct vm_area, vma_rb)
+
+static void
+vma_augment(struct rb_node *n)
+{
+    struct vm_area *vma = rb_vma(n);
+    uint32_t max = vma->vma_gap;
 
-bool
-vm_area_less(const struct list_elem *a, const struct list_elem *b, void *aux)
+    if (n->rb_left && rb_vma(n->rb_left)->vma_max_gap > max)
+        max = rb_vma(n->rb_left)->vma_max_gap;
+    if (n->rb_right && rb_vma(n->rb_right)->vma_max_gap > max)
+        max = rb_vma(n->rb_right)->vma_max_gap;
+
+    vma->vma_max_gap = max;
+}
+
+/* recompute the gap below @vma, after the VMA before it changed */
+static void
+__vma_update_gap(struct task *task, struct vm_area *vma)
 {
-    struct vm_area *vma_a = list_entry(a, struct vm_area, vma_list_elem);
-    struct vm_area *vma_b = list_entry(b, struct vm_area, vma_list_elem);
+    struct vm_area *prev;
+
+    if (list_front(&task->vma_list) == &vma->vma_list_elem) {
+        vma->vma_gap = 0;
+    } else {
+        prev = list_entry(list_prev(&vma->vma_list_elem), struct vm_area, vma_list_elem);
+        vma->vma_gap = vma->vma_start - prev->vma_end;
+    }
 
-    return vma_a->vma_start < vma_b->vma_start;
+    rb_augment_path(&task->vma_tree, &vma->vma_rb);
 }
 
 bool
@@ -19,23 +54,58 @@ vm_area_check_overlap(struct vm_area *a, struct vm_area *b)
     return a->vma_end > b->vma_start;
 }
 
-bool
-vm_area_overlaps(struct vm_area *vma, struct list *vm_areas)
+/*
+ * __vma_link - add @vma to the VMAs of @task, fails if it overlaps with
+ *              one of them, vm_lock must be held
+ */
+static int
+__vma_link(struct task *task, struct vm_area *vma)
 {
-    bool has_overlap = false;
-    struct vm_area *other_vma;
-
-    if (list_front(vm_areas) != &vma->vma_list_elem) {
-        other_vma = list_entry(list_prev(&vma->vma_list_elem), struct vm_area, vma_list_elem);
-        has_overlap |= vm_area_check_overlap(other_vma, vma);
+    struct rb_node **link = &task->vma_tree.rb_root, *parent = NULL;
+    struct vm_area *prev = NULL, *next = NULL, *other;
+
+    while (*link) {
+        parent = *link;
+        other = rb_vma(parent);
+
+        if (vma->vma_start < other->vma_start) {
+            next = other;
+            link = &parent->rb_left;
+        } else {
+            prev = other;
+            link = &parent->rb_right;
+        }
     }
 
-    if (list_back(vm_areas) != &vma->vma_list_elem) {
-        other_vma = list_entry(list_next(&vma->vma_list_elem), struct vm_area, vma_list_elem);
-        has_overlap |= vm_area_check_overlap(vma, other_vma);
-    }
+    if ((prev && vm_area_check_overlap(prev, vma)) ||
+            (next && vm_area_check_overlap(vma, next)))
+        return -EINVAL;
+
+    list_insert(next ? &next->vma_list_elem : list_end(&task->vma_list),
+                &vma->vma_list_elem);
+    rb_insert(&task->vma_tree, parent, link, &vma->vma_rb);
+
+    __vma_update_gap(task, vma);
+    if (next)
+        __vma_update_gap(task, next);
 
-    return has_overlap;
+    return 0;
+}
+
+/* __vma_unlink - take @vma off the VMAs of @task, vm_lock must be held */
+static void
+__vma_unlink(struct task *task, struct vm_area *vma)
+{
+    struct list_elem *next = list_next(&vma->vma_list_elem);
+
+    list_remove(&vma->vma_list_elem);
+    rb_remove(&task->vma_tree, &vma->vma_rb);
+
+    if (next != list_end(&task->vma_list))
+        __vma_update_gap(task, list_entry(next, struct vm_area, vma_list_elem));
+
+    if (task->vma_last == vma)
+        task->vma_last = NULL;
 }
 
 struct vm_area *
@@ -45,7 +115,7 @@ vm_area_create_insert(uint32_t vaddr_start, uint32_t vaddr_offset, uint32_t vadd
     panic_ifnot(vaddr_start + 4096 <= vaddr_end);
     struct vm_area *vma;
 
-    vma = calloc(1, sizeof(struct vm_area));
+    vma = kmem_cache_zalloc(vma_cache);
     if (!vma)
         return NULL;
 
@@ -56,11 +126,8 @@ vm_area_create_insert(uint32_t vaddr_start, uint32_t vaddr_offset, uint32_t vadd
 
     spin_lock(&task->vm_lock);
 
-    list_insert_ordered(&task->vma_list, &vma->vma_list_elem, vm_area_less, NULL);
-
-    if (vm_area_overlaps(vma, &task->vma_list)) {
-        list_remove(&vma->vma_list_elem);
-        free(vma);
+    if (__vma_link(task, vma)) {
+        kmem_cache_free(vma_cache, vma);
         vma = NULL;
     }
 
@@ -96,30 +163,164 @@ vma_set_mapping(struct vm_area *vma, struct file *f, uint32_t offset, uint32_t l
     return 0;
 }
 
+/*
+ * vma_find - find the VMA of @task that @addr is in
+ *
+ * Faults tend to come in runs on the same VMA, so the last one found is
+ * tried before the tree.
+ */
 struct vm_area *
-vma_find(struct list *vm_areas, uint32_t addr)
+vma_find(struct task *task, uint32_t addr)
 {
-    struct list_elem *e;
-    struct vm_area *vma;
+    struct vm_area *vma = task->vma_last;
+    struct rb_node *n;
+
+    if (vma && vma->vma_start <= addr && addr < vma->vma_end)
+        return vma;
+
+    n = task->vma_tree.rb_root;
+    while (n) {
+        vma = rb_vma(n);
+
+        if (addr < vma->vma_start)
+            n = n->rb_left;
+        else if (addr >= vma->vma_end)
+            n = n->rb_right;
+        else {
+            task->vma_last = vma;
+            return vma;
+        }
+    }
 
-    //vma_dump(current_task);
+    return NULL;
+}
 
-    list_foreach_raw(vm_areas, e) {
-        vma = list_entry(e, struct vm_area, vma_list_elem);
+/* __vma_find_first - the lowest VMA of @task that ends above @addr */
+static struct vm_area *
+__vma_find_first(struct task *task, uint32_t addr)
+{
+    struct rb_node *n = task->vma_tree.rb_root;
+    struct vm_area *vma, *found = NULL;
 
-        //printk("COMPARE 0x%x with [0x%x - 0x%x]\n",
-                //addr, vma->vma_start, vma->vma_end);
-        if (vma->vma_start <= addr && addr < vma->vma_end)
-            return vma;
+    while (n) {
+        vma = rb_vma(n);
+
+        if (vma->vma_end > addr) {
+            found = vma;
+            n = n->rb_left;
+        } else {
+            n = n->rb_right;
+        }
     }
-    
-    return NULL;
+
+    return found;
 }
 
+/* the first read-ahead window once faults look sequential, in pages */
+#define VMA_RA_MIN_PAGES 4
+
+/* can the file pages of @vma be mapped straight from the page cache? */
+static int
+__vma_cached(struct vm_area *vma)
+{
+    return vma->vma_mapping &&
+        pagecache_cacheable(vma->vma_mapping->map_backing) &&
+        vma->vma_mapping_offset % 4096 == 0 &&
+        (vma->vma_flags & (VMA_SHARED | VMA_WRITEABLE)) != (VMA_SHARED | VMA_WRITEABLE);
+}
+
+/*
+ * vma_readahead - @vma faulted at file offset @offset, if that is in or
+ *                 right past the last window the faults are sequential
+ *                 and the next window, twice as big, is read in by the
+ *                 worker
+ */
+static void
+vma_readahead(struct vm_area *vma, uint32_t offset)
+{
+    struct file *f = vma->vma_mapping->map_backing;
+    uint32_t end = PG_RND_UP(vma->vma_mapping_offset + vma->vma_mapping_length);
+    int max = f->fs->fs_ra_pages;
+    int nr;
+
+    if (max <= 0)
+        return;
+
+    if (offset < vma->vma_ra_start ||
+            offset > vma->vma_ra_start + vma->vma_ra_size * 4096) {
+        /* a random access, see whether the next fault follows it */
+        vma->vma_ra_start = offset + 4096;
+        vma->vma_ra_size = 0;
+        return;
+    }
+
+    if (vma->vma_ra_size == 0)
+        vma->vma_ra_size = VMA_RA_MIN_PAGES;
+    else
+        vma->vma_ra_size *= 2;
+
+    if (vma->vma_ra_size > max)
+        vma->vma_ra_size = max;
+
+    vma->vma_ra_start = offset;
+
+    nr = (end - offset) / 4096;
+    if (nr > vma->vma_ra_size)
+        nr = vma->vma_ra_size;
+
+    pagecache_readahead(f, offset, nr);
+}
+
+/*
+ * vma_fault_around - map the pages next to @addr that are already in the
+ *                    page cache, so touching them doesn't fault
+ */
+static void
+vma_fault_around(struct vm_area *vma, uint32_t addr)
+{
+    struct file *f = vma->vma_mapping->map_backing;
+    int nr = f->fs->fs_fault_around;
+    uint32_t start, end, vaddr;
+    uintptr_t cphys;
+    page_t *page;
+
+    if (nr <= 1)
+        return;
+
+    /* the block of @nr pages the fault is in */
+    start = addr - ((addr / 4096) % nr) * 4096;
+    end = start + nr * 4096;
+
+    if (start < vma->vma_start)
+        start = vma->vma_start;
+
+    /* a page the file only partly covers needs a private copy */
+    if (end > vma->vma_start + ROUND_DOWN(vma->vma_mapping_length, 4096))
+        end = vma->vma_start + ROUND_DOWN(vma->vma_mapping_length, 4096);
+
+    for (vaddr = start; vaddr < end; vaddr += 4096) {
+        if (vaddr == addr)
+            continue;
+
+        page = get_page_from_curr(vaddr);
+        if (page && *page)
+            continue;
+
+        cphys = pagecache_lookup(f,
+                vma->vma_mapping_offset + vaddr - vma->vma_start);
+        if (cphys)
+            mapping_map_cached(cphys, (void *) vaddr, vma->vma_flags);
+    }
+}
+
+/*
+ * vma_load - bring in the page at @addr of @vma, @write says whether it
+ *            is about to be written to
+ */
 int
-vma_load(struct vm_area *vma, uint32_t addr)
+vma_load(struct vm_area *vma, uint32_t addr, int write)
 {
-    int rc;
+    int rc, cached;
     uint32_t offset, map_begin, map_end;
 
     panic_ifnot(addr % 4096 == 0);
@@ -145,7 +346,14 @@ vma_load(struct vm_area *vma, uint32_t addr)
             max_len = 0x1000;
 
 
+        cached = max_len != 0 && __vma_cached(vma);
+
+        /* the faulting page first, read-ahead then starts past it */
         rc = mapping_load(vma->vma_mapping, addr, map_begin, max_len, vma->vma_flags);
+        if (rc == 0 && cached) {
+            vma_readahead(vma, map_begin);
+            vma_fault_around(vma, addr);
+        }
         //rc = new_mapping_load(vma->vma_mapping, addr, map_begin, map_end);
         //if (map_begin == 0) {
             //printk("FIRST PAGE\n");
@@ -173,22 +381,30 @@ vma_load(struct vm_area *vma, uint32_t addr)
         return rc;
     } else {
 map_zero: ;
-        uintptr_t phys = palloc_get_page();
+        /* reads share the zero page until the first write */
+        if (!write) {
+            map_zero_page_curr(addr, vma->vma_flags & VMA_WRITEABLE);
+            return 0;
+        }
+
+        uintptr_t phys = palloc_get_zeroed_page();
+        if (!phys)
+            return -ENOMEM;
+
         map_page_curr(phys, addr, 1);
-        memset(addr, 0, 4096);
         //printk("ZERO FILLING: addr 0x%x phys 0x%x\n", addr, phys);
         return 0;
     }
 }
 
 int
-vma_handle_pagefault(struct task *task, uint32_t req_addr)
+vma_handle_pagefault(struct task *task, uint32_t req_addr, int write)
 {
     uint32_t req_addr_a = PG_RND_DOWN(req_addr);
 
     //printk("%s: req_addr 0x%x\n", __func__, req_addr);
 
-    struct vm_area *vma = vma_find(&task->vma_list, req_addr_a);
+    struct vm_area *vma = vma_find(task, req_addr_a);
     if (!vma)
         return 1;
 
@@ -196,9 +412,11 @@ vma_handle_pagefault(struct task *task, uint32_t req_addr)
     if (vma->vma_flags & VMA_RESERVED)
         return 1;
 
-    /* FIXME: figure out what it was trying to do */
+    /* nothing to load for a write to a read-only mapping, it's a SIGSEGV */
+    if (write && !(vma->vma_flags & VMA_WRITEABLE))
+        return 1;
 
-    return vma_load(vma, req_addr_a);
+    return vma_load(vma, req_addr_a, write);
 }
 
 void
@@ -232,6 +450,8 @@ copy_vmas(struct task *new, struct task *old)
     //printk("%s\n", __func__);
 
     list_init(&new->vma_list);
+    rb_init(&new->vma_tree, vma_augment);
+    new->vma_last = NULL;
     spin_lock_init(&new->vm_lock);
 
     list_foreach_raw(&old->vma_list, elem) {
@@ -257,10 +477,10 @@ vma_try_prefault(struct task *task, uint32_t addr, uint32_t len)
     for (base = PG_RND_DOWN(addr); base < PG_RND_UP(addr + len); base += 4096) {
         page_t *page = get_page_from_curr(base);
         if (!page || (page && ((*page & (1 << 0)) == 0))) {
-            vma = vma_find(&task->vma_list, base);
+            vma = vma_find(task, base);
             if (vma) {
                 //printk("%s: VMA load base 0x%x\n", __func__, base);
-                vma_load(vma, base);
+                vma_load(vma, base, 1);
             } else {
                 /* This is probably the data segment: TODO convert to VMA */
                 //printk("OMG: THIS IS VERY SAD for address base 0x%x\n", base);
@@ -278,7 +498,15 @@ vma_destroy(struct vm_area *vma)
     if (vma->vma_mapping)
         mapping_destroy(vma->vma_mapping);
 
-    free(vma);
+    kmem_cache_free(vma_cache, vma);
+}
+
+void
+vma_cache_init(void)
+{
+    vma_cache = kmem_cache_create("vm_area", sizeof(struct vm_area), NULL);
+    if (!vma_cache)
+        panic("vma: unable to create the vm_area cache\n");
 }
 
 void
@@ -287,6 +515,8 @@ vma_init(struct task *task)
     struct vm_area *stack_vma;
 
     list_init(&task->vma_list);
+    rb_init(&task->vma_tree, vma_augment);
+    task->vma_last = NULL;
 
     stack_vma = vm_area_create_insert(VIRT_BASE - (0x1000 * 1000), 0, VIRT_BASE,
                         task, VMA_WRITEABLE | VMA_STACK);
@@ -300,38 +530,44 @@ vma_init(struct task *task)
 void
 vma_unload_all(struct task *task)
 {
-    struct list_elem *elem;
-
-    list_foreach_raw(&task->vma_list, elem) {
-        struct vm_area *vma = list_entry(elem, struct vm_area, vma_list_elem);
+    struct vm_area *vma;
 
+    while (!list_empty(&task->vma_list)) {
+        vma = list_entry(list_pop_front(&task->vma_list), struct vm_area, vma_list_elem);
         vma_destroy(vma);
-        list_remove(elem);
     }
 
+    rb_init(&task->vma_tree, vma_augment);
+    task->vma_last = NULL;
+
     //printk("unloaded all VMAs: %d left\n", list_size(&task->vma_list));
 }
 
+/*
+ * vma_find_free_region - find the lowest gap between two VMAs of @task
+ *                        that is larger than @len
+ */
 uint32_t
 vma_find_free_region(struct task *task, size_t len)
 {
-    struct list_elem *elem;
-    struct vm_area *prev = NULL;
+    struct rb_node *n = task->vma_tree.rb_root;
+    struct vm_area *vma;
 
-    list_foreach_raw(&task->vma_list, elem) {
-        struct vm_area *vma = list_entry(elem, struct vm_area, vma_list_elem);
-        if (prev == NULL) {
-            prev = vma;
+    if (!n || rb_vma(n)->vma_max_gap <= len)
+        return -1;
+
+    while (1) {
+        if (n->rb_left && rb_vma(n->rb_left)->vma_max_gap > len) {
+            n = n->rb_left;
             continue;
         }
 
-        if (vma->vma_start - prev->vma_end > len)
-            return prev->vma_end;
+        vma = rb_vma(n);
+        if (vma->vma_gap > len)
+            return vma->vma_start - vma->vma_gap;
 
-        prev = vma;
+        n = n->rb_right;
     }
-
-    return -1;
 }
 
 struct vm_area *
@@ -366,7 +602,13 @@ do_mmap(void *addr, size_t len, int prot, int flags, struct file *f,
     if (len == 0)
         return -EINVAL;
 
+    len = PG_RND_UP(len);
+
     if (flags & MAP_FIXED) {
+        /* whatever was mapped there before goes away */
+        if (do_munmap(addr, len))
+            return -EINVAL;
+
         vma = do_mmap_fixed(f, addr, len, offset);
         if (!vma)
             return -ENOMEM;
@@ -399,3 +641,347 @@ do_mmap(void *addr, size_t len, int prot, int flags, struct file *f,
 
     return addr;
 }
+
+/*
+ * __vma_split - split @vma at @addr, @vma keeps the part below @addr and
+ *               the part from @addr on is returned as a new VMA
+ */
+static struct vm_area *
+__vma_split(struct task *task, struct vm_area *vma, uint32_t addr)
+{
+    struct vm_area *new;
+    uint32_t delta = addr - vma->vma_start;
+
+    panic_ifnot(addr % 4096 == 0);
+    panic_ifnot(vma->vma_start < addr && addr < vma->vma_end);
+
+    new = kmem_cache_zalloc(vma_cache);
+    if (!new)
+        return NULL;
+
+    new->vma_start = addr;
+    new->vma_end = vma->vma_end;
+    new->vma_flags = vma->vma_flags;
+
+    /* the file part of the mapping is cut at the same place */
+    new->vma_mapping_offset = vma->vma_mapping_offset + delta;
+    if (vma->vma_mapping_length > delta) {
+        new->vma_mapping_length = vma->vma_mapping_length - delta;
+        vma->vma_mapping_length = delta;
+    }
+    mapping_copy(new, vma);
+
+    spin_lock(&task->vm_lock);
+    vma->vma_end = addr;
+    __vma_link(task, new);
+    spin_unlock(&task->vm_lock);
+
+    return new;
+}
+
+/*
+ * __vma_isolate - split @vma so that the returned VMA is the part of it
+ *                 that lies in [@start, @end)
+ */
+static struct vm_area *
+__vma_isolate(struct task *task, struct vm_area *vma, uint32_t start, uint32_t end)
+{
+    if (vma->vma_start < start) {
+        vma = __vma_split(task, vma, start);
+        if (!vma)
+            return NULL;
+    }
+
+    if (vma->vma_end > end)
+        if (!__vma_split(task, vma, end))
+            return NULL;
+
+    return vma;
+}
+
+/* could @b be folded into @a, the VMA right below it? */
+static int
+__vma_mergeable(struct vm_area *a, struct vm_area *b)
+{
+    if (a->vma_end != b->vma_start || a->vma_flags != b->vma_flags)
+        return 0;
+
+    if (!a->vma_mapping && !b->vma_mapping)
+        return 1;
+
+    /* the file has to continue where @a ends, without a zero filled gap */
+    return a->vma_mapping == b->vma_mapping &&
+        a->vma_mapping_length == a->vma_end - a->vma_start &&
+        a->vma_mapping_offset + a->vma_mapping_length == b->vma_mapping_offset;
+}
+
+/*
+ * __vma_merge_range - fold the neighbouring VMAs that meet in [@start,
+ *                     @end] and are alike into one
+ */
+static void
+__vma_merge_range(struct task *task, uint32_t start, uint32_t end)
+{
+    struct list_elem *e, *next;
+    struct vm_area *a, *b;
+
+    a = __vma_find_first(task, start ? start - 1 : 0);
+    if (!a)
+        return;
+
+    e = &a->vma_list_elem;
+    while (e != list_end(&task->vma_list)) {
+        next = list_next(e);
+        if (next == list_end(&task->vma_list))
+            break;
+
+        a = list_entry(e, struct vm_area, vma_list_elem);
+        b = list_entry(next, struct vm_area, vma_list_elem);
+
+        if (a->vma_end > end)
+            break;
+
+        if (a->vma_end < start || !__vma_mergeable(a, b)) {
+            e = next;
+            continue;
+        }
+
+        spin_lock(&task->vm_lock);
+        a->vma_end = b->vma_end;
+        a->vma_mapping_length += b->vma_mapping_length;
+        __vma_unlink(task, b);
+        spin_unlock(&task->vm_lock);
+
+        vma_destroy(b);
+    }
+}
+
+/*
+ * do_munmap - remove the mappings in [@addr, @addr + @len) of the current
+ *             task, giving back their frames and page cache references
+ */
+int
+do_munmap(void *addr, size_t len)
+{
+    struct task *task = current_task;
+    uint32_t start = (uint32_t) addr, end;
+    struct list_elem *e;
+    struct vm_area *vma;
+
+    if (start % 4096 || len == 0)
+        return -EINVAL;
+
+    end = PG_RND_UP(start + len);
+    if (end <= start || end > VIRT_BASE)
+        return -EINVAL;
+
+    vma = __vma_find_first(task, start);
+    e = vma ? &vma->vma_list_elem : list_end(&task->vma_list);
+    while (e != list_end(&task->vma_list)) {
+        vma = list_entry(e, struct vm_area, vma_list_elem);
+
+        if (vma->vma_start >= end)
+            break;
+
+        vma = __vma_isolate(task, vma, start, end);
+        if (!vma)
+            return -ENOMEM;
+
+        e = list_next(&vma->vma_list_elem);
+
+        unmap_user_pages(task->mm, vma->vma_start, vma->vma_end);
+
+        spin_lock(&task->vm_lock);
+        __vma_unlink(task, vma);
+        spin_unlock(&task->vm_lock);
+
+        vma_destroy(vma);
+    }
+
+    return 0;
+}
+
+/*
+ * __vma_protect_pages - bring the PTEs of @vma in line with its flags
+ *
+ * Pages that lose write access are made read-only, including the COW
+ * ones, since a write to those would otherwise be resolved. Pages that
+ * gain it become copy-on-write, the first write gets a private frame
+ * or, if nobody else maps it, reuses the one it has, see __do_cow().
+ */
+static void
+__vma_protect_pages(struct task *task, struct vm_area *vma)
+{
+    struct tlb_batch tb;
+    uint32_t vaddr;
+    page_t *page;
+
+    tlb_batch_init(&tb, task->mm);
+
+    for (vaddr = vma->vma_start; vaddr < vma->vma_end; vaddr += 4096) {
+        page = get_page_from_pgd(task->mm, vaddr);
+        if (!page || !pte_present(*page))
+            continue;
+
+        if (vma->vma_flags & VMA_WRITEABLE) {
+            if (!pte_writeable(*page))
+                pte_mark_cow(page);
+            continue;
+        }
+
+        if (pte_writeable(*page))
+            tlb_batch_add(&tb, vaddr);
+
+        pte_mark_read_only(page);
+        pte_unmark_cow(page);
+    }
+
+    tlb_batch_flush(&tb);
+}
+
+/* is every page of [@start, @end) covered by a VMA of @task? */
+static int
+__vma_range_mapped(struct task *task, uint32_t start, uint32_t end)
+{
+    struct vm_area *vma;
+
+    while (start < end) {
+        vma = vma_find(task, start);
+        if (!vma || (vma->vma_flags & VMA_RESERVED))
+            return 0;
+
+        start = vma->vma_end;
+    }
+
+    return 1;
+}
+
+/*
+ * do_mprotect - change the protection of [@addr, @addr + @len) of the
+ *               current task to @prot
+ */
+int
+do_mprotect(void *addr, size_t len, int prot)
+{
+    struct task *task = current_task;
+    uint32_t start = (uint32_t) addr, end;
+    struct list_elem *e;
+    struct vm_area *vma;
+
+    if (start % 4096)
+        return -EINVAL;
+
+    if (len == 0)
+        return 0;
+
+    end = PG_RND_UP(start + len);
+    if (end <= start || end > VIRT_BASE)
+        return -EINVAL;
+
+    if (!__vma_range_mapped(task, start, end))
+        return -ENOMEM;
+
+    vma = __vma_find_first(task, start);
+    e = vma ? &vma->vma_list_elem : list_end(&task->vma_list);
+    while (e != list_end(&task->vma_list)) {
+        vma = list_entry(e, struct vm_area, vma_list_elem);
+
+        if (vma->vma_start >= end)
+            break;
+
+        vma = __vma_isolate(task, vma, start, end);
+        if (!vma)
+            return -ENOMEM;
+
+        e = list_next(&vma->vma_list_elem);
+
+        if (prot & PROT_WRITE)
+            vma->vma_flags |= VMA_WRITEABLE;
+        else
+            vma->vma_flags &= ~VMA_WRITEABLE;
+
+        /* FIXME: like in do_mmap(), this is noop for now */
+        if (prot & PROT_READ)
+            vma->vma_flags &= ~VMA_NOREAD;
+        else
+            vma->vma_flags |= VMA_NOREAD;
+
+        __vma_protect_pages(task, vma);
+    }
+
+    __vma_merge_range(task, start, end);
+
+    return 0;
+}
+
+/*
+ * do_madvise - act on the advice @advice about [@addr, @addr + @len) of
+ *              the current task
+ *
+ * MADV_DONTNEED drops the pages, the next touch finds them like a fresh
+ * mapping would: zeroes for anonymous memory, the file's contents for
+ * private file mappings. MADV_WILLNEED reads file pages into the page
+ * cache ahead of time, so faulting them in doesn't wait for the disk.
+ */
+int
+do_madvise(void *addr, size_t len, int advice)
+{
+    struct task *task = current_task;
+    uint32_t start = (uint32_t) addr, end, s, e, off;
+    struct list_elem *elem;
+    struct vm_area *vma;
+
+    if (start % 4096)
+        return -EINVAL;
+
+    if (advice != MADV_NORMAL && advice != MADV_WILLNEED &&
+            advice != MADV_DONTNEED)
+        return -EINVAL;
+
+    end = PG_RND_UP(start + len);
+    if (end < start || end > VIRT_BASE)
+        return -EINVAL;
+
+    if (advice == MADV_NORMAL)
+        return 0;
+
+    vma = __vma_find_first(task, start);
+    elem = vma ? &vma->vma_list_elem : list_end(&task->vma_list);
+    for (; elem != list_end(&task->vma_list); elem = list_next(elem)) {
+        vma = list_entry(elem, struct vm_area, vma_list_elem);
+        if (vma->vma_start >= end)
+            break;
+
+        s = start > vma->vma_start ? start : vma->vma_start;
+        e = end < vma->vma_end ? end : vma->vma_end;
+        if (s >= e)
+            continue;
+
+        if (advice == MADV_DONTNEED) {
+            unmap_user_pages(task->mm, s, e);
+
+            /* the heap is mapped by sbrk(2), it can't be faulted back in */
+            if (vma->vma_flags & VMA_RESERVED)
+                for (; s < e && s < task->bstate.actual_brk; s += 4096)
+                    map_zero_page_curr(s, 1);
+
+            continue;
+        }
+
+        if (!vma->vma_mapping ||
+                !pagecache_cacheable(vma->vma_mapping->map_backing))
+            continue;
+
+        if (s - vma->vma_start >= vma->vma_mapping_length)
+            continue;
+
+        off = vma->vma_mapping_offset + s - vma->vma_start;
+        if (e > vma->vma_start + PG_RND_UP(vma->vma_mapping_length))
+            e = vma->vma_start + PG_RND_UP(vma->vma_mapping_length);
+        if (off % 4096 == 0)
+            pagecache_readahead(vma->vma_mapping->map_backing, off,
+                    (e - s) / 4096);
+    }
+
+    return 0;
+}
@@ -0,0 +1,169 @@
+#include <levos/kernel.h>
+#include <levos/page.h>
+#include <levos/palloc.h>
+#include <levos/spinlock.h>
+#include <levos/string.h>
+#include <levos/task.h>
+
+#define MODULE_NAME zero
+
+/*
+ * Demand-zero memory. An anonymous page that has only been read maps
+ * the one frame that is all zeroes, read-only and copy-on-write, and
+ * gets a frame of its own on the first write, see __do_cow(). The
+ * frames handed out then come from a pool that a low priority thread
+ * keeps filled with pages it zeroed in advance, so neither the fault
+ * nor sbrk(2) have to clear anything themselves.
+ */
+#define ZERO_POOL_SIZE 64
+
+/* below this many frames the zeroing thread is woken up */
+#define ZERO_POOL_LOW  16
+
+uintptr_t zero_page_phys;
+
+static uintptr_t zero_pool[ZERO_POOL_SIZE];
+static int zero_pool_nr;
+static spinlock_t zero_pool_lock;
+
+static struct task *zero_task;
+static int zero_task_idle;
+
+static void
+__zero_frame(uintptr_t phys)
+{
+    void *va = kmap_temp(phys);
+
+    clear_page(va);
+    kunmap_temp(va);
+}
+
+/*
+ * palloc_get_zeroed_page - allocate a frame that is filled with zeroes,
+ *                          the caller holds the only reference. Returns
+ *                          zero if memory ran out.
+ */
+uintptr_t
+palloc_get_zeroed_page(void)
+{
+    uintptr_t phys = 0;
+    uint32_t flags;
+    int kick = 0;
+
+    flags = spin_lock_irqsave(&zero_pool_lock);
+    if (zero_pool_nr)
+        phys = zero_pool[-- zero_pool_nr];
+
+    if (zero_pool_nr < ZERO_POOL_LOW && zero_task_idle) {
+        zero_task_idle = 0;
+        kick = 1;
+    }
+    spin_unlock_irqrestore(&zero_pool_lock, flags);
+
+    if (kick)
+        task_kick(zero_task);
+
+    if (phys)
+        return phys;
+
+    /* the pool ran dry, zero one ourselves */
+    phys = palloc_try_get_page();
+    if (!phys)
+        return 0;
+
+    __zero_frame(phys);
+
+    return phys;
+}
+
+/*
+ * map_zero_page_curr - map the zero page at @vaddr of the current task,
+ *                      the first write to it gets a private frame
+ *
+ * Only if @writeable, otherwise the page stays read-only and a write to
+ * it is a fault like any other.
+ */
+void
+map_zero_page_curr(uint32_t vaddr, int writeable)
+{
+    page_t *pte;
+
+    /* every mapping holds a reference, like any other frame */
+    palloc_ref_page(zero_page_phys);
+    map_page_curr(zero_page_phys, vaddr, 1);
+
+    pte = get_page_from_curr(vaddr);
+    pte_mark_read_only(pte);
+    if (writeable)
+        pte_mark_cow(pte);
+    __flush_tlb_page(vaddr);
+}
+
+static void
+zero_thread(void)
+{
+    uintptr_t phys;
+    uint32_t flags;
+
+    while (1) {
+        flags = spin_lock_irqsave(&zero_pool_lock);
+
+        /* block with the lock held, so that a refill request isn't lost */
+        if (zero_pool_nr == ZERO_POOL_SIZE) {
+            zero_task_idle = 1;
+            task_block_noresched(current_task);
+            spin_unlock_irqrestore(&zero_pool_lock, flags);
+            sched_yield();
+            continue;
+        }
+
+        spin_unlock_irqrestore(&zero_pool_lock, flags);
+
+        /*
+         * memory ran out, the pool isn't worth taking the last of it,
+         * wait until the next allocation asks for more
+         */
+        phys = palloc_try_get_page();
+        if (!phys) {
+            flags = spin_lock_irqsave(&zero_pool_lock);
+            zero_task_idle = 1;
+            task_block_noresched(current_task);
+            spin_unlock_irqrestore(&zero_pool_lock, flags);
+            sched_yield();
+            continue;
+        }
+
+        __zero_frame(phys);
+
+        flags = spin_lock_irqsave(&zero_pool_lock);
+        if (zero_pool_nr < ZERO_POOL_SIZE) {
+            zero_pool[zero_pool_nr ++] = phys;
+            phys = 0;
+        }
+        spin_unlock_irqrestore(&zero_pool_lock, flags);
+
+        if (phys)
+            palloc_unref_page(phys);
+
+        /* one frame at a time, anybody else who wants to run goes first */
+        sched_yield();
+    }
+}
+
+void
+zero_init(void)
+{
+    spin_lock_init(&zero_pool_lock);
+    zero_pool_nr = 0;
+
+    /* the reference from the allocation is never dropped */
+    zero_page_phys = palloc_get_page();
+    __zero_frame(zero_page_phys);
+
+    zero_task = create_kernel_task(zero_thread);
+    sched_set_nice(zero_task, NICE_MAX);
+    sched_add_rq(zero_task);
+
+    mprintk("zero page at 0x%x, keeping %d frames pre-zeroed\n",
+            zero_page_phys, ZERO_POOL_SIZE);
+}
@@ -6,6 +6,7 @@
 #include <levos/udp.h>
 #include <levos/arp.h>
 #include <levos/bitmap.h>
+#include <levos/tcp.h>
 
 struct list net_devices_list;
 spinlock_t net_devices_lock;
@@ -25,6 +26,10 @@ net_init()
     /* initalize ARP cache */
     arp_cache_init();
 
+    /* object caches for packets and connections */
+    packet_init();
+    tcp_init();
+
     /* initialize devices */
     list_init(&net_devices_list);
     spin_lock_init(&net_devices_lock);
@@ -209,7 +214,7 @@ socket_fs_close(struct file *filp)
     struct socket *sock = filp->priv;
 
     socket_destroy(sock);
-    free(filp);
+    file_free(filp);
 }
 
 struct file_operations socket_fops = {
@@ -222,7 +227,7 @@ struct file_operations socket_fops = {
 struct file *
 file_from_socket(struct socket *sock)
 {
-    struct file *filp = malloc(sizeof(*filp));
+    struct file *filp = file_alloc();
     if (!filp)
         return NULL;
 
@@ -231,6 +236,7 @@ file_from_socket(struct socket *sock)
     filp->fpos = 0;
     filp->respath = NULL;
     filp->priv = sock;
+    filp->ino = 0;
     filp->fops = &socket_fops;
 
     return filp;
@@ -6,11 +6,15 @@
 #include <levos/list.h>
 #include <levos/tcp.h>
 #include <levos/work.h>
+#include <levos/slab.h>
 #include <levos/e1000.h> /* FIXME: make it net_device eventually */
 
 static struct list packet_list;
 static spinlock_t packet_list_lock;
 
+static struct kmem_cache *packet_cache;
+static struct kmem_cache *packet_desc_cache;
+
 struct packet_desc {
     void *pdata;
     size_t plen;
@@ -20,7 +24,7 @@ struct packet_desc {
 
 packet_t *packet_allocate()
 {
-    packet_t *pkt = malloc(sizeof(*pkt));
+    packet_t *pkt = kmem_cache_alloc(packet_cache);
     if (!pkt)
         return NULL;
 
@@ -54,7 +58,7 @@ packet_destroy(packet_t *pkt)
             return;
 
     free(pkt->p_buf);
-    free(pkt);
+    kmem_cache_free(packet_cache, pkt);
 }
 
 struct packet_retransmission_descriptor {
@@ -120,6 +124,20 @@ packet_schedule_retransmission(struct net_info *ni,
     return work;
 }
 
+/*
+ * packet_init - set up the object caches for packets, this must happen
+ *               before any network device is brought up
+ */
+void
+packet_init(void)
+{
+    packet_cache = kmem_cache_create("packet", sizeof(packet_t), NULL);
+    packet_desc_cache = kmem_cache_create("packet_desc",
+                                          sizeof(struct packet_desc), NULL);
+    if (!packet_cache || !packet_desc_cache)
+        panic("net: unable to create the packet caches\n");
+}
+
 void
 net_info_init(struct net_info *ni)
 {
@@ -133,7 +151,9 @@ net_info_init(struct net_info *ni)
 void
 packet_push_queue(struct net_info *ni, void *packet, size_t len)
 {
-    struct packet_desc *desc = malloc(sizeof(*desc));
+    struct packet_desc *desc = kmem_cache_alloc(packet_desc_cache);
+    uint32_t flags;
+
     if (!desc)
         return;
 
@@ -141,11 +161,11 @@ packet_push_queue(struct net_info *ni, void *packet, size_t len)
     desc->plen = len;
     desc->ni = ni;
 
-    spin_lock(&packet_list_lock);
+    flags = spin_lock_irqsave(&packet_list_lock);
 
     list_push_back(&packet_list, &desc->elem);
 
-    spin_unlock(&packet_list_lock);
+    spin_unlock_irqrestore(&packet_list_lock, flags);
 }
 
 void
@@ -199,7 +219,7 @@ void
 handle_packet(struct packet_desc *packet)
 {
     struct net_info *ni;
-    packet_t *pkt = malloc(sizeof(*pkt));
+    packet_t *pkt = kmem_cache_alloc(packet_cache);
     if (!pkt) {
         printk("CRITICAL: dropped a packet due to OOM\n");
         return;
@@ -216,7 +236,7 @@ handle_packet(struct packet_desc *packet)
     ni = packet->ni;
 
     /* free the descriptor */
-    free(packet);
+    kmem_cache_free(packet_desc_cache, packet);
 
     /* handle the packet now */
     do_handle_packet(ni, pkt);
@@ -235,12 +255,12 @@ packet_processor_thread()
             continue;
         }
 
-        spin_lock(&packet_list_lock);
+        uint32_t flags = spin_lock_irqsave(&packet_list_lock);
         struct packet_desc *desc
             = list_entry(list_pop_front(&packet_list),
                          struct packet_desc,
                          elem);
-        spin_unlock(&packet_list_lock);
+        spin_unlock_irqrestore(&packet_list_lock, flags);
 
         handle_packet(desc);
     }
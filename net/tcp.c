@@ -4,6 +4,9 @@
 #include <levos/ip.h>
 #include <levos/arp.h>
 #include <levos/work.h>
+#include <levos/slab.h>
+
+static struct kmem_cache *tcp_info_cache;
 
 /* TODO list:
  * 1) segment reconstruction
@@ -297,7 +300,7 @@ tcp_conn_start(struct net_info *ni, port_t srcport, ip_addr_t dstip,
     int rc;
 
     /* allocate the tcp_info structure */
-    ti = malloc(sizeof(*ti));
+    ti = kmem_cache_alloc(tcp_info_cache);
     if (!ti) {
         rc = -ENOMEM;
         goto fail_nolock;
@@ -361,7 +364,7 @@ tcp_conn_start(struct net_info *ni, port_t srcport, ip_addr_t dstip,
 fail:
     spin_unlock(&ni->ni_tcp_infos_lock);
 fail_nolock:
-    free(ti);
+    kmem_cache_free(tcp_info_cache, ti);
     return rc;
 }
 
@@ -688,3 +691,11 @@ test_tcp(struct net_info *ni)
         net_printk("tcp failed to close %s\n", errno_to_string(rc));
     }
 }
+
+void
+tcp_init(void)
+{
+    tcp_info_cache = kmem_cache_create("tcp_info", sizeof(struct tcp_info), NULL);
+    if (!tcp_info_cache)
+        panic("tcp: unable to create the tcp_info cache\n");
+}
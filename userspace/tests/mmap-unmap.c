@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/signal.h>
+
+#include "test.h"
+
+#define __MADV_DONTNEED 4
+
+/* the C library does not wrap these, so go straight to the kernel */
+static int
+__mprotect(void *addr, size_t len, int prot)
+{
+    int rc;
+    asm volatile("int $0x80":"=a"(rc):"a"(0x7d),"b"(addr),"c"(len),"d"(prot));
+    return rc;
+}
+
+static int
+__madvise(void *addr, size_t len, int advice)
+{
+    int rc;
+    asm volatile("int $0x80":"=a"(rc):"a"(0xdb),"b"(addr),"c"(len),"d"(advice));
+    return rc;
+}
+
+/* a write to @addr must kill the writer with a SIGSEGV */
+static int
+write_faults(char *addr)
+{
+    int pid, status = 0, rc;
+
+    if ((pid = fork()) == 0) {
+        *addr = 'x';
+        exit(0);
+    }
+
+    CHECK_VAL(waitpid(pid, &status, 0), "%d", pid);
+    CHECK(WIFSIGNALED(status), 1);
+    CHECK_VAL(WTERMSIG(status), "%d", SIGSEGV);
+
+    return 0;
+}
+
+int
+run_test()
+{
+    int rc;
+    char *p;
+
+    p = mmap(NULL, 0x4000, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return 1;
+
+    memset(p, 'a', 0x4000);
+
+    /* dropped pages read back as zeroes */
+    CHECK(__madvise(p + 0x1000, 0x1000, __MADV_DONTNEED), 0);
+    CHECK(p[0x1000], 0);
+    CHECK(p[0x2000], 'a');
+
+    /* changing the protection of a part splits the mapping */
+    CHECK(__mprotect(p + 0x2000, 0x1000, PROT_READ), 0);
+    CHECK(p[0x2000], 'a');
+    CHECK(write_faults(p + 0x2000), 0);
+    CHECK(p[0x2000], 'a');
+    CHECK(__mprotect(p + 0x2000, 0x1000, PROT_READ | PROT_WRITE), 0);
+    p[0x2000] = 'b';
+    CHECK(p[0x2000], 'b');
+
+    /* a hole in the middle, the rest stays */
+    CHECK(munmap(p + 0x1000, 0x1000), 0);
+    CHECK(p[0], 'a');
+    CHECK(p[0x3000], 'a');
+
+    /* there is nothing left to protect in the hole */
+    CHECK(__mprotect(p, 0x4000, PROT_READ), -12);
+
+    CHECK(munmap(p, 0x4000), 0);
+
+    /* a read-only page that was only read from can't be written either */
+    p = mmap(NULL, 0x1000, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return 1;
+
+    CHECK(p[0], 0);
+    CHECK(write_faults(p), 0);
+    CHECK(p[0], 0);
+
+    CHECK(munmap(p, 0x1000), 0);
+
+    return 0;
+}
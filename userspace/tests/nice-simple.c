@@ -0,0 +1,66 @@
+#include <unistd.h>
+#include <stdio.h>
+
+#include "test.h"
+
+#define PRIO_PROCESS 0
+
+/* the C library does not wrap these, so go straight to the kernel */
+static int
+__nice(int inc)
+{
+    int rc;
+    asm volatile("int $0x80":"=a"(rc):"a"(0x22),"b"(inc));
+    return rc;
+}
+
+static int
+__getpriority(int which, int who)
+{
+    int rc;
+    asm volatile("int $0x80":"=a"(rc):"a"(0x60),"b"(which),"c"(who));
+    return rc;
+}
+
+static int
+__setpriority(int which, int who, int prio)
+{
+    int rc;
+    asm volatile("int $0x80":"=a"(rc):"a"(0x61),"b"(which),"c"(who),"d"(prio));
+    return rc;
+}
+
+int
+run_test()
+{
+    int rc, c;
+
+    /* the raw system call returns 20 - nice */
+    CHECK(__getpriority(PRIO_PROCESS, 0), 20);
+
+    CHECK(__nice(5), 0);
+    CHECK(__getpriority(PRIO_PROCESS, 0), 15);
+
+    /* nice values are clamped to [-20, 19] */
+    CHECK(__nice(100), 0);
+    CHECK(__getpriority(PRIO_PROCESS, 0), 1);
+
+    CHECK(__setpriority(PRIO_PROCESS, getpid(), -100), 0);
+    CHECK(__getpriority(PRIO_PROCESS, 0), 40);
+
+    CHECK(__setpriority(PRIO_PROCESS, 0, 0), 0);
+
+    /* the child inherits the nice value */
+    CHECK(__nice(3), 0);
+    if (fork() == 0) {
+        if (__getpriority(PRIO_PROCESS, 0) != 17)
+            return 1;
+        return 0;
+    }
+
+    c = 0xffffff;
+    while (c --)
+        ;
+
+    return 0;
+}
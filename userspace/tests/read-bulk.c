@@ -0,0 +1,66 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/errno.h>
+
+#include "test.h"
+
+/* an odd size, so that the small reads straddle block boundaries */
+#define SMALL 333
+
+int
+run_test()
+{
+    struct stat st;
+    char *bulk, *small;
+    int fd, rc, off;
+
+    fd = open("/init", O_RDONLY, 0);
+    if (fd < 0)
+        return 1;
+
+    CHECK(fstat(fd, &st), 0);
+
+    bulk = malloc(st.st_size + SMALL);
+    small = malloc(st.st_size + SMALL);
+    if (!bulk || !small)
+        return 1;
+
+    /* the whole file in one go, and nothing past the end */
+    CHECK_VAL(read(fd, bulk, st.st_size + SMALL), "%d", (int) st.st_size);
+    CHECK(read(fd, bulk, SMALL), 0);
+
+    /* the same in small pieces */
+    CHECK(lseek(fd, 0, SEEK_SET), 0);
+    for (off = 0; off < st.st_size; off += rc) {
+        rc = read(fd, small + off, SMALL);
+        if (rc <= 0) {
+            printf("small read at %d failed with rc %d\n", off, rc);
+            return 1;
+        }
+    }
+
+    if (memcmp(bulk, small, st.st_size)) {
+        printf("bulk and small reads differ\n");
+        return 1;
+    }
+
+    /* from the middle of a block to the end */
+    CHECK(lseek(fd, 1000, SEEK_SET), 1000);
+    CHECK_VAL(read(fd, small, st.st_size), "%d", (int) st.st_size - 1000);
+    if (memcmp(bulk + 1000, small, st.st_size - 1000)) {
+        printf("read from the middle differs\n");
+        return 1;
+    }
+
+    /* a bad buffer fails without moving the position */
+    CHECK(lseek(fd, 0, SEEK_SET), 0);
+    CHECK_ERR(read(fd, (char *) 0x11223344, 8192), EFAULT);
+    CHECK(lseek(fd, 0, SEEK_CUR), 0);
+
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,46 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/errno.h>
+#include <sys/mman.h>
+
+#include "test.h"
+
+int
+run_test()
+{
+    int rc, fd;
+    struct stat st;
+    char *ro;
+
+    /* paths that can't be read fail */
+    CHECK_ERR(open((char *) 0x1337, O_RDONLY), EFAULT);
+    CHECK_ERR(open((char *) 0xC0001337, O_RDONLY), EFAULT);
+    CHECK_ERR(stat((char *) 0x1337, &st), EFAULT);
+
+    /* results that can't be stored fail */
+    CHECK_ERR(stat("/", (struct stat *) 0x1337), EFAULT);
+    CHECK_ERR(stat("/", (struct stat *) 0xC0001337), EFAULT);
+    CHECK_ERR(pipe((int *) 0x1337), EFAULT);
+
+    /* the good ones still work */
+    CHECK(stat("/", &st), 0);
+
+    /* reading into memory that can't be written fails */
+    ro = mmap(NULL, 0x1000, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ro == MAP_FAILED)
+        return 1;
+
+    fd = open("/init", O_RDONLY);
+    if (fd < 0)
+        return 1;
+
+    CHECK_ERR(read(fd, ro, 16), EFAULT);
+    CHECK_ERR(read(fd, (char *) 0x1337, 16), EFAULT);
+
+    close(fd);
+
+    return 0;
+}
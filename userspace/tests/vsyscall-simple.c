@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "test.h"
+
+/* include/levos/vsyscall.h */
+#define VSYSCALL_BASE         0xBFC00000
+#define VSYSCALL_GETPID       (VSYSCALL_BASE + 0x40)
+#define VSYSCALL_GETTIMEOFDAY (VSYSCALL_BASE + 0x80)
+
+/* the kernel's struct timeval */
+struct __timeval {
+    unsigned long long tv_sec;
+    unsigned long long tv_usec;
+};
+
+typedef int (*vgetpid_t)(void);
+typedef int (*vgettimeofday_t)(struct __timeval *, void *);
+
+static int
+__vsyscall3(int no, int a, int b, int c)
+{
+    int rc;
+    asm volatile("call *%%esi"
+                :"=a"(rc)
+                :"a"(no), "b"(a), "c"(b), "d"(c), "S"(VSYSCALL_BASE)
+                :"memory");
+    return rc;
+}
+
+int
+run_test()
+{
+    static const char msg[] = "hello from the vsyscall page\n";
+    int rc, a = 0x1234, b = 0x5678, status, i;
+    struct __timeval tv, tv_sys, tv_prev;
+    pid_t pid;
+
+    CHECK(__vsyscall3(0x14, 0, 0, 0), getpid());
+    CHECK(__vsyscall3(0x4, 1, (int) msg, strlen(msg)), strlen(msg));
+
+    /* everything but %eax survives */
+    asm volatile("call *%%esi"
+                :"=a"(rc), "+c"(a), "+d"(b)
+                :"a"(0x14), "S"(VSYSCALL_BASE)
+                :"memory");
+    CHECK(a, 0x1234);
+    CHECK(b, 0x5678);
+
+    /* these don't enter the kernel at all */
+    CHECK(((vgetpid_t) VSYSCALL_GETPID)(), getpid());
+
+    CHECK(__vsyscall3(0x4e, (int) &tv_sys, 0, 0), 0);
+    CHECK(((vgettimeofday_t) VSYSCALL_GETTIMEOFDAY)(&tv, NULL), 0);
+    if (tv.tv_usec >= 1000000 || tv.tv_sec < tv_sys.tv_sec ||
+            tv.tv_sec > tv_sys.tv_sec + 1)
+        return 1;
+
+    /* and the clock never goes back */
+    for (i = 0; i < 10000; i ++) {
+        tv_prev = tv;
+        ((vgettimeofday_t) VSYSCALL_GETTIMEOFDAY)(&tv, NULL);
+        if (tv.tv_sec < tv_prev.tv_sec || (tv.tv_sec == tv_prev.tv_sec &&
+                    tv.tv_usec < tv_prev.tv_usec))
+            return 1;
+    }
+
+    /* the child comes back through the same page, with a pid of its own */
+    pid = __vsyscall3(0x2, 0, 0, 0);
+    if (pid == 0)
+        _exit(__vsyscall3(0x14, 0, 0, 0) == getpid() &&
+              ((vgetpid_t) VSYSCALL_GETPID)() == getpid() ? 7 : 1);
+
+    CHECK(waitpid(pid, &status, 0), pid);
+    CHECK(WEXITSTATUS(status), 7);
+
+    return 0;
+}
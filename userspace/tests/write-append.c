@@ -0,0 +1,99 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/errno.h>
+
+#include "test.h"
+
+#define FILE_NAME "/write-append.tmp"
+
+/* an odd size, so that the appends straddle block boundaries */
+#define SMALL 333
+
+/* past the singly indirect blocks, even with 1K blocks */
+#define TOTAL (300 * 1024)
+
+static char
+pattern(int off)
+{
+    return 'a' + (off * 7 + off / 1024) % 26;
+}
+
+int
+run_test()
+{
+    struct stat st;
+    char *data, *back;
+    int fd, rc, off, len;
+
+    data = malloc(TOTAL);
+    back = malloc(TOTAL);
+    if (!data || !back)
+        return 1;
+
+    for (off = 0; off < TOTAL; off ++)
+        data[off] = pattern(off);
+
+    fd = open(FILE_NAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return 1;
+
+    /* lots of small appends, like a log */
+    for (off = 0; off < TOTAL; off += len) {
+        len = TOTAL - off < SMALL ? TOTAL - off : SMALL;
+        rc = write(fd, data + off, len);
+        if (rc != len) {
+            printf("append at %d failed with rc %d\n", off, rc);
+            return 1;
+        }
+    }
+
+    CHECK(fstat(fd, &st), 0);
+    CHECK_VAL((int) st.st_size, "%d", TOTAL);
+
+    /* reading it back sees what was written, before and after close */
+    CHECK(lseek(fd, 0, SEEK_SET), 0);
+    CHECK_VAL(read(fd, back, TOTAL), "%d", TOTAL);
+    if (memcmp(data, back, TOTAL)) {
+        printf("read back differs\n");
+        return 1;
+    }
+
+    /* overwrite a piece in the middle */
+    memset(data + 5000, 'Z', 3000);
+    CHECK(lseek(fd, 5000, SEEK_SET), 5000);
+    CHECK(write(fd, data + 5000, 3000), 3000);
+
+    /* a bad buffer fails without moving the position */
+    CHECK_ERR(write(fd, (char *) 0xC0001337, 4096), EFAULT);
+    CHECK(lseek(fd, 0, SEEK_CUR), 8000);
+
+    close(fd);
+
+    memset(back, 0, TOTAL);
+    fd = open(FILE_NAME, O_RDONLY, 0);
+    if (fd < 0)
+        return 1;
+
+    CHECK_VAL(read(fd, back, TOTAL), "%d", TOTAL);
+    if (memcmp(data, back, TOTAL)) {
+        printf("read back after reopening differs\n");
+        return 1;
+    }
+    close(fd);
+
+    /* truncating throws it all away */
+    fd = open(FILE_NAME, O_RDWR | O_TRUNC, 0);
+    if (fd < 0)
+        return 1;
+
+    CHECK(fstat(fd, &st), 0);
+    CHECK((int) st.st_size, 0);
+    CHECK(read(fd, back, SMALL), 0);
+
+    close(fd);
+    return 0;
+}